@@ -0,0 +1,659 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <plist/plist.h>
+
+#include "../include/config.h"
+#include "../include/client.h"
+#include "../include/server.h"
+#include "../src/archive.h"
+#include "../src/deflate.h"
+#include "../src/bplist.h"
+#include "../src/config_private.h"
+#include "../src/event_ring.h"
+
+int bench_config();
+int bench_bplist();
+int bench_response();
+int bench_deflate();
+int bench_events();
+int bench_load();
+
+// Results are printed one benchmark per line as "bench=<name> key=value ...", so runs can be diffed across releases
+int main(int argc, char **argv) {
+    const struct {
+        const char *name;
+        int (*run)();
+    } benches[] = {
+        { "config", bench_config },
+        { "bplist", bench_bplist },
+        { "response", bench_response },
+        { "deflate", bench_deflate },
+        { "events", bench_events },
+        { "load", bench_load }
+    };
+
+    // Without arguments every benchmark runs
+    int ret = 0;
+    bool found = false;
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        if (argc == 1 || !strcmp(argv[1], benches[i].name)) {
+            found = true;
+            ret |= benches[i].run();
+        }
+    }
+
+    if (!found) {
+        printf("Unknown benchmark %s\n", argv[1]);
+        return 2;
+    }
+
+    return ret;
+}
+
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+MEASUREMENT
+*/
+
+// Allocations from every thread while a benchmark is being measured
+static atomic_bool alloc_counting;
+static atomic_size_t alloc_count;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) {
+    if (atomic_load_explicit(&alloc_counting, memory_order_relaxed)) {
+        atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+    }
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    if (atomic_load_explicit(&alloc_counting, memory_order_relaxed)) {
+        atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+    }
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (atomic_load_explicit(&alloc_counting, memory_order_relaxed)) {
+        atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+    }
+    return __libc_realloc(ptr, size);
+}
+
+typedef struct bench_stats_s {
+    size_t ops;
+    double ops_per_s;
+    // Per-op latency percentiles in nanoseconds
+    double p50_ns;
+    double p90_ns;
+    double p99_ns;
+    double max_ns;
+    double allocs_per_op;
+} bench_stats;
+
+// Benchmarked operation, returns 0 on success
+typedef int (*bench_op)(void *ctx);
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return x < y ? -1 : x > y;
+}
+
+// Times samples of batch ops each, after one untimed batch to warm caches and lazily built state
+// Operations too short to time alone should run in batches, their latency is the batch average
+int bench_measure(bench_op op, void *ctx, size_t samples, size_t batch, bench_stats *stats) {
+    double *latencies = (double*) malloc(samples * sizeof(double));
+    if (!latencies) {
+        return 1;
+    }
+
+    int ret = 0;
+    for (size_t i = 0; i < batch && !ret; i++) {
+        ret = op(ctx);
+    }
+
+    atomic_store(&alloc_count, 0);
+    atomic_store(&alloc_counting, true);
+    double start = now_seconds();
+    for (size_t s = 0; s < samples && !ret; s++) {
+        double sample_start = now_seconds();
+        for (size_t i = 0; i < batch && !ret; i++) {
+            ret = op(ctx);
+        }
+        latencies[s] = (now_seconds() - sample_start) / batch * 1e9;
+    }
+    double elapsed = now_seconds() - start;
+    atomic_store(&alloc_counting, false);
+
+    if (!ret) {
+        qsort(latencies, samples, sizeof(double), compare_doubles);
+        stats->ops = samples * batch;
+        stats->ops_per_s = stats->ops / elapsed;
+        stats->p50_ns = latencies[(samples - 1) / 2];
+        stats->p90_ns = latencies[(samples - 1) * 9 / 10];
+        stats->p99_ns = latencies[(samples - 1) * 99 / 100];
+        stats->max_ns = latencies[samples - 1];
+        stats->allocs_per_op = (double) atomic_load(&alloc_count) / stats->ops;
+    }
+
+    free(latencies);
+    return ret;
+}
+
+// Prints one result line, params holds extra key=value pairs and may be empty
+void bench_print(const char *name, const char *params, const bench_stats *stats) {
+    printf("bench=%s%s%s ops=%zu ops_per_s=%.1f p50_ns=%.0f p90_ns=%.0f p99_ns=%.0f max_ns=%.0f allocs_per_op=%.2f\n",
+        name, *params ? " " : "", params, stats->ops, stats->ops_per_s, stats->p50_ns, stats->p90_ns, stats->p99_ns,
+        stats->max_ns, stats->allocs_per_op);
+    fflush(stdout);
+}
+
+/*
+CONFIG BENCHMARK
+*/
+
+static int config_op(void *ctx) {
+    opendrop_config *config;
+    unsigned char root_ca[] = "root";
+    if (opendrop_config_new(&config, root_ca, sizeof(root_ca) - 1)) {
+        return 1;
+    }
+
+    opendrop_config_free(config);
+    return 0;
+}
+
+// Creates configs, dominated by generating a fresh identity each time
+int bench_config() {
+    bench_stats stats;
+    if (bench_measure(config_op, NULL, 10, 1, &stats)) {
+        return 1;
+    }
+
+    bench_print("config_new", "", &stats);
+    return 0;
+}
+
+/*
+BPLIST BENCHMARK
+*/
+
+typedef struct bplist_bench_s {
+    opendrop_config config;
+    opendrop_bplist_template *template;
+    opendrop_bplist_buf buf;
+    const opendrop_client_file_data **files;
+    size_t files_len;
+} bplist_bench;
+
+// Builds an Ask body the way the client did before templates
+int bplist_ask_libplist(const opendrop_config *config, const opendrop_client_file_data **files, size_t files_len, char **buf, uint32_t *len) {
+    plist_t root = plist_new_dict();
+    plist_dict_set_item(root, "SenderComputerName", plist_new_string(config->computer_name));
+    plist_dict_set_item(root, "BundleID", plist_new_string("com.apple.finder"));
+    plist_dict_set_item(root, "SenderModelName", plist_new_string(config->computer_model));
+    plist_dict_set_item(root, "SenderID", plist_new_string(config->service_id));
+    plist_dict_set_item(root, "ConvertMediaFormats", plist_new_bool(false));
+    plist_dict_set_item(root, "SenderRecordData", plist_new_string(config->record_data));
+
+    plist_t array = plist_new_array();
+    plist_dict_set_item(root, "Files", array);
+    for (size_t i = 0; i < files_len; i++) {
+        plist_t file = plist_new_dict();
+        plist_dict_set_item(file, "FileName", plist_new_string(files[i]->name));
+        plist_dict_set_item(file, "FileType", plist_new_string(files[i]->type));
+        plist_dict_set_item(file, "FileBomPath", plist_new_string(files[i]->bom_path));
+        plist_dict_set_item(file, "FileIsDirectory", plist_new_bool(files[i]->is_dir));
+        plist_dict_set_item(file, "ConvertMediaFormats", plist_new_bool(false));
+        plist_array_append_item(array, file);
+    }
+
+    int err = plist_to_bin(root, buf, len);
+    plist_free(root);
+    return err;
+}
+
+static int ask_libplist_op(void *ctx) {
+    bplist_bench *bench = (bplist_bench*) ctx;
+    char *body;
+    uint32_t len;
+    if (bplist_ask_libplist(&bench->config, bench->files, bench->files_len, &body, &len)) {
+        return 1;
+    }
+
+    plist_mem_free(body);
+    return 0;
+}
+
+static int ask_template_op(void *ctx) {
+    bplist_bench *bench = (bplist_bench*) ctx;
+    return opendrop_bplist_encode_ask(bench->template, &bench->buf, bench->files, bench->files_len, false, NULL);
+}
+
+// Rebuilding the template is the whole cost of encoding a Discover body
+static int template_op(void *ctx) {
+    bplist_bench *bench = (bplist_bench*) ctx;
+    opendrop_bplist_template *template;
+    if (opendrop_bplist_template_new(&template, &bench->config)) {
+        return 1;
+    }
+
+    opendrop_bplist_template_free(template);
+    return 0;
+}
+
+// Encodes Ask bodies with libplist and with the config template
+int bench_bplist() {
+    bplist_bench bench = { 0 };
+    bench.config.computer_name = "Benchmark MacBook Pro";
+    bench.config.computer_model = "MacBookPro18,3";
+    strcpy(bench.config.service_id, "a1b2c3");
+    bench.config.record_data = "record data placeholder";
+
+    if (opendrop_bplist_template_new(&bench.template, &bench.config)) {
+        return 1;
+    }
+
+    char names[32][32];
+    opendrop_client_file_data files[32];
+    const opendrop_client_file_data *file_ptrs[32];
+    for (int i = 0; i < 32; i++) {
+        snprintf(names[i], sizeof(names[i]), "IMG_%04i.HEIC", i);
+        files[i] = (opendrop_client_file_data) { names[i], "public.heic", names[i], false };
+        file_ptrs[i] = &files[i];
+    }
+    bench.files = file_ptrs;
+
+    int ret = 0;
+    bench_stats stats;
+    char params[64];
+    for (bench.files_len = 1; bench.files_len <= 32 && !ret; bench.files_len *= 32) {
+        snprintf(params, sizeof(params), "files=%zu", bench.files_len);
+
+        if (!(ret = bench_measure(ask_libplist_op, &bench, 2000, 16, &stats))) {
+            bench_print("ask_encode_libplist", params, &stats);
+        }
+
+        if (!ret && !(ret = bench_measure(ask_template_op, &bench, 2000, 16, &stats))) {
+            bench_print("ask_encode_template", params, &stats);
+        }
+    }
+
+    if (!ret && !(ret = bench_measure(template_op, &bench, 2000, 16, &stats))) {
+        bench_print("discover_encode_template", "", &stats);
+    }
+
+    opendrop_bplist_buf_free(&bench.buf);
+    opendrop_bplist_template_free(bench.template);
+    return ret;
+}
+
+/*
+RESPONSE BENCHMARK
+*/
+
+typedef struct response_bench_s {
+    char *body;
+    uint32_t body_len;
+    char name[64];
+} response_bench;
+
+static int response_libplist_op(void *ctx) {
+    response_bench *bench = (response_bench*) ctx;
+    plist_t root = NULL;
+    plist_from_bin(bench->body, bench->body_len, &root);
+
+    char *name = NULL;
+    plist_t node = root ? plist_dict_get_item(root, "ReceiverComputerName") : NULL;
+    if (node) {
+        plist_get_string_val(node, &name);
+    }
+
+    int ret = !name;
+    plist_mem_free(name);
+    plist_free(root);
+    return ret;
+}
+
+static int response_reader_op(void *ctx) {
+    response_bench *bench = (response_bench*) ctx;
+    opendrop_bplist_value value;
+    size_t len;
+    return opendrop_bplist_dict_get((const unsigned char*) bench->body, bench->body_len, "ReceiverComputerName", &value) ||
+        opendrop_bplist_get_string(&value, bench->name, sizeof(bench->name), &len);
+}
+
+// Reads the receiver name from a Discover response carrying a record blob
+int bench_response() {
+    unsigned char record[2048];
+    memset(record, 0x5A, sizeof(record));
+
+    plist_t root = plist_new_dict();
+    plist_dict_set_item(root, "ReceiverComputerName", plist_new_string("Benchmark Receiver"));
+    plist_dict_set_item(root, "ReceiverModelName", plist_new_string("MacBookPro18,3"));
+    plist_dict_set_item(root, "ReceiverMediaCapabilities", plist_new_data("{\"Version\":1}", 13));
+    plist_dict_set_item(root, "ReceiverRecordData", plist_new_data((const char*) record, sizeof(record)));
+
+    response_bench bench = { 0 };
+    int ret = plist_to_bin(root, &bench.body, &bench.body_len);
+    plist_free(root);
+
+    bench_stats stats;
+    char params[64];
+    snprintf(params, sizeof(params), "body_bytes=%u", bench.body_len);
+
+    if (!ret && !(ret = bench_measure(response_libplist_op, &bench, 2000, 16, &stats))) {
+        bench_print("response_parse_libplist", params, &stats);
+    }
+
+    if (!ret && !(ret = bench_measure(response_reader_op, &bench, 2000, 16, &stats))) {
+        bench_print("response_parse_reader", params, &stats);
+    }
+
+    plist_mem_free(bench.body);
+    return ret;
+}
+
+/*
+DEFLATE BENCHMARK
+*/
+
+typedef struct deflate_bench_s {
+    opendrop_archive *archive;
+    opendrop_deflate *stream;
+    const opendrop_client_file_data **files;
+    unsigned char buf[64 * 1024];
+    size_t out_len;
+} deflate_bench;
+
+static int deflate_op(void *ctx) {
+    deflate_bench *bench = (deflate_bench*) ctx;
+    if (opendrop_archive_reset(bench->archive, bench->files, 1) || opendrop_deflate_reset(bench->stream, bench->archive)) {
+        return 1;
+    }
+
+    size_t read;
+    bench->out_len = 0;
+    do {
+        if (opendrop_deflate_read(bench->stream, bench->buf, sizeof(bench->buf), &read)) {
+            return 1;
+        }
+        bench->out_len += read;
+    } while (read);
+
+    return 0;
+}
+
+// Archives and compresses a 16 MiB file with an increasing number of workers, then a photo with and without adaptive levels
+int bench_deflate() {
+    size_t data_len = 16 * 1024 * 1024;
+    unsigned char *data = (unsigned char*) malloc(data_len);
+    if (!data) {
+        return 1;
+    }
+
+    // Moderately compressible: short random runs of a small alphabet
+    srand(1);
+    for (size_t i = 0; i < data_len; i++) {
+        data[i] = "abcdefghijklmnop"[rand() % 16] ^ (i % 4096 == 0);
+    }
+
+    opendrop_client_file_data file = { "data.bin", "public.data", "./data.bin", false, data, data_len };
+    const opendrop_client_file_data *files[] = { &file };
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    deflate_bench bench = { .files = files };
+
+    int ret = 0;
+    for (unsigned int threads = 1; threads <= (unsigned int) (cores > 1 ? cores : 1) * 2 && !ret; threads *= 2) {
+        if (opendrop_archive_new(&bench.archive, files, 1) || opendrop_deflate_new(&bench.stream, bench.archive, threads)) {
+            ret = 1;
+            break;
+        }
+
+        bench_stats stats;
+        if (!(ret = bench_measure(deflate_op, &bench, 5, 1, &stats))) {
+            char params[128];
+            snprintf(params, sizeof(params), "threads=%u cores=%ld mb_per_s=%.1f ratio=%.3f", threads, cores,
+                stats.ops_per_s * data_len / 1e6, (double) bench.out_len / data_len);
+            bench_print("archive_deflate", params, &stats);
+        }
+
+        opendrop_deflate_free(bench.stream);
+        opendrop_archive_free(bench.archive);
+    }
+
+    // A photo doesn't compress, adaptive compression stores it instead of deflating it
+    srand(1);
+    for (size_t i = 0; i < data_len; i++) {
+        data[i] = rand();
+    }
+    memcpy(data, "\xff\xd8\xff\xe0", 4);
+
+    for (int adaptive = 0; adaptive < 2 && !ret; adaptive++) {
+        if (opendrop_archive_new(&bench.archive, files, 1) || opendrop_deflate_new(&bench.stream, bench.archive, 1)) {
+            ret = 1;
+            break;
+        }
+        opendrop_archive_set_adaptive(bench.archive, adaptive);
+
+        bench_stats stats;
+        if (!(ret = bench_measure(deflate_op, &bench, 5, 1, &stats))) {
+            char params[128];
+            snprintf(params, sizeof(params), "adaptive=%i mb_per_s=%.1f ratio=%.3f", adaptive,
+                stats.ops_per_s * data_len / 1e6, (double) bench.out_len / data_len);
+            bench_print("archive_deflate_media", params, &stats);
+        }
+
+        opendrop_deflate_free(bench.stream);
+        opendrop_archive_free(bench.archive);
+    }
+
+    free(data);
+    return ret;
+}
+
+/*
+EVENT QUEUE BENCHMARK
+*/
+
+#define EVENTS_BENCH_BATCH 64
+
+static int events_op(void *ctx) {
+    opendrop_event_ring *ring = (opendrop_event_ring*) ctx;
+    opendrop_browser_event event = { OPENDROP_BROWSER_EVENT_STATUS }, events[EVENTS_BENCH_BATCH];
+
+    for (int i = 0; i < EVENTS_BENCH_BATCH; i++) {
+        if (opendrop_event_ring_push(ring, &event)) {
+            return 1;
+        }
+    }
+
+    return opendrop_event_ring_poll(ring, events, EVENTS_BENCH_BATCH) != EVENTS_BENCH_BATCH;
+}
+
+// Pushes and polls browser events in batches, as a browser callback and an application loop would
+int bench_events() {
+    opendrop_event_ring *ring;
+    if (opendrop_event_ring_new(&ring, 1024)) {
+        return 1;
+    }
+
+    bench_stats stats;
+    int ret = bench_measure(events_op, ring, 20000, 1, &stats);
+    if (!ret) {
+        // Each op moves a whole batch, report per event
+        stats.ops *= EVENTS_BENCH_BATCH;
+        stats.ops_per_s *= EVENTS_BENCH_BATCH;
+        stats.p50_ns /= EVENTS_BENCH_BATCH;
+        stats.p90_ns /= EVENTS_BENCH_BATCH;
+        stats.p99_ns /= EVENTS_BENCH_BATCH;
+        stats.max_ns /= EVENTS_BENCH_BATCH;
+        stats.allocs_per_op /= EVENTS_BENCH_BATCH;
+
+        char params[32];
+        snprintf(params, sizeof(params), "batch=%i", EVENTS_BENCH_BATCH);
+        bench_print("event_dispatch", params, &stats);
+    }
+
+    opendrop_event_ring_free(ring);
+    return ret;
+}
+
+/*
+LOAD BENCHMARK
+*/
+
+#define LOAD_PORT 18775
+#define LOAD_ROUNDS 4
+#define LOAD_PAYLOAD (256 * 1024)
+#define LOAD_MAX_CONCURRENCY 16
+
+typedef struct load_worker_s {
+    pthread_t thread;
+    const opendrop_config *config;
+    const opendrop_client_file_data **files;
+    // First Discover of a fresh client, covering the TCP and TLS handshakes
+    double handshake_ns;
+    double ask_ns[LOAD_ROUNDS];
+    int failed;
+} load_worker;
+
+// Runs Discover once, then Ask and Upload rounds, like a sender offering several transfers to one receiver
+void *load_worker_run(void *userdata) {
+    load_worker *worker = (load_worker*) userdata;
+    opendrop_client *client;
+    if (opendrop_client_new(&client, "https://[::1]", LOAD_PORT, worker->config)) {
+        worker->failed = 1;
+        return NULL;
+    }
+
+    char *receiver_name = NULL;
+    double start = now_seconds();
+    worker->failed = opendrop_client_discover(client, &receiver_name);
+    worker->handshake_ns = (now_seconds() - start) * 1e9;
+
+    for (int round = 0; round < LOAD_ROUNDS && !worker->failed; round++) {
+        start = now_seconds();
+        worker->failed = opendrop_client_ask(client, worker->files, 1, false, NULL);
+        worker->ask_ns[round] = (now_seconds() - start) * 1e9;
+
+        worker->failed = worker->failed || opendrop_client_send(client, worker->files, 1);
+    }
+
+    free(receiver_name);
+    opendrop_client_free(client);
+    return NULL;
+}
+
+// Gets a percentile of sorted samples
+static double percentile(const double *samples, size_t len, int p) {
+    return samples[(len - 1) * p / 100];
+}
+
+// Drives concurrent clients against a local receiver over HTTPS, reporting end-to-end throughput and latencies
+// The receiver is the library's own server on the loopback interface, it discards uploads so only the transfer is measured
+int bench_load() {
+    opendrop_config *config;
+    unsigned char root_ca[] = "root";
+    if (opendrop_config_new(&config, root_ca, sizeof(root_ca) - 1)) {
+        return 1;
+    }
+
+    opendrop_config_set_interface(config, "lo");
+    opendrop_config_set_server_port(config, LOAD_PORT);
+    opendrop_config_set_verify_peer(config, false);
+
+    opendrop_server *server;
+    if (opendrop_server_new(&server, config)) {
+        opendrop_config_free(config);
+        return 1;
+    }
+
+    if (opendrop_server_start(server)) {
+        printf("Receiver failed to start: %s\n", opendrop_server_strerror(opendrop_server_errno(server)));
+        opendrop_server_free(server);
+        opendrop_config_free(config);
+        return 1;
+    }
+
+    // Half compressible, like a mix of documents and media
+    unsigned char *data = (unsigned char*) malloc(LOAD_PAYLOAD);
+    if (!data) {
+        opendrop_server_free(server);
+        opendrop_config_free(config);
+        return 1;
+    }
+
+    srand(1);
+    for (size_t i = 0; i < LOAD_PAYLOAD; i++) {
+        data[i] = i % 2 ? rand() : 'a';
+    }
+
+    opendrop_client_file_data file = { "payload.bin", "public.data", "./payload.bin", false, data, LOAD_PAYLOAD };
+    const opendrop_client_file_data *files[] = { &file };
+
+    load_worker workers[LOAD_MAX_CONCURRENCY];
+    double handshakes[LOAD_MAX_CONCURRENCY], asks[LOAD_MAX_CONCURRENCY * LOAD_ROUNDS];
+
+    int ret = 0;
+    for (int concurrency = 1; concurrency <= LOAD_MAX_CONCURRENCY && !ret; concurrency *= 4) {
+        double start = now_seconds();
+        int started = 0;
+        for (; started < concurrency; started++) {
+            workers[started] = (load_worker) { .config = config, .files = files };
+            if (pthread_create(&workers[started].thread, NULL, load_worker_run, &workers[started])) {
+                ret = 1;
+                break;
+            }
+        }
+
+        for (int i = 0; i < started; i++) {
+            pthread_join(workers[i].thread, NULL);
+            ret |= workers[i].failed;
+        }
+        double elapsed = now_seconds() - start;
+
+        if (ret) {
+            printf("Transfers failed at concurrency %i\n", concurrency);
+            break;
+        }
+
+        for (int i = 0; i < concurrency; i++) {
+            handshakes[i] = workers[i].handshake_ns;
+            memcpy(&asks[i * LOAD_ROUNDS], workers[i].ask_ns, sizeof(workers[i].ask_ns));
+        }
+
+        size_t asks_len = concurrency * LOAD_ROUNDS;
+        qsort(handshakes, concurrency, sizeof(double), compare_doubles);
+        qsort(asks, asks_len, sizeof(double), compare_doubles);
+
+        printf("bench=load concurrency=%i transfers=%zu payload_bytes=%i mb_per_s=%.1f handshake_p50_ns=%.0f "
+            "handshake_p99_ns=%.0f ask_p50_ns=%.0f ask_p90_ns=%.0f ask_p99_ns=%.0f ask_max_ns=%.0f\n",
+            concurrency, asks_len, LOAD_PAYLOAD, asks_len * LOAD_PAYLOAD / elapsed / 1e6,
+            percentile(handshakes, concurrency, 50), percentile(handshakes, concurrency, 99),
+            percentile(asks, asks_len, 50), percentile(asks, asks_len, 90), percentile(asks, asks_len, 99),
+            asks[asks_len - 1]);
+        fflush(stdout);
+    }
+
+    free(data);
+    opendrop_server_free(server);
+    opendrop_config_free(config);
+    return ret;
+}
@@ -1,7 +1,9 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include "loop.h"
 
 typedef struct opendrop_browser_s opendrop_browser;
 
@@ -11,6 +13,16 @@ typedef enum opendrop_browser_status_e {
     OPENDROP_BROWSER_ERROR // Avahi browser error
 } opendrop_browser_status;
 
+// Maximum number of addresses kept per service
+#define OPENDROP_SERVICE_MAX_ADDRESSES 4
+
+// Network address of a service
+typedef struct opendrop_address_s {
+    int family; // AF_INET6 or AF_INET
+    unsigned char address[16]; // Only the first 4 bytes are used for AF_INET
+    unsigned int scope_id; // Interface index, required for link-local IPv6
+} opendrop_address;
+
 // Structure for OpenDrop service within a list
 typedef struct opendrop_service_s {
     const char *name;
@@ -19,13 +31,33 @@ typedef struct opendrop_service_s {
     const char *host_name;
     uint16_t port;
 
+    // IPv6 address, zero if only IPv4 addresses are known
     unsigned char address[16];
+
+    // Every address the service was resolved to, IPv6 and IPv4
+    opendrop_address addresses[OPENDROP_SERVICE_MAX_ADDRESSES];
+    size_t addresses_len;
 } opendrop_service;
 
+typedef enum opendrop_browser_event_type_e {
+    OPENDROP_BROWSER_EVENT_ADD, // Service resolved, service is set
+    OPENDROP_BROWSER_EVENT_REMOVE, // Service removed, service has only name, type and domain set
+    OPENDROP_BROWSER_EVENT_STATUS, // Browser status changed, status is set
+    OPENDROP_BROWSER_EVENT_OVERFLOW // The queue was full and later events were lost, resync with opendrop_browser_snapshot
+} opendrop_browser_event_type;
+
+// Queued browser event
+typedef struct opendrop_browser_event_s {
+    opendrop_browser_event_type type;
+    opendrop_browser_status status;
+    // Owned by the event, free with opendrop_browser_events_free
+    opendrop_service *service;
+} opendrop_browser_event;
+
 // Callback for added services
 // Args:
 // - Browser instance
-// - Service struct
+// - Service struct, only valid during the callback, the browser keeps its own copy
 // - Userdata
 typedef void (*opendrop_browser_service_add_cb)(opendrop_browser*, const opendrop_service*, void*);
 
@@ -52,6 +84,15 @@ typedef void (*opendrop_browser_status_cb)(opendrop_browser*, opendrop_browser_s
 // Returns 0 on success, >0 on error
 int opendrop_browser_new(opendrop_browser **browser, const char *interface);
 
+// Initializes OpenDrop browser on an application-driven loop instead of the shared Avahi thread
+// Callbacks are called from opendrop_loop_dispatch on the application's thread
+// Args:
+// - browser: OpenDrop browser
+// - interface: The NULL-terminated name of the interface to bind the browser to
+// - loop: OpenDrop loop, must outlive the browser
+// Returns 0 on success, >0 on error
+int opendrop_browser_new_with_loop(opendrop_browser **browser, const char *interface, opendrop_loop *loop);
+
 // Frees OpenDrop browser, memory will become invalid
 // Args:
 // - browser: OpenDrop browser
@@ -89,6 +130,72 @@ void opendrop_browser_set_add_service_callback(opendrop_browser *browser, opendr
 // - userdata: Data to be passed to callback
 void opendrop_browser_set_remove_service_callback(opendrop_browser *browser, opendrop_browser_service_remove_cb callback, void *userdata);
 
+// Sets how many services are resolved at once, further services wait in a queue
+// Args:
+// - browser: OpenDrop browser, must not be running
+// - max_resolvers: Maximum resolvers in flight, 8 by default
+void opendrop_browser_set_max_resolvers(opendrop_browser *browser, size_t max_resolvers);
+
+// Sets how long resolved services are kept without being resolved again
+// While browsing with a TTL, services Avahi still reports are resolved again every half TTL, which keeps them listed.
+// Services that aren't resolved again within the TTL are dropped and reported like a removal by Avahi. They come
+// back with an add once a later resolve succeeds.
+// Args:
+// - browser: OpenDrop browser, call from the loop's thread for one made with opendrop_browser_new_with_loop
+// - ttl: Lifetime in seconds, 0 (default) keeps services until Avahi removes them
+void opendrop_browser_set_ttl(opendrop_browser *browser, unsigned int ttl);
+
+// Looks up a resolved service, safe to call from any thread
+// Args:
+// - browser: OpenDrop browser
+// - name: Service name
+// - type: Service type
+// - domain: Service domain
+// - service: Copy of the service, free with opendrop_browser_services_free
+// Returns 0 on success, 1 if not found, 2 if malloc failed
+int opendrop_browser_lookup(opendrop_browser *browser, const char *name, const char *type, const char *domain, opendrop_service **service);
+
+// Copies every resolved service, safe to call from any thread
+// Args:
+// - browser: OpenDrop browser
+// - services: Array of copies, free with opendrop_browser_services_free, NULL if there are none
+// - services_len: Number of services
+// Returns 0 on success, 1 if malloc failed
+int opendrop_browser_snapshot(opendrop_browser *browser, opendrop_service **services, size_t *services_len);
+
+// Frees services returned by lookup or snapshot
+// Args:
+// - services: Services
+void opendrop_browser_services_free(opendrop_service *services);
+
+// Queues add, remove and status events instead of calling their callbacks
+// Events are pushed into a lock-free ring so a slow consumer never holds up mDNS processing
+// Args:
+// - browser: OpenDrop browser, must not be running
+// - capacity: Number of events the queue holds, rounded up to a power of two
+// Returns 0 on success, >0 on error
+int opendrop_browser_enable_event_queue(opendrop_browser *browser, size_t capacity);
+
+// Gets an eventfd that becomes readable when events are queued, -1 if the queue isn't enabled
+// Args:
+// - browser: OpenDrop browser
+int opendrop_browser_event_fd(const opendrop_browser *browser);
+
+// Takes queued events, only one thread may poll a browser
+// A full batch may leave events behind, keep polling until fewer than max are returned before waiting on the fd again
+// Args:
+// - browser: OpenDrop browser
+// - events: Array filled with events, free them with opendrop_browser_events_free
+// - max: Size of events
+// Returns the number of events taken
+size_t opendrop_browser_poll_events(opendrop_browser *browser, opendrop_browser_event *events, size_t max);
+
+// Frees the services owned by polled events
+// Args:
+// - events: Events
+// - events_len: Number of events
+void opendrop_browser_events_free(opendrop_browser_event *events, size_t events_len);
+
 // Gets the previous initialization error code
 int opendrop_browser_init_errno();
 
@@ -3,30 +3,52 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include "browser.h"
 #include "config.h"
 
 typedef struct opendrop_client_s opendrop_client;
 
+// Cache shared between clients so repeated transfers to a known receiver can skip the TLS handshake
+typedef struct opendrop_client_share_s opendrop_client_share;
+
+// Token bucket limiting the upload rate of a group of clients, safe to use from multiple threads
+typedef struct opendrop_client_limiter_s opendrop_client_limiter;
+
+// Directory of compressed upload bodies, so sending the same files again skips archiving and compression
+typedef struct opendrop_client_cache_s opendrop_client_cache;
+
 typedef struct opendrop_client_data_s {
     unsigned char *data;
     size_t data_len;
 } opendrop_client_data;
 
+// Where the contents of a file are read from when it is sent
+typedef enum opendrop_client_file_source_e {
+    OPENDROP_CLIENT_SOURCE_MEMORY, // data and data_len
+    OPENDROP_CLIENT_SOURCE_PATH, // path, opened when the file is reached in the upload
+    OPENDROP_CLIENT_SOURCE_FD // fd, read from offset 0 and left open
+} opendrop_client_file_source;
+
 typedef struct opendrop_client_file_data_s {
     char *name;
     char *type;
     char *bom_path;
     bool is_dir;
 
-    // These values may be NULL/0 for ASK requests
+    // These values may be NULL/0 for ASK requests or non-memory sources
     unsigned char *data;
     size_t data_len;
+
+    // File-backed sources must be regular files, they are read in bounded windows as the upload streams
+    opendrop_client_file_source source;
+    const char *path;
+    int fd;
 } opendrop_client_file_data;
 
 // Initializes OpenDrop client
 // Args:
 // - client: OpenDrop client
-// - target_address: The address to attempt to connect to
+// - target_address: The base URL to attempt to connect to, request paths are appended to it
 // - target_port: The port to attempt to connect to
 // - config: OpenDrop config instance
 // Returns: 0 on success, >0 on error
@@ -37,10 +59,41 @@ int opendrop_client_new(opendrop_client **client, const char *target_address, ui
 // - client: OpenDrop client
 void opendrop_client_free(opendrop_client *client);
 
+// Initializes a cache of TLS sessions and DNS results that clients can share, safe to use from multiple threads
+// Args:
+// - share: Client share
+// - share_connections: Also share open connections, libcurl doesn't support using a shared connection
+//   cache from concurrent threads so only set this if the sharing clients transfer from one thread
+// Returns: 0 on success, >0 on error
+int opendrop_client_share_new(opendrop_client_share **share, bool share_connections);
+
+// Frees client share
+// Args:
+// - share: Client share, must outlive every client using it
+void opendrop_client_share_free(opendrop_client_share *share);
+
+// Makes the client use a share for later transfers
+// Args:
+// - client: OpenDrop client
+// - share: Client share, NULL stops sharing
+// Returns: 0 on success, >0 on error
+int opendrop_client_set_share(opendrop_client *client, opendrop_client_share *share);
+
+// Races TLS handshakes with every address of a receiver and points the client at the first to complete
+// Attempts start 250 ms apart, alternating between IPv6 and IPv4, or as soon as the previous one fails
+// Without a share set, the client creates one so later requests resume the winning TLS session
+// Args:
+// - client: OpenDrop client
+// - addresses: Resolved receiver addresses, such as opendrop_service addresses
+// - addresses_len: Number of addresses
+// Returns: 0 on success, >0 on error
+int opendrop_client_connect(opendrop_client *client, const opendrop_address *addresses, size_t addresses_len);
+
 // Sends DISCOVER request to server to show record data
 // Args:
 // - client: OpenDrop client
 // - receiver_name: Receiver name, allocated and populated if discoverable, not automatically freed
+//   A previous name from the same pointer is overwritten in place when the new one fits
 // Returns: 0 on success, >0 on error
 int opendrop_client_discover(opendrop_client *client, char **receiver_name);
 
@@ -55,9 +108,144 @@ int opendrop_client_discover(opendrop_client *client, char **receiver_name);
 int opendrop_client_ask(opendrop_client *client, const opendrop_client_file_data **data_arr, size_t data_arr_len, bool is_url, const opendrop_client_data *icon);
 
 // Attempts to send file, DO NOT USE TO SEND A URL
+// The cpio archive is built and gzip-compressed as it is uploaded, so memory use does not grow with the payload
+// Entries are limited to 8 GiB each by the cpio format
+// The archive and compressor are kept by the client and reused, so repeated sends don't allocate
 // Args:
 // - client: OpenDrop client
 // - data_arr: An array of pointers to client data that will be sent
 // - data_arr_len: Number of datas to be sent
 // Returns: 0 on success, >0 on error
-int opendrop_client_send(const opendrop_client *client, const opendrop_client_file_data **data_arr, size_t data_arr_len);
\ No newline at end of file
+int opendrop_client_send(opendrop_client *client, const opendrop_client_file_data **data_arr, size_t data_arr_len);
+
+// Timings and counters of client requests, times are in microseconds from the start of a request
+typedef struct opendrop_client_request_stats_s {
+    // Requests counted, failed ones included
+    uint64_t requests;
+    uint64_t dns_us;
+    uint64_t connect_us;
+    // TLS handshake complete, 0 when an open connection was reused
+    uint64_t tls_us;
+    // First response byte received
+    uint64_t ttfb_us;
+    uint64_t total_us;
+
+    // Request and response bodies
+    uint64_t bytes_up;
+    uint64_t bytes_down;
+    // Archive bytes compressed into bytes_up by sends, 0 for Discover and Ask
+    uint64_t uncompressed_bytes;
+    // Compressed over uncompressed size of sends, 0 without any
+    double compression_ratio;
+    // Archive bytes of sends by how they were compressed, all at the high level unless compression is adaptive
+    uint64_t stored_bytes;
+    uint64_t low_level_bytes;
+    uint64_t high_level_bytes;
+
+    // Connections cURL had to open again, such as when a reused connection turned out to be closed
+    uint64_t retries;
+    // Requests sent over an already open connection
+    uint64_t connections_reused;
+    // Requests whose new connection resumed a TLS session instead of a full handshake
+    uint64_t tls_sessions_resumed;
+    // Sends whose body was streamed from the cache, their uncompressed_bytes is 0
+    uint64_t cache_hits;
+} opendrop_client_request_stats;
+
+typedef struct opendrop_client_stats_s {
+    // Most recent request, counters are 0 or 1
+    opendrop_client_request_stats last;
+    // Sums over every request since the client was created
+    opendrop_client_request_stats total;
+} opendrop_client_stats;
+
+// Gets timings and counters of the client's requests
+// Args:
+// - client: OpenDrop client
+// - stats: Copied stats
+void opendrop_client_get_stats(const opendrop_client *client, opendrop_client_stats *stats);
+
+// Initializes a bandwidth limit that clients can share, their uploads together stay under the rate
+// Args:
+// - limiter: Client limiter
+// - bytes_per_second: Rate of compressed upload bytes, 0 for no limit
+// - burst: Bytes that may be sent at once after the group was idle, 0 for a tenth of a second's worth
+// Returns: 0 on success, 1 if malloc failed
+int opendrop_client_limiter_new(opendrop_client_limiter **limiter, uint64_t bytes_per_second, uint64_t burst);
+
+// Frees client limiter
+// Args:
+// - limiter: Client limiter, must outlive every client using it
+void opendrop_client_limiter_free(opendrop_client_limiter *limiter);
+
+// Changes the rate of a limiter, uploads in progress pick it up on their next read
+// Args:
+// - limiter: Client limiter
+// - bytes_per_second: Rate of compressed upload bytes, 0 for no limit
+// - burst: Bytes that may be sent at once after the group was idle, 0 for a tenth of a second's worth
+void opendrop_client_limiter_set_rate(opendrop_client_limiter *limiter, uint64_t bytes_per_second, uint64_t burst);
+
+// Makes the client's uploads take from a shared limiter, on top of its own rate limit
+// Args:
+// - client: OpenDrop client
+// - limiter: Client limiter, NULL stops sharing
+void opendrop_client_set_limiter(opendrop_client *client, opendrop_client_limiter *limiter);
+
+// Limits the client's own upload rate
+// Args:
+// - client: OpenDrop client
+// - bytes_per_second: Rate of compressed upload bytes, 0 for no limit
+// - burst: Bytes that may be sent at once after the client was idle, 0 for a tenth of a second's worth
+void opendrop_client_set_rate_limit(opendrop_client *client, uint64_t bytes_per_second, uint64_t burst);
+
+// Progress of an upload
+typedef struct opendrop_client_progress_s {
+    // Compressed bytes handed to the connection
+    uint64_t bytes_sent;
+    // Archive bytes compressed so far, file data plus cpio headers
+    uint64_t archive_bytes;
+    // Compressed bytes produced from them, bytes_sent also counts HTTP framing and trails what is still buffered
+    uint64_t compressed_bytes;
+    // Set on the last event of a successful upload
+    bool done;
+} opendrop_client_progress;
+
+typedef void (*opendrop_client_progress_callback)(opendrop_client *client, const opendrop_client_progress *progress, void *userdata);
+
+// Reports upload progress, called on the sending thread while a send runs
+// Args:
+// - client: OpenDrop client
+// - callback: Called at most once per interval and once more when the upload completes, NULL stops reporting
+// - interval_ms: Least time between events
+// - userdata: Passed to callback
+void opendrop_client_set_progress_callback(opendrop_client *client, opendrop_client_progress_callback callback,
+    unsigned int interval_ms, void *userdata);
+
+// Cancels the client's requests, safe to call from any thread including a progress callback
+// While set, a running request stops the next time cURL calls back, and a rate limited upload stops waiting immediately
+// Later requests fail until it is cleared
+// Args:
+// - client: OpenDrop client
+// - cancelled: Whether requests are cancelled
+void opendrop_client_set_cancelled(opendrop_client *client, bool cancelled);
+
+// Initializes a cache of compressed upload bodies, keyed by a hash of the names, paths and contents of the files
+// Bodies left in the directory by earlier runs are used again
+// Args:
+// - cache: Client cache
+// - directory: Existing directory holding the bodies, other files in it are left alone
+// - max_bytes: Size of all bodies together, least recently used ones are deleted beyond it
+// Returns: 0 on success, 1 if malloc failed, 2 if the directory couldn't be opened
+int opendrop_client_cache_new(opendrop_client_cache **cache, const char *directory, uint64_t max_bytes);
+
+// Frees client cache, the bodies stay in the directory
+// Args:
+// - cache: Client cache, must outlive every client using it
+void opendrop_client_cache_free(opendrop_client_cache *cache);
+
+// Makes the client's sends stream bodies from a cache, and add the bodies they compress to it
+// The files are read once more to hash them before every send
+// Args:
+// - client: OpenDrop client
+// - cache: Client cache, NULL stops caching
+void opendrop_client_set_cache(opendrop_client *client, opendrop_client_cache *cache);
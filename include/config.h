@@ -2,15 +2,52 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 typedef struct opendrop_config_s opendrop_config;
 
+// Pool of identities generated ahead of demand on background threads
+typedef struct opendrop_config_pool_s opendrop_config_pool;
+
 // Initializes OpenDrop config instance with default values
 // - config: OpenDrop config
 // - root_ca: Apple root CA data, copied to internal buffer
 // - root_ca_len: Length of CA data
 int opendrop_config_new(opendrop_config **config, const unsigned char *root_ca, size_t root_ca_len);
 
+// Initializes OpenDrop config instance with the identity (certificate, key and service ID) stored at path
+// If the file doesn't exist, a new identity is generated and saved there, later calls skip key generation
+// A stored certificate expiring within 30 days, or not matching the stored key, is regenerated and saved again
+// - config: OpenDrop config
+// - root_ca: Apple root CA data, copied to internal buffer
+// - root_ca_len: Length of CA data
+// - path: Identity file path
+int opendrop_config_new_from_identity(opendrop_config **config, const unsigned char *root_ca, size_t root_ca_len, const char *path);
+
+// Creates an identity pool and starts generating identities in the background
+// - pool: Identity pool
+// - capacity: Number of identities kept ready
+// - threads: Number of generator threads
+// Returns 0 on success, 1 on error
+int opendrop_config_pool_new(opendrop_config_pool **pool, size_t capacity, unsigned int threads);
+
+// Stops generation and frees the pool along with any unused identities
+void opendrop_config_pool_free(opendrop_config_pool *pool);
+
+// Initializes OpenDrop config instance with a fresh identity taken from the pool
+// Only blocks if no identity is ready yet, safe to call from multiple threads
+// - config: OpenDrop config
+// - root_ca: Apple root CA data, copied to internal buffer
+// - root_ca_len: Length of CA data
+// - pool: Identity pool
+int opendrop_config_new_from_pool(opendrop_config **config, const unsigned char *root_ca, size_t root_ca_len, opendrop_config_pool *pool);
+
+// Saves the config's identity (certificate, key and service ID) to path, readable only by the owner
+// - config: OpenDrop config
+// - path: Identity file path, replaced atomically
+// Returns 0 on success, >0 error code usable with opendrop_config_strerror
+int opendrop_config_save_identity(const opendrop_config *config, const char *path);
+
 void opendrop_config_free(opendrop_config *config);
 
 // Setter functions
@@ -26,6 +63,17 @@ void opendrop_config_set_server_port(opendrop_config *config, uint16_t port);
 
 void opendrop_config_set_service_id(opendrop_config *config, const char *service_id);
 
+// Number of threads used to compress uploads, 1 (default) compresses on the transfer thread
+void opendrop_config_set_compression_threads(opendrop_config *config, unsigned int threads);
+
+// Whether uploads sample each file and store already compressed media instead of deflating it, disabled by default
+// Other files are deflated at a fast level when dense and at the default level otherwise
+void opendrop_config_set_adaptive_compression(opendrop_config *config, bool adaptive);
+
+// Whether clients verify the receiver's certificate against the root CA, enabled by default
+// Receivers that aren't Apple devices present self-signed certificates and need this disabled
+void opendrop_config_set_verify_peer(opendrop_config *config, bool verify_peer);
+
 int opendrop_config_set_interface(opendrop_config *config, const char *interface);
 
 int opendrop_config_set_email(opendrop_config *config, const char *email);
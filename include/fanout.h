@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "client.h"
+#include "config.h"
+
+typedef struct opendrop_fanout_s opendrop_fanout;
+
+// Outcome of a receiver
+typedef enum opendrop_fanout_result_e {
+    OPENDROP_FANOUT_PENDING, // Not sent yet
+    OPENDROP_FANOUT_SENT, // Ask accepted and upload completed
+    OPENDROP_FANOUT_DECLINED, // Ask failed or was declined, nothing was uploaded
+    OPENDROP_FANOUT_FAILED // Upload failed
+} opendrop_fanout_result;
+
+// Callback for receivers whose transfer ended
+// Args:
+// - Fanout instance
+// - Receiver index, in the order receivers were added
+// - Result
+// - Userdata
+typedef void (*opendrop_fanout_done_cb)(opendrop_fanout*, size_t, opendrop_fanout_result, void*);
+
+// Initializes a send of one set of files to many receivers
+// The Ask body is encoded once and the archive is compressed once, every receiver streams the same compressed chunks
+// Args:
+// - fanout: OpenDrop fanout
+// - config: OpenDrop config, must outlive the fanout
+// - files: Files to send, must outlive the fanout
+// - files_len: Number of files
+// - icon: Optional icon, must be image in JPEG2000 form and outlive the fanout
+// Returns 0 on success, >0 on error
+int opendrop_fanout_new(opendrop_fanout **fanout, const opendrop_config *config, const opendrop_client_file_data **files,
+    size_t files_len, const opendrop_client_data *icon);
+
+// Frees OpenDrop fanout
+// Args:
+// - fanout: OpenDrop fanout
+void opendrop_fanout_free(opendrop_fanout *fanout);
+
+// Adds a receiver, receivers are numbered in the order added
+// Args:
+// - fanout: OpenDrop fanout, must not have been sent
+// - target_address: The base URL of the receiver, request paths are appended to it
+// - target_port: The port of the receiver
+// Returns 0 on success, >0 on error
+int opendrop_fanout_add(opendrop_fanout *fanout, const char *target_address, uint16_t target_port);
+
+// Sends Ask and then Upload to every receiver at once from the calling thread
+// Compressed chunks are kept until the slowest receiver has sent them, beyond the memory limit they are
+// kept in an unlinked temporary file instead
+// Args:
+// - fanout: OpenDrop fanout, can only be sent once
+// Returns 0 if every receiver got the files, 1 if some didn't, >1 on error
+int opendrop_fanout_send(opendrop_fanout *fanout);
+
+// Gets the outcome of a receiver
+// Args:
+// - fanout: OpenDrop fanout
+// - index: Receiver index
+opendrop_fanout_result opendrop_fanout_get_result(const opendrop_fanout *fanout, size_t index);
+
+// Sets the callback for receivers whose transfer ended, it is called from the sending thread
+// Args:
+// - fanout: OpenDrop fanout, must not be sending
+// - callback: Done callback
+// - userdata: Data to be passed to callback
+void opendrop_fanout_set_done_callback(opendrop_fanout *fanout, opendrop_fanout_done_cb callback, void *userdata);
+
+// Makes the fanout's requests use a client share, so receivers reached before resume their TLS sessions
+// Args:
+// - fanout: OpenDrop fanout, must not be sending
+// - share: Client share, must outlive the fanout
+void opendrop_fanout_set_share(opendrop_fanout *fanout, opendrop_client_share *share);
+
+// Sets how many bytes of compressed chunks are kept in memory before spilling to a temporary file
+// Args:
+// - fanout: OpenDrop fanout, must not be sending
+// - bytes: Memory limit, 0 spills every chunk
+void opendrop_fanout_set_memory_limit(opendrop_fanout *fanout, size_t bytes);
+
+// Gets the previous initialization error code
+int opendrop_fanout_init_errno();
+
+// Gets the previous error code
+// Args:
+// - fanout: OpenDrop fanout
+int opendrop_fanout_errno(const opendrop_fanout *fanout);
+
+// Gets string description from error code
+// Args:
+// - code: Error code
+const char *opendrop_fanout_strerror(int code);
@@ -0,0 +1,32 @@
+#pragma once
+
+typedef struct opendrop_loop_s opendrop_loop;
+
+// Initializes an event loop for running browsers on the application's own thread
+// The loop never blocks, the application waits on its fd and calls dispatch
+// Args:
+// - loop: OpenDrop loop
+// Returns 0 on success, >0 on error
+int opendrop_loop_new(opendrop_loop **loop);
+
+// Frees OpenDrop loop, browsers using it must be freed first
+// Args:
+// - loop: OpenDrop loop
+void opendrop_loop_free(opendrop_loop *loop);
+
+// Gets the epoll fd to wait on, readable whenever dispatch has work
+// Args:
+// - loop: OpenDrop loop
+int opendrop_loop_fd(const opendrop_loop *loop);
+
+// Gets how long the application may wait on the fd before calling dispatch anyway
+// Args:
+// - loop: OpenDrop loop
+// Returns milliseconds until the next timeout, 0 if one is due, -1 if there is none
+int opendrop_loop_timeout(const opendrop_loop *loop);
+
+// Runs callbacks for ready fds and due timeouts, browser callbacks are called from here
+// Args:
+// - loop: OpenDrop loop
+// Returns 0 on success, >0 on error
+int opendrop_loop_dispatch(opendrop_loop *loop);
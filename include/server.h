@@ -7,22 +7,46 @@ typedef struct opendrop_server_s opendrop_server;
 // Initializes OpenDrop server
 // Args:
 // - server: OpenDrop server
-// - config: OpenDrop config
+// - config: OpenDrop config, must outlive the server
 // Return: 0 on success, >0 on error
-int opendrop_server_new(opendrop_server *server, const opendrop_config *config);
+int opendrop_server_new(opendrop_server **server, const opendrop_config *config);
 
-// Frees OpenDrop server
+// Frees OpenDrop server, stopping it first if needed
 // Args:
 // - server: OpenDrop server
 void opendrop_server_free(opendrop_server *server);
 
 // Starts OpenDrop server
+// Listens on the config's port and interface and serves /Discover, /Ask and /Upload from one event loop thread
+// SIGPIPE is blocked on that thread, so peers resetting their connection don't end the process, other threads
+// and the application's own signal handling are left alone
 // Args:
 // - server: OpenDrop server
 // Returns:  0 on success, >0 on error
 int opendrop_server_start(opendrop_server *server);
 
-// Stops OpenDrop server
+// Stops OpenDrop server, closing all connections
 // Args:
 // - server: OpenDrop server
-void opendrop_server_stop(opendrop_server *server);
\ No newline at end of file
+void opendrop_server_stop(opendrop_server *server);
+
+// Sets the directory received files are written to, uploads are accepted but discarded until this is set
+// Files are extracted as they arrive, so memory use per upload is fixed regardless of its size
+// Args:
+// - server: OpenDrop server, must not be running
+// - directory: Existing directory, copied to internal buffer
+// Returns 0 on success, 1 if malloc failed
+int opendrop_server_set_output_directory(opendrop_server *server, const char *directory);
+
+// Gets the previous initialization error code
+int opendrop_server_init_errno();
+
+// Gets the previous error code
+// Args:
+// - server: OpenDrop server
+int opendrop_server_errno(const opendrop_server *server);
+
+// Gets string description from error code
+// Args:
+// - code: Error code
+const char *opendrop_server_strerror(int code);
\ No newline at end of file
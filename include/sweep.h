@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stddef.h>
+#include "browser.h"
+#include "client.h"
+#include "config.h"
+
+typedef struct opendrop_sweep_s opendrop_sweep;
+
+// Callback for receivers that answered Discover
+// Args:
+// - Sweep instance
+// - Service name the receiver was browsed as
+// - Receiver computer name
+// - Userdata
+typedef void (*opendrop_sweep_found_cb)(opendrop_sweep*, const char*, const char*, void*);
+
+// Initializes a sweep that sends Discover to services as they are added, several at once
+// Args:
+// - sweep: OpenDrop sweep
+// - config: OpenDrop config, must outlive the sweep
+// - max_transfers: Maximum number of Discover requests in flight, later services wait for a free slot
+// Returns 0 on success, >0 on error
+int opendrop_sweep_new(opendrop_sweep **sweep, const opendrop_config *config, size_t max_transfers);
+
+// Frees OpenDrop sweep, stopping it first if needed
+// Args:
+// - sweep: OpenDrop sweep
+void opendrop_sweep_free(opendrop_sweep *sweep);
+
+// Starts the thread driving Discover requests, the found callback is called from it
+// Args:
+// - sweep: OpenDrop sweep
+// Returns 0 on success, >0 on error
+int opendrop_sweep_start(opendrop_sweep *sweep);
+
+// Stops the sweep, abandoning requests in flight and waiting
+// Args:
+// - sweep: OpenDrop sweep
+void opendrop_sweep_stop(opendrop_sweep *sweep);
+
+// Queues Discover for a resolved service, safe to call from any thread including browser callbacks
+// The service's addresses are tried in order until one connects, so a stale first address doesn't hide it
+// Args:
+// - sweep: OpenDrop sweep
+// - service: Resolved service, copied
+// Returns 0 on success, >0 on error
+int opendrop_sweep_add(opendrop_sweep *sweep, const opendrop_service *service);
+
+// Sets the callback for receivers that answered
+// Args:
+// - sweep: OpenDrop sweep, must not be running
+// - callback: Found callback
+// - userdata: Data to be passed to callback
+void opendrop_sweep_set_found_callback(opendrop_sweep *sweep, opendrop_sweep_found_cb callback, void *userdata);
+
+// Makes the sweep's requests use a client share, so later transfers to the same receivers resume their TLS sessions
+// Args:
+// - sweep: OpenDrop sweep, must not be running
+// - share: Client share, must outlive the sweep
+void opendrop_sweep_set_share(opendrop_sweep *sweep, opendrop_client_share *share);
+
+// Gets the previous initialization error code
+int opendrop_sweep_init_errno();
+
+// Gets the previous error code
+// Args:
+// - sweep: OpenDrop sweep
+int opendrop_sweep_errno(const opendrop_sweep *sweep);
+
+// Gets string description from error code
+// Args:
+// - code: Error code
+const char *opendrop_sweep_strerror(int code);
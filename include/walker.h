@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "client.h"
+
+typedef struct opendrop_walker_s opendrop_walker;
+
+// Walks files and directory trees to send, listing and stating directories on several threads at once
+// Every directory and regular file becomes a file-backed entry, symbolic links and special files are skipped
+// Entries are ordered with each directory before its contents and siblings sorted by name, so walking the same
+// tree again gives the same archive
+// Args:
+// - walker: OpenDrop walker
+// - paths: Files and directories the user picked, each becomes a top-level entry named after its last component
+// - paths_len: Number of paths
+// - threads: Threads listing directories, including the calling one, 0 is treated as 1
+// Returns 0 on success, >0 on error
+int opendrop_walker_new(opendrop_walker **walker, const char **paths, size_t paths_len, unsigned int threads);
+
+// Frees OpenDrop walker
+// Args:
+// - walker: OpenDrop walker, its entries must no longer be used
+void opendrop_walker_free(opendrop_walker *walker);
+
+// Gets the top-level entries, for the Files array of Ask
+// Args:
+// - walker: OpenDrop walker
+// - len: Number of entries
+// Returns the entries, valid until the walker is freed
+const opendrop_client_file_data **opendrop_walker_get_ask_files(const opendrop_walker *walker, size_t *len);
+
+// Gets every entry in archive order, for send
+// Args:
+// - walker: OpenDrop walker
+// - len: Number of entries
+// Returns the entries, valid until the walker is freed
+const opendrop_client_file_data **opendrop_walker_get_files(const opendrop_walker *walker, size_t *len);
+
+// Gets the size of every regular file together, as stated by the walk
+// Args:
+// - walker: OpenDrop walker
+uint64_t opendrop_walker_get_bytes(const opendrop_walker *walker);
+
+// Gets the previous initialization error code
+int opendrop_walker_init_errno();
+
+// Gets string description from error code
+// Args:
+// - code: Error code
+const char *opendrop_walker_strerror(int code);
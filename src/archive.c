@@ -0,0 +1,478 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "archive.h"
+
+// Fixed odc header size, followed by the NUL-terminated name and the data
+#define ODC_HEADER_LEN 76
+#define ODC_TRAILER "TRAILER!!!"
+
+// Size of the mapped window for file-backed entries, a multiple of the page size
+#define ARCHIVE_WINDOW (4 * 1024 * 1024)
+
+// File-backed entries after the current one are opened early and their data is read ahead while earlier entries stream,
+// so trees of small files don't wait on the disk one file at a time
+#define ARCHIVE_AHEAD_FILES 32
+#define ARCHIVE_AHEAD_BYTES (16 * 1024 * 1024)
+
+// Adaptive archives sample this much from the middle of a file, past headers that tend to differ from the data
+#define ARCHIVE_SAMPLE 4096
+// Files smaller than this aren't worth switching levels for
+#define ARCHIVE_SAMPLE_MIN 1024
+// Entropy in bits per byte above which files are stored, and above which they are compressed at the low level
+#define ARCHIVE_STORED_ENTROPY 7.5
+#define ARCHIVE_LOW_ENTROPY 6.0
+
+enum archive_state {
+    ARCHIVE_HEADER,
+    ARCHIVE_DATA,
+    ARCHIVE_DONE
+};
+
+struct opendrop_archive_s {
+    const opendrop_client_file_data **files;
+    size_t files_len;
+
+    // Index of the entry being produced, files_len is the trailer
+    size_t index;
+    enum archive_state state;
+
+    // Header and name of the current entry
+    unsigned char header[ODC_HEADER_LEN + PATH_MAX + 1];
+    size_t header_len;
+    size_t header_pos;
+
+    size_t data_len;
+    size_t data_pos;
+
+    // Open file of the current entry for file-backed sources
+    int fd;
+    bool owns_fd;
+    bool use_pread;
+
+    // Mapped window of fd, covering [map_off, map_off + map_len)
+    unsigned char *map;
+    size_t map_off;
+    size_t map_len;
+
+    // Entries in (index, ahead_index) were opened early, entry i uses slot i % ARCHIVE_AHEAD_FILES
+    size_t ahead_index;
+    int ahead_fds[ARCHIVE_AHEAD_FILES];
+    size_t ahead_lens[ARCHIVE_AHEAD_FILES];
+    // Bytes asked to be read ahead and not reached yet
+    size_t ahead_bytes;
+
+    bool adaptive;
+    // Level of the current entry, sampled when first asked for
+    bool level_known;
+    opendrop_archive_level level;
+};
+
+static const char *entry_name(const opendrop_client_file_data *file) {
+    return file->bom_path ? file->bom_path : file->name;
+}
+
+// Releases the file and window of the current entry
+static void close_source(opendrop_archive *archive) {
+    if (archive->map) {
+        munmap(archive->map, archive->map_len);
+        archive->map = NULL;
+    }
+
+    if (archive->owns_fd && archive->fd >= 0) {
+        close(archive->fd);
+    }
+
+    archive->fd = -1;
+    archive->owns_fd = false;
+}
+
+// Closes files opened early and not reached
+static void close_ahead(opendrop_archive *archive) {
+    for (size_t i = 0; i < ARCHIVE_AHEAD_FILES; i++) {
+        if (archive->ahead_fds[i] >= 0) {
+            close(archive->ahead_fds[i]);
+            archive->ahead_fds[i] = -1;
+        }
+        archive->ahead_lens[i] = 0;
+    }
+
+    archive->ahead_index = 0;
+    archive->ahead_bytes = 0;
+}
+
+// Opens upcoming file-backed entries and asks the kernel to start reading them
+static void read_ahead(opendrop_archive *archive) {
+    if (archive->ahead_index <= archive->index) {
+        archive->ahead_index = archive->index + 1;
+    }
+
+    while (archive->ahead_index < archive->files_len && archive->ahead_index - archive->index <= ARCHIVE_AHEAD_FILES &&
+        archive->ahead_bytes < ARCHIVE_AHEAD_BYTES) {
+        const opendrop_client_file_data *file = archive->files[archive->ahead_index];
+        size_t slot = archive->ahead_index++ % ARCHIVE_AHEAD_FILES;
+        if (file->is_dir || file->source == OPENDROP_CLIENT_SOURCE_MEMORY) {
+            continue;
+        }
+
+        // Failures are left for the entry's own open to report
+        int fd = file->source == OPENDROP_CLIENT_SOURCE_PATH ? open(file->path, O_RDONLY | O_CLOEXEC) : file->fd;
+        struct stat st;
+        if (fd >= 0 && !fstat(fd, &st) && S_ISREG(st.st_mode)) {
+            size_t len = ARCHIVE_AHEAD_BYTES - archive->ahead_bytes;
+            if ((size_t) st.st_size < len) {
+                len = st.st_size;
+            }
+
+            posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED);
+            archive->ahead_lens[slot] = len;
+            archive->ahead_bytes += len;
+        }
+
+        if (file->source == OPENDROP_CLIENT_SOURCE_PATH) {
+            archive->ahead_fds[slot] = fd;
+        }
+    }
+}
+
+// Opens the current entry's file and gets its size
+static int open_source(opendrop_archive *archive, const opendrop_client_file_data *file, size_t *size) {
+    size_t slot = archive->index % ARCHIVE_AHEAD_FILES;
+    if (file->source == OPENDROP_CLIENT_SOURCE_PATH && archive->ahead_fds[slot] >= 0) {
+        archive->fd = archive->ahead_fds[slot];
+        archive->ahead_fds[slot] = -1;
+        archive->owns_fd = true;
+    } else if (file->source == OPENDROP_CLIENT_SOURCE_PATH) {
+        if ((archive->fd = open(file->path, O_RDONLY | O_CLOEXEC)) < 0) {
+            return 1;
+        }
+        archive->owns_fd = true;
+    } else {
+        archive->fd = file->fd;
+    }
+
+    struct stat st;
+    if (fstat(archive->fd, &st) || !S_ISREG(st.st_mode)) {
+        return 1;
+    }
+
+    *size = st.st_size;
+    archive->use_pread = false;
+    return 0;
+}
+
+// Copies file-backed data into buf, mapping the window containing data_pos
+static int read_source(opendrop_archive *archive, unsigned char *buf, size_t n) {
+    if (archive->use_pread) {
+        while (n) {
+            ssize_t r = pread(archive->fd, buf, n, archive->data_pos);
+            if (r <= 0) {
+                return 1;
+            }
+
+            buf += r;
+            n -= r;
+            archive->data_pos += r;
+        }
+        return 0;
+    }
+
+    if (!archive->map || archive->data_pos >= archive->map_off + archive->map_len) {
+        if (archive->map) {
+            munmap(archive->map, archive->map_len);
+            archive->map = NULL;
+        }
+
+        archive->map_off = archive->data_pos - archive->data_pos % ARCHIVE_WINDOW;
+        archive->map_len = archive->data_len - archive->map_off;
+        if (archive->map_len > ARCHIVE_WINDOW) {
+            archive->map_len = ARCHIVE_WINDOW;
+        }
+
+        void *map = mmap(NULL, archive->map_len, PROT_READ, MAP_PRIVATE, archive->fd, archive->map_off);
+        if (map == MAP_FAILED) {
+            // Some filesystems can't be mapped
+            archive->use_pread = true;
+            return read_source(archive, buf, n);
+        }
+
+        madvise(map, archive->map_len, MADV_SEQUENTIAL);
+        archive->map = (unsigned char*) map;
+    }
+
+    size_t available = archive->map_off + archive->map_len - archive->data_pos;
+    if (n > available) {
+        n = available;
+    }
+
+    memcpy(buf, archive->map + (archive->data_pos - archive->map_off), n);
+    archive->data_pos += n;
+    return 0;
+}
+
+// Leading bytes of formats that are compressed already, offset first
+static const struct {
+    size_t offset;
+    size_t len;
+    const char *magic;
+} compressed_formats[] = {
+    { 0, 3, "\xff\xd8\xff" }, // JPEG
+    { 0, 4, "\x89PNG" },
+    { 0, 4, "GIF8" },
+    { 4, 4, "ftyp" }, // HEIC, MP4, MOV and the rest of ISO media
+    { 4, 4, "moov" },
+    { 4, 4, "mdat" },
+    { 4, 4, "wide" },
+    { 8, 4, "WEBP" },
+    { 0, 4, "\x1a\x45\xdf\xa3" }, // Matroska, WebM
+    { 0, 4, "OggS" },
+    { 0, 4, "fLaC" },
+    { 0, 3, "ID3" }, // MP3
+    { 0, 4, "PK\x03\x04" }, // ZIP and the formats built on it
+    { 0, 2, "\x1f\x8b" }, // gzip
+    { 0, 3, "BZh" },
+    { 0, 6, "\xfd\x37\x7a\x58\x5a\x00" }, // xz
+    { 0, 4, "\x28\xb5\x2f\xfd" }, // zstd
+    { 0, 4, "7z\xbc\xaf" }
+};
+
+// log2 to within 0.09, enough to tell media from text
+static double approx_log2(unsigned int x) {
+    int whole = 31 - __builtin_clz(x);
+    return whole + (double) (x - (1u << whole)) / (1u << whole);
+}
+
+// Copies part of the current entry's data without moving the read position
+static int sample_data(opendrop_archive *archive, unsigned char *buf, size_t offset, size_t len) {
+    const opendrop_client_file_data *file = archive->files[archive->index];
+    if (archive->fd < 0) {
+        memcpy(buf, file->data + offset, len);
+        return 0;
+    }
+
+    return pread(archive->fd, buf, len, offset) != (ssize_t) len;
+}
+
+// Picks the current entry's level from its leading bytes, or failing that from the entropy of a sample
+static opendrop_archive_level sample_level(opendrop_archive *archive) {
+    if (!archive->adaptive) {
+        return OPENDROP_ARCHIVE_LEVEL_HIGH;
+    }
+
+    if (archive->index == archive->files_len || archive->files[archive->index]->is_dir ||
+        archive->data_len < ARCHIVE_SAMPLE_MIN) {
+        return OPENDROP_ARCHIVE_LEVEL_ANY;
+    }
+
+    // Read errors are left for the entry's own reads to report
+    unsigned char sample[ARCHIVE_SAMPLE];
+    if (sample_data(archive, sample, 0, 16)) {
+        return OPENDROP_ARCHIVE_LEVEL_HIGH;
+    }
+
+    for (size_t i = 0; i < sizeof(compressed_formats) / sizeof(compressed_formats[0]); i++) {
+        if (!memcmp(sample + compressed_formats[i].offset, compressed_formats[i].magic, compressed_formats[i].len)) {
+            return OPENDROP_ARCHIVE_LEVEL_STORED;
+        }
+    }
+
+    size_t len = archive->data_len < ARCHIVE_SAMPLE ? archive->data_len : ARCHIVE_SAMPLE;
+    if (sample_data(archive, sample, (archive->data_len - len) / 2, len)) {
+        return OPENDROP_ARCHIVE_LEVEL_HIGH;
+    }
+
+    unsigned int counts[256] = { 0 };
+    for (size_t i = 0; i < len; i++) {
+        counts[sample[i]]++;
+    }
+
+    // Shannon entropy, log2(len) minus the mean of log2(count) weighted by count
+    double weighted = 0;
+    for (int i = 0; i < 256; i++) {
+        if (counts[i]) {
+            weighted += counts[i] * approx_log2(counts[i]);
+        }
+    }
+
+    double entropy = approx_log2(len) - weighted / len;
+    if (entropy > ARCHIVE_STORED_ENTROPY) {
+        return OPENDROP_ARCHIVE_LEVEL_STORED;
+    }
+    return entropy > ARCHIVE_LOW_ENTROPY ? OPENDROP_ARCHIVE_LEVEL_LOW : OPENDROP_ARCHIVE_LEVEL_HIGH;
+}
+
+void opendrop_archive_set_adaptive(opendrop_archive *archive, bool adaptive) {
+    archive->adaptive = adaptive;
+    archive->level_known = false;
+}
+
+opendrop_archive_level opendrop_archive_get_level(opendrop_archive *archive) {
+    if (!archive->level_known) {
+        archive->level = sample_level(archive);
+        archive->level_known = true;
+    }
+
+    return archive->level;
+}
+
+// Writes the header of the current entry into the header buffer
+static int build_header(opendrop_archive *archive) {
+    const char *name = ODC_TRAILER;
+    unsigned int mode = 0;
+    unsigned int nlink = 1;
+    size_t size = 0;
+
+    if (archive->index < archive->files_len) {
+        // The entry is reached, its share of the read-ahead budget goes to later ones
+        if (archive->index < archive->ahead_index) {
+            size_t slot = archive->index % ARCHIVE_AHEAD_FILES;
+            archive->ahead_bytes -= archive->ahead_lens[slot];
+            archive->ahead_lens[slot] = 0;
+        }
+
+        const opendrop_client_file_data *file = archive->files[archive->index];
+        name = entry_name(file);
+        if (file->is_dir) {
+            mode = S_IFDIR | 0755;
+            nlink = 2;
+        } else {
+            mode = S_IFREG | 0644;
+            size = file->data_len;
+
+            if (file->source != OPENDROP_CLIENT_SOURCE_MEMORY && open_source(archive, file, &size)) {
+                return 1;
+            }
+        }
+
+        read_ahead(archive);
+    }
+
+    size_t name_len = strlen(name) + 1;
+    if (name_len > PATH_MAX + 1 || size > OPENDROP_ARCHIVE_MAX_ENTRY_SIZE) {
+        return 1;
+    }
+
+    // dev, ino, mode, uid, gid, nlink, rdev, mtime, namesize, filesize
+    snprintf((char*) archive->header, ODC_HEADER_LEN + 1, "070707%06o%06o%06o%06o%06o%06o%06o%011o%06o%011llo",
+        0, (unsigned int) (archive->index + 1) & 0777777, mode, 0, 0, nlink, 0, 0, (unsigned int) name_len, (unsigned long long) size);
+    memcpy(archive->header + ODC_HEADER_LEN, name, name_len);
+
+    archive->header_len = ODC_HEADER_LEN + name_len;
+    archive->header_pos = 0;
+    archive->data_len = size;
+    archive->data_pos = 0;
+    archive->level_known = false;
+    return 0;
+}
+
+int opendrop_archive_new(opendrop_archive **archive, const opendrop_client_file_data **files, size_t files_len) {
+    if (!(*archive = (opendrop_archive*) malloc(sizeof(opendrop_archive)))) {
+        return 1;
+    }
+
+    memset(*archive, 0, sizeof(opendrop_archive));
+    (*archive)->fd = -1;
+    for (size_t i = 0; i < ARCHIVE_AHEAD_FILES; i++) {
+        (*archive)->ahead_fds[i] = -1;
+    }
+
+    if (opendrop_archive_reset(*archive, files, files_len)) {
+        opendrop_archive_free(*archive);
+        *archive = NULL;
+        return 1;
+    }
+
+    return 0;
+}
+
+int opendrop_archive_reset(opendrop_archive *archive, const opendrop_client_file_data **files, size_t files_len) {
+    close_source(archive);
+    close_ahead(archive);
+
+    archive->files = files;
+    archive->files_len = files_len;
+    archive->index = 0;
+    archive->state = ARCHIVE_HEADER;
+
+    return build_header(archive);
+}
+
+void opendrop_archive_free(opendrop_archive *archive) {
+    if (archive) {
+        close_source(archive);
+        close_ahead(archive);
+        free(archive);
+    }
+}
+
+int opendrop_archive_read(opendrop_archive *archive, unsigned char *buf, size_t len, size_t *read) {
+    size_t written = 0;
+    opendrop_archive_level level = archive->adaptive ? opendrop_archive_get_level(archive) : OPENDROP_ARCHIVE_LEVEL_HIGH;
+
+    while (written < len && archive->state != ARCHIVE_DONE) {
+        if (archive->state == ARCHIVE_HEADER) {
+            // Entries that want another level start the next read
+            opendrop_archive_level next;
+            if (archive->adaptive && written && !archive->header_pos &&
+                (next = opendrop_archive_get_level(archive)) != OPENDROP_ARCHIVE_LEVEL_ANY && next != level) {
+                break;
+            }
+
+            size_t n = archive->header_len - archive->header_pos;
+            if (n > len - written) {
+                n = len - written;
+            }
+
+            memcpy(buf + written, archive->header + archive->header_pos, n);
+            archive->header_pos += n;
+            written += n;
+
+            if (archive->header_pos == archive->header_len) {
+                if (archive->index == archive->files_len) {
+                    archive->state = ARCHIVE_DONE;
+                } else {
+                    archive->state = ARCHIVE_DATA;
+                }
+            }
+            continue;
+        }
+
+        // ARCHIVE_DATA
+        size_t n = archive->data_len - archive->data_pos;
+        if (n > len - written) {
+            n = len - written;
+        }
+
+        if (n && archive->fd >= 0) {
+            size_t before = archive->data_pos;
+            if (read_source(archive, buf + written, n)) {
+                *read = written;
+                return 1;
+            }
+            written += archive->data_pos - before;
+        } else if (n) {
+            memcpy(buf + written, archive->files[archive->index]->data + archive->data_pos, n);
+            archive->data_pos += n;
+            written += n;
+        }
+
+        if (archive->data_pos == archive->data_len) {
+            close_source(archive);
+            archive->index++;
+            if (build_header(archive)) {
+                *read = written;
+                return 1;
+            }
+            archive->state = ARCHIVE_HEADER;
+        }
+    }
+
+    *read = written;
+    return 0;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stddef.h>
+#include "../include/client.h"
+
+// Largest entry size representable in an odc cpio header (11 octal digits)
+#define OPENDROP_ARCHIVE_MAX_ENTRY_SIZE 077777777777ULL
+
+typedef struct opendrop_archive_s opendrop_archive;
+
+// How hard a stretch of the archive is worth compressing
+typedef enum opendrop_archive_level_e {
+    OPENDROP_ARCHIVE_LEVEL_ANY = -1, // Directories, small files and the trailer, whatever level came before is kept
+    OPENDROP_ARCHIVE_LEVEL_STORED, // Already compressed media and archives, stored as is
+    OPENDROP_ARCHIVE_LEVEL_LOW, // Dense binary data, a fast level gets most of what there is
+    OPENDROP_ARCHIVE_LEVEL_HIGH // Text and the like, also every stretch of an archive that isn't adaptive
+} opendrop_archive_level;
+
+// Number of levels that bytes are counted under
+#define OPENDROP_ARCHIVE_LEVELS 3
+
+// Creates a streaming cpio (odc) archive over the given files
+// No file data is copied, entries are produced lazily by opendrop_archive_read
+// Args:
+// - archive: Archive instance
+// - files: Files to archive, must stay valid until the archive is freed
+// - files_len: Number of files
+// Returns 0 on success, >0 on error
+int opendrop_archive_new(opendrop_archive **archive, const opendrop_client_file_data **files, size_t files_len);
+
+// Starts the archive over with a new set of files, without allocating
+// Args:
+// - archive: Archive instance
+// - files: Files to archive, must stay valid until the archive is freed or reset again
+// - files_len: Number of files
+// Returns 0 on success, >0 on error
+int opendrop_archive_reset(opendrop_archive *archive, const opendrop_client_file_data **files, size_t files_len);
+
+// Frees archive
+// Args:
+// - archive: Archive instance
+void opendrop_archive_free(opendrop_archive *archive);
+
+// Reads the next bytes of the archive
+// Args:
+// - archive: Archive instance
+// - buf: Buffer to fill
+// - len: Size of buf
+// - read: Number of bytes written to buf, 0 once the archive is complete
+// Returns 0 on success, >0 on error
+int opendrop_archive_read(opendrop_archive *archive, unsigned char *buf, size_t len, size_t *read);
+
+// Makes the archive sample each file's magic bytes and entropy to pick its level
+// Reads of an adaptive archive end where the level changes, so every read can be compressed at one level
+// Args:
+// - archive: Archive instance
+// - adaptive: Whether to pick levels per file, otherwise every stretch is OPENDROP_ARCHIVE_LEVEL_HIGH
+void opendrop_archive_set_adaptive(opendrop_archive *archive, bool adaptive);
+
+// Gets the level of the entry the next read starts in, sampling it on first use
+// Args:
+// - archive: Archive instance
+opendrop_archive_level opendrop_archive_get_level(opendrop_archive *archive);
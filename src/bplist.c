@@ -0,0 +1,648 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "bplist.h"
+#include "config_private.h"
+
+#define BPLIST_HEADER "bplist00"
+#define BPLIST_HEADER_LEN 8
+#define BPLIST_TRAILER_LEN 32
+
+// Object markers, the low nibble holds the length
+#define BPLIST_FALSE 0x08
+#define BPLIST_TRUE 0x09
+#define BPLIST_INT 0x10
+#define BPLIST_DATA 0x40
+#define BPLIST_ASCII 0x50
+#define BPLIST_UTF16 0x60
+#define BPLIST_ARRAY 0xA0
+#define BPLIST_DICT 0xD0
+
+// Lengths from this value on follow the marker as an int object
+#define BPLIST_LEN_INLINE_MAX 15
+
+// Constant objects at the start of every Ask body, in order
+enum template_object {
+    OBJ_FALSE,
+    OBJ_TRUE,
+    OBJ_KEY_SENDER_COMPUTER_NAME,
+    OBJ_SENDER_COMPUTER_NAME,
+    OBJ_KEY_BUNDLE_ID,
+    OBJ_BUNDLE_ID,
+    OBJ_KEY_SENDER_MODEL_NAME,
+    OBJ_SENDER_MODEL_NAME,
+    OBJ_KEY_SENDER_ID,
+    OBJ_SENDER_ID,
+    OBJ_KEY_CONVERT_MEDIA_FORMATS,
+    OBJ_KEY_FILE_ICON,
+    OBJ_KEY_FILES,
+    OBJ_KEY_FILE_NAME,
+    OBJ_KEY_FILE_TYPE,
+    OBJ_KEY_FILE_BOM_PATH,
+    OBJ_KEY_FILE_IS_DIRECTORY,
+    // Only serialized when the config has record data
+    OBJ_KEY_SENDER_RECORD_DATA,
+    OBJ_SENDER_RECORD_DATA,
+    OBJ_TEMPLATE_MAX
+};
+
+// Objects each file adds to an Ask body: name, type, BOM path and its dict
+#define OBJ_PER_FILE 4
+
+struct opendrop_bplist_template_s {
+    // Header followed by the constant objects
+    unsigned char *prefix;
+    size_t prefix_len;
+    size_t offsets[OBJ_TEMPLATE_MAX];
+    size_t objects;
+
+    // Discover bodies only carry the record data
+    unsigned char *discover;
+    size_t discover_len;
+};
+
+static int buf_reserve(opendrop_bplist_buf *buf, size_t extra) {
+    if (buf->len + extra <= buf->cap) {
+        return 0;
+    }
+
+    size_t cap = buf->cap ? buf->cap : 256;
+    while (cap < buf->len + extra) {
+        cap *= 2;
+    }
+
+    unsigned char *data = (unsigned char*) realloc(buf->data, cap);
+    if (!data) {
+        return 1;
+    }
+
+    buf->data = data;
+    buf->cap = cap;
+    return 0;
+}
+
+// Resets the buffer for a body of count objects
+static int buf_begin(opendrop_bplist_buf *buf, size_t count) {
+    buf->len = 0;
+
+    if (count > buf->offsets_cap) {
+        size_t *offsets = (size_t*) realloc(buf->offsets, count * sizeof(size_t));
+        if (!offsets) {
+            return 1;
+        }
+
+        buf->offsets = offsets;
+        buf->offsets_cap = count;
+    }
+
+    return 0;
+}
+
+static void put_uint(opendrop_bplist_buf *buf, uint64_t value, size_t size) {
+    for (size_t i = size; i > 0; i--) {
+        buf->data[buf->len++] = (unsigned char) (value >> ((i - 1) * 8));
+    }
+}
+
+// Smallest of 1, 2, 4 or 8 bytes that holds value
+static size_t uint_size(uint64_t value) {
+    return value <= UINT8_MAX ? 1 : value <= UINT16_MAX ? 2 : value <= UINT32_MAX ? 4 : 8;
+}
+
+// Starts object index with its marker and length
+static int put_marker(opendrop_bplist_buf *buf, size_t index, unsigned char marker, size_t len) {
+    if (buf_reserve(buf, 2 + sizeof(uint64_t))) {
+        return 1;
+    }
+
+    buf->offsets[index] = buf->len;
+
+    if (len < BPLIST_LEN_INLINE_MAX) {
+        buf->data[buf->len++] = marker | len;
+        return 0;
+    }
+
+    size_t size = uint_size(len);
+    buf->data[buf->len++] = marker | 0x0F;
+    buf->data[buf->len++] = BPLIST_INT | (size == 1 ? 0 : size == 2 ? 1 : size == 4 ? 2 : 3);
+    put_uint(buf, len, size);
+    return 0;
+}
+
+static int put_bool(opendrop_bplist_buf *buf, size_t index, bool value) {
+    if (buf_reserve(buf, 1)) {
+        return 1;
+    }
+
+    buf->offsets[index] = buf->len;
+    buf->data[buf->len++] = value ? BPLIST_TRUE : BPLIST_FALSE;
+    return 0;
+}
+
+static int put_data(opendrop_bplist_buf *buf, size_t index, const unsigned char *data, size_t len) {
+    if (put_marker(buf, index, BPLIST_DATA, len) || buf_reserve(buf, len)) {
+        return 1;
+    }
+
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return 0;
+}
+
+// Decodes the code point at *pos, invalid sequences decode to U+FFFD one byte at a time
+static uint32_t utf8_next(const unsigned char *str, size_t len, size_t *pos) {
+    unsigned char c = str[(*pos)++];
+    if (c < 0x80) {
+        return c;
+    }
+
+    size_t extra = (c & 0xE0) == 0xC0 ? 1 : (c & 0xF0) == 0xE0 ? 2 : (c & 0xF8) == 0xF0 ? 3 : 0;
+    uint32_t code = c & (0x3F >> extra);
+    if (!extra || *pos + extra > len) {
+        return 0xFFFD;
+    }
+
+    for (size_t i = 0; i < extra; i++) {
+        if ((str[*pos + i] & 0xC0) != 0x80) {
+            return 0xFFFD;
+        }
+        code = (code << 6) | (str[*pos + i] & 0x3F);
+    }
+
+    // Overlong forms, surrogates and values past U+10FFFF
+    static const uint32_t min[] = { 0, 0x80, 0x800, 0x10000 };
+    if (code < min[extra] || (code >= 0xD800 && code <= 0xDFFF) || code > 0x10FFFF) {
+        return 0xFFFD;
+    }
+
+    *pos += extra;
+    return code;
+}
+
+// Writes an ASCII string as is and anything else as UTF-16BE, like plist_to_bin
+static int put_string(opendrop_bplist_buf *buf, size_t index, const char *str, size_t len) {
+    const unsigned char *bytes = (const unsigned char*) str;
+
+    size_t units = 0;
+    bool ascii = true;
+    for (size_t pos = 0; pos < len;) {
+        uint32_t code = utf8_next(bytes, len, &pos);
+        ascii = ascii && code < 0x80;
+        units += code > 0xFFFF ? 2 : 1;
+    }
+
+    if (ascii) {
+        if (put_marker(buf, index, BPLIST_ASCII, len) || buf_reserve(buf, len)) {
+            return 1;
+        }
+
+        memcpy(buf->data + buf->len, str, len);
+        buf->len += len;
+        return 0;
+    }
+
+    if (put_marker(buf, index, BPLIST_UTF16, units) || buf_reserve(buf, units * 2)) {
+        return 1;
+    }
+
+    for (size_t pos = 0; pos < len;) {
+        uint32_t code = utf8_next(bytes, len, &pos);
+        if (code > 0xFFFF) {
+            code -= 0x10000;
+            put_uint(buf, 0xD800 | (code >> 10), 2);
+            put_uint(buf, 0xDC00 | (code & 0x3FF), 2);
+        } else {
+            put_uint(buf, code, 2);
+        }
+    }
+
+    return 0;
+}
+
+// Writes an array or dict, dict refs are all keys followed by all values
+static int put_container(opendrop_bplist_buf *buf, size_t index, unsigned char marker, size_t entries,
+    const size_t *refs, size_t refs_len, size_t ref_size) {
+    if (put_marker(buf, index, marker, entries) || buf_reserve(buf, refs_len * ref_size)) {
+        return 1;
+    }
+
+    for (size_t i = 0; i < refs_len; i++) {
+        put_uint(buf, refs[i], ref_size);
+    }
+
+    return 0;
+}
+
+static size_t ref_size_for(size_t count) {
+    return uint_size(count - 1);
+}
+
+// Appends the offset table and trailer of a body of count objects
+static int finish(opendrop_bplist_buf *buf, size_t count, size_t top, size_t ref_size) {
+    size_t table = buf->len;
+    size_t offset_size = uint_size(table);
+
+    if (buf_reserve(buf, count * offset_size + BPLIST_TRAILER_LEN)) {
+        return 1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        put_uint(buf, buf->offsets[i], offset_size);
+    }
+
+    // Six unused bytes and the sort version
+    memset(buf->data + buf->len, 0, 7);
+    buf->len += 7;
+    put_uint(buf, offset_size, 1);
+    put_uint(buf, ref_size, 1);
+    put_uint(buf, count, 8);
+    put_uint(buf, top, 8);
+    put_uint(buf, table, 8);
+    return 0;
+}
+
+static int put_header(opendrop_bplist_buf *buf) {
+    if (buf_reserve(buf, BPLIST_HEADER_LEN)) {
+        return 1;
+    }
+
+    memcpy(buf->data, BPLIST_HEADER, BPLIST_HEADER_LEN);
+    buf->len = BPLIST_HEADER_LEN;
+    return 0;
+}
+
+static int build_discover(opendrop_bplist_template *template, const opendrop_config *config) {
+    opendrop_bplist_buf buf = {0};
+    size_t count = config->record_data ? 3 : 1;
+    size_t refs[] = { 0, 1 };
+
+    int err = buf_begin(&buf, count) || put_header(&buf);
+    if (!err && config->record_data) {
+        err = put_string(&buf, 0, "SenderRecordData", strlen("SenderRecordData")) ||
+            put_string(&buf, 1, config->record_data, strlen(config->record_data));
+    }
+
+    err = err || put_container(&buf, count - 1, BPLIST_DICT, count / 2, refs, count - 1, ref_size_for(count)) ||
+        finish(&buf, count, count - 1, ref_size_for(count));
+
+    free(buf.offsets);
+    template->discover = buf.data;
+    template->discover_len = buf.len;
+    return err;
+}
+
+int opendrop_bplist_template_new(opendrop_bplist_template **template, const opendrop_config *config) {
+    if (!(*template = (opendrop_bplist_template*) calloc(1, sizeof(opendrop_bplist_template)))) {
+        return 1;
+    }
+
+    const char *strings[OBJ_TEMPLATE_MAX] = {
+        [OBJ_KEY_SENDER_COMPUTER_NAME] = "SenderComputerName",
+        [OBJ_SENDER_COMPUTER_NAME] = config->computer_name,
+        [OBJ_KEY_BUNDLE_ID] = "BundleID",
+        [OBJ_BUNDLE_ID] = "com.apple.finder",
+        [OBJ_KEY_SENDER_MODEL_NAME] = "SenderModelName",
+        [OBJ_SENDER_MODEL_NAME] = config->computer_model,
+        [OBJ_KEY_SENDER_ID] = "SenderID",
+        [OBJ_SENDER_ID] = config->service_id,
+        [OBJ_KEY_CONVERT_MEDIA_FORMATS] = "ConvertMediaFormats",
+        [OBJ_KEY_FILE_ICON] = "FileIcon",
+        [OBJ_KEY_FILES] = "Files",
+        [OBJ_KEY_FILE_NAME] = "FileName",
+        [OBJ_KEY_FILE_TYPE] = "FileType",
+        [OBJ_KEY_FILE_BOM_PATH] = "FileBomPath",
+        [OBJ_KEY_FILE_IS_DIRECTORY] = "FileIsDirectory",
+        [OBJ_KEY_SENDER_RECORD_DATA] = "SenderRecordData",
+        [OBJ_SENDER_RECORD_DATA] = config->record_data
+    };
+
+    opendrop_bplist_buf buf = {0};
+    size_t objects = config->record_data ? OBJ_TEMPLATE_MAX : OBJ_KEY_SENDER_RECORD_DATA;
+
+    int err = buf_begin(&buf, objects) || put_header(&buf) ||
+        put_bool(&buf, OBJ_FALSE, false) || put_bool(&buf, OBJ_TRUE, true);
+    for (size_t i = OBJ_KEY_SENDER_COMPUTER_NAME; !err && i < objects; i++) {
+        err = put_string(&buf, i, strings[i], strlen(strings[i]));
+    }
+
+    if (!err) {
+        memcpy((*template)->offsets, buf.offsets, objects * sizeof(size_t));
+    }
+
+    free(buf.offsets);
+    (*template)->prefix = buf.data;
+    (*template)->prefix_len = buf.len;
+    (*template)->objects = objects;
+
+    if (err || build_discover(*template, config)) {
+        opendrop_bplist_template_free(*template);
+        *template = NULL;
+        return 1;
+    }
+
+    return 0;
+}
+
+void opendrop_bplist_template_free(opendrop_bplist_template *template) {
+    if (template) {
+        free(template->prefix);
+        free(template->discover);
+        free(template);
+    }
+}
+
+const unsigned char *opendrop_bplist_template_discover(const opendrop_bplist_template *template, size_t *len) {
+    *len = template->discover_len;
+    return template->discover;
+}
+
+int opendrop_bplist_encode_ask(const opendrop_bplist_template *template, opendrop_bplist_buf *buf,
+    const opendrop_client_file_data **files, size_t files_len, bool is_url, const opendrop_client_data *icon) {
+    bool record = template->objects == OBJ_TEMPLATE_MAX;
+    size_t entries = is_url ? files_len > 0 : files_len;
+    size_t file_objects = is_url ? entries : files_len * OBJ_PER_FILE;
+
+    // Per-request objects follow the template: files, the icon, the Files array and the root dict
+    size_t first = template->objects;
+    size_t icon_index = first + file_objects;
+    size_t files_index = icon_index + (icon != NULL);
+    size_t count = files_index + 2;
+    size_t ref_size = ref_size_for(count);
+
+    if (buf_begin(buf, count) || buf_reserve(buf, template->prefix_len)) {
+        return 1;
+    }
+
+    memcpy(buf->data, template->prefix, template->prefix_len);
+    memcpy(buf->offsets, template->offsets, first * sizeof(size_t));
+    buf->len = template->prefix_len;
+
+    if (is_url && entries) {
+        if (put_string(buf, first, (const char*) files[0]->data, files[0]->data_len)) {
+            return 1;
+        }
+    } else if (!is_url) {
+        for (size_t i = 0; i < files_len; i++) {
+            size_t index = first + i * OBJ_PER_FILE;
+            size_t refs[] = {
+                OBJ_KEY_FILE_NAME, OBJ_KEY_FILE_TYPE, OBJ_KEY_FILE_BOM_PATH, OBJ_KEY_FILE_IS_DIRECTORY, OBJ_KEY_CONVERT_MEDIA_FORMATS,
+                index, index + 1, index + 2, files[i]->is_dir ? OBJ_TRUE : OBJ_FALSE, OBJ_FALSE
+            };
+
+            if (put_string(buf, index, files[i]->name, strlen(files[i]->name)) ||
+                put_string(buf, index + 1, files[i]->type, strlen(files[i]->type)) ||
+                put_string(buf, index + 2, files[i]->bom_path, strlen(files[i]->bom_path)) ||
+                put_container(buf, index + 3, BPLIST_DICT, 5, refs, 10, ref_size)) {
+                return 1;
+            }
+        }
+    }
+
+    if (icon && put_data(buf, icon_index, icon->data, icon->data_len)) {
+        return 1;
+    }
+
+    // The Files array refers to every string when a URL is sent, otherwise to every file dict
+    if (put_marker(buf, files_index, BPLIST_ARRAY, entries) || buf_reserve(buf, entries * ref_size)) {
+        return 1;
+    }
+    for (size_t i = 0; i < entries; i++) {
+        put_uint(buf, is_url ? first : first + i * OBJ_PER_FILE + 3, ref_size);
+    }
+
+    // Keys in the order libplist would have written them
+    size_t keys[8], values[8], refs[16], n = 0;
+    keys[n] = OBJ_KEY_SENDER_COMPUTER_NAME; values[n++] = OBJ_SENDER_COMPUTER_NAME;
+    keys[n] = OBJ_KEY_BUNDLE_ID; values[n++] = OBJ_BUNDLE_ID;
+    keys[n] = OBJ_KEY_SENDER_MODEL_NAME; values[n++] = OBJ_SENDER_MODEL_NAME;
+    keys[n] = OBJ_KEY_SENDER_ID; values[n++] = OBJ_SENDER_ID;
+    keys[n] = OBJ_KEY_CONVERT_MEDIA_FORMATS; values[n++] = OBJ_FALSE;
+    if (record) {
+        keys[n] = OBJ_KEY_SENDER_RECORD_DATA; values[n++] = OBJ_SENDER_RECORD_DATA;
+    }
+    if (icon) {
+        keys[n] = OBJ_KEY_FILE_ICON; values[n++] = icon_index;
+    }
+    keys[n] = OBJ_KEY_FILES; values[n++] = files_index;
+
+    memcpy(refs, keys, n * sizeof(size_t));
+    memcpy(refs + n, values, n * sizeof(size_t));
+
+    return put_container(buf, files_index + 1, BPLIST_DICT, n, refs, n * 2, ref_size) ||
+        finish(buf, count, files_index + 1, ref_size);
+}
+
+void opendrop_bplist_buf_free(opendrop_bplist_buf *buf) {
+    free(buf->data);
+    free(buf->offsets);
+    buf->data = NULL;
+    buf->offsets = NULL;
+    buf->len = buf->cap = buf->offsets_cap = 0;
+}
+
+// Trailer fields of a body being read
+typedef struct bplist_trailer_s {
+    size_t offset_size;
+    size_t ref_size;
+    uint64_t count;
+    uint64_t top;
+    uint64_t table;
+} bplist_trailer;
+
+static uint64_t get_uint(const unsigned char *data, size_t size) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; i++) {
+        value = (value << 8) | data[i];
+    }
+
+    return value;
+}
+
+static int read_trailer(const unsigned char *body, size_t body_len, bplist_trailer *trailer) {
+    if (body_len < BPLIST_HEADER_LEN + BPLIST_TRAILER_LEN || memcmp(body, BPLIST_HEADER, BPLIST_HEADER_LEN)) {
+        return 1;
+    }
+
+    const unsigned char *end = body + body_len - BPLIST_TRAILER_LEN;
+    trailer->offset_size = end[6];
+    trailer->ref_size = end[7];
+    trailer->count = get_uint(end + 8, 8);
+    trailer->top = get_uint(end + 16, 8);
+    trailer->table = get_uint(end + 24, 8);
+
+    // The offset table has to sit between the objects and the trailer
+    size_t table_max = body_len - BPLIST_TRAILER_LEN;
+    if (trailer->offset_size < 1 || trailer->offset_size > 8 || trailer->ref_size < 1 || trailer->ref_size > 8 ||
+        trailer->top >= trailer->count || trailer->table < BPLIST_HEADER_LEN || trailer->table > table_max ||
+        trailer->count > (table_max - trailer->table) / trailer->offset_size) {
+        return 1;
+    }
+
+    return 0;
+}
+
+// Locates an object and checks that its payload ends before the offset table
+static int read_object(const unsigned char *body, const bplist_trailer *trailer, uint64_t index, opendrop_bplist_value *value) {
+    if (index >= trailer->count) {
+        return 1;
+    }
+
+    uint64_t offset = get_uint(body + trailer->table + index * trailer->offset_size, trailer->offset_size);
+    if (offset < BPLIST_HEADER_LEN || offset >= trailer->table) {
+        return 1;
+    }
+
+    const unsigned char *pos = body + offset;
+    const unsigned char *end = body + trailer->table;
+    unsigned char marker = *pos++;
+    uint64_t len = marker & 0x0F;
+
+    value->type = marker & 0xF0;
+    bool sized = value->type == BPLIST_DATA || value->type == BPLIST_ASCII || value->type == BPLIST_UTF16 ||
+        value->type == BPLIST_ARRAY || value->type == BPLIST_DICT;
+
+    if (sized && len == 0x0F) {
+        if (pos == end || (*pos & 0xF0) != BPLIST_INT || (*pos & 0x0F) > 3) {
+            return 1;
+        }
+
+        size_t size = (size_t) 1 << (*pos++ & 0x0F);
+        if ((size_t) (end - pos) < size) {
+            return 1;
+        }
+
+        len = get_uint(pos, size);
+        pos += size;
+    }
+
+    size_t width = value->type == BPLIST_UTF16 ? 2 : value->type == BPLIST_DICT ? trailer->ref_size * 2 :
+        value->type == BPLIST_ARRAY ? trailer->ref_size : 1;
+    if (sized && len > (uint64_t) (end - pos) / width) {
+        return 1;
+    }
+
+    value->data = pos;
+    value->len = len;
+    return 0;
+}
+
+// Decodes the code point at *pos, unpaired surrogates decode to U+FFFD
+static uint32_t utf16_next(const unsigned char *units, size_t len, size_t *pos) {
+    uint32_t code = get_uint(units + 2 * (*pos)++, 2);
+    if (code >= 0xDC00 && code <= 0xDFFF) {
+        return 0xFFFD;
+    }
+
+    if (code >= 0xD800 && code <= 0xDBFF) {
+        uint32_t low = *pos < len ? get_uint(units + 2 * *pos, 2) : 0;
+        if (low < 0xDC00 || low > 0xDFFF) {
+            return 0xFFFD;
+        }
+
+        (*pos)++;
+        return 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+    }
+
+    return code;
+}
+
+// Encodes a code point as UTF-8, returning the number of bytes written to out
+static size_t utf8_put(uint32_t code, char *out) {
+    if (code < 0x80) {
+        out[0] = code;
+        return 1;
+    } else if (code < 0x800) {
+        out[0] = 0xC0 | (code >> 6);
+        out[1] = 0x80 | (code & 0x3F);
+        return 2;
+    } else if (code < 0x10000) {
+        out[0] = 0xE0 | (code >> 12);
+        out[1] = 0x80 | ((code >> 6) & 0x3F);
+        out[2] = 0x80 | (code & 0x3F);
+        return 3;
+    }
+
+    out[0] = 0xF0 | (code >> 18);
+    out[1] = 0x80 | ((code >> 12) & 0x3F);
+    out[2] = 0x80 | ((code >> 6) & 0x3F);
+    out[3] = 0x80 | (code & 0x3F);
+    return 4;
+}
+
+int opendrop_bplist_get_string(const opendrop_bplist_value *value, char *out, size_t out_len, size_t *len) {
+    if (value->type == BPLIST_ASCII) {
+        *len = value->len;
+        if (out_len) {
+            size_t n = value->len < out_len - 1 ? value->len : out_len - 1;
+            memcpy(out, value->data, n);
+            out[n] = 0;
+        }
+        return 0;
+    } else if (value->type != BPLIST_UTF16) {
+        return 1;
+    }
+
+    // Code points that don't fit whole are dropped, so truncated output stays valid UTF-8
+    size_t written = 0;
+    *len = 0;
+    for (size_t pos = 0; pos < value->len;) {
+        char code[4];
+        size_t n = utf8_put(utf16_next(value->data, value->len, &pos), code);
+        if (written == *len && out_len && written + n < out_len) {
+            memcpy(out + written, code, n);
+            written += n;
+        }
+        *len += n;
+    }
+
+    if (out_len) {
+        out[written] = 0;
+    }
+
+    return 0;
+}
+
+// Compares a string object with a null-terminated UTF-8 string
+static bool string_equals(const opendrop_bplist_value *value, const char *str, size_t str_len) {
+    if (value->type == BPLIST_ASCII) {
+        return value->len == str_len && !memcmp(value->data, str, str_len);
+    } else if (value->type != BPLIST_UTF16) {
+        return false;
+    }
+
+    size_t matched = 0;
+    for (size_t pos = 0; pos < value->len;) {
+        char code[4];
+        size_t n = utf8_put(utf16_next(value->data, value->len, &pos), code);
+        if (n > str_len - matched || memcmp(str + matched, code, n)) {
+            return false;
+        }
+        matched += n;
+    }
+
+    return matched == str_len;
+}
+
+int opendrop_bplist_dict_get(const unsigned char *body, size_t body_len, const char *key, opendrop_bplist_value *value) {
+    bplist_trailer trailer;
+    opendrop_bplist_value root;
+    if (read_trailer(body, body_len, &trailer) || read_object(body, &trailer, trailer.top, &root) || root.type != BPLIST_DICT) {
+        return 2;
+    }
+
+    size_t key_len = strlen(key);
+    for (size_t i = 0; i < root.len; i++) {
+        opendrop_bplist_value entry;
+        if (read_object(body, &trailer, get_uint(root.data + i * trailer.ref_size, trailer.ref_size), &entry)) {
+            return 2;
+        }
+
+        if (string_equals(&entry, key, key_len)) {
+            uint64_t ref = get_uint(root.data + (root.len + i) * trailer.ref_size, trailer.ref_size);
+            return read_object(body, &trailer, ref, value) ? 2 : 0;
+        }
+    }
+
+    return 1;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "../include/client.h"
+#include "../include/config.h"
+
+typedef struct opendrop_bplist_template_s opendrop_bplist_template;
+
+// Object inside a body, it points into the body and is only valid as long as the body is
+typedef struct opendrop_bplist_value_s {
+    // Marker with the length nibble cleared, such as 0x50 for ASCII strings
+    unsigned char type;
+    const unsigned char *data;
+    // Bytes for data and ASCII strings, code units for UTF-16 strings, entries for containers
+    size_t len;
+} opendrop_bplist_value;
+
+// Growable output buffer, its storage is kept between requests
+typedef struct opendrop_bplist_buf_s {
+    unsigned char *data;
+    size_t len;
+    size_t cap;
+
+    // Object offsets of the body being encoded
+    size_t *offsets;
+    size_t offsets_cap;
+} opendrop_bplist_buf;
+
+// Pre-serializes the parts of Discover and Ask bodies that only depend on the config
+// Args:
+// - template: Body template
+// - config: OpenDrop config, values are copied so later changes need a new template
+// Returns 0 on success, >0 if malloc failed
+int opendrop_bplist_template_new(opendrop_bplist_template **template, const opendrop_config *config);
+
+// Frees body template
+// Args:
+// - template: Body template
+void opendrop_bplist_template_free(opendrop_bplist_template *template);
+
+// Gets the complete Discover body, it doesn't depend on the request
+// Args:
+// - template: Body template
+// - len: Length of the body
+// Returns the body, owned by the template
+const unsigned char *opendrop_bplist_template_discover(const opendrop_bplist_template *template, size_t *len);
+
+// Encodes an Ask body by copying the template and appending the files and icon
+// Produces the same dict as building it with libplist and calling plist_to_bin
+// Args:
+// - template: Body template
+// - buf: Output buffer, replaced with the body
+// - files: Files offered, only the first one's data is used as a string when is_url is set
+// - files_len: Length of files
+// - is_url: Whether a URL is offered instead of files
+// - icon: File icon, may be NULL
+// Returns 0 on success, >0 if malloc failed or the body has too many objects
+int opendrop_bplist_encode_ask(const opendrop_bplist_template *template, opendrop_bplist_buf *buf,
+    const opendrop_client_file_data **files, size_t files_len, bool is_url, const opendrop_client_data *icon);
+
+// Frees the storage of an output buffer
+// Args:
+// - buf: Output buffer
+void opendrop_bplist_buf_free(opendrop_bplist_buf *buf);
+
+// Looks up a key in the top-level dict of a body without building a plist tree
+// The body is validated as far as the lookup reads it, so untrusted responses are safe to pass
+// Args:
+// - body: Binary plist
+// - body_len: Length of body
+// - key: Key to look up
+// - value: Value of the key
+// Returns 0 on success, 1 if the key is missing, 2 if the body is malformed
+int opendrop_bplist_dict_get(const unsigned char *body, size_t body_len, const char *key, opendrop_bplist_value *value);
+
+// Copies a string value as UTF-8, truncating it to fit like snprintf
+// Args:
+// - value: String value
+// - out: Output buffer, may be NULL if out_len is 0
+// - out_len: Size of out, including the null terminator
+// - len: Length of the whole string in UTF-8, excluding the null terminator
+// Returns 0 on success, 1 if value isn't a string
+int opendrop_bplist_get_string(const opendrop_bplist_value *value, char *out, size_t out_len, size_t *len);
@@ -1,18 +1,60 @@
 #include <stdlib.h>
 #include <net/if.h>
+#include <sys/socket.h>
 #include <string.h>
 #include <avahi-common/error.h>
 #include <avahi-common/thread-watch.h>
+#include <avahi-common/timeval.h>
 #include <avahi-client/lookup.h>
 #include "../include/browser.h"
+#include "peers.h"
+#include "loop_private.h"
+#include "event_ring.h"
 
 #include <stdio.h>
 
+// Resolvers running at once unless set otherwise
+#define BROWSER_DEFAULT_MAX_RESOLVERS 8
+
+// Service waiting for or being resolved
+typedef struct browser_resolve_s {
+    struct browser_resolve_s *next;
+    opendrop_browser *browser;
+    // NULL while queued
+    AvahiServiceResolver *resolver;
+
+    AvahiIfIndex interface;
+    AvahiProtocol protocol;
+    // Point into data
+    char *name;
+    char *type;
+    char *domain;
+    char data[];
+} browser_resolve;
+
 struct opendrop_browser_s {
+    // Whether the client runs on the shared Avahi thread rather than an application loop
+    bool threaded;
+    const AvahiPoll *poll;
     AvahiClient *avahi_client;
     unsigned int interface_idx;
     AvahiServiceBrowser *avahi_browser;
 
+    // Resolved services, updated from the thread running Avahi callbacks
+    opendrop_peers *peers;
+
+    // Resolver scheduling, only touched from the thread running Avahi callbacks
+    browser_resolve *resolving;
+    size_t resolving_len;
+    size_t max_resolvers;
+    browser_resolve *queued;
+    browser_resolve *queued_tail;
+
+    // Services Avahi currently reports, resolved again every half TTL so live ones don't expire
+    browser_resolve *browsed;
+    unsigned int ttl;
+    AvahiTimeout *ttl_timeout;
+
     opendrop_browser_status_cb browser_status;
     void *status_userdata;
 
@@ -22,6 +64,9 @@ struct opendrop_browser_s {
     opendrop_browser_service_remove_cb service_remove;
     void *remove_userdata;
 
+    // Replaces the add, remove and status callbacks when set
+    opendrop_event_ring *events;
+
     int last_avahi_error;
 };
 
@@ -31,26 +76,67 @@ size_t watch_refs = 0;
 
 int last_browser_init_error = 0;
 
+static void emit_status(opendrop_browser *browser, opendrop_browser_status status) {
+    if (browser->events) {
+        opendrop_browser_event event = { OPENDROP_BROWSER_EVENT_STATUS, status, NULL };
+        opendrop_event_ring_push(browser->events, &event);
+    } else {
+        (*browser->browser_status)(browser, status, browser->status_userdata);
+    }
+}
+
+// Takes ownership of service
+static void emit_add(opendrop_browser *browser, opendrop_service *service) {
+    if (browser->events) {
+        opendrop_browser_event event = { OPENDROP_BROWSER_EVENT_ADD, 0, service };
+        opendrop_event_ring_push(browser->events, &event);
+        return;
+    }
+
+    if (browser->service_add) {
+        (*browser->service_add)(browser, service, browser->add_userdata);
+    }
+    free(service);
+}
+
+static void emit_remove(opendrop_browser *browser, const char *name, const char *type, const char *domain) {
+    if (!browser->events) {
+        if (browser->service_remove) {
+            (*browser->service_remove)(browser, name, type, domain, browser->remove_userdata);
+        }
+        return;
+    }
+
+    // Same single allocation layout as lookup copies
+    size_t name_len = strlen(name) + 1, type_len = strlen(type) + 1, domain_len = strlen(domain) + 1;
+    opendrop_service *service = (opendrop_service*) malloc(sizeof(opendrop_service) + name_len + type_len + domain_len);
+    if (!service) {
+        return;
+    }
+
+    char *data = (char*) (service + 1);
+    memset(service, 0, sizeof(opendrop_service));
+    service->name = memcpy(data, name, name_len);
+    service->type = memcpy(data + name_len, type, type_len);
+    service->domain = memcpy(data + name_len + type_len, domain, domain_len);
+    service->host_name = service->name + name_len - 1;
+
+    opendrop_browser_event event = { OPENDROP_BROWSER_EVENT_REMOVE, 0, service };
+    opendrop_event_ring_push(browser->events, &event);
+}
+
 // Handles Avahi client events
 void client_callback(AvahiClient *client, AvahiClientState state, void *userdata) {
     opendrop_browser *browser = (opendrop_browser*) userdata;
 
     if (state == AVAHI_CLIENT_FAILURE) {
         browser->last_avahi_error = avahi_client_errno(client);
-        (*browser->browser_status)(browser, OPENDROP_BROWSER_ERROR, browser->status_userdata);
+        emit_status(browser, OPENDROP_BROWSER_ERROR);
     }
 }
 
-int opendrop_browser_new(opendrop_browser **browser, const char *interface) {
-    // Create Avahi main loop
-    if (!watch_refs++) {
-        avahi_loop = avahi_threaded_poll_new();
-        if (!avahi_loop || avahi_threaded_poll_start(avahi_loop)) {
-            last_browser_init_error = 1;
-            return 1;
-        }
-    }
-
+// Sets up a browser whose Avahi client runs on poll
+static int browser_init(opendrop_browser **browser, const char *interface, const AvahiPoll *poll, bool threaded) {
     // Allocate browser struct
     if (!(*browser = (opendrop_browser*) malloc(sizeof(opendrop_browser)))) {
         last_browser_init_error = 2;
@@ -58,6 +144,15 @@ int opendrop_browser_new(opendrop_browser **browser, const char *interface) {
     }
 
     memset(*browser, 0, sizeof(opendrop_browser));
+    (*browser)->threaded = threaded;
+    (*browser)->poll = poll;
+    (*browser)->max_resolvers = BROWSER_DEFAULT_MAX_RESOLVERS;
+
+    if (opendrop_peers_new(&(*browser)->peers)) {
+        opendrop_browser_free(*browser);
+        last_browser_init_error = 2;
+        return 1;
+    }
 
     // Find interface index
     if (!((*browser)->interface_idx = if_nametoindex(interface))) {
@@ -67,40 +162,222 @@ int opendrop_browser_new(opendrop_browser **browser, const char *interface) {
     }
 
     // Create Avahi client
-    avahi_threaded_poll_lock(avahi_loop);
+    if (threaded) {
+        avahi_threaded_poll_lock(avahi_loop);
+    }
     int err;
-    if (!((*browser)->avahi_client = avahi_client_new(avahi_threaded_poll_get(avahi_loop), 0, client_callback, *browser, &err))) {
+    (*browser)->avahi_client = avahi_client_new(poll, 0, client_callback, *browser, &err);
+    if (threaded) {
         avahi_threaded_poll_unlock(avahi_loop);
+    }
+
+    if (!(*browser)->avahi_client) {
         opendrop_browser_free(*browser);
         last_browser_init_error = err;
         return 1;
     }
-    avahi_threaded_poll_unlock(avahi_loop);
 
     return 0;
 }
 
+int opendrop_browser_new(opendrop_browser **browser, const char *interface) {
+    // Create Avahi main loop
+    if (!watch_refs++) {
+        avahi_loop = avahi_threaded_poll_new();
+        if (!avahi_loop || avahi_threaded_poll_start(avahi_loop)) {
+            last_browser_init_error = 1;
+            return 1;
+        }
+    }
+
+    return browser_init(browser, interface, avahi_threaded_poll_get(avahi_loop), true);
+}
+
+int opendrop_browser_new_with_loop(opendrop_browser **browser, const char *interface, opendrop_loop *loop) {
+    return browser_init(browser, interface, opendrop_loop_get_poll(loop), false);
+}
+
+// Cancels running resolvers and drops queued ones, along with the services Avahi reported
+static void clear_resolves(opendrop_browser *browser) {
+    browser_resolve *lists[] = { browser->resolving, browser->queued, browser->browsed };
+    for (int i = 0; i < 3; i++) {
+        browser_resolve *resolve = lists[i];
+        while (resolve) {
+            browser_resolve *next = resolve->next;
+            if (resolve->resolver) {
+                avahi_service_resolver_free(resolve->resolver);
+            }
+            free(resolve);
+            resolve = next;
+        }
+    }
+
+    browser->resolving = NULL;
+    browser->resolving_len = 0;
+    browser->queued = NULL;
+    browser->queued_tail = NULL;
+    browser->browsed = NULL;
+}
+
+// Stops the TTL timer
+static void disarm_ttl(opendrop_browser *browser) {
+    if (browser->ttl_timeout) {
+        browser->poll->timeout_free(browser->ttl_timeout);
+        browser->ttl_timeout = NULL;
+    }
+}
+
 void opendrop_browser_free(opendrop_browser *browser) {
     if (browser) {
+        // Callbacks on the Avahi thread touch the browser and resolves until these are gone
+        if (browser->threaded) {
+            avahi_threaded_poll_lock(avahi_loop);
+        }
+
         if (browser->avahi_browser) {
             avahi_service_browser_free(browser->avahi_browser);
         }
 
+        clear_resolves(browser);
+        disarm_ttl(browser);
+
         if (browser->avahi_client) {
-            avahi_threaded_poll_lock(avahi_loop);
             avahi_client_free(browser->avahi_client);
+        }
+
+        if (browser->threaded) {
             avahi_threaded_poll_unlock(avahi_loop);
         }
-        
+
+        bool threaded = browser->threaded;
+        opendrop_event_ring_free(browser->events);
+        opendrop_peers_free(browser->peers);
         free(browser);
 
         // Avahi loop dealloc
-        if (!watch_refs || !(--watch_refs)) {
+        if (threaded && (!watch_refs || !(--watch_refs))) {
             avahi_threaded_poll_free(avahi_loop);
         }
     }
 }
 
+void resolve_callback(
+    AvahiServiceResolver *r,
+    AvahiIfIndex interface,
+    AvahiProtocol protocol,
+    AvahiResolverEvent event,
+    const char *name,
+    const char *type,
+    const char *domain,
+    const char *host_name,
+    const AvahiAddress *address,
+    uint16_t port,
+    AvahiStringList *txt,
+    AvahiLookupResultFlags flags,
+    void *userdata);
+
+// Finds the service in a resolve list, each protocol is resolved separately
+static browser_resolve *find_resolve(browser_resolve *list, AvahiProtocol protocol, const char *name, const char *type, const char *domain) {
+    for (; list; list = list->next) {
+        if (list->protocol == protocol && !strcmp(list->name, name) && !strcmp(list->type, type) && !strcmp(list->domain, domain)) {
+            return list;
+        }
+    }
+
+    return NULL;
+}
+
+// Removes a resolve from a list, tail is updated when given
+static void unlink_resolve(browser_resolve **list, browser_resolve **tail, browser_resolve *resolve) {
+    browser_resolve *prev = NULL;
+    for (browser_resolve **link = list; *link; prev = *link, link = &(*link)->next) {
+        if (*link == resolve) {
+            *link = resolve->next;
+            if (tail && *tail == resolve) {
+                *tail = prev;
+            }
+            return;
+        }
+    }
+}
+
+// Starts resolvers for queued services while there are free slots
+static void start_queued(opendrop_browser *browser) {
+    while (browser->queued && browser->resolving_len < browser->max_resolvers) {
+        browser_resolve *resolve = browser->queued;
+        if (!(browser->queued = resolve->next)) {
+            browser->queued_tail = NULL;
+        }
+
+        if (!(resolve->resolver = avahi_service_resolver_new(browser->avahi_client, resolve->interface, resolve->protocol, resolve->name,
+            resolve->type, resolve->domain, resolve->protocol, 0, resolve_callback, resolve))) {
+            free(resolve);
+            emit_status(browser, OPENDROP_BROWSER_ERROR);
+            continue;
+        }
+
+        resolve->next = browser->resolving;
+        browser->resolving = resolve;
+        browser->resolving_len++;
+    }
+}
+
+// Allocates a resolve record in one allocation with its strings, NULL if malloc failed
+static browser_resolve *new_resolve(opendrop_browser *browser, AvahiIfIndex interface, AvahiProtocol protocol, const char *name, const char *type, const char *domain) {
+    size_t name_len = strlen(name) + 1, type_len = strlen(type) + 1, domain_len = strlen(domain) + 1;
+    browser_resolve *resolve = (browser_resolve*) malloc(sizeof(browser_resolve) + name_len + type_len + domain_len);
+    if (!resolve) {
+        return NULL;
+    }
+
+    resolve->next = NULL;
+    resolve->browser = browser;
+    resolve->resolver = NULL;
+    resolve->interface = interface;
+    resolve->protocol = protocol;
+    resolve->name = memcpy(resolve->data, name, name_len);
+    resolve->type = memcpy(resolve->data + name_len, type, type_len);
+    resolve->domain = memcpy(resolve->data + name_len + type_len, domain, domain_len);
+    return resolve;
+}
+
+// Queues a service for resolving, repeated NEW events for a service already waiting or resolving are coalesced
+static int schedule_resolve(opendrop_browser *browser, AvahiIfIndex interface, AvahiProtocol protocol, const char *name, const char *type, const char *domain) {
+    if (find_resolve(browser->resolving, protocol, name, type, domain) || find_resolve(browser->queued, protocol, name, type, domain)) {
+        return 0;
+    }
+
+    browser_resolve *resolve = new_resolve(browser, interface, protocol, name, type, domain);
+    if (!resolve) {
+        return 1;
+    }
+
+    if (browser->queued_tail) {
+        browser->queued_tail->next = resolve;
+    } else {
+        browser->queued = resolve;
+    }
+    browser->queued_tail = resolve;
+
+    start_queued(browser);
+    return 0;
+}
+
+// Drops a queued resolve or cancels a running one
+static void cancel_resolve(opendrop_browser *browser, AvahiProtocol protocol, const char *name, const char *type, const char *domain) {
+    browser_resolve *resolve;
+    if ((resolve = find_resolve(browser->queued, protocol, name, type, domain))) {
+        unlink_resolve(&browser->queued, &browser->queued_tail, resolve);
+        free(resolve);
+    } else if ((resolve = find_resolve(browser->resolving, protocol, name, type, domain))) {
+        unlink_resolve(&browser->resolving, NULL, resolve);
+        browser->resolving_len--;
+        avahi_service_resolver_free(resolve->resolver);
+        free(resolve);
+        start_queued(browser);
+    }
+}
+
 // Handles Avahi resolver events
 void resolve_callback(
     AvahiServiceResolver *r, 
@@ -117,26 +394,115 @@ void resolve_callback(
     AvahiLookupResultFlags flags, 
     void *userdata) {
     
-    opendrop_browser *browser = (opendrop_browser*) userdata;
+    browser_resolve *resolve = (browser_resolve*) userdata;
+    opendrop_browser *browser = resolve->browser;
 
     switch (event) {
     case AVAHI_RESOLVER_FAILURE:
-        (*browser->browser_status)(browser, OPENDROP_BROWSER_ERROR, browser->status_userdata);
+        emit_status(browser, OPENDROP_BROWSER_ERROR);
         break;
 
     case AVAHI_RESOLVER_FOUND: ;
         opendrop_service service;
-        memcpy(service.address, address->data.ipv6.address, 16);
+        memset(&service, 0, sizeof(service));
         service.name = name;
         service.type = type;
         service.domain = domain;
         service.host_name = host_name;
         service.port = port;
 
-        (*browser->service_add)(browser, &service, browser->add_userdata);
+        service.addresses_len = 1;
+        service.addresses[0].scope_id = interface;
+        if (address->proto == AVAHI_PROTO_INET) {
+            service.addresses[0].family = AF_INET;
+            memcpy(service.addresses[0].address, &address->data.ipv4.address, 4);
+        } else {
+            service.addresses[0].family = AF_INET6;
+            memcpy(service.addresses[0].address, address->data.ipv6.address, 16);
+            memcpy(service.address, address->data.ipv6.address, 16);
+        }
+
+        // The table merges this address with ones resolved over the other protocol, resolving again without
+        // news only refreshes the service's lifetime
+        opendrop_service *merged;
+        bool changed;
+        if (opendrop_peers_put(browser->peers, &service, &changed) ||
+            (changed && opendrop_peers_get(browser->peers, name, type, domain, &merged))) {
+            emit_status(browser, OPENDROP_BROWSER_ERROR);
+            break;
+        }
+
+        if (changed) {
+            emit_add(browser, merged);
+        }
     }
 
+    // The slot goes to the next queued service
+    unlink_resolve(&browser->resolving, NULL, resolve);
+    browser->resolving_len--;
     avahi_service_resolver_free(r);
+    free(resolve);
+
+    start_queued(browser);
+}
+
+// Remembers a service Avahi reports, to resolve it again while a TTL is set
+static int track_browsed(opendrop_browser *browser, AvahiIfIndex interface, AvahiProtocol protocol, const char *name, const char *type, const char *domain) {
+    if (find_resolve(browser->browsed, protocol, name, type, domain)) {
+        return 0;
+    }
+
+    browser_resolve *browsed = new_resolve(browser, interface, protocol, name, type, domain);
+    if (!browsed) {
+        return 1;
+    }
+
+    browsed->next = browser->browsed;
+    browser->browsed = browsed;
+    return 0;
+}
+
+static void ttl_callback(AvahiTimeout *timeout, void *userdata);
+
+// Schedules the next TTL pass half a TTL from now, or stops the timer without a TTL or while not browsing
+static void arm_ttl(opendrop_browser *browser) {
+    if (!browser->ttl || !browser->avahi_browser) {
+        disarm_ttl(browser);
+        return;
+    }
+
+    struct timeval tv;
+    avahi_elapse_time(&tv, browser->ttl * 500, 0);
+    if (browser->ttl_timeout) {
+        browser->poll->timeout_update(browser->ttl_timeout, &tv);
+    } else if (!(browser->ttl_timeout = browser->poll->timeout_new(browser->poll, &tv, ttl_callback, browser))) {
+        emit_status(browser, OPENDROP_BROWSER_ERROR);
+    }
+}
+
+// Reports services that weren't resolved again within the TTL as removed, then resolves the ones Avahi still reports
+static void ttl_callback(AvahiTimeout *timeout, void *userdata) {
+    opendrop_browser *browser = (opendrop_browser*) userdata;
+
+    opendrop_service *expired;
+    size_t expired_len;
+    if (opendrop_peers_expire(browser->peers, &expired, &expired_len)) {
+        emit_status(browser, OPENDROP_BROWSER_ERROR);
+    }
+
+    for (size_t i = 0; i < expired_len; i++) {
+        emit_remove(browser, expired[i].name, expired[i].type, expired[i].domain);
+    }
+    free(expired);
+
+    for (browser_resolve *browsed = browser->browsed; browsed; browsed = browsed->next) {
+        if (schedule_resolve(browser, browsed->interface, browsed->protocol, browsed->name, browsed->type, browsed->domain)) {
+            emit_status(browser, OPENDROP_BROWSER_ERROR);
+            break;
+        }
+    }
+
+    arm_ttl(browser);
 }
 
 // Handles Avahi browser events
@@ -155,36 +521,57 @@ void browse_callback(
 
     switch (event) {
     case AVAHI_BROWSER_NEW:
-        if (!avahi_service_resolver_new(browser->avahi_client, interface, protocol, name, type, domain, AVAHI_PROTO_INET6, 0, resolve_callback, browser)) {
-            (*browser->browser_status)(browser, OPENDROP_BROWSER_ERROR, browser->status_userdata);
+        if (track_browsed(browser, interface, protocol, name, type, domain) ||
+            schedule_resolve(browser, interface, protocol, name, type, domain)) {
+            emit_status(browser, OPENDROP_BROWSER_ERROR);
         }
         break;
 
-    case AVAHI_BROWSER_REMOVE:
-        (*browser->service_remove)(browser, name, type, domain, browser->remove_userdata);
+    case AVAHI_BROWSER_REMOVE: ;
+        browser_resolve *browsed = find_resolve(browser->browsed, protocol, name, type, domain);
+        if (browsed) {
+            unlink_resolve(&browser->browsed, NULL, browsed);
+            free(browsed);
+        }
+        cancel_resolve(browser, protocol, name, type, domain);
+
+        // Each protocol is browsed on its own, the service stays while the other one still has addresses
+        if (opendrop_peers_remove_family(browser->peers, name, type, domain, protocol == AVAHI_PROTO_INET ? AF_INET : AF_INET6) == 1) {
+            emit_remove(browser, name, type, domain);
+        }
         break;
 
     case AVAHI_BROWSER_FAILURE:
-        (*browser->browser_status)(browser, OPENDROP_BROWSER_ERROR, browser->status_userdata);
+        emit_status(browser, OPENDROP_BROWSER_ERROR);
         break;
 
     case AVAHI_BROWSER_ALL_FOR_NOW:
-        (*browser->browser_status)(browser, OPENDROP_BROWSER_DONE, browser->status_userdata);
+        emit_status(browser, OPENDROP_BROWSER_DONE);
         break;
 
     case AVAHI_BROWSER_CACHE_EXHAUSTED:
-        (*browser->browser_status)(browser, OPENDROP_BROWSER_CACHE_EMPTY, browser->status_userdata);
+        emit_status(browser, OPENDROP_BROWSER_CACHE_EMPTY);
         break;
     }
 }
 
 int opendrop_browser_start(opendrop_browser *browser) {
-    if (!(browser->avahi_browser = avahi_service_browser_new(browser->avahi_client, browser->interface_idx, AVAHI_PROTO_INET6, "_airdrop._tcp", NULL, 0, browse_callback, browser))) {
+    if (browser->threaded) {
+        avahi_threaded_poll_lock(avahi_loop);
+    }
+
+    int ret = 0;
+    if (!(browser->avahi_browser = avahi_service_browser_new(browser->avahi_client, browser->interface_idx, AVAHI_PROTO_UNSPEC, "_airdrop._tcp", NULL, 0, browse_callback, browser))) {
         browser->last_avahi_error = avahi_client_errno(browser->avahi_client);
-        return 1;
+        ret = 1;
     }
+    arm_ttl(browser);
 
-    return 0;
+    if (browser->threaded) {
+        avahi_threaded_poll_unlock(avahi_loop);
+    }
+
+    return ret;
 }
 
 void opendrop_browser_stop(opendrop_browser *browser) {
@@ -192,9 +579,18 @@ void opendrop_browser_stop(opendrop_browser *browser) {
         return;
     }
 
-    avahi_service_browser_free(browser->avahi_browser);
+    if (browser->threaded) {
+        avahi_threaded_poll_lock(avahi_loop);
+    }
 
+    avahi_service_browser_free(browser->avahi_browser);
+    clear_resolves(browser);
     browser->avahi_browser = NULL;
+    disarm_ttl(browser);
+
+    if (browser->threaded) {
+        avahi_threaded_poll_unlock(avahi_loop);
+    }
 }
 
 void opendrop_browser_set_state_callback(opendrop_browser *browser, opendrop_browser_status_cb callback, void *userdata) {
@@ -212,6 +608,59 @@ void opendrop_browser_set_remove_service_callback(opendrop_browser *browser, ope
     browser->remove_userdata = userdata;
 }
 
+void opendrop_browser_set_max_resolvers(opendrop_browser *browser, size_t max_resolvers) {
+    browser->max_resolvers = max_resolvers ? max_resolvers : 1;
+}
+
+void opendrop_browser_set_ttl(opendrop_browser *browser, unsigned int ttl) {
+    if (browser->threaded) {
+        avahi_threaded_poll_lock(avahi_loop);
+    }
+
+    browser->ttl = ttl;
+    opendrop_peers_set_ttl(browser->peers, ttl);
+    arm_ttl(browser);
+
+    if (browser->threaded) {
+        avahi_threaded_poll_unlock(avahi_loop);
+    }
+}
+
+int opendrop_browser_lookup(opendrop_browser *browser, const char *name, const char *type, const char *domain, opendrop_service **service) {
+    return opendrop_peers_get(browser->peers, name, type, domain, service);
+}
+
+int opendrop_browser_snapshot(opendrop_browser *browser, opendrop_service **services, size_t *services_len) {
+    return opendrop_peers_snapshot(browser->peers, services, services_len);
+}
+
+void opendrop_browser_services_free(opendrop_service *services) {
+    free(services);
+}
+
+int opendrop_browser_enable_event_queue(opendrop_browser *browser, size_t capacity) {
+    if (browser->events) {
+        return 0;
+    }
+
+    return opendrop_event_ring_new(&browser->events, capacity);
+}
+
+int opendrop_browser_event_fd(const opendrop_browser *browser) {
+    return browser->events ? opendrop_event_ring_fd(browser->events) : -1;
+}
+
+size_t opendrop_browser_poll_events(opendrop_browser *browser, opendrop_browser_event *events, size_t max) {
+    return browser->events ? opendrop_event_ring_poll(browser->events, events, max) : 0;
+}
+
+void opendrop_browser_events_free(opendrop_browser_event *events, size_t events_len) {
+    for (size_t i = 0; i < events_len; i++) {
+        free(events[i].service);
+        events[i].service = NULL;
+    }
+}
+
 int opendrop_browser_init_errno() {
     return last_browser_init_error;
 }
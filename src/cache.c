@@ -0,0 +1,320 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+
+#include "cache.h"
+
+// Bumped when the compressed body changes for the same files, so older bodies stop matching
+#define CACHE_FORMAT 1
+// Hex key followed by ".gz"
+#define CACHE_NAME_LEN (OPENDROP_CACHE_KEY_LEN * 2 + sizeof(".gz"))
+// Read size when hashing file-backed data
+#define CACHE_HASH_BLOCK (64 * 1024)
+
+typedef struct cache_entry_s {
+    char name[CACHE_NAME_LEN];
+    uint64_t size;
+    // Larger is more recently used
+    uint64_t used;
+} cache_entry;
+
+struct opendrop_client_cache_s {
+    int dir_fd;
+    uint64_t max_bytes;
+
+    // Bodies in the directory, guarded by lock
+    pthread_mutex_t lock;
+    cache_entry *entries;
+    size_t entries_len;
+    size_t entries_cap;
+    uint64_t total_bytes;
+    uint64_t clock;
+};
+
+static void key_name(const unsigned char *key, char *name) {
+    for (int i = 0; i < OPENDROP_CACHE_KEY_LEN; i++) {
+        sprintf(name + i * 2, "%02x", key[i]);
+    }
+    strcpy(name + OPENDROP_CACHE_KEY_LEN * 2, ".gz");
+}
+
+// Whether a directory entry is a body, anything else in the directory is left alone
+static bool is_body_name(const char *name) {
+    for (int i = 0; i < OPENDROP_CACHE_KEY_LEN * 2; i++) {
+        if (!(name[i] >= '0' && name[i] <= '9') && !(name[i] >= 'a' && name[i] <= 'f')) {
+            return false;
+        }
+    }
+    return !strcmp(name + OPENDROP_CACHE_KEY_LEN * 2, ".gz");
+}
+
+// Adds an entry, caller holds the lock
+static int add_entry(opendrop_client_cache *cache, const char *name, uint64_t size, uint64_t used) {
+    if (cache->entries_len == cache->entries_cap) {
+        size_t cap = cache->entries_cap ? cache->entries_cap * 2 : 16;
+        cache_entry *entries = (cache_entry*) realloc(cache->entries, cap * sizeof(cache_entry));
+        if (!entries) {
+            return 1;
+        }
+
+        cache->entries = entries;
+        cache->entries_cap = cap;
+    }
+
+    cache_entry *entry = &cache->entries[cache->entries_len++];
+    strcpy(entry->name, name);
+    entry->size = size;
+    entry->used = used;
+    cache->total_bytes += size;
+    if (used > cache->clock) {
+        cache->clock = used;
+    }
+    return 0;
+}
+
+// Forgets an entry and deletes its body, caller holds the lock
+static void remove_entry(opendrop_client_cache *cache, size_t i) {
+    unlinkat(cache->dir_fd, cache->entries[i].name, 0);
+    cache->total_bytes -= cache->entries[i].size;
+    cache->entries[i] = cache->entries[--cache->entries_len];
+}
+
+// Marks a body as used now, in its modification time so later runs see the same order, caller holds the lock
+// Stamps always move forward, the filesystem's own clock is too coarse to order bodies used in quick succession
+static uint64_t touch(opendrop_client_cache *cache, int fd) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t stamp = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    if (stamp <= cache->clock) {
+        stamp = cache->clock + 1;
+    }
+    cache->clock = stamp;
+
+    struct timespec times[2] = { { 0, UTIME_OMIT }, { stamp / 1000000000ULL, stamp % 1000000000ULL } };
+    futimens(fd, times);
+    return stamp;
+}
+
+// Deletes least recently used bodies until the rest fit, caller holds the lock
+static void evict(opendrop_client_cache *cache) {
+    while (cache->total_bytes > cache->max_bytes && cache->entries_len) {
+        size_t oldest = 0;
+        for (size_t i = 1; i < cache->entries_len; i++) {
+            if (cache->entries[i].used < cache->entries[oldest].used) {
+                oldest = i;
+            }
+        }
+        remove_entry(cache, oldest);
+    }
+}
+
+int opendrop_client_cache_new(opendrop_client_cache **cache, const char *directory, uint64_t max_bytes) {
+    if (!(*cache = (opendrop_client_cache*) malloc(sizeof(opendrop_client_cache)))) {
+        return 1;
+    }
+
+    memset(*cache, 0, sizeof(opendrop_client_cache));
+    (*cache)->max_bytes = max_bytes;
+    pthread_mutex_init(&(*cache)->lock, NULL);
+
+    // The listing gets its own descriptor, closedir closes it
+    DIR *dir = NULL;
+    int dir_fd = -1;
+    if (((*cache)->dir_fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 ||
+        (dir_fd = dup((*cache)->dir_fd)) < 0 || !(dir = fdopendir(dir_fd))) {
+        if (dir_fd >= 0) {
+            close(dir_fd);
+        }
+        opendrop_client_cache_free(*cache);
+        return 2;
+    }
+
+    // Bodies left by earlier runs, last modification is when they were last used
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        struct stat st;
+        if (is_body_name(ent->d_name) && !fstatat((*cache)->dir_fd, ent->d_name, &st, 0) && S_ISREG(st.st_mode) &&
+            add_entry(*cache, ent->d_name, st.st_size, st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec)) {
+            closedir(dir);
+            opendrop_client_cache_free(*cache);
+            return 1;
+        }
+    }
+    closedir(dir);
+
+    evict(*cache);
+    return 0;
+}
+
+void opendrop_client_cache_free(opendrop_client_cache *cache) {
+    if (cache) {
+        if (cache->dir_fd >= 0) {
+            close(cache->dir_fd);
+        }
+
+        pthread_mutex_destroy(&cache->lock);
+        free(cache->entries);
+        free(cache);
+    }
+}
+
+// Feeds a length-prefixed string, so neighbouring fields can't run into each other
+static void hash_string(EVP_MD_CTX *ctx, const char *str) {
+    uint64_t len = str ? strlen(str) : 0;
+    EVP_DigestUpdate(ctx, &len, sizeof(len));
+    EVP_DigestUpdate(ctx, str, len);
+}
+
+// Feeds the size and contents of a file
+static int hash_data(EVP_MD_CTX *ctx, const opendrop_client_file_data *file) {
+    if (file->source == OPENDROP_CLIENT_SOURCE_MEMORY) {
+        uint64_t size = file->data_len;
+        EVP_DigestUpdate(ctx, &size, sizeof(size));
+        EVP_DigestUpdate(ctx, file->data, file->data_len);
+        return 0;
+    }
+
+    int fd = file->source == OPENDROP_CLIENT_SOURCE_PATH ? open(file->path, O_RDONLY | O_CLOEXEC) : file->fd;
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+        if (fd >= 0 && file->source == OPENDROP_CLIENT_SOURCE_PATH) {
+            close(fd);
+        }
+        return 1;
+    }
+
+    uint64_t size = st.st_size;
+    EVP_DigestUpdate(ctx, &size, sizeof(size));
+
+    // pread leaves the offset of caller-owned descriptors alone
+    unsigned char buf[CACHE_HASH_BLOCK];
+    off_t offset = 0;
+    ssize_t n;
+    while ((n = pread(fd, buf, sizeof(buf), offset)) > 0) {
+        EVP_DigestUpdate(ctx, buf, n);
+        offset += n;
+    }
+
+    if (file->source == OPENDROP_CLIENT_SOURCE_PATH) {
+        close(fd);
+    }
+    return n < 0 || (uint64_t) offset != size;
+}
+
+int opendrop_cache_key(const opendrop_client_file_data **files, size_t files_len, unsigned char *key) {
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    if (!ctx || !EVP_DigestInit_ex(ctx, EVP_sha256(), NULL)) {
+        EVP_MD_CTX_free(ctx);
+        return 1;
+    }
+
+    uint64_t header[2] = { CACHE_FORMAT, files_len };
+    EVP_DigestUpdate(ctx, header, sizeof(header));
+
+    int ret = 0;
+    for (size_t i = 0; i < files_len && !ret; i++) {
+        unsigned char is_dir = files[i]->is_dir;
+        hash_string(ctx, files[i]->name);
+        hash_string(ctx, files[i]->bom_path);
+        EVP_DigestUpdate(ctx, &is_dir, 1);
+        ret = !is_dir && hash_data(ctx, files[i]);
+    }
+
+    ret = ret || !EVP_DigestFinal_ex(ctx, key, NULL);
+    EVP_MD_CTX_free(ctx);
+    return ret;
+}
+
+int opendrop_cache_open(opendrop_client_cache *cache, const unsigned char *key, int *fd) {
+    char name[CACHE_NAME_LEN];
+    key_name(key, name);
+
+    int ret = 1;
+    pthread_mutex_lock(&cache->lock);
+    for (size_t i = 0; i < cache->entries_len; i++) {
+        if (strcmp(cache->entries[i].name, name)) {
+            continue;
+        }
+
+        if ((*fd = openat(cache->dir_fd, name, O_RDONLY | O_CLOEXEC)) < 0) {
+            // Deleted behind the cache's back
+            remove_entry(cache, i);
+            break;
+        }
+
+        cache->entries[i].used = touch(cache, *fd);
+        ret = 0;
+        break;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return ret;
+}
+
+int opendrop_cache_begin(opendrop_client_cache *cache, const unsigned char *key, opendrop_cache_writer *writer) {
+    // An unnamed file disappears by itself if the send fails or the process dies
+    writer->fd = openat(cache->dir_fd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0600);
+    memcpy(writer->key, key, OPENDROP_CACHE_KEY_LEN);
+    writer->len = 0;
+    writer->complete = false;
+    return writer->fd < 0;
+}
+
+void opendrop_cache_write(opendrop_client_cache *cache, opendrop_cache_writer *writer, const unsigned char *data, size_t len) {
+    if (writer->fd < 0) {
+        return;
+    }
+
+    // Bodies larger than the whole cache would only be evicted again
+    writer->len += len;
+    while (len && writer->len <= cache->max_bytes) {
+        ssize_t n = write(writer->fd, data, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            break;
+        }
+
+        data += n;
+        len -= n;
+    }
+
+    if (len) {
+        close(writer->fd);
+        writer->fd = -1;
+    }
+}
+
+void opendrop_cache_end(opendrop_client_cache *cache, opendrop_cache_writer *writer, bool keep) {
+    if (writer->fd < 0) {
+        return;
+    }
+
+    if (keep && writer->complete) {
+        char name[CACHE_NAME_LEN], path[sizeof("/proc/self/fd/") + 16];
+        key_name(writer->key, name);
+        snprintf(path, sizeof(path), "/proc/self/fd/%i", writer->fd);
+
+        // Another sender may have added the same files first, its body is as good
+        pthread_mutex_lock(&cache->lock);
+        uint64_t used = touch(cache, writer->fd);
+        if (!linkat(AT_FDCWD, path, cache->dir_fd, name, AT_SYMLINK_FOLLOW) &&
+            add_entry(cache, name, writer->len, used)) {
+            unlinkat(cache->dir_fd, name, 0);
+        }
+        evict(cache);
+        pthread_mutex_unlock(&cache->lock);
+    }
+
+    close(writer->fd);
+    writer->fd = -1;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "../include/client.h"
+
+// SHA-256 of a file set
+#define OPENDROP_CACHE_KEY_LEN 32
+
+// Compressed body being written while it is uploaded, made visible by commit
+typedef struct opendrop_cache_writer_s {
+    // Unnamed file in the cache directory, -1 when not writing
+    int fd;
+    unsigned char key[OPENDROP_CACHE_KEY_LEN];
+    uint64_t len;
+    // Set once the whole body was written
+    bool complete;
+} opendrop_cache_writer;
+
+// Hashes the names, BOM paths, sizes and contents of a file set
+// Args:
+// - files: Files to send
+// - files_len: Number of files
+// - key: Cache key
+// Returns 0 on success, 1 if a file couldn't be read
+int opendrop_cache_key(const opendrop_client_file_data **files, size_t files_len, unsigned char *key);
+
+// Opens the cached body of a file set, marking it as most recently used
+// Args:
+// - cache: Client cache
+// - key: Cache key
+// - fd: Body, opened for reading
+// Returns 0 on a hit, 1 on a miss
+int opendrop_cache_open(opendrop_client_cache *cache, const unsigned char *key, int *fd);
+
+// Starts writing a body, nothing is visible to other senders until it is committed
+// Args:
+// - cache: Client cache
+// - key: Cache key
+// - writer: Writer, fd stays -1 on error
+// Returns 0 on success, 1 on error
+int opendrop_cache_begin(opendrop_client_cache *cache, const unsigned char *key, opendrop_cache_writer *writer);
+
+// Appends compressed bytes, a failed write abandons the writer
+// Args:
+// - cache: Client cache
+// - writer: Writer
+// - data: Compressed bytes
+// - len: Length of data
+void opendrop_cache_write(opendrop_client_cache *cache, opendrop_cache_writer *writer, const unsigned char *data, size_t len);
+
+// Ends a writer, adding the body if it is complete and evicting least recently used bodies over the size limit
+// Args:
+// - cache: Client cache
+// - writer: Writer
+// - keep: Whether to add the body, an incomplete body is always dropped
+void opendrop_cache_end(opendrop_client_cache *cache, opendrop_cache_writer *writer, bool keep);
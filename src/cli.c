@@ -7,6 +7,7 @@
 #include "../include/client.h"
 #include "config_private.h"
 #include "../include/server.h"
+#include "../include/sweep.h"
 
 enum Action {
     ACTION_RECEIVE,
@@ -70,16 +71,28 @@ static struct argp argp = { options, parse_opt, args_doc, docs };
 
 sigset_t mask, oldmask;
 opendrop_browser * browser;
+opendrop_sweep *sweep;
+volatile sig_atomic_t receiving = 0;
 
 void int_handler(int val) {
     if (browser) {
         opendrop_browser_free(browser);
         browser = NULL;
     }
+
+    receiving = 0;
 }
 
 void browser_add_service(opendrop_browser* b, const opendrop_service* s, void* userdata) {
     printf("Service Added:\nNAME: %s\nHOST NAME: %s\nADDRESS: %s\nPORT: %u\nTYPE: %s\nDOMAIN: %s\n", s->name, s->host_name, s->address, s->port, s->type, s->domain);
+
+    if (sweep && opendrop_sweep_add(sweep, s)) {
+        printf("Failed to queue Discover for %s\n", s->name);
+    }
+}
+
+void sweep_found(opendrop_sweep *s, const char *service_name, const char *receiver_name, void *userdata) {
+    printf("Receiver Found:\nNAME: %s\nRECEIVER: %s\n", service_name, receiver_name);
 }
 
 void browser_remove_service(opendrop_browser* b, const char* name, const char* type, const char* domain, void* userdata) {
@@ -118,6 +131,19 @@ int find(const opendrop_config *config) {
     opendrop_browser_set_add_service_callback(browser, browser_add_service, NULL);
     opendrop_browser_set_remove_service_callback(browser, browser_remove_service, NULL);
 
+    // Peers are asked for their names as they are resolved
+    if (opendrop_sweep_new(&sweep, config, 8)) {
+        printf("Failed to create sweep: %s\n", opendrop_sweep_strerror(opendrop_sweep_init_errno()));
+        return 1;
+    }
+
+    opendrop_sweep_set_found_callback(sweep, sweep_found, NULL);
+
+    if (opendrop_sweep_start(sweep)) {
+        printf("Failed to start sweep: %s\n", opendrop_sweep_strerror(opendrop_sweep_errno(sweep)));
+        return 1;
+    }
+
     if (opendrop_browser_start(browser)) {
         printf("Failed to start browser: %s\n", opendrop_browser_strerror(opendrop_browser_errno(browser)));
         return 1;
@@ -132,6 +158,40 @@ int find(const opendrop_config *config) {
     }
     sigprocmask(SIG_UNBLOCK, &mask, NULL);
 
+    opendrop_sweep_free(sweep);
+    sweep = NULL;
+
+    printf("\nSIGINT! Shutdown successful\n");
+
+    return 0;
+}
+
+int receive(const opendrop_config *config) {
+    printf("Starting server on interface \"%s\", port %u, saving files to the current directory\n", config->interface, config->server_port);
+
+    opendrop_server *server;
+    if (opendrop_server_new(&server, config)) {
+        printf("Failed to create server: %s\n", opendrop_server_strerror(opendrop_server_init_errno()));
+        return 1;
+    }
+
+    if (opendrop_server_set_output_directory(server, ".") || opendrop_server_start(server)) {
+        printf("Failed to start server: %s\n", opendrop_server_strerror(opendrop_server_errno(server)));
+        opendrop_server_free(server);
+        return 1;
+    }
+
+    printf("Ctrl+C to stop server\n");
+
+    // Wait for signal
+    receiving = 1;
+    sigprocmask(SIG_BLOCK, &mask, &oldmask);
+    while (receiving) {
+        sigsuspend(&oldmask);
+    }
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+
+    opendrop_server_free(server);
     printf("\nSIGINT! Shutdown successful\n");
 
     return 0;
@@ -188,6 +248,8 @@ int main(int argc, char **argv) {
     switch (args.action) {
         case ACTION_FIND:
             return find(args.config);
+        case ACTION_RECEIVE:
+            return receive(args.config);
     }
     
     return 1;
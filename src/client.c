@@ -1,43 +1,170 @@
+#include <stdio.h>
 #include <stdlib.h>
+#include <stdatomic.h>
 #include <curl/curl.h>
-#include <plist/plist.h>
+#include <openssl/ssl.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
 
 #include "../include/client.h"
+#include "client_private.h"
 #include "config_private.h"
+#include "archive.h"
+#include "deflate.h"
+#include "bplist.h"
+#include "limiter.h"
+#include "cache.h"
+
+// Delay before racing the next address while earlier attempts are pending
+#define CLIENT_RACE_DELAY_MS 250
+// Give up on an address that hasn't completed its handshake in this time
+#define CLIENT_RACE_TIMEOUT_MS 10000L
+// Responses are small plists, anything larger fails the request
+#define CLIENT_MAX_RESPONSE (64 * 1024)
 
 size_t write_callback(char *ptr, size_t size, size_t nmemb, void *userdata);
+size_t upload_read_callback(char *buffer, size_t size, size_t nitems, void *userdata);
+int progress_callback(void *userdata, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow);
 
 struct opendrop_client_s {
     CURL *curl;
-    char *latest_response;
+    // Target address followed by the request path
+    char *url;
+    size_t url_base_len;
+    uint16_t port;
+
+    opendrop_client_share *share;
+    // Created when racing addresses without a share, so the winning TLS session can be resumed
+    opendrop_client_share *own_share;
+
+    // Kept between requests, it only grows until it fits the largest response
+    unsigned char *latest_response;
     size_t latest_response_len;
+    size_t latest_response_cap;
 
     const opendrop_config *config;
 
+    // Serialized config values, rebuilt when the config's revision moves on
+    opendrop_bplist_template *template;
+    unsigned int template_revision;
+    // Ask body, its storage is reused between requests
+    opendrop_bplist_buf body;
+
+    // Built once, requests only point the handle at them
+    struct curl_slist *headers;
+    struct curl_slist *upload_headers;
+
+    // Upload pipeline, created by the first send and reset for later ones
+    opendrop_archive *archive;
+    opendrop_deflate *stream;
+    unsigned int stream_threads;
+
+    // Compressed bodies of earlier sends, NULL to always compress
+    opendrop_client_cache *cache;
+    // Body of the running send when it came from the cache, -1 when it is compressed
+    int cache_fd;
+    // Compressed body of the running send on its way into the cache, fd is -1 when not caching
+    opendrop_cache_writer cache_writer;
+
+    // Filled in after every request
+    opendrop_client_stats stats;
+    // Compressed bytes of every send, for the cumulative compression ratio
+    uint64_t total_compressed_bytes;
+    // Whether the current request's TLS session has been looked at and was resumed
+    bool tls_checked;
+    bool tls_resumed;
+
+    // Upload rate limits, the client's own bucket is unlimited until a rate is set
+    opendrop_client_limiter own_limiter;
+    opendrop_client_limiter *limiter;
+    // Wakes a rate limited upload when the client is cancelled
+    pthread_mutex_t wait_lock;
+    pthread_cond_t wait_cond;
+    atomic_bool cancelled;
+
+    opendrop_client_progress_callback progress;
+    void *progress_userdata;
+    unsigned int progress_interval_ms;
+    long long progress_last_ms;
+    bool uploading;
+    // Compressed bytes handed to cURL by the running upload
+    uint64_t upload_read;
+
     int last_error;
     int last_curl_error;
 };
 
+// libcurl global state with reference count, the lock also serializes curl_global_init and cleanup
 size_t curl_refs = 0;
+static pthread_mutex_t curl_refs_lock = PTHREAD_MUTEX_INITIALIZER;
 
 int last_client_init_error = 0;
 
-int opendrop_client_new(opendrop_client **client, const char *target_address, uint16_t target_port, const opendrop_config *config) {
-    // Create global cURL context
+int opendrop_client_global_init() {
+    int err = 0;
+    pthread_mutex_lock(&curl_refs_lock);
     if (!curl_refs++) {
-        if (last_client_init_error = curl_global_init(CURL_GLOBAL_ALL)) {
-            return 1;
+        if (err = curl_global_init(CURL_GLOBAL_ALL)) {
+            curl_refs--;
         }
     }
+    pthread_mutex_unlock(&curl_refs_lock);
+
+    return err;
+}
+
+void opendrop_client_global_cleanup() {
+    pthread_mutex_lock(&curl_refs_lock);
+    if (!curl_refs || !(--curl_refs)) {
+        curl_global_cleanup();
+    }
+    pthread_mutex_unlock(&curl_refs_lock);
+}
+
+int opendrop_client_configure(CURL *curl, const opendrop_config *config) {
+    int err;
+    if ((err = curl_easy_setopt(curl, CURLOPT_INTERFACE, config->interface)) ||
+        (err = curl_easy_setopt(curl, CURLOPT_SSLCERT_BLOB, config->cert_data)) ||
+        (err = curl_easy_setopt(curl, CURLOPT_SSLKEY_BLOB, config->key_data)) ||
+        (err = curl_easy_setopt(curl, CURLOPT_KEYPASSWD, OPENDROP_KEY_PASSPHRASE)) ||
+        (err = curl_easy_setopt(curl, CURLOPT_CAINFO_BLOB, config->root_ca)) ||
+        (err = curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, (long) config->verify_peer)) ||
+        (err = curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, config->verify_peer ? 2L : 0L)) ||
+        (err = curl_easy_setopt(curl, CURLOPT_SSLVERSION, CURL_SSLVERSION_TLSv1_2))) {
+        return err;
+    }
+
+    return 0;
+}
+
+int opendrop_client_new(opendrop_client **client, const char *target_address, uint16_t target_port, const opendrop_config *config) {
+    // Create global cURL context
+    if (last_client_init_error = opendrop_client_global_init()) {
+        return 1;
+    }
 
     if (!(*client = (opendrop_client*) malloc(sizeof(opendrop_client)))) {
+        opendrop_client_global_cleanup();
         last_client_init_error = -1;
         return 1;
     }
 
     memset(*client, 0, sizeof(opendrop_client));
 
+    // Throttled uploads wait against the monotonic clock the limiters use
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&(*client)->wait_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    pthread_mutex_init(&(*client)->wait_lock, NULL);
+    opendrop_client_limiter_init(&(*client)->own_limiter, 0, 0);
+    (*client)->cache_fd = -1;
+    (*client)->cache_writer.fd = -1;
+
     if(!((*client)->curl = curl_easy_init())) {
         opendrop_client_free(*client);
         last_client_init_error = -2;
@@ -45,17 +172,32 @@ int opendrop_client_new(opendrop_client **client, const char *target_address, ui
     }
 
     (*client)->config = config;
+    (*client)->port = target_port;
+
+    (*client)->url_base_len = strlen(target_address);
+    if (!((*client)->url = (char*) malloc((*client)->url_base_len + sizeof("/Discover")))) {
+        opendrop_client_free(*client);
+        last_client_init_error = -1;
+        return 1;
+    }
+    strcpy((*client)->url, target_address);
+
+    if (!((*client)->headers = generate_body_headers_list()) || !((*client)->upload_headers = generate_upload_headers_list())) {
+        opendrop_client_free(*client);
+        last_client_init_error = -1;
+        return 1;
+    }
 
 #define curl_handle (*client)->curl
     // Set regular values
-    if (curl_easy_setopt(curl_handle, CURLOPT_INTERFACE, config->interface) || 
+    if (opendrop_client_configure(curl_handle, config) ||
         curl_easy_setopt(curl_handle, CURLOPT_PORT, target_port) || 
         curl_easy_setopt(curl_handle, CURLOPT_URL, target_address) ||
-        curl_easy_setopt(curl_handle, CURLOPT_SSLCERT_BLOB, config->cert_data) ||
-        curl_easy_setopt(curl_handle, CURLOPT_CAINFO_BLOB, config->root_ca) ||
-        curl_easy_setopt(curl_handle, CURLOPT_SSLVERSION, CURL_SSLVERSION_TLSv1_2) ||
         curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, write_callback) ||
-        curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, *client)) {
+        curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, *client) ||
+        curl_easy_setopt(curl_handle, CURLOPT_XFERINFOFUNCTION, progress_callback) ||
+        curl_easy_setopt(curl_handle, CURLOPT_XFERINFODATA, *client) ||
+        curl_easy_setopt(curl_handle, CURLOPT_NOPROGRESS, 0L)) {
         opendrop_client_free(*client);
         last_client_init_error = -3;
         return 1;
@@ -65,6 +207,262 @@ int opendrop_client_new(opendrop_client **client, const char *target_address, ui
     return 0;
 }
 
+static void share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr) {
+    opendrop_client_share *share = (opendrop_client_share*) userptr;
+    pthread_mutex_lock(&share->locks[data]);
+}
+
+static void share_unlock(CURL *handle, curl_lock_data data, void *userptr) {
+    opendrop_client_share *share = (opendrop_client_share*) userptr;
+    pthread_mutex_unlock(&share->locks[data]);
+}
+
+int opendrop_client_share_new(opendrop_client_share **share, bool share_connections) {
+    if (last_client_init_error = opendrop_client_global_init()) {
+        return 1;
+    }
+
+    if (!(*share = (opendrop_client_share*) malloc(sizeof(opendrop_client_share)))) {
+        opendrop_client_global_cleanup();
+        last_client_init_error = -1;
+        return 1;
+    }
+
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_init(&(*share)->locks[i], NULL);
+    }
+
+    if (!((*share)->share = curl_share_init())) {
+        opendrop_client_share_free(*share);
+        last_client_init_error = -2;
+        return 1;
+    }
+
+    if (curl_share_setopt((*share)->share, CURLSHOPT_LOCKFUNC, share_lock) ||
+        curl_share_setopt((*share)->share, CURLSHOPT_UNLOCKFUNC, share_unlock) ||
+        curl_share_setopt((*share)->share, CURLSHOPT_USERDATA, *share) ||
+        curl_share_setopt((*share)->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION) ||
+        curl_share_setopt((*share)->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS) ||
+        (share_connections && curl_share_setopt((*share)->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT))) {
+        opendrop_client_share_free(*share);
+        last_client_init_error = -3;
+        return 1;
+    }
+
+    return 0;
+}
+
+void opendrop_client_share_free(opendrop_client_share *share) {
+    if (share) {
+        if (share->share) {
+            curl_share_cleanup(share->share);
+        }
+
+        for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+            pthread_mutex_destroy(&share->locks[i]);
+        }
+
+        free(share);
+
+        opendrop_client_global_cleanup();
+    }
+}
+
+int opendrop_client_set_share(opendrop_client *client, opendrop_client_share *share) {
+    if (curl_easy_setopt(client->curl, CURLOPT_SHARE, share ? share->share : NULL)) {
+        client->last_error = 2;
+        client->last_curl_error = 0;
+        return 1;
+    }
+
+    client->share = share;
+    return 0;
+}
+
+void opendrop_client_format_host(const opendrop_address *address, char *host) {
+    if (address->family == AF_INET) {
+        inet_ntop(AF_INET, address->address, host, OPENDROP_CLIENT_HOST_MAX);
+    } else {
+        host[0] = '[';
+        inet_ntop(AF_INET6, address->address, host + 1, OPENDROP_CLIENT_HOST_MAX - 2);
+        strcat(host, "]");
+    }
+}
+
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long now_ms() {
+    return now_ns() / 1000000;
+}
+
+// Finds the next address at or after from in the given family, len if there is none
+static size_t next_family(const opendrop_address *addresses, size_t len, size_t from, bool ipv4) {
+    while (from < len && (addresses[from].family == AF_INET) != ipv4) {
+        from++;
+    }
+
+    return from;
+}
+
+// Starts a connect-only handshake with one address
+static CURL *race_start(opendrop_client *client, CURLM *multi, const opendrop_address *address) {
+    char host[OPENDROP_CLIENT_HOST_MAX], url[sizeof("https://:65535/") + OPENDROP_CLIENT_HOST_MAX];
+    opendrop_client_format_host(address, host);
+    snprintf(url, sizeof(url), "https://%s:%u/", host, client->port);
+
+    CURL *curl = curl_easy_init();
+    if (!curl) {
+        return NULL;
+    }
+
+    if (opendrop_client_configure(curl, client->config) ||
+        curl_easy_setopt(curl, CURLOPT_URL, url) ||
+        (address->scope_id && curl_easy_setopt(curl, CURLOPT_ADDRESS_SCOPE, (long) address->scope_id)) ||
+        curl_easy_setopt(curl, CURLOPT_CONNECT_ONLY, 1L) ||
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, CLIENT_RACE_TIMEOUT_MS) ||
+        curl_easy_setopt(curl, CURLOPT_SHARE, client->share->share) ||
+        curl_multi_add_handle(multi, curl)) {
+        curl_easy_cleanup(curl);
+        return NULL;
+    }
+
+    return curl;
+}
+
+// Points the client at an address, request paths are appended as before
+static int use_address(opendrop_client *client, const opendrop_address *address) {
+    char host[OPENDROP_CLIENT_HOST_MAX];
+    opendrop_client_format_host(address, host);
+
+    size_t url_base_len = strlen("https://") + strlen(host);
+    char *url = (char*) malloc(url_base_len + sizeof("/Discover"));
+    if (!url) {
+        return 1;
+    }
+
+    sprintf(url, "https://%s", host);
+    free(client->url);
+    client->url = url;
+    client->url_base_len = url_base_len;
+
+    return curl_easy_setopt(client->curl, CURLOPT_URL, client->url) ||
+        curl_easy_setopt(client->curl, CURLOPT_ADDRESS_SCOPE, (long) address->scope_id);
+}
+
+int opendrop_client_connect(opendrop_client *client, const opendrop_address *addresses, size_t addresses_len) {
+    client->last_error = 0;
+    client->last_curl_error = 0;
+
+    if (!addresses_len) {
+        client->last_error = 4;
+        return 1;
+    }
+
+    // The handshake is resumed from the session cached by the winning attempt
+    if (!client->share) {
+        if (opendrop_client_share_new(&client->own_share, false) || opendrop_client_set_share(client, client->own_share)) {
+            client->last_error = 2;
+            return 1;
+        }
+    }
+
+    size_t *order = (size_t*) malloc(sizeof(size_t) * addresses_len);
+    CURL **attempts = (CURL**) calloc(addresses_len, sizeof(CURL*));
+    CURLM *multi = curl_multi_init();
+    if (!order || !attempts || !multi) {
+        free(order);
+        free(attempts);
+        if (multi) {
+            curl_multi_cleanup(multi);
+        }
+        client->last_error = 1;
+        return 1;
+    }
+
+    // Alternate address families so one unreachable family can't delay the other
+    size_t v6 = next_family(addresses, addresses_len, 0, false), v4 = next_family(addresses, addresses_len, 0, true);
+    for (size_t n = 0; n < addresses_len; n++) {
+        if (v6 == addresses_len || (v4 < addresses_len && n % 2)) {
+            order[n] = v4;
+            v4 = next_family(addresses, addresses_len, v4 + 1, true);
+        } else {
+            order[n] = v6;
+            v6 = next_family(addresses, addresses_len, v6 + 1, false);
+        }
+    }
+
+    size_t started = 0, failed = 0;
+    long winner = -1;
+    long long next_start = 0;
+    CURLcode last_result = CURLE_COULDNT_CONNECT;
+
+    while (winner < 0 && failed < addresses_len) {
+        // The next attempt starts after the delay, or straight away when nothing else is pending
+        long long time = now_ms();
+        if (started < addresses_len && (started == failed || time >= next_start)) {
+            size_t i = order[started++];
+            next_start = time + CLIENT_RACE_DELAY_MS;
+            if (!(attempts[i] = race_start(client, multi, &addresses[i]))) {
+                failed++;
+                continue;
+            }
+        }
+
+        int running;
+        curl_multi_perform(multi, &running);
+
+        CURLMsg *msg;
+        int left;
+        while ((msg = curl_multi_info_read(multi, &left))) {
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+
+            if (msg->data.result == CURLE_OK) {
+                if (winner < 0) {
+                    for (winner = 0; attempts[winner] != msg->easy_handle; winner++);
+                }
+            } else {
+                last_result = msg->data.result;
+                failed++;
+            }
+        }
+
+        if (winner < 0 && failed < addresses_len) {
+            long long wait = started < addresses_len ? next_start - now_ms() : 1000;
+            curl_multi_poll(multi, NULL, 0, wait > 0 ? (int) wait : 0, NULL);
+        }
+    }
+
+    // Losing attempts are abandoned, the winner's connection isn't reusable for requests
+    for (size_t i = 0; i < addresses_len; i++) {
+        if (attempts[i]) {
+            curl_multi_remove_handle(multi, attempts[i]);
+            curl_easy_cleanup(attempts[i]);
+        }
+    }
+
+    curl_multi_cleanup(multi);
+    free(attempts);
+    free(order);
+
+    if (winner < 0) {
+        client->last_curl_error = last_result;
+        return 1;
+    }
+
+    if (use_address(client, &addresses[winner])) {
+        client->last_error = 2;
+        return 1;
+    }
+
+    return 0;
+}
+
 struct curl_slist *generate_default_headers_list() {
     struct curl_slist *list = NULL;
     list = curl_slist_append(list, "Connection: keep-alive");
@@ -76,163 +474,312 @@ struct curl_slist *generate_default_headers_list() {
     return list;
 }
 
+// Appends to a list, freeing it instead if the append fails
+struct curl_slist *append_or_free(struct curl_slist *list, const char *header) {
+    struct curl_slist *appended = list ? curl_slist_append(list, header) : NULL;
+    if (!appended) {
+        curl_slist_free_all(list);
+    }
+
+    return appended;
+}
+
+struct curl_slist *generate_body_headers_list() {
+    return append_or_free(generate_default_headers_list(), "ContentType: application/octet-stream");
+}
+
+struct curl_slist *generate_upload_headers_list() {
+    struct curl_slist *list = append_or_free(generate_default_headers_list(), "Content-Type: application/x-cpio");
+    // Body size is unknown until the archive is compressed
+    list = append_or_free(list, "Transfer-Encoding: chunked");
+    return append_or_free(list, "Expect:");
+}
+
+// Points the handle at an endpoint of the target, path must fit in "/Discover"
+int set_endpoint(opendrop_client *client, const char *path) {
+    strcpy(client->url + client->url_base_len, path);
+    return curl_easy_setopt(client->curl, CURLOPT_URL, client->url) != CURLE_OK;
+}
+
+// Rebuilds the body template if the config changed since it was built
+static int update_template(opendrop_client *client) {
+    if (client->template && client->template_revision == client->config->revision) {
+        return 0;
+    }
+
+    opendrop_bplist_template_free(client->template);
+    client->template_revision = client->config->revision;
+    return opendrop_bplist_template_new(&client->template, client->config);
+}
+
 void opendrop_client_free(opendrop_client *client) {
     if (client) {
         if (client->curl) {
             curl_easy_cleanup(client->curl);
         }
 
+        free(client->url);
+        free(client->latest_response);
+        curl_slist_free_all(client->headers);
+        curl_slist_free_all(client->upload_headers);
+        opendrop_deflate_free(client->stream);
+        opendrop_archive_free(client->archive);
+        opendrop_bplist_template_free(client->template);
+        opendrop_bplist_buf_free(&client->body);
+        opendrop_client_share_free(client->own_share);
+        opendrop_client_limiter_destroy(&client->own_limiter);
+        pthread_cond_destroy(&client->wait_cond);
+        pthread_mutex_destroy(&client->wait_lock);
         free(client);
 
-        if (!curl_refs || !(--curl_refs)) {
-            curl_global_cleanup();
-        }
+        opendrop_client_global_cleanup();
+    }
+}
+
+// Notes whether the connection resumed a TLS session, the SSL object is only reachable while a transfer runs
+static void check_tls(opendrop_client *client) {
+    const struct curl_tlssessioninfo *info;
+    if (client->tls_checked || curl_easy_getinfo(client->curl, CURLINFO_TLS_SSL_PTR, &info) ||
+        info->backend != CURLSSLBACKEND_OPENSSL || !info->internals || !SSL_is_init_finished((SSL*) info->internals)) {
+        return;
+    }
+
+    client->tls_checked = true;
+    client->tls_resumed = SSL_session_reused((SSL*) info->internals);
+}
+
+// Hands the progress of the running upload to the application
+static void report_progress(opendrop_client *client, uint64_t bytes_sent, bool done) {
+    // Both counts stay zero when the body comes from the cache
+    opendrop_client_progress progress = { bytes_sent, 0, 0, done };
+    if (client->cache_fd < 0) {
+        opendrop_deflate_counts(client->stream, &progress.archive_bytes, &progress.compressed_bytes);
+    }
+
+    client->progress_last_ms = now_ms();
+    client->progress(client, &progress, client->progress_userdata);
+}
+
+int progress_callback(void *userdata, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+    opendrop_client *client = (opendrop_client*) userdata;
+    check_tls(client);
+
+    if (client->uploading && client->progress && now_ms() - client->progress_last_ms >= client->progress_interval_ms) {
+        report_progress(client, ulnow, false);
+    }
+
+    // Any nonzero value aborts the transfer
+    return atomic_load_explicit(&client->cancelled, memory_order_relaxed);
+}
+
+void opendrop_client_set_limiter(opendrop_client *client, opendrop_client_limiter *limiter) {
+    client->limiter = limiter;
+}
+
+void opendrop_client_set_rate_limit(opendrop_client *client, uint64_t bytes_per_second, uint64_t burst) {
+    opendrop_client_limiter_set_rate(&client->own_limiter, bytes_per_second, burst);
+}
+
+void opendrop_client_set_progress_callback(opendrop_client *client, opendrop_client_progress_callback callback,
+    unsigned int interval_ms, void *userdata) {
+    client->progress = callback;
+    client->progress_interval_ms = interval_ms;
+    client->progress_userdata = userdata;
+}
+
+void opendrop_client_set_cache(opendrop_client *client, opendrop_client_cache *cache) {
+    client->cache = cache;
+}
+
+void opendrop_client_set_cancelled(opendrop_client *client, bool cancelled) {
+    // Under the lock so a throttled upload can't miss the wakeup between its check and its wait
+    pthread_mutex_lock(&client->wait_lock);
+    atomic_store(&client->cancelled, cancelled);
+    pthread_cond_broadcast(&client->wait_cond);
+    pthread_mutex_unlock(&client->wait_lock);
+}
+
+// Clears per-request state before a transfer
+static void begin_request(opendrop_client *client) {
+    client->latest_response_len = 0;
+    client->tls_checked = false;
+    client->tls_resumed = false;
+}
+
+// Collects the timings and counters of the transfer that just ended, successful or not
+static void record_request(opendrop_client *client, bool upload) {
+    curl_off_t dns = 0, connect = 0, tls = 0, ttfb = 0, total = 0, up = 0, down = 0;
+    long connects = 0;
+    curl_easy_getinfo(client->curl, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+    curl_easy_getinfo(client->curl, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(client->curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+    curl_easy_getinfo(client->curl, CURLINFO_STARTTRANSFER_TIME_T, &ttfb);
+    curl_easy_getinfo(client->curl, CURLINFO_TOTAL_TIME_T, &total);
+    curl_easy_getinfo(client->curl, CURLINFO_SIZE_UPLOAD_T, &up);
+    curl_easy_getinfo(client->curl, CURLINFO_SIZE_DOWNLOAD_T, &down);
+    curl_easy_getinfo(client->curl, CURLINFO_NUM_CONNECTS, &connects);
+
+    opendrop_client_request_stats *last = &client->stats.last;
+    memset(last, 0, sizeof(opendrop_client_request_stats));
+    last->requests = 1;
+    last->dns_us = dns;
+    last->connect_us = connect;
+    last->tls_us = tls;
+    last->ttfb_us = ttfb;
+    last->total_us = total;
+    last->bytes_up = up;
+    last->bytes_down = down;
+    last->retries = connects > 1 ? connects - 1 : 0;
+    last->connections_reused = !connects;
+    last->tls_sessions_resumed = connects && client->tls_resumed;
+
+    uint64_t compressed = 0;
+    last->cache_hits = upload && client->cache_fd >= 0;
+    if (upload && !last->cache_hits) {
+        uint64_t levels[OPENDROP_ARCHIVE_LEVELS];
+        opendrop_deflate_counts(client->stream, &last->uncompressed_bytes, &compressed);
+        opendrop_deflate_level_counts(client->stream, levels);
+        last->stored_bytes = levels[OPENDROP_ARCHIVE_LEVEL_STORED];
+        last->low_level_bytes = levels[OPENDROP_ARCHIVE_LEVEL_LOW];
+        last->high_level_bytes = levels[OPENDROP_ARCHIVE_LEVEL_HIGH];
+        last->compression_ratio = last->uncompressed_bytes ? (double) compressed / last->uncompressed_bytes : 0;
     }
+
+    opendrop_client_request_stats *sum = &client->stats.total;
+    sum->requests++;
+    sum->dns_us += last->dns_us;
+    sum->connect_us += last->connect_us;
+    sum->tls_us += last->tls_us;
+    sum->ttfb_us += last->ttfb_us;
+    sum->total_us += last->total_us;
+    sum->bytes_up += last->bytes_up;
+    sum->bytes_down += last->bytes_down;
+    sum->uncompressed_bytes += last->uncompressed_bytes;
+    sum->stored_bytes += last->stored_bytes;
+    sum->low_level_bytes += last->low_level_bytes;
+    sum->high_level_bytes += last->high_level_bytes;
+    sum->retries += last->retries;
+    sum->connections_reused += last->connections_reused;
+    sum->tls_sessions_resumed += last->tls_sessions_resumed;
+    sum->cache_hits += last->cache_hits;
+
+    client->total_compressed_bytes += compressed;
+    sum->compression_ratio = sum->uncompressed_bytes ? (double) client->total_compressed_bytes / sum->uncompressed_bytes : 0;
+}
+
+void opendrop_client_get_stats(const opendrop_client *client, opendrop_client_stats *stats) {
+    *stats = client->stats;
 }
 
 size_t write_callback(char *ptr, size_t size, size_t nmemb, void *userdata) {
     opendrop_client *client = (opendrop_client*) userdata;
+    check_tls(client);
 
-    size_t new_len = client->latest_response_len + size * nmemb;
-    if (!(client->latest_response = realloc(client->latest_response, new_len + 1))) {
+    size_t len = size * nmemb;
+    if (len > CLIENT_MAX_RESPONSE - client->latest_response_len) {
         return 0;
     }
 
-    memcpy(client->latest_response + client->latest_response_len, ptr, size*nmemb);
-    client->latest_response[new_len] = 0;
-    return size * nmemb;
+    if (client->latest_response_len + len > client->latest_response_cap) {
+        size_t cap = client->latest_response_cap ? client->latest_response_cap : 1024;
+        while (cap < client->latest_response_len + len) {
+            cap *= 2;
+        }
+
+        unsigned char *response = (unsigned char*) realloc(client->latest_response, cap);
+        if (!response) {
+            return 0;
+        }
+
+        client->latest_response = response;
+        client->latest_response_cap = cap;
+    }
+
+    memcpy(client->latest_response + client->latest_response_len, ptr, len);
+    client->latest_response_len += len;
+    return len;
 }
 
 int opendrop_client_discover(opendrop_client *client, char **receiver_name) {
     int ret = 0;
-    struct curl_slist *headers = generate_default_headers_list();
-    headers = curl_slist_append(headers, "ContentType: application/octet-stream");
-
-    if (curl_easy_setopt(client->curl, CURLOPT_HTTPHEADER, headers)) {
-        curl_slist_free_all(headers);
+    if (set_endpoint(client, "/Discover") || curl_easy_setopt(client->curl, CURLOPT_HTTPHEADER, client->headers)) {
         return 1;
     }
 
-    plist_t root = plist_new_dict();
-
-    if (client->config->record_data) {
-        plist_dict_set_item(root, "SenderRecordData", plist_new_string(client->config->record_data));
+    // The body only depends on the config, so it is sent straight from the template
+    size_t len;
+    if (update_template(client)) {
+        ret = 1;
+        goto DONE;
     }
 
-    char *buf;
-    uint32_t len;
-    // Convert PLIST to binary format and null-terminate
-    if (plist_to_bin(root, &buf, &len) || !(buf = realloc(buf, len + 1)) || curl_easy_setopt(client->curl, CURLOPT_POSTFIELDS, buf)) {
+    const unsigned char *body = opendrop_bplist_template_discover(client->template, &len);
+    if (curl_easy_setopt(client->curl, CURLOPT_POSTFIELDSIZE, (long) len) ||
+        curl_easy_setopt(client->curl, CURLOPT_POSTFIELDS, body)) {
         ret = 1;
         goto DONE;
     }
-    buf[len] = 0;
 
-    free(client->latest_response);
-    client->latest_response = NULL;
-    client->latest_response_len = 0;
-    if (curl_easy_perform(client->curl)) {
+    begin_request(client);
+    CURLcode code = curl_easy_perform(client->curl);
+    record_request(client, false);
+    if (code) {
         ret = 1;
         goto DONE;
     }
 
-    plist_t *response;
-    plist_from_memory(client->latest_response, client->latest_response_len, response);
-
-    plist_t receiver_comp = plist_dict_get_item(response, "ReceiverComputerName");
-    if (receiver_comp) {
-        char *receiver_comp_tmp;
-        plist_get_string_val(receiver_comp, &receiver_comp_tmp);
-
-        if (!(*receiver_name = (char*) realloc(*receiver_name, strlen(receiver_comp_tmp) + 1))) {
-            plist_mem_free(receiver_comp_tmp);
-            ret - 1;
+    // The name is read in place, the response isn't turned into a plist tree
+    opendrop_bplist_value value;
+    size_t name_len;
+    if (!opendrop_bplist_dict_get(client->latest_response, client->latest_response_len, "ReceiverComputerName", &value) &&
+        !opendrop_bplist_get_string(&value, NULL, 0, &name_len)) {
+        // A previous name at least as long is overwritten in place
+        if ((!*receiver_name || strlen(*receiver_name) < name_len) &&
+            !(*receiver_name = (char*) realloc(*receiver_name, name_len + 1))) {
+            ret = 1;
             goto DONE;
         }
 
-        strcpy(*receiver_name, receiver_comp_tmp);
-        plist_mem_free(receiver_comp_tmp);
+        opendrop_bplist_get_string(&value, *receiver_name, name_len + 1, &name_len);
     }
 
 DONE:
-    curl_slist_free_all(headers);
-    plist_free(root);
-    plist_free(response);
+    curl_easy_setopt(client->curl, CURLOPT_POSTFIELDS, NULL);
     return ret;
 }
 
 int opendrop_client_ask(opendrop_client *client, const opendrop_client_file_data **data_arr, size_t data_arr_len, bool is_url, const opendrop_client_data *icon) {
-    plist_t *root = plist_new_dict();
-
-    // Setup body
-    plist_dict_set_item(root, "SenderComputerName", plist_new_string(client->config->computer_name));
-    plist_dict_set_item(root, "BundleID", plist_new_string("com.apple.finder"));
-    plist_dict_set_item(root, "SenderModelName", plist_new_string(client->config->computer_model));
-    plist_dict_set_item(root, "SenderID", plist_new_string(client->config->service_id));
-    plist_dict_set_item(root, "ConvertMediaFormats", plist_new_bool(false));
-
-    if (client->config->record_data) {
-        plist_dict_set_item(root, "SenderRecordData", plist_new_string(client->config->record_data));
-    }
-
-    if (icon) {
-        plist_dict_set_item(root, "FileIcon", plist_new_data(icon->data, icon->data_len));
-    }
-
-    plist_t *files = plist_new_array();
-    plist_dict_set_item(root, "Files", files);
-    
-    if (is_url) {
-        // Might have to change this to data if it doesn't work correctly
-        char *url = (char*) malloc(sizeof(char) * data_arr[0]->data_len);
-        if (!url) {
-            plist_free(root);
-            client->last_error = 1;
-            client->last_curl_error = 0;
-            return 1;
-        }
-
-        url[data_arr[0]->data_len] = 0;
-        strncpy(url, data_arr[0]->data, data_arr[0]->data_len);
-        plist_array_append_item(files, plist_new_string(data_arr[0]->data));
+    int ret = 0;
 
-        free(url);
-    } else {
-        for (size_t i = 0; i < data_arr_len; i++) {
-            plist_t *file = plist_new_dict();
-            
-            plist_dict_set_item(file, "FileName", plist_new_string(data_arr[i]->name));
-            plist_dict_set_item(file, "FileType", plist_new_string(data_arr[i]->type));
-            plist_dict_set_item(file, "FileBomPath", plist_new_string(data_arr[i]->bom_path));
-            plist_dict_set_item(file, "FileIsDirectory", plist_new_bool(data_arr[i]->is_dir));
-            plist_dict_set_item(file, "ConvertMediaFormats", plist_new_bool(false));
-            
-            plist_array_append_item(files, file);
-        }
+    // Only the files and icon are serialized per request, the rest is copied from the template
+    // Binary plists contain null bytes, so the body size is passed explicitly
+    if (update_template(client) ||
+        opendrop_bplist_encode_ask(client->template, &client->body, data_arr, data_arr_len, is_url, icon)) {
+        client->last_error = 1;
+        client->last_curl_error = 0;
+        return 1;
     }
 
-    int ret = 0;
-
-    char *buf;
-    uint32_t len;
-    // Convert PLIST to binary format and null-terminate
-    if (plist_to_bin(root, &buf, &len) || !(buf = realloc(buf, len + 1)) || curl_easy_setopt(client->curl, CURLOPT_POSTFIELDS, buf)) {
+    if (curl_easy_setopt(client->curl, CURLOPT_POSTFIELDSIZE, (long) client->body.len) ||
+        curl_easy_setopt(client->curl, CURLOPT_POSTFIELDS, client->body.data)) {
+        ret = 1;
         client->last_error = 2;
+        client->last_curl_error = 0;
         goto DONE;
     }
 
-    struct curl_slist *headers = generate_default_headers_list();
-    headers = curl_slist_append(headers, "ContentType: application/octet-stream");
-
-    if (curl_easy_setopt(client->curl, CURLOPT_HTTPHEADER, headers)) {
+    if (set_endpoint(client, "/Ask") || curl_easy_setopt(client->curl, CURLOPT_HTTPHEADER, client->headers)) {
         ret = 1;
         client->last_error = 2;
         client->last_curl_error = 0;
         goto DONE;
     }
 
-    int code;
-    if (code = curl_easy_perform(client->curl)) {
+    begin_request(client);
+
+    int code = curl_easy_perform(client->curl);
+    record_request(client, false);
+    if (code) {
         ret = 1;
         client->last_error = 0;
         client->last_curl_error = code;
@@ -240,17 +787,168 @@ int opendrop_client_ask(opendrop_client *client, const opendrop_client_file_data
     }
 
 DONE:
-    curl_slist_free_all(headers);
-    plist_free(root);
+    // cURL doesn't copy POSTFIELDS
+    curl_easy_setopt(client->curl, CURLOPT_POSTFIELDS, NULL);
     return ret;
 }
 
-int opendrop_client_send(const opendrop_client *client, const opendrop_client_file_data **data_arr, size_t data_arr_len) {
-    struct curl_slist *headers = generate_default_headers_list();
-    headers = curl_slist_append(headers, "ContentType: application/x-cpio");
+// Waits until the rate limits allow part of a read
+// Returns the bytes allowed, 0 if the client was cancelled
+static size_t throttle(opendrop_client *client, size_t want) {
+    opendrop_client_limiter *limiters[] = { &client->own_limiter, client->limiter };
+    size_t allowed = 0;
+
+    pthread_mutex_lock(&client->wait_lock);
+    while (!atomic_load(&client->cancelled)) {
+        long long wait_ns, now = now_ns();
+        if ((allowed = opendrop_client_limiter_take(limiters, 2, want, now, &wait_ns))) {
+            break;
+        }
+
+        // cURL can't call back while the upload waits here, so progress is reported from the wait
+        // Callbacks may cancel the client, so they run without the lock
+        long long deadline_ns = now + wait_ns;
+        if (client->progress) {
+            long long due_ns = (client->progress_last_ms + client->progress_interval_ms) * 1000000LL;
+            if (due_ns <= now) {
+                pthread_mutex_unlock(&client->wait_lock);
+                report_progress(client, client->upload_read, false);
+                pthread_mutex_lock(&client->wait_lock);
+                continue;
+            }
+
+            deadline_ns = due_ns < deadline_ns ? due_ns : deadline_ns;
+        }
+
+        struct timespec deadline = { deadline_ns / 1000000000LL, deadline_ns % 1000000000LL };
+        pthread_cond_timedwait(&client->wait_cond, &client->wait_lock, &deadline);
+    }
+    pthread_mutex_unlock(&client->wait_lock);
+
+    return allowed;
+}
+
+// Feeds the gzip-compressed cpio stream to cURL, no faster than the rate limits allow
+size_t upload_read_callback(char *buffer, size_t size, size_t nitems, void *userdata) {
+    opendrop_client *client = (opendrop_client*) userdata;
 
+    size_t len = throttle(client, size * nitems);
+    if (!len) {
+        return CURL_READFUNC_ABORT;
+    }
+
+    // Cached bodies are already compressed
+    if (client->cache_fd >= 0) {
+        ssize_t cached = read(client->cache_fd, buffer, len);
+        if (cached < 0) {
+            return CURL_READFUNC_ABORT;
+        }
+
+        client->upload_read += cached;
+        return cached;
+    }
 
+    size_t read;
+    if (opendrop_deflate_read(client->stream, (unsigned char*) buffer, len, &read)) {
+        return CURL_READFUNC_ABORT;
+    }
+
+    // The compressed body is copied into the cache as it is sent
+    if (client->cache_writer.fd >= 0) {
+        if (read) {
+            opendrop_cache_write(client->cache, &client->cache_writer, (unsigned char*) buffer, read);
+        } else {
+            client->cache_writer.complete = true;
+        }
+    }
+
+    client->upload_read += read;
+    return read;
+}
+
+// Points the upload pipeline at the files, creating it on first use
+static int prepare_upload(opendrop_client *client, const opendrop_client_file_data **data_arr, size_t data_arr_len) {
+    unsigned int threads = client->config->compression_threads;
+    if (client->stream && client->stream_threads != threads) {
+        opendrop_deflate_free(client->stream);
+        client->stream = NULL;
+    }
+
+    if (client->archive ? opendrop_archive_reset(client->archive, data_arr, data_arr_len) :
+        opendrop_archive_new(&client->archive, data_arr, data_arr_len)) {
+        return 1;
+    }
+    opendrop_archive_set_adaptive(client->archive, client->config->adaptive_compression);
+
+    if (client->stream) {
+        return opendrop_deflate_reset(client->stream, client->archive);
+    }
+
+    client->stream_threads = threads;
+    return opendrop_deflate_new(&client->stream, client->archive, threads);
+}
+
+// Looks the files up in the cache, starting to cache their body on a miss
+static void begin_cache(opendrop_client *client, const opendrop_client_file_data **data_arr, size_t data_arr_len) {
+    unsigned char key[OPENDROP_CACHE_KEY_LEN];
+    if (client->cache && !opendrop_cache_key(data_arr, data_arr_len, key) &&
+        opendrop_cache_open(client->cache, key, &client->cache_fd)) {
+        opendrop_cache_begin(client->cache, key, &client->cache_writer);
+    }
+}
+
+// Closes the cached body, or adds the compressed one if the upload went through
+static void end_cache(opendrop_client *client, bool keep) {
+    if (client->cache_fd >= 0) {
+        close(client->cache_fd);
+        client->cache_fd = -1;
+    }
+
+    if (client->cache_writer.fd >= 0) {
+        opendrop_cache_end(client->cache, &client->cache_writer, keep);
+    }
+}
+
+int opendrop_client_send(opendrop_client *client, const opendrop_client_file_data **data_arr, size_t data_arr_len) {
+    begin_cache(client, data_arr, data_arr_len);
+    if (client->cache_fd < 0 && prepare_upload(client, data_arr, data_arr_len)) {
+        end_cache(client, false);
+        client->last_error = 3;
+        client->last_curl_error = 0;
+        return 1;
+    }
+
+    if (set_endpoint(client, "/Upload") ||
+        curl_easy_setopt(client->curl, CURLOPT_HTTPHEADER, client->upload_headers) ||
+        curl_easy_setopt(client->curl, CURLOPT_POST, 1L) ||
+        curl_easy_setopt(client->curl, CURLOPT_POSTFIELDS, NULL) ||
+        curl_easy_setopt(client->curl, CURLOPT_POSTFIELDSIZE, -1L) ||
+        curl_easy_setopt(client->curl, CURLOPT_READFUNCTION, upload_read_callback) ||
+        curl_easy_setopt(client->curl, CURLOPT_READDATA, client)) {
+        end_cache(client, false);
+        client->last_error = 2;
+        client->last_curl_error = 0;
+        return 1;
+    }
+
+    begin_request(client);
+    client->uploading = true;
+    client->upload_read = 0;
+    client->progress_last_ms = now_ms();
+
+    int code = curl_easy_perform(client->curl);
+    client->uploading = false;
+    record_request(client, true);
+    if (!code && client->progress) {
+        report_progress(client, client->stats.last.bytes_up, true);
+    }
+
+    end_cache(client, !code);
+    if (code) {
+        client->last_error = 0;
+        client->last_curl_error = code;
+        return 1;
+    }
 
-    curl_slist_free_all(headers);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <curl/curl.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include "../include/client.h"
+
+struct opendrop_client_share_s {
+    CURLSH *share;
+    // One lock per kind of shared data
+    pthread_mutex_t locks[CURL_LOCK_DATA_LAST];
+};
+
+// Takes a reference on the global cURL state, initializing it on first use
+// Returns 0 on success, the cURL error otherwise
+int opendrop_client_global_init();
+
+// Drops a reference on the global cURL state, cleaning it up with the last one
+void opendrop_client_global_cleanup();
+
+// Applies the config's interface, TLS version and identity to an easy handle
+// Returns 0 on success, the cURL error otherwise
+int opendrop_client_configure(CURL *curl, const opendrop_config *config);
+
+// Longest host formatted by opendrop_client_format_host, an IPv6 address in brackets
+#define OPENDROP_CLIENT_HOST_MAX (INET6_ADDRSTRLEN + 2)
+
+// Formats an address as a URL host, IPv6 addresses are bracketed and scope IDs are left to CURLOPT_ADDRESS_SCOPE
+// Args:
+// - address: Address
+// - host: Buffer of at least OPENDROP_CLIENT_HOST_MAX bytes
+void opendrop_client_format_host(const opendrop_address *address, char *host);
+
+// Headers sent with every request
+struct curl_slist *generate_default_headers_list();
+
+// Appends a header, freeing the whole list and returning NULL if list is NULL or malloc failed
+struct curl_slist *append_or_free(struct curl_slist *list, const char *header);
+
+// Headers of Discover and Ask requests, NULL if malloc failed
+struct curl_slist *generate_body_headers_list();
+
+// Headers of Upload requests, the body is sent chunked, NULL if malloc failed
+struct curl_slist *generate_upload_headers_list();
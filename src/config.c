@@ -1,6 +1,13 @@
+#define _GNU_SOURCE
 #include <memory.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <unistd.h>
+#include <time.h>
 #include <stdbool.h>
+#include <pthread.h>
 #include <openssl/ssl.h>
 #include <openssl/evp.h>
 #include <openssl/rsa.h>
@@ -24,10 +31,36 @@
 #define OPENDROP_AIRDROP_SUPPORTS_UNKNOWN3 0x100
 #define OPENDROP_AIRDROP_SUPPORTS_ASSET_BUNDLE 0x200
 
+// Upper bound on the size of an identity file
+#define OPENDROP_IDENTITY_MAX (16 * 1024)
+// Stored identities are replaced once their certificate has less than this left, 30 days
+#define OPENDROP_IDENTITY_RENEW (30 * 24 * 60 * 60L)
+
+struct opendrop_config_pool_s {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t space;
+    bool shutdown;
+
+    pthread_t *threads;
+    unsigned int threads_len;
+
+    // Ring of generated certificate and key pairs
+    struct curl_blob **certs;
+    struct curl_blob **keys;
+    size_t capacity;
+    size_t head;
+    size_t len;
+
+    // Set when generation fails, consumers stop waiting
+    int error;
+};
+
 int last_config_init_error = 0;
 bool srand_called = false;
 
-int opendrop_config_new(opendrop_config **config, const unsigned char *root_ca, size_t root_ca_len) {
+// Allocates config and fills in defaults, leaving the identity (certificate and key) empty
+static int config_init(opendrop_config **config, const unsigned char *root_ca, size_t root_ca_len) {
     if (!(root_ca && root_ca_len)) {
         last_config_init_error = 1;
         return 1;
@@ -77,6 +110,10 @@ int opendrop_config_new(opendrop_config **config, const unsigned char *root_ca,
 
     config_unwrap->server_port = 8771;
 
+    config_unwrap->compression_threads = 1;
+
+    config_unwrap->verify_peer = true;
+
     if (!srand_called) {
         srand(time(NULL));
         srand_called = true;
@@ -96,21 +133,47 @@ int opendrop_config_new(opendrop_config **config, const unsigned char *root_ca,
 
     config_unwrap->record_data = NULL;
 
+#undef config_unwrap
+
+    return 0;
+}
+
+// Copies the contents of a memory BIO into a new blob
+static struct curl_blob *blob_from_bio(BIO *bio) {
+    char *data;
+    long len = BIO_get_mem_data(bio, &data);
+
+    struct curl_blob *blob = (struct curl_blob*) malloc(sizeof(struct curl_blob));
+    if (!blob) {
+        return NULL;
+    }
+
+    if (!(blob->data = malloc(len))) {
+        free(blob);
+        return NULL;
+    }
+
+    memcpy(blob->data, data, len);
+    blob->len = len;
+    blob->flags = CURL_BLOB_NOCOPY;
+    return blob;
+}
+
+// Generates a self-signed certificate and key as PEM blobs
+// Returns 0 on success or an init error code
+static int generate_identity(struct curl_blob **cert_data, struct curl_blob **key_data) {
     // Create default certificate and key
     EVP_PKEY *pkey;
     if (!(pkey = EVP_PKEY_new())) {
-        opendrop_config_free(config_unwrap);
-        last_config_init_error = 4;
-        return 1;
+        return 4;
     }
 
+    // Public exponent, TLS peers reject keys with oversized exponents
     BIGNUM *big = BN_new();
-    BN_generate_prime_ex(big, 2048, true, NULL, NULL, NULL);
-    if (!big) {
+    if (!(big && BN_set_word(big, RSA_F4))) {
+        BN_free(big);
         EVP_PKEY_free(pkey);
-        opendrop_config_free(config_unwrap);
-        last_config_init_error = 5;
-        return 1;
+        return 5;
     }
 
     RSA *rsa = RSA_new();
@@ -120,20 +183,16 @@ int opendrop_config_new(opendrop_config **config, const unsigned char *root_ca,
         }
         BN_free(big);
         EVP_PKEY_free(pkey);
-        opendrop_config_free(config_unwrap);
-        last_config_init_error = 6;
-        return 1;
+        return 6;
     }
 
+    BN_free(big);
     EVP_PKEY_assign_RSA(pkey, rsa);
 
     X509 *x509;
     if (!(x509 = X509_new())) {
-        RSA_free(rsa);
         EVP_PKEY_free(pkey);
-        opendrop_config_free(config_unwrap);
-        last_config_init_error = 7;
-        return 1;
+        return 7;
     }
 
     ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
@@ -154,47 +213,315 @@ int opendrop_config_new(opendrop_config **config, const unsigned char *root_ca,
     X509_set_issuer_name(x509, name);
     X509_sign(x509, pkey, EVP_sha3_512());
 
-    // Write certs to temp files then read them back into memory
-    FILE *key_file = tmpfile();
-    PEM_write_PrivateKey(key_file, pkey, EVP_des_ede3_cbc(), "openDropKey", 11, NULL, NULL);
-    fflush(key_file);
-    FILE *cert_file = tmpfile();
-    PEM_write_X509(cert_file, x509);
-    fflush(cert_file);
+    // Write PEMs to memory, no temporary files involved
+    int err = 0;
+    BIO *key_bio = BIO_new(BIO_s_mem());
+    BIO *cert_bio = BIO_new(BIO_s_mem());
+    if (!(key_bio && cert_bio &&
+        PEM_write_bio_PrivateKey(key_bio, pkey, EVP_des_ede3_cbc(), (unsigned char*) OPENDROP_KEY_PASSPHRASE, strlen(OPENDROP_KEY_PASSPHRASE), NULL, NULL) &&
+        PEM_write_bio_X509(cert_bio, x509) &&
+        (*key_data = blob_from_bio(key_bio)) &&
+        (*cert_data = blob_from_bio(cert_bio)))) {
+        err = 8;
+    }
 
+    BIO_free(key_bio);
+    BIO_free(cert_bio);
     X509_free(x509);
-    BN_free(big);
     EVP_PKEY_free(pkey);
 
-    long key_file_size = ftell(key_file);
-    rewind(key_file);
+    return err;
+}
 
-    config_unwrap->key_data = (struct curl_blob*) malloc(sizeof(struct curl_blob));
-    config_unwrap->key_data->len = key_file_size;
-    config_unwrap->key_data->flags = CURL_BLOB_NOCOPY;
-    config_unwrap->key_data->data = malloc(key_file_size);
-    if (fread(config_unwrap->key_data->data, 1, key_file_size, key_file) != key_file_size) {
-        opendrop_config_free(config_unwrap);
-        last_config_init_error = 8;
+int opendrop_config_new(opendrop_config **config, const unsigned char *root_ca, size_t root_ca_len) {
+    if (config_init(config, root_ca, root_ca_len)) {
         return 1;
     }
 
-    fclose(key_file);
+    int err;
+    if ((err = generate_identity(&(*config)->cert_data, &(*config)->key_data))) {
+        opendrop_config_free(*config);
+        last_config_init_error = err;
+        return 1;
+    }
 
-    long cert_file_size = ftell(cert_file);
-    rewind(cert_file);
+    return 0;
+}
 
-    config_unwrap->cert_data = (struct curl_blob*) malloc(sizeof(struct curl_blob));
-    config_unwrap->cert_data->len = cert_file_size;
-    config_unwrap->cert_data->flags = CURL_BLOB_NOCOPY;
-    config_unwrap->cert_data->data = malloc(cert_file_size);
-    if (fread(config_unwrap->cert_data->data, 1, cert_file_size, cert_file) != cert_file_size) {
-        opendrop_config_free(config_unwrap);
-        last_config_init_error = 9;
+static void blob_free(struct curl_blob *blob) {
+    if (blob) {
+        free(blob->data);
+        free(blob);
+    }
+}
+
+static void *pool_generate(void *userdata) {
+    opendrop_config_pool *pool = (opendrop_config_pool*) userdata;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->shutdown && !pool->error) {
+        if (pool->len == pool->capacity) {
+            pthread_cond_wait(&pool->space, &pool->lock);
+            continue;
+        }
+
+        // Key generation runs unlocked so consumers and other generators aren't held up
+        pthread_mutex_unlock(&pool->lock);
+        struct curl_blob *cert = NULL, *key = NULL;
+        int err = generate_identity(&cert, &key);
+        pthread_mutex_lock(&pool->lock);
+
+        if (err) {
+            blob_free(cert);
+            blob_free(key);
+            pool->error = err;
+            pthread_cond_broadcast(&pool->ready);
+            break;
+        }
+
+        // Another generator may have filled the last slot meanwhile
+        if (pool->len == pool->capacity || pool->shutdown) {
+            blob_free(cert);
+            blob_free(key);
+            continue;
+        }
+
+        size_t slot = (pool->head + pool->len++) % pool->capacity;
+        pool->certs[slot] = cert;
+        pool->keys[slot] = key;
+        pthread_cond_signal(&pool->ready);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+int opendrop_config_pool_new(opendrop_config_pool **pool, size_t capacity, unsigned int threads) {
+    if (!capacity || !threads) {
+        return 1;
+    }
+
+    if (!(*pool = (opendrop_config_pool*) malloc(sizeof(opendrop_config_pool)))) {
         return 1;
     }
 
-#undef config_unrwap
+    memset(*pool, 0, sizeof(opendrop_config_pool));
+    (*pool)->capacity = capacity;
+
+    if (pthread_mutex_init(&(*pool)->lock, NULL) || pthread_cond_init(&(*pool)->ready, NULL) || pthread_cond_init(&(*pool)->space, NULL) ||
+        !((*pool)->certs = (struct curl_blob**) calloc(capacity, sizeof(struct curl_blob*))) ||
+        !((*pool)->keys = (struct curl_blob**) calloc(capacity, sizeof(struct curl_blob*))) ||
+        !((*pool)->threads = (pthread_t*) malloc(sizeof(pthread_t) * threads))) {
+        opendrop_config_pool_free(*pool);
+        return 1;
+    }
+
+    for (; (*pool)->threads_len < threads; (*pool)->threads_len++) {
+        if (pthread_create(&(*pool)->threads[(*pool)->threads_len], NULL, pool_generate, *pool)) {
+            opendrop_config_pool_free(*pool);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void opendrop_config_pool_free(opendrop_config_pool *pool) {
+    if (pool) {
+        pthread_mutex_lock(&pool->lock);
+        pool->shutdown = true;
+        pthread_cond_broadcast(&pool->space);
+        pthread_cond_broadcast(&pool->ready);
+        pthread_mutex_unlock(&pool->lock);
+
+        for (unsigned int i = 0; i < pool->threads_len; i++) {
+            pthread_join(pool->threads[i], NULL);
+        }
+
+        for (size_t i = 0; i < pool->len; i++) {
+            size_t slot = (pool->head + i) % pool->capacity;
+            blob_free(pool->certs[slot]);
+            blob_free(pool->keys[slot]);
+        }
+
+        free(pool->certs);
+        free(pool->keys);
+        free(pool->threads);
+        pthread_cond_destroy(&pool->space);
+        pthread_cond_destroy(&pool->ready);
+        pthread_mutex_destroy(&pool->lock);
+        free(pool);
+    }
+}
+
+int opendrop_config_new_from_pool(opendrop_config **config, const unsigned char *root_ca, size_t root_ca_len, opendrop_config_pool *pool) {
+    if (config_init(config, root_ca, root_ca_len)) {
+        return 1;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->len && !pool->error && !pool->shutdown) {
+        pthread_cond_wait(&pool->ready, &pool->lock);
+    }
+
+    int err = 0;
+    if (pool->len) {
+        (*config)->cert_data = pool->certs[pool->head];
+        (*config)->key_data = pool->keys[pool->head];
+        pool->head = (pool->head + 1) % pool->capacity;
+        pool->len--;
+        pthread_cond_signal(&pool->space);
+    } else {
+        err = pool->error ? pool->error : 13;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (err) {
+        opendrop_config_free(*config);
+        last_config_init_error = err;
+        return 1;
+    }
+
+    return 0;
+}
+
+// Copies the PEM block with the given label out of data
+static struct curl_blob *blob_from_pem(const char *data, size_t len, const char *label) {
+    char begin[64], end[64];
+    snprintf(begin, sizeof(begin), "-----BEGIN %s-----", label);
+    snprintf(end, sizeof(end), "-----END %s-----\n", label);
+
+    const char *start = memmem(data, len, begin, strlen(begin));
+    if (!start) {
+        return NULL;
+    }
+
+    const char *stop = memmem(start, data + len - start, end, strlen(end));
+    if (!stop) {
+        return NULL;
+    }
+    stop += strlen(end);
+
+    struct curl_blob *blob = (struct curl_blob*) malloc(sizeof(struct curl_blob));
+    if (!blob) {
+        return NULL;
+    }
+
+    if (!(blob->data = malloc(stop - start))) {
+        free(blob);
+        return NULL;
+    }
+
+    memcpy(blob->data, start, stop - start);
+    blob->len = stop - start;
+    blob->flags = CURL_BLOB_NOCOPY;
+    return blob;
+}
+
+// Loads an identity file written by opendrop_config_save_identity
+static int load_identity(opendrop_config *config, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return 10;
+    }
+
+    char data[OPENDROP_IDENTITY_MAX];
+    size_t len = fread(data, 1, sizeof(data), file);
+    bool truncated = !feof(file);
+    fclose(file);
+
+    // First line is the service ID, followed by the certificate and encrypted key
+    if (truncated || len < 7 || data[6] != '\n') {
+        return 11;
+    }
+
+    memcpy(config->service_id, data, 6);
+    config->service_id[6] = '\0';
+
+    if (!(config->cert_data = blob_from_pem(data, len, "CERTIFICATE")) ||
+        !(config->key_data = blob_from_pem(data, len, "ENCRYPTED PRIVATE KEY"))) {
+        return 11;
+    }
+
+    return 0;
+}
+
+// Whether a loaded certificate stays valid past the renewal margin and belongs to the key
+static bool identity_usable(const opendrop_config *config) {
+    BIO *cert_bio = BIO_new_mem_buf(config->cert_data->data, config->cert_data->len);
+    BIO *key_bio = BIO_new_mem_buf(config->key_data->data, config->key_data->len);
+    X509 *x509 = cert_bio ? PEM_read_bio_X509(cert_bio, NULL, NULL, NULL) : NULL;
+    EVP_PKEY *pkey = key_bio ? PEM_read_bio_PrivateKey(key_bio, NULL, NULL, (void*) OPENDROP_KEY_PASSPHRASE) : NULL;
+
+    time_t renew = time(NULL) + OPENDROP_IDENTITY_RENEW;
+    bool usable = x509 && pkey && X509_cmp_time(X509_get0_notAfter(x509), &renew) > 0 && X509_check_private_key(x509, pkey) == 1;
+
+    EVP_PKEY_free(pkey);
+    X509_free(x509);
+    BIO_free(key_bio);
+    BIO_free(cert_bio);
+
+    return usable;
+}
+
+int opendrop_config_new_from_identity(opendrop_config **config, const unsigned char *root_ca, size_t root_ca_len, const char *path) {
+    if (config_init(config, root_ca, root_ca_len)) {
+        return 1;
+    }
+
+    int err = load_identity(*config, path);
+    bool create = err == 10 && errno == ENOENT;
+    if (!err && !identity_usable(*config)) {
+        // Expiring or mismatched certificate, replaced under the same service ID
+        blob_free((*config)->cert_data);
+        blob_free((*config)->key_data);
+        (*config)->cert_data = (*config)->key_data = NULL;
+        create = true;
+    }
+
+    if (create) {
+        // First run or replaced certificate, create the identity and keep it for next time
+        if ((err = generate_identity(&(*config)->cert_data, &(*config)->key_data)) == 0) {
+            err = opendrop_config_save_identity(*config, path);
+        }
+    }
+
+    if (err) {
+        opendrop_config_free(*config);
+        last_config_init_error = err;
+        return 1;
+    }
+
+    return 0;
+}
+
+int opendrop_config_save_identity(const opendrop_config *config, const char *path) {
+    // Written next to the destination then renamed so readers never see a partial file
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int) sizeof(tmp_path)) {
+        return 12;
+    }
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return 12;
+    }
+
+    FILE *file = fdopen(fd, "w");
+    if (!file) {
+        close(fd);
+        unlink(tmp_path);
+        return 12;
+    }
+
+    bool ok = fprintf(file, "%s\n", config->service_id) == 7 &&
+        fwrite(config->cert_data->data, 1, config->cert_data->len, file) == config->cert_data->len &&
+        fwrite(config->key_data->data, 1, config->key_data->len, file) == config->key_data->len;
+
+    if (fclose(file) || !ok || rename(tmp_path, path)) {
+        unlink(tmp_path);
+        return 12;
+    }
 
     return 0;
 }
@@ -204,6 +531,9 @@ void opendrop_config_free(opendrop_config *config) {
         free(config->computer_name);
         free(config->computer_model);
         free(config->interface);
+        free(config->email);
+        free(config->phone);
+        free(config->record_data);
 
         if (config->root_ca) {
             free(config->root_ca->data);
@@ -230,11 +560,12 @@ void opendrop_config_set_host_name(opendrop_config *config, const char *host_nam
 }
 
 int opendrop_config_set_computer_name(opendrop_config *config, const char *computer_name) {
-    if (!(config->computer_name = (char*) realloc(config->computer_name, sizeof(computer_name) + 1))) {
+    if (!(config->computer_name = (char*) realloc(config->computer_name, strlen(computer_name) + 1))) {
         return 1;
     }
 
     strcpy(config->computer_name, computer_name);
+    config->revision++;
     return 0;
 }
 
@@ -244,6 +575,7 @@ int opendrop_config_set_computer_model(opendrop_config *config, const char *comp
     }
 
     strcpy(config->computer_model, computer_model);
+    config->revision++;
     return 0;
 }
 
@@ -254,6 +586,19 @@ void opendrop_config_set_server_port(opendrop_config *config, uint16_t port) {
 void opendrop_config_set_service_id(opendrop_config *config, const char *service_id) {
     strncpy(config->service_id, service_id, 6);
     config->service_id[6] = '\0';
+    config->revision++;
+}
+
+void opendrop_config_set_compression_threads(opendrop_config *config, unsigned int threads) {
+    config->compression_threads = threads ? threads : 1;
+}
+
+void opendrop_config_set_adaptive_compression(opendrop_config *config, bool adaptive) {
+    config->adaptive_compression = adaptive;
+}
+
+void opendrop_config_set_verify_peer(opendrop_config *config, bool verify_peer) {
+    config->verify_peer = verify_peer;
 }
 
 int opendrop_config_set_interface(opendrop_config *config, const char *interface) {
@@ -305,6 +650,7 @@ int opendrop_config_set_record_data(opendrop_config *config, const char *record_
     }
 
     strcpy(config->record_data, record_data);
+    config->revision++;
     return 0;
 }
 
@@ -322,6 +668,10 @@ const char *opendrop_config_strerror(int code) {
     case 6: return "Failed to generate RSA for certificate.";
     case 7: return "Failed to generate X509 for certificate.";
     case 8: return "Failed to read generated certificate.";
+    case 10: return "Failed to open identity file.";
+    case 11: return "Identity file is invalid.";
+    case 12: return "Failed to write identity file.";
+    case 13: return "Identity pool was shut down.";
     }
 
     return "Unknown error.";
@@ -2,6 +2,10 @@
 
 #include <curl/curl.h>
 #include <stdint.h>
+#include <stdbool.h>
+
+// Passphrase protecting the PEM-encoded private key in key_data
+#define OPENDROP_KEY_PASSPHRASE "openDropKey"
 
 struct opendrop_config_s {
     char host_name[HOST_NAME_MAX + 1];
@@ -19,10 +23,21 @@ struct opendrop_config_s {
 
     uint8_t flags;
 
+    // Upload compression workers, 1 compresses on the transfer thread
+    unsigned int compression_threads;
+    // Whether uploads pick a compression level per file
+    bool adaptive_compression;
+
+    // Whether clients verify receivers against root_ca
+    bool verify_peer;
+
     // Certs
     struct curl_blob *root_ca;
     struct curl_blob *cert_data;
     struct curl_blob *key_data;
 
     char *record_data;
+
+    // Bumped whenever a value serialized into request bodies changes
+    unsigned int revision;
 };
\ No newline at end of file
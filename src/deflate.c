@@ -0,0 +1,517 @@
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "deflate.h"
+
+// Size of the uncompressed staging buffer
+#define DEFLATE_CHUNK (64 * 1024)
+
+// Parallel mode compresses independent blocks primed with the previous block's tail
+#define DEFLATE_BLOCK (128 * 1024)
+#define DEFLATE_DICT (32 * 1024)
+
+// Jobs in flight per worker, bounds memory use of parallel mode
+#define DEFLATE_JOBS_PER_THREAD 2
+
+// zlib level of each archive level
+static const int deflate_levels[OPENDROP_ARCHIVE_LEVELS] = { 0, 1, Z_DEFAULT_COMPRESSION };
+
+enum deflate_job_state {
+    JOB_FREE,
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_DONE,
+    JOB_FAILED
+};
+
+struct deflate_job {
+    enum deflate_job_state state;
+
+    // Dictionary occupies the DEFLATE_DICT bytes before the block data
+    unsigned char *in;
+    size_t dict_len;
+    size_t in_len;
+    bool last;
+    opendrop_archive_level level;
+
+    unsigned char *out;
+    size_t out_cap;
+    size_t out_len;
+    size_t out_pos;
+
+    uLong crc;
+};
+
+struct opendrop_deflate_s {
+    opendrop_archive *archive;
+    z_stream zs;
+    bool zs_init;
+
+    bool input_done;
+    bool finished;
+
+    unsigned char in[DEFLATE_CHUNK];
+
+    // Parallel mode, unused when threads is 0
+    unsigned int threads;
+    pthread_t *workers;
+    unsigned int workers_started;
+
+    pthread_mutex_t lock;
+    pthread_cond_t job_queued;
+    pthread_cond_t job_done;
+    bool shutdown;
+
+    struct deflate_job *jobs;
+    size_t jobs_len;
+
+    // Sequence numbers, the job for sequence n lives in jobs[n % jobs_len]
+    size_t submit_seq;
+    size_t take_seq;
+    size_t output_seq;
+
+    // Tail of the last submitted block, primes the next one
+    unsigned char tail[DEFLATE_DICT];
+    size_t tail_len;
+
+    // gzip framing
+    unsigned char frame[10];
+    size_t frame_len;
+    size_t frame_pos;
+    bool trailer_written;
+    uLong crc;
+    uLong total_in;
+
+    // Archive bytes taken and compressed bytes handed out since the stream was created or reset
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+
+    // Level of the latest archive bytes, stretches the archive leaves to any level stay at it
+    opendrop_archive_level level;
+    uint64_t level_bytes[OPENDROP_ARCHIVE_LEVELS];
+};
+
+static void *deflate_worker(void *userdata);
+
+// Queues the gzip header written ahead of the parallel blocks
+static void begin_frame(opendrop_deflate *stream) {
+    // Fixed gzip header: deflate, no flags, no mtime, unknown OS
+    static const unsigned char header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 255 };
+    memcpy(stream->frame, header, sizeof(header));
+    stream->frame_len = sizeof(header);
+    stream->frame_pos = 0;
+    stream->trailer_written = false;
+    stream->crc = crc32(0, NULL, 0);
+    stream->total_in = 0;
+    stream->tail_len = 0;
+}
+
+static int parallel_init(opendrop_deflate *stream, unsigned int threads) {
+    stream->threads = threads;
+    stream->jobs_len = threads * DEFLATE_JOBS_PER_THREAD;
+
+    if (pthread_mutex_init(&stream->lock, NULL) || pthread_cond_init(&stream->job_queued, NULL) || pthread_cond_init(&stream->job_done, NULL)) {
+        return 1;
+    }
+
+    if (!(stream->jobs = (struct deflate_job*) calloc(stream->jobs_len, sizeof(struct deflate_job)))) {
+        return 1;
+    }
+
+    // Worst case for a block plus the sync flush marker
+    size_t out_cap = DEFLATE_BLOCK + DEFLATE_BLOCK / 1000 * 5 + 64;
+    for (size_t i = 0; i < stream->jobs_len; i++) {
+        if (!(stream->jobs[i].in = (unsigned char*) malloc(DEFLATE_DICT + DEFLATE_BLOCK)) ||
+            !(stream->jobs[i].out = (unsigned char*) malloc(out_cap))) {
+            return 1;
+        }
+        stream->jobs[i].out_cap = out_cap;
+    }
+
+    if (!(stream->workers = (pthread_t*) malloc(sizeof(pthread_t) * threads))) {
+        return 1;
+    }
+
+    for (; stream->workers_started < threads; stream->workers_started++) {
+        if (pthread_create(&stream->workers[stream->workers_started], NULL, deflate_worker, stream)) {
+            return 1;
+        }
+    }
+
+    begin_frame(stream);
+    return 0;
+}
+
+int opendrop_deflate_new(opendrop_deflate **stream, opendrop_archive *archive, unsigned int threads) {
+    if (!(*stream = (opendrop_deflate*) malloc(sizeof(opendrop_deflate)))) {
+        return 1;
+    }
+
+    memset(*stream, 0, sizeof(opendrop_deflate));
+    (*stream)->archive = archive;
+    (*stream)->level = OPENDROP_ARCHIVE_LEVEL_HIGH;
+
+    if (threads > 1) {
+        if (parallel_init(*stream, threads)) {
+            opendrop_deflate_free(*stream);
+            *stream = NULL;
+            return 1;
+        }
+
+        return 0;
+    }
+
+    // 15 window bits + 16 selects the gzip wrapper
+    if (deflateInit2(&(*stream)->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        opendrop_deflate_free(*stream);
+        *stream = NULL;
+        return 1;
+    }
+    (*stream)->zs_init = true;
+
+    return 0;
+}
+
+int opendrop_deflate_reset(opendrop_deflate *stream, opendrop_archive *archive) {
+    stream->archive = archive;
+    stream->input_done = false;
+    stream->finished = false;
+    stream->bytes_in = 0;
+    stream->bytes_out = 0;
+    memset(stream->level_bytes, 0, sizeof(stream->level_bytes));
+
+    if (!stream->threads) {
+        stream->zs.avail_in = 0;
+        return deflateReset(&stream->zs) != Z_OK;
+    }
+
+    // Blocks of an abandoned stream may still be compressing
+    pthread_mutex_lock(&stream->lock);
+    for (size_t i = 0; i < stream->jobs_len; i++) {
+        while (stream->jobs[i].state == JOB_QUEUED || stream->jobs[i].state == JOB_RUNNING) {
+            pthread_cond_wait(&stream->job_done, &stream->lock);
+        }
+        stream->jobs[i].state = JOB_FREE;
+    }
+    stream->submit_seq = stream->take_seq = stream->output_seq = 0;
+    pthread_mutex_unlock(&stream->lock);
+
+    begin_frame(stream);
+    return 0;
+}
+
+void opendrop_deflate_free(opendrop_deflate *stream) {
+    if (stream) {
+        if (stream->zs_init) {
+            deflateEnd(&stream->zs);
+        }
+
+        if (stream->threads) {
+            pthread_mutex_lock(&stream->lock);
+            stream->shutdown = true;
+            pthread_cond_broadcast(&stream->job_queued);
+            pthread_mutex_unlock(&stream->lock);
+
+            for (unsigned int i = 0; i < stream->workers_started; i++) {
+                pthread_join(stream->workers[i], NULL);
+            }
+
+            if (stream->jobs) {
+                for (size_t i = 0; i < stream->jobs_len; i++) {
+                    free(stream->jobs[i].in);
+                    free(stream->jobs[i].out);
+                }
+            }
+
+            free(stream->jobs);
+            free(stream->workers);
+            pthread_cond_destroy(&stream->job_done);
+            pthread_cond_destroy(&stream->job_queued);
+            pthread_mutex_destroy(&stream->lock);
+        }
+
+        free(stream);
+    }
+}
+
+// Compresses one block as a byte-aligned piece of a single deflate stream
+static int compress_job(z_stream *zs, opendrop_archive_level *level, struct deflate_job *job) {
+    if (deflateReset(zs) != Z_OK) {
+        return 1;
+    }
+
+    // Nothing is pending right after a reset, so changing the level can't emit anything
+    if (job->level != *level) {
+        if (deflateParams(zs, deflate_levels[job->level], Z_DEFAULT_STRATEGY) != Z_OK) {
+            return 1;
+        }
+        *level = job->level;
+    }
+
+    if (job->dict_len && deflateSetDictionary(zs, job->in + DEFLATE_DICT - job->dict_len, job->dict_len) != Z_OK) {
+        return 1;
+    }
+
+    zs->next_in = job->in + DEFLATE_DICT;
+    zs->avail_in = job->in_len;
+    zs->next_out = job->out;
+    zs->avail_out = job->out_cap;
+
+    // Only the final block may set BFINAL, the others end on a sync flush
+    int ret = deflate(zs, job->last ? Z_FINISH : Z_SYNC_FLUSH);
+    if (job->last ? ret != Z_STREAM_END : (ret != Z_OK || zs->avail_in || !zs->avail_out)) {
+        return 1;
+    }
+
+    job->out_len = job->out_cap - zs->avail_out;
+    job->out_pos = 0;
+    job->crc = crc32(crc32(0, NULL, 0), job->in + DEFLATE_DICT, job->in_len);
+    return 0;
+}
+
+static void *deflate_worker(void *userdata) {
+    opendrop_deflate *stream = (opendrop_deflate*) userdata;
+
+    // Raw deflate, the reader writes the gzip framing
+    z_stream zs = {0};
+    opendrop_archive_level level = OPENDROP_ARCHIVE_LEVEL_HIGH;
+    bool zs_ok = deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+
+    pthread_mutex_lock(&stream->lock);
+    while (true) {
+        while (!stream->shutdown && stream->take_seq == stream->submit_seq) {
+            pthread_cond_wait(&stream->job_queued, &stream->lock);
+        }
+
+        if (stream->shutdown) {
+            break;
+        }
+
+        struct deflate_job *job = &stream->jobs[stream->take_seq++ % stream->jobs_len];
+        job->state = JOB_RUNNING;
+        pthread_mutex_unlock(&stream->lock);
+
+        bool failed = !zs_ok || compress_job(&zs, &level, job);
+
+        pthread_mutex_lock(&stream->lock);
+        job->state = failed ? JOB_FAILED : JOB_DONE;
+        pthread_cond_broadcast(&stream->job_done);
+    }
+    pthread_mutex_unlock(&stream->lock);
+
+    if (zs_ok) {
+        deflateEnd(&zs);
+    }
+
+    return NULL;
+}
+
+// Takes the level of the archive bytes read next
+static void update_level(opendrop_deflate *stream) {
+    opendrop_archive_level level = opendrop_archive_get_level(stream->archive);
+    if (level != OPENDROP_ARCHIVE_LEVEL_ANY) {
+        stream->level = level;
+    }
+}
+
+// Fills and queues the next block, caller holds no lock
+// Blocks end early where the archive's level changes, so each is compressed at one level
+static int submit_job(opendrop_deflate *stream) {
+    struct deflate_job *job = &stream->jobs[stream->submit_seq % stream->jobs_len];
+    update_level(stream);
+    job->level = stream->level;
+
+    size_t filled = 0;
+    while (filled < DEFLATE_BLOCK) {
+        opendrop_archive_level next;
+        if (filled && (next = opendrop_archive_get_level(stream->archive)) != OPENDROP_ARCHIVE_LEVEL_ANY && next != job->level) {
+            break;
+        }
+
+        size_t n;
+        if (opendrop_archive_read(stream->archive, job->in + DEFLATE_DICT + filled, DEFLATE_BLOCK - filled, &n)) {
+            return 1;
+        }
+
+        if (!n) {
+            stream->input_done = true;
+            break;
+        }
+        filled += n;
+    }
+
+    memcpy(job->in + DEFLATE_DICT - stream->tail_len, stream->tail + DEFLATE_DICT - stream->tail_len, stream->tail_len);
+    job->dict_len = stream->tail_len;
+    job->in_len = filled;
+    job->last = stream->input_done;
+
+    // Keep the last DEFLATE_DICT bytes seen for the next block
+    if (filled >= DEFLATE_DICT) {
+        memcpy(stream->tail, job->in + DEFLATE_DICT + filled - DEFLATE_DICT, DEFLATE_DICT);
+        stream->tail_len = DEFLATE_DICT;
+    } else if (filled) {
+        size_t keep = stream->tail_len + filled > DEFLATE_DICT ? DEFLATE_DICT - filled : stream->tail_len;
+        memmove(stream->tail + DEFLATE_DICT - keep - filled, stream->tail + DEFLATE_DICT - keep, keep);
+        memcpy(stream->tail + DEFLATE_DICT - filled, job->in + DEFLATE_DICT, filled);
+        stream->tail_len = keep + filled;
+    }
+
+    stream->total_in += filled;
+    stream->bytes_in += filled;
+    stream->level_bytes[job->level] += filled;
+
+    pthread_mutex_lock(&stream->lock);
+    job->state = JOB_QUEUED;
+    stream->submit_seq++;
+    pthread_cond_signal(&stream->job_queued);
+    pthread_mutex_unlock(&stream->lock);
+
+    return 0;
+}
+
+static int parallel_read(opendrop_deflate *stream, unsigned char *buf, size_t len, size_t *read) {
+    size_t written = 0;
+
+    while (written < len && !stream->finished) {
+        // Header or trailer bytes pending
+        if (stream->frame_pos < stream->frame_len) {
+            size_t n = stream->frame_len - stream->frame_pos;
+            if (n > len - written) {
+                n = len - written;
+            }
+
+            memcpy(buf + written, stream->frame + stream->frame_pos, n);
+            stream->frame_pos += n;
+            written += n;
+
+            if (stream->trailer_written && stream->frame_pos == stream->frame_len) {
+                stream->finished = true;
+            }
+            continue;
+        }
+
+        // Keep every worker busy
+        while (!stream->input_done && stream->submit_seq - stream->output_seq < stream->jobs_len) {
+            if (submit_job(stream)) {
+                return 1;
+            }
+        }
+
+        if (stream->output_seq == stream->submit_seq) {
+            // All blocks written, finish with CRC32 and ISIZE
+            for (int i = 0; i < 4; i++) {
+                stream->frame[i] = (stream->crc >> (8 * i)) & 0xff;
+                stream->frame[4 + i] = (stream->total_in >> (8 * i)) & 0xff;
+            }
+            stream->frame_len = 8;
+            stream->frame_pos = 0;
+            stream->trailer_written = true;
+            continue;
+        }
+
+        struct deflate_job *job = &stream->jobs[stream->output_seq % stream->jobs_len];
+
+        pthread_mutex_lock(&stream->lock);
+        if (written && job->state != JOB_DONE && job->state != JOB_FAILED) {
+            // Hand back what is ready instead of stalling the transfer
+            pthread_mutex_unlock(&stream->lock);
+            break;
+        }
+
+        while (job->state != JOB_DONE && job->state != JOB_FAILED) {
+            pthread_cond_wait(&stream->job_done, &stream->lock);
+        }
+        pthread_mutex_unlock(&stream->lock);
+
+        if (job->state == JOB_FAILED) {
+            return 1;
+        }
+
+        size_t n = job->out_len - job->out_pos;
+        if (n > len - written) {
+            n = len - written;
+        }
+
+        memcpy(buf + written, job->out + job->out_pos, n);
+        job->out_pos += n;
+        written += n;
+
+        if (job->out_pos == job->out_len) {
+            stream->crc = crc32_combine(stream->crc, job->crc, job->in_len);
+            job->state = JOB_FREE;
+            stream->output_seq++;
+        }
+    }
+
+    *read = written;
+    return 0;
+}
+
+int opendrop_deflate_read(opendrop_deflate *stream, unsigned char *buf, size_t len, size_t *read) {
+    *read = 0;
+    if (stream->finished) {
+        return 0;
+    }
+
+    if (stream->threads) {
+        int ret = parallel_read(stream, buf, len, read);
+        stream->bytes_out += *read;
+        return ret;
+    }
+
+    z_stream *zs = &stream->zs;
+    zs->next_out = buf;
+    zs->avail_out = len > UINT_MAX ? UINT_MAX : (uInt) len;
+
+    while (zs->avail_out) {
+        if (!zs->avail_in && !stream->input_done) {
+            // Switching levels flushes what the old level holds, which needs room in buf
+            opendrop_archive_level previous = stream->level;
+            update_level(stream);
+            if (stream->level != previous) {
+                int ret = deflateParams(zs, deflate_levels[stream->level], Z_DEFAULT_STRATEGY);
+                if (ret == Z_BUF_ERROR && !zs->avail_out) {
+                    stream->level = previous;
+                    break;
+                } else if (ret != Z_OK) {
+                    return 1;
+                }
+            }
+
+            size_t n;
+            if (opendrop_archive_read(stream->archive, stream->in, DEFLATE_CHUNK, &n)) {
+                return 1;
+            }
+
+            stream->input_done = !n;
+            stream->bytes_in += n;
+            stream->level_bytes[stream->level] += n;
+            zs->next_in = stream->in;
+            zs->avail_in = (uInt) n;
+        }
+
+        int ret = deflate(zs, stream->input_done ? Z_FINISH : Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) {
+            stream->finished = true;
+            break;
+        } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            return 1;
+        }
+    }
+
+    *read = len - zs->avail_out;
+    stream->bytes_out += *read;
+    return 0;
+}
+
+void opendrop_deflate_counts(const opendrop_deflate *stream, uint64_t *in, uint64_t *out) {
+    *in = stream->bytes_in;
+    *out = stream->bytes_out;
+}
+
+void opendrop_deflate_level_counts(const opendrop_deflate *stream, uint64_t counts[OPENDROP_ARCHIVE_LEVELS]) {
+    memcpy(counts, stream->level_bytes, sizeof(stream->level_bytes));
+}
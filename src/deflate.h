@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "archive.h"
+
+typedef struct opendrop_deflate_s opendrop_deflate;
+
+// Creates a gzip stream that compresses an archive as it is read
+// Memory use is fixed regardless of the archive size
+// With more than one thread, blocks are compressed in parallel by a worker pool and joined into one gzip member
+// Each read of the archive is compressed at the level the archive gives for it, see opendrop_archive_set_adaptive
+// Args:
+// - stream: Deflate stream
+// - archive: Archive to compress, not owned by the stream
+// - threads: Number of compression workers, 0 or 1 compresses on the calling thread
+// Returns 0 on success, >0 on error
+int opendrop_deflate_new(opendrop_deflate **stream, opendrop_archive *archive, unsigned int threads);
+
+// Starts a new gzip member over another archive, keeping the compressor state and workers
+// Args:
+// - stream: Deflate stream
+// - archive: Archive to compress, not owned by the stream
+// Returns 0 on success, >0 on error
+int opendrop_deflate_reset(opendrop_deflate *stream, opendrop_archive *archive);
+
+// Frees deflate stream
+// Args:
+// - stream: Deflate stream
+void opendrop_deflate_free(opendrop_deflate *stream);
+
+// Reads the next compressed bytes
+// Args:
+// - stream: Deflate stream
+// - buf: Buffer to fill
+// - len: Size of buf
+// - read: Number of bytes written to buf, 0 once the gzip member is complete
+// Returns 0 on success, >0 on error
+int opendrop_deflate_read(opendrop_deflate *stream, unsigned char *buf, size_t len, size_t *read);
+
+// Gets how much of the current gzip member has been produced
+// Args:
+// - stream: Deflate stream
+// - in: Archive bytes taken since the stream was created or reset, read ahead of the output in parallel mode
+// - out: Compressed bytes read since the stream was created or reset
+void opendrop_deflate_counts(const opendrop_deflate *stream, uint64_t *in, uint64_t *out);
+
+// Gets how many archive bytes of the current gzip member were compressed at each level
+// Args:
+// - stream: Deflate stream
+// - counts: Bytes taken at each level, indexed by opendrop_archive_level
+void opendrop_deflate_level_counts(const opendrop_deflate *stream, uint64_t counts[OPENDROP_ARCHIVE_LEVELS]);
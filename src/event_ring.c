@@ -0,0 +1,116 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "event_ring.h"
+
+struct opendrop_event_ring_s {
+    opendrop_browser_event *slots;
+    size_t mask;
+    int fd;
+
+    // Written by the consumer, kept apart from the producer's fields to avoid false sharing
+    _Alignas(64) atomic_size_t head;
+    // Set by the consumer before draining, the producer only signals the fd while it is set
+    atomic_bool armed;
+
+    _Alignas(64) atomic_size_t tail;
+    atomic_bool dropped;
+};
+
+int opendrop_event_ring_new(opendrop_event_ring **ring, size_t capacity) {
+    size_t slots_len = 1;
+    while (slots_len < capacity) {
+        slots_len <<= 1;
+    }
+
+    if (!(*ring = (opendrop_event_ring*) aligned_alloc(64, sizeof(opendrop_event_ring)))) {
+        return 1;
+    }
+
+    memset(*ring, 0, sizeof(opendrop_event_ring));
+    (*ring)->mask = slots_len - 1;
+    atomic_init(&(*ring)->head, 0);
+    atomic_init(&(*ring)->tail, 0);
+    atomic_init(&(*ring)->armed, true);
+    atomic_init(&(*ring)->dropped, false);
+
+    if (!((*ring)->slots = (opendrop_browser_event*) malloc(sizeof(opendrop_browser_event) * slots_len))) {
+        free(*ring);
+        return 1;
+    }
+
+    if (((*ring)->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        free((*ring)->slots);
+        free(*ring);
+        return 1;
+    }
+
+    return 0;
+}
+
+void opendrop_event_ring_free(opendrop_event_ring *ring) {
+    if (ring) {
+        size_t tail = atomic_load(&ring->tail);
+        for (size_t i = atomic_load(&ring->head); i != tail; i++) {
+            free(ring->slots[i & ring->mask].service);
+        }
+
+        close(ring->fd);
+        free(ring->slots);
+        free(ring);
+    }
+}
+
+int opendrop_event_ring_fd(const opendrop_event_ring *ring) {
+    return ring->fd;
+}
+
+int opendrop_event_ring_push(opendrop_event_ring *ring, const opendrop_browser_event *event) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if (tail - head > ring->mask) {
+        free(event->service);
+        atomic_store_explicit(&ring->dropped, true, memory_order_relaxed);
+    } else {
+        ring->slots[tail & ring->mask] = *event;
+        // Sequentially consistent with the armed flag, so a consumer arming after this sees the event
+        atomic_store(&ring->tail, tail + 1);
+    }
+
+    // One wakeup per drain is enough, later events are picked up by the same drain
+    if (atomic_exchange(&ring->armed, false)) {
+        uint64_t one = 1;
+        write(ring->fd, &one, sizeof(one));
+    }
+
+    return tail - head > ring->mask;
+}
+
+size_t opendrop_event_ring_poll(opendrop_event_ring *ring, opendrop_browser_event *events, size_t max) {
+    // Clear the wakeup before rearming so events pushed from here on signal again
+    uint64_t count;
+    read(ring->fd, &count, sizeof(count));
+    atomic_store(&ring->armed, true);
+
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load(&ring->tail);
+
+    size_t n = 0;
+    for (; n < max && head != tail; n++, head++) {
+        events[n] = ring->slots[head & ring->mask];
+    }
+    atomic_store_explicit(&ring->head, head, memory_order_release);
+
+    if (n < max && head == tail && atomic_exchange_explicit(&ring->dropped, false, memory_order_relaxed)) {
+        memset(&events[n], 0, sizeof(opendrop_browser_event));
+        events[n++].type = OPENDROP_BROWSER_EVENT_OVERFLOW;
+    }
+
+    return n;
+}
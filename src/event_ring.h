@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stddef.h>
+#include "../include/browser.h"
+
+typedef struct opendrop_event_ring_s opendrop_event_ring;
+
+// Creates a single-producer single-consumer ring of browser events with an eventfd for wakeups
+// Args:
+// - ring: Event ring
+// - capacity: Number of events held, rounded up to a power of two
+// Returns 0 on success, >0 on error
+int opendrop_event_ring_new(opendrop_event_ring **ring, size_t capacity);
+
+// Frees event ring along with events still queued
+// Args:
+// - ring: Event ring
+void opendrop_event_ring_free(opendrop_event_ring *ring);
+
+// Gets the eventfd that becomes readable when events are pushed
+// Args:
+// - ring: Event ring
+int opendrop_event_ring_fd(const opendrop_event_ring *ring);
+
+// Pushes an event, only called from the producer thread
+// The ring takes ownership of the event's service, it is freed if the ring is full
+// Args:
+// - ring: Event ring
+// - event: Event
+// Returns 0 if queued, 1 if dropped
+int opendrop_event_ring_push(opendrop_event_ring *ring, const opendrop_browser_event *event);
+
+// Takes queued events, only called from the consumer thread
+// Args:
+// - ring: Event ring
+// - events: Array filled with events
+// - max: Size of events
+// Returns the number of events taken, an overflow event follows the queued ones if any were dropped
+size_t opendrop_event_ring_poll(opendrop_event_ring *ring, opendrop_browser_event *events, size_t max);
@@ -0,0 +1,373 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "extract.h"
+
+// Size of the inflated staging buffer
+#define EXTRACT_CHUNK (64 * 1024)
+
+// odc ("070707") and newc ("070701"/"070702") header sizes
+#define ODC_HEADER_LEN 76
+#define NEWC_HEADER_LEN 110
+#define CPIO_TRAILER "TRAILER!!!"
+
+enum extract_state {
+    EXTRACT_HEADER,
+    EXTRACT_NAME,
+    EXTRACT_NAME_PAD,
+    EXTRACT_DATA,
+    EXTRACT_DATA_PAD,
+    EXTRACT_DONE
+};
+
+struct opendrop_extract_s {
+    int dir_fd;
+
+    z_stream zs;
+    bool zs_init;
+    bool stream_end;
+
+    enum extract_state state;
+
+    // Current entry
+    bool newc;
+    unsigned char header[NEWC_HEADER_LEN];
+    size_t header_len;
+    char name[PATH_MAX + 1];
+    size_t name_len;
+    size_t name_need;
+    unsigned int mode;
+    unsigned long long data_left;
+    // newc aligns names and data to 4 bytes
+    size_t pad_left;
+    size_t data_pad;
+    int fd;
+
+    unsigned char out[EXTRACT_CHUNK];
+};
+
+int opendrop_extract_new(opendrop_extract **extract, const char *directory) {
+    if (!(*extract = (opendrop_extract*) malloc(sizeof(opendrop_extract)))) {
+        return 1;
+    }
+
+    memset(*extract, 0, offsetof(opendrop_extract, out));
+    (*extract)->fd = -1;
+    (*extract)->dir_fd = -1;
+
+    if (((*extract)->dir_fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        opendrop_extract_free(*extract);
+        *extract = NULL;
+        return 1;
+    }
+
+    // 32 added to the window bits accepts gzip or zlib framing
+    if (inflateInit2(&(*extract)->zs, 15 + 32) != Z_OK) {
+        opendrop_extract_free(*extract);
+        *extract = NULL;
+        return 1;
+    }
+    (*extract)->zs_init = true;
+
+    return 0;
+}
+
+void opendrop_extract_free(opendrop_extract *extract) {
+    if (extract) {
+        if (extract->zs_init) {
+            inflateEnd(&extract->zs);
+        }
+
+        if (extract->fd >= 0) {
+            close(extract->fd);
+        }
+
+        if (extract->dir_fd >= 0) {
+            close(extract->dir_fd);
+        }
+
+        free(extract);
+    }
+}
+
+static int parse_num(const unsigned char *field, size_t len, int base, unsigned long long *value) {
+    *value = 0;
+    for (size_t i = 0; i < len; i++) {
+        int digit;
+        unsigned char c = field[i];
+        if (c >= '0' && c <= '9') {
+            digit = c - '0';
+        } else if (base == 16 && (c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+            digit = (c | 0x20) - 'a' + 10;
+        } else {
+            return 1;
+        }
+
+        if (digit >= base) {
+            return 1;
+        }
+        *value = *value * base + digit;
+    }
+
+    return 0;
+}
+
+// Parses the fixed header, setting up name collection
+static int parse_header(opendrop_extract *extract) {
+    unsigned long long mode, name_len, size;
+
+    if (extract->newc) {
+        if (parse_num(extract->header + 14, 8, 16, &mode) || parse_num(extract->header + 54, 8, 16, &size) ||
+            parse_num(extract->header + 94, 8, 16, &name_len)) {
+            return 1;
+        }
+    } else if (parse_num(extract->header + 18, 6, 8, &mode) || parse_num(extract->header + 59, 6, 8, &name_len) ||
+        parse_num(extract->header + 65, 11, 8, &size)) {
+        return 1;
+    }
+
+    if (!name_len || name_len > PATH_MAX + 1) {
+        return 1;
+    }
+
+    extract->mode = mode;
+    extract->data_left = size;
+    extract->name_need = name_len;
+    extract->name_len = 0;
+    extract->pad_left = extract->newc ? (4 - (NEWC_HEADER_LEN + name_len) % 4) % 4 : 0;
+    extract->data_pad = extract->newc ? (4 - size % 4) % 4 : 0;
+    return 0;
+}
+
+// Opens the parent directory of path below dir_fd, creating it as needed
+// Returns the directory fd and points leaf at the last component, or -1 if the path is unsafe
+// leaf is NULL if the path names the output directory itself
+static int open_parent(opendrop_extract *extract, char *path, char **leaf) {
+    int fd = dup(extract->dir_fd);
+    char *component = path;
+    *leaf = NULL;
+
+    while (fd >= 0 && component) {
+        char *slash = strchr(component, '/');
+        if (slash) {
+            *slash = 0;
+        }
+
+        // Skip empty and current directory components
+        if (!*component || !strcmp(component, ".")) {
+            component = slash ? slash + 1 : NULL;
+            continue;
+        }
+
+        if (!strcmp(component, "..")) {
+            close(fd);
+            return -1;
+        }
+
+        if (!slash) {
+            *leaf = component;
+            break;
+        }
+
+        if (mkdirat(fd, component, 0755) && errno != EEXIST) {
+            close(fd);
+            return -1;
+        }
+
+        int next = openat(fd, component, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        close(fd);
+        fd = next;
+        component = slash + 1;
+    }
+
+    return fd;
+}
+
+// Creates the entry named in extract->name
+static int begin_entry(opendrop_extract *extract) {
+    if (!strcmp(extract->name, CPIO_TRAILER)) {
+        extract->state = EXTRACT_DONE;
+        return 0;
+    }
+
+    extract->state = EXTRACT_DATA;
+
+    char *leaf;
+    int parent = open_parent(extract, extract->name, &leaf);
+    if (parent < 0) {
+        return 1;
+    }
+
+    int ret = 0;
+    if (!leaf) {
+        // Archives commonly start with a "." entry for the root
+        ret = !S_ISDIR(extract->mode);
+    } else if (S_ISDIR(extract->mode)) {
+        ret = mkdirat(parent, leaf, 0755) && errno != EEXIST;
+    } else if (S_ISREG(extract->mode)) {
+        ret = (extract->fd = openat(parent, leaf, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0644)) < 0;
+    }
+    // Other entry types such as symlinks are skipped, their data is consumed without being written
+
+    close(parent);
+    return ret;
+}
+
+static int write_all(int fd, const unsigned char *data, size_t len) {
+    while (len) {
+        ssize_t w = write(fd, data, len);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 1;
+        }
+
+        data += w;
+        len -= w;
+    }
+
+    return 0;
+}
+
+// Consumes inflated cpio bytes, zero-length steps are taken even when no bytes are left
+static int consume(opendrop_extract *extract, const unsigned char *data, size_t len) {
+    size_t pos = 0;
+
+    while (extract->state != EXTRACT_DONE) {
+        size_t avail = len - pos;
+        size_t n;
+
+        switch (extract->state) {
+        case EXTRACT_HEADER: ;
+            // The magic decides how long the rest of the header is
+            size_t need = extract->header_len < 6 ? 6 : (extract->newc ? NEWC_HEADER_LEN : ODC_HEADER_LEN);
+            if (!avail) {
+                return 0;
+            }
+
+            n = need - extract->header_len < avail ? need - extract->header_len : avail;
+            memcpy(extract->header + extract->header_len, data + pos, n);
+            extract->header_len += n;
+            pos += n;
+
+            if (extract->header_len == 6 && need == 6) {
+                if (!memcmp(extract->header, "070707", 6)) {
+                    extract->newc = false;
+                } else if (!memcmp(extract->header, "070701", 6) || !memcmp(extract->header, "070702", 6)) {
+                    extract->newc = true;
+                } else {
+                    return 1;
+                }
+            } else if (extract->header_len == need) {
+                if (parse_header(extract)) {
+                    return 1;
+                }
+                extract->state = EXTRACT_NAME;
+            }
+            break;
+
+        case EXTRACT_NAME:
+            if (!avail) {
+                return 0;
+            }
+
+            n = extract->name_need - extract->name_len < avail ? extract->name_need - extract->name_len : avail;
+            memcpy(extract->name + extract->name_len, data + pos, n);
+            extract->name_len += n;
+            pos += n;
+
+            if (extract->name_len == extract->name_need) {
+                extract->name[extract->name_len - 1] = 0;
+                extract->state = EXTRACT_NAME_PAD;
+            }
+            break;
+
+        case EXTRACT_NAME_PAD:
+        case EXTRACT_DATA_PAD:
+            n = extract->pad_left < avail ? extract->pad_left : avail;
+            pos += n;
+            if ((extract->pad_left -= n)) {
+                return 0;
+            }
+
+            if (extract->state == EXTRACT_DATA_PAD) {
+                extract->state = EXTRACT_HEADER;
+                extract->header_len = 0;
+            } else {
+                extract->pad_left = extract->data_pad;
+                if (begin_entry(extract)) {
+                    return 1;
+                }
+            }
+            break;
+
+        case EXTRACT_DATA:
+            n = extract->data_left < avail ? extract->data_left : avail;
+            if (n && extract->fd >= 0 && write_all(extract->fd, data + pos, n)) {
+                return 1;
+            }
+
+            pos += n;
+            if ((extract->data_left -= n)) {
+                return 0;
+            }
+
+            if (extract->fd >= 0) {
+                int ret = close(extract->fd);
+                extract->fd = -1;
+                if (ret) {
+                    return 1;
+                }
+            }
+            extract->state = EXTRACT_DATA_PAD;
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    // Anything after the trailer, such as block padding, is ignored
+    return 0;
+}
+
+int opendrop_extract_write(opendrop_extract *extract, const unsigned char *data, size_t len) {
+    z_stream *zs = &extract->zs;
+    zs->next_in = (unsigned char*) data;
+    zs->avail_in = len;
+
+    while (!extract->stream_end && (zs->avail_in || !zs->avail_out)) {
+        zs->next_out = extract->out;
+        zs->avail_out = EXTRACT_CHUNK;
+
+        int ret = inflate(zs, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) {
+            extract->stream_end = true;
+        } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            return 1;
+        }
+
+        if (consume(extract, extract->out, EXTRACT_CHUNK - zs->avail_out)) {
+            return 1;
+        }
+
+        if (ret == Z_BUF_ERROR) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+int opendrop_extract_finish(opendrop_extract *extract) {
+    return !(extract->stream_end && extract->state == EXTRACT_DONE);
+}
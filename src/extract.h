@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+
+typedef struct opendrop_extract_s opendrop_extract;
+
+// Creates an extractor that inflates a gzip-compressed cpio stream and writes its entries as they arrive
+// Memory use is fixed regardless of the stream size
+// Args:
+// - extract: Extractor instance
+// - directory: Directory entries are written under, entries can't escape it
+// Returns 0 on success, >0 on error
+int opendrop_extract_new(opendrop_extract **extract, const char *directory);
+
+// Frees extractor, closing any partially written file
+// Args:
+// - extract: Extractor instance
+void opendrop_extract_free(opendrop_extract *extract);
+
+// Feeds the next bytes of the compressed stream
+// Args:
+// - extract: Extractor instance
+// - data: Compressed bytes
+// - len: Length of data
+// Returns 0 on success, >0 on error
+int opendrop_extract_write(opendrop_extract *extract, const unsigned char *data, size_t len);
+
+// Checks that the stream ended with a complete archive
+// Args:
+// - extract: Extractor instance
+// Returns 0 on success, >0 if the stream was truncated
+int opendrop_extract_finish(opendrop_extract *extract);
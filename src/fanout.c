@@ -0,0 +1,548 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <curl/curl.h>
+
+#include "../include/fanout.h"
+#include "client_private.h"
+#include "config_private.h"
+#include "archive.h"
+#include "deflate.h"
+#include "bplist.h"
+
+// Compressed bytes per chunk, also the granularity of spilling
+#define FANOUT_CHUNK (256 * 1024)
+// Chunks kept in memory before spilling, unless changed with opendrop_fanout_set_memory_limit
+#define FANOUT_DEFAULT_MEMORY_LIMIT (32 * 1024 * 1024)
+
+// Part of the compressed archive, shared by every receiver
+typedef struct fanout_chunk_s {
+    struct fanout_chunk_s *next;
+    unsigned char *data;
+    size_t len;
+    // Receivers that still have to send the chunk
+    size_t refs;
+    // Offset in the spill file, -1 for chunks in memory
+    off_t spill_offset;
+} fanout_chunk;
+
+typedef enum fanout_stage_e {
+    FANOUT_STAGE_ASK,
+    FANOUT_STAGE_UPLOAD,
+    FANOUT_STAGE_DONE
+} fanout_stage;
+
+typedef struct fanout_receiver_s {
+    opendrop_fanout *fanout;
+    size_t index;
+    CURL *curl;
+
+    // Target address followed by the request path
+    char *url;
+    size_t url_base_len;
+    uint16_t port;
+
+    fanout_stage stage;
+    opendrop_fanout_result result;
+
+    // Chunk being sent and the offset in it, NULL until the upload reads the first chunk
+    fanout_chunk *chunk;
+    size_t offset;
+} fanout_receiver;
+
+struct opendrop_fanout_s {
+    const opendrop_config *config;
+    opendrop_client_share *share;
+
+    CURLM *multi;
+    struct curl_slist *headers;
+    struct curl_slist *upload_headers;
+
+    // Encoded once, every receiver is asked with the same body
+    opendrop_bplist_template *template;
+    opendrop_bplist_buf ask_body;
+
+    opendrop_archive *archive;
+    opendrop_deflate *stream;
+    bool compressed;
+
+    fanout_receiver *receivers;
+    size_t receivers_len;
+    size_t receivers_cap;
+    // Easy handles in the multi handle
+    size_t active;
+    // Receivers that haven't finished, every new chunk is referenced once for each
+    size_t readers;
+
+    // Chunks from the oldest still referenced to the newest
+    fanout_chunk *first;
+    fanout_chunk *last;
+    size_t memory_used;
+    size_t memory_limit;
+
+    // Unlinked temporary file, opened when the first chunk spills
+    int spill_fd;
+    off_t spill_len;
+
+    bool sent;
+
+    opendrop_fanout_done_cb done;
+    void *done_userdata;
+
+    int last_error;
+};
+
+int last_fanout_init_error = 0;
+
+int opendrop_fanout_new(opendrop_fanout **fanout, const opendrop_config *config, const opendrop_client_file_data **files,
+    size_t files_len, const opendrop_client_data *icon) {
+    if (opendrop_client_global_init()) {
+        last_fanout_init_error = 2;
+        return 1;
+    }
+
+    if (!(*fanout = (opendrop_fanout*) malloc(sizeof(opendrop_fanout)))) {
+        opendrop_client_global_cleanup();
+        last_fanout_init_error = 1;
+        return 1;
+    }
+
+    memset(*fanout, 0, sizeof(opendrop_fanout));
+    (*fanout)->config = config;
+    (*fanout)->memory_limit = FANOUT_DEFAULT_MEMORY_LIMIT;
+    (*fanout)->spill_fd = -1;
+
+    if (!((*fanout)->multi = curl_multi_init())) {
+        opendrop_fanout_free(*fanout);
+        last_fanout_init_error = 3;
+        return 1;
+    }
+
+    if (!((*fanout)->headers = generate_body_headers_list()) || !((*fanout)->upload_headers = generate_upload_headers_list())) {
+        opendrop_fanout_free(*fanout);
+        last_fanout_init_error = 1;
+        return 1;
+    }
+
+    if (opendrop_bplist_template_new(&(*fanout)->template, config) ||
+        opendrop_bplist_encode_ask((*fanout)->template, &(*fanout)->ask_body, files, files_len, false, icon)) {
+        opendrop_fanout_free(*fanout);
+        last_fanout_init_error = 4;
+        return 1;
+    }
+
+    // Compression only starts once the first receiver uploads
+    if (opendrop_archive_new(&(*fanout)->archive, files, files_len) ||
+        opendrop_deflate_new(&(*fanout)->stream, (*fanout)->archive, config->compression_threads)) {
+        opendrop_fanout_free(*fanout);
+        last_fanout_init_error = 5;
+        return 1;
+    }
+    opendrop_archive_set_adaptive((*fanout)->archive, config->adaptive_compression);
+
+    return 0;
+}
+
+static void chunk_free(opendrop_fanout *fanout, fanout_chunk *chunk) {
+    if (chunk->spill_offset < 0) {
+        free(chunk->data);
+        fanout->memory_used -= FANOUT_CHUNK;
+    } else {
+        munmap(chunk->data, FANOUT_CHUNK);
+        // Give the disk space back, the file keeps its size so later offsets stay valid
+        fallocate(fanout->spill_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, chunk->spill_offset, FANOUT_CHUNK);
+    }
+
+    free(chunk);
+}
+
+void opendrop_fanout_free(opendrop_fanout *fanout) {
+    if (fanout) {
+        for (size_t i = 0; i < fanout->receivers_len; i++) {
+            if (fanout->receivers[i].curl) {
+                curl_multi_remove_handle(fanout->multi, fanout->receivers[i].curl);
+                curl_easy_cleanup(fanout->receivers[i].curl);
+            }
+            free(fanout->receivers[i].url);
+        }
+        free(fanout->receivers);
+
+        while (fanout->first) {
+            fanout_chunk *next = fanout->first->next;
+            chunk_free(fanout, fanout->first);
+            fanout->first = next;
+        }
+
+        if (fanout->spill_fd >= 0) {
+            close(fanout->spill_fd);
+        }
+
+        if (fanout->multi) {
+            curl_multi_cleanup(fanout->multi);
+        }
+
+        curl_slist_free_all(fanout->headers);
+        curl_slist_free_all(fanout->upload_headers);
+        opendrop_bplist_template_free(fanout->template);
+        opendrop_bplist_buf_free(&fanout->ask_body);
+        opendrop_deflate_free(fanout->stream);
+        opendrop_archive_free(fanout->archive);
+        free(fanout);
+
+        opendrop_client_global_cleanup();
+    }
+}
+
+int opendrop_fanout_add(opendrop_fanout *fanout, const char *target_address, uint16_t target_port) {
+    if (fanout->sent) {
+        fanout->last_error = 7;
+        return 1;
+    }
+
+    if (fanout->receivers_len == fanout->receivers_cap) {
+        size_t cap = fanout->receivers_cap ? fanout->receivers_cap * 2 : 8;
+        fanout_receiver *receivers = (fanout_receiver*) realloc(fanout->receivers, cap * sizeof(fanout_receiver));
+        if (!receivers) {
+            fanout->last_error = 1;
+            return 1;
+        }
+
+        fanout->receivers = receivers;
+        fanout->receivers_cap = cap;
+    }
+
+    fanout_receiver *receiver = &fanout->receivers[fanout->receivers_len];
+    memset(receiver, 0, sizeof(fanout_receiver));
+    receiver->url_base_len = strlen(target_address);
+    if (!(receiver->url = (char*) malloc(receiver->url_base_len + sizeof("/Upload")))) {
+        fanout->last_error = 1;
+        return 1;
+    }
+
+    strcpy(receiver->url, target_address);
+    receiver->port = target_port;
+    receiver->index = fanout->receivers_len++;
+    return 0;
+}
+
+// Gets memory for a chunk, from the spill file once the memory limit is reached
+static fanout_chunk *chunk_new(opendrop_fanout *fanout) {
+    fanout_chunk *chunk = (fanout_chunk*) malloc(sizeof(fanout_chunk));
+    if (!chunk) {
+        fanout->last_error = 1;
+        return NULL;
+    }
+
+    memset(chunk, 0, sizeof(fanout_chunk));
+    chunk->spill_offset = -1;
+
+    if (fanout->memory_used + FANOUT_CHUNK <= fanout->memory_limit) {
+        if (!(chunk->data = (unsigned char*) malloc(FANOUT_CHUNK))) {
+            free(chunk);
+            fanout->last_error = 1;
+            return NULL;
+        }
+
+        fanout->memory_used += FANOUT_CHUNK;
+        return chunk;
+    }
+
+    if (fanout->spill_fd < 0) {
+        const char *dir = getenv("TMPDIR");
+        fanout->spill_fd = open(dir ? dir : "/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    }
+
+    chunk->spill_offset = fanout->spill_len;
+    if (fanout->spill_fd < 0 || ftruncate(fanout->spill_fd, fanout->spill_len + FANOUT_CHUNK) ||
+        (chunk->data = (unsigned char*) mmap(NULL, FANOUT_CHUNK, PROT_READ | PROT_WRITE, MAP_SHARED, fanout->spill_fd,
+            chunk->spill_offset)) == MAP_FAILED) {
+        free(chunk);
+        fanout->last_error = 6;
+        return NULL;
+    }
+
+    fanout->spill_len += FANOUT_CHUNK;
+    return chunk;
+}
+
+// Compresses the next chunk, setting compressed instead if the archive is complete
+static int chunk_produce(opendrop_fanout *fanout) {
+    fanout_chunk *chunk = chunk_new(fanout);
+    if (!chunk) {
+        return 1;
+    }
+
+    while (chunk->len < FANOUT_CHUNK) {
+        size_t read;
+        if (opendrop_deflate_read(fanout->stream, chunk->data + chunk->len, FANOUT_CHUNK - chunk->len, &read)) {
+            chunk_free(fanout, chunk);
+            fanout->last_error = 5;
+            return 1;
+        }
+
+        if (!read) {
+            fanout->compressed = true;
+            break;
+        }
+        chunk->len += read;
+    }
+
+    if (!chunk->len) {
+        chunk_free(fanout, chunk);
+        return 0;
+    }
+
+    chunk->refs = fanout->readers;
+    if (fanout->last) {
+        fanout->last->next = chunk;
+    } else {
+        fanout->first = chunk;
+    }
+    fanout->last = chunk;
+    return 0;
+}
+
+// Drops a receiver's reference, chunks are freed from the front once every receiver is past them
+static void chunk_release(opendrop_fanout *fanout, fanout_chunk *chunk) {
+    chunk->refs--;
+
+    while (fanout->first && !fanout->first->refs) {
+        fanout_chunk *next = fanout->first->next;
+        chunk_free(fanout, fanout->first);
+        if (!(fanout->first = next)) {
+            fanout->last = NULL;
+        }
+    }
+}
+
+static size_t upload_read(char *buffer, size_t size, size_t nitems, void *userdata) {
+    fanout_receiver *receiver = (fanout_receiver*) userdata;
+    opendrop_fanout *fanout = receiver->fanout;
+
+    size_t len = size * nitems, written = 0;
+    while (written < len) {
+        if (!receiver->chunk) {
+            if (!fanout->first && !fanout->compressed && chunk_produce(fanout)) {
+                return CURL_READFUNC_ABORT;
+            }
+
+            if (!(receiver->chunk = fanout->first)) {
+                break;
+            }
+            receiver->offset = 0;
+        }
+
+        fanout_chunk *chunk = receiver->chunk;
+        if (receiver->offset == chunk->len) {
+            // The fastest receiver compresses for everyone
+            if (!chunk->next && !fanout->compressed && chunk_produce(fanout)) {
+                return CURL_READFUNC_ABORT;
+            }
+
+            if (!chunk->next) {
+                break;
+            }
+
+            receiver->chunk = chunk->next;
+            receiver->offset = 0;
+            chunk_release(fanout, chunk);
+            continue;
+        }
+
+        size_t n = chunk->len - receiver->offset;
+        if (n > len - written) {
+            n = len - written;
+        }
+
+        memcpy(buffer + written, chunk->data + receiver->offset, n);
+        receiver->offset += n;
+        written += n;
+    }
+
+    return written;
+}
+
+// Responses aren't needed, only the status
+static size_t discard_write(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    return size * nmemb;
+}
+
+// Points a receiver's handle at an endpoint and adds it to the multi handle
+static int receiver_begin(opendrop_fanout *fanout, fanout_receiver *receiver, const char *path) {
+    strcpy(receiver->url + receiver->url_base_len, path);
+    if (curl_easy_setopt(receiver->curl, CURLOPT_URL, receiver->url) || curl_multi_add_handle(fanout->multi, receiver->curl)) {
+        return 1;
+    }
+
+    fanout->active++;
+    return 0;
+}
+
+static int receiver_begin_ask(opendrop_fanout *fanout, fanout_receiver *receiver) {
+    receiver->fanout = fanout;
+    if (!(receiver->curl = curl_easy_init())) {
+        return 1;
+    }
+
+    // Binary plists contain null bytes, so the body size is passed explicitly
+    if (opendrop_client_configure(receiver->curl, fanout->config) ||
+        curl_easy_setopt(receiver->curl, CURLOPT_PORT, (long) receiver->port) ||
+        curl_easy_setopt(receiver->curl, CURLOPT_HTTPHEADER, fanout->headers) ||
+        curl_easy_setopt(receiver->curl, CURLOPT_POSTFIELDSIZE, (long) fanout->ask_body.len) ||
+        curl_easy_setopt(receiver->curl, CURLOPT_POSTFIELDS, fanout->ask_body.data) ||
+        curl_easy_setopt(receiver->curl, CURLOPT_WRITEFUNCTION, discard_write) ||
+        curl_easy_setopt(receiver->curl, CURLOPT_PRIVATE, receiver) ||
+        (fanout->share && curl_easy_setopt(receiver->curl, CURLOPT_SHARE, fanout->share->share))) {
+        return 1;
+    }
+
+    receiver->stage = FANOUT_STAGE_ASK;
+    return receiver_begin(fanout, receiver, "/Ask");
+}
+
+// Reuses the Ask handle, so the upload goes over the same connection
+static int receiver_begin_upload(opendrop_fanout *fanout, fanout_receiver *receiver) {
+    if (curl_easy_setopt(receiver->curl, CURLOPT_HTTPHEADER, fanout->upload_headers) ||
+        curl_easy_setopt(receiver->curl, CURLOPT_POST, 1L) ||
+        curl_easy_setopt(receiver->curl, CURLOPT_POSTFIELDS, NULL) ||
+        curl_easy_setopt(receiver->curl, CURLOPT_POSTFIELDSIZE, -1L) ||
+        curl_easy_setopt(receiver->curl, CURLOPT_READFUNCTION, upload_read) ||
+        curl_easy_setopt(receiver->curl, CURLOPT_READDATA, receiver)) {
+        return 1;
+    }
+
+    receiver->stage = FANOUT_STAGE_UPLOAD;
+    return receiver_begin(fanout, receiver, "/Upload");
+}
+
+// Releases every chunk the receiver would still have sent and reports it
+static void receiver_finish(opendrop_fanout *fanout, fanout_receiver *receiver, opendrop_fanout_result result) {
+    fanout_chunk *chunk = receiver->chunk ? receiver->chunk : fanout->first;
+    while (chunk) {
+        fanout_chunk *next = chunk->next;
+        chunk_release(fanout, chunk);
+        chunk = next;
+    }
+
+    receiver->chunk = NULL;
+    receiver->stage = FANOUT_STAGE_DONE;
+    receiver->result = result;
+    fanout->readers--;
+
+    if (receiver->curl) {
+        curl_easy_cleanup(receiver->curl);
+        receiver->curl = NULL;
+    }
+
+    if (fanout->done) {
+        (*fanout->done)(fanout, receiver->index, result, fanout->done_userdata);
+    }
+}
+
+static void receiver_done(opendrop_fanout *fanout, fanout_receiver *receiver, CURLcode code) {
+    long status = 0;
+    curl_easy_getinfo(receiver->curl, CURLINFO_RESPONSE_CODE, &status);
+    curl_multi_remove_handle(fanout->multi, receiver->curl);
+    fanout->active--;
+
+    bool ok = code == CURLE_OK && status == 200;
+    if (receiver->stage == FANOUT_STAGE_ASK) {
+        if (!ok || receiver_begin_upload(fanout, receiver)) {
+            receiver_finish(fanout, receiver, OPENDROP_FANOUT_DECLINED);
+        }
+    } else {
+        receiver_finish(fanout, receiver, ok ? OPENDROP_FANOUT_SENT : OPENDROP_FANOUT_FAILED);
+    }
+}
+
+int opendrop_fanout_send(opendrop_fanout *fanout) {
+    if (fanout->sent) {
+        fanout->last_error = 7;
+        return 2;
+    }
+
+    fanout->sent = true;
+    fanout->readers = fanout->receivers_len;
+
+    for (size_t i = 0; i < fanout->receivers_len; i++) {
+        if (receiver_begin_ask(fanout, &fanout->receivers[i])) {
+            receiver_finish(fanout, &fanout->receivers[i], OPENDROP_FANOUT_DECLINED);
+        }
+    }
+
+    while (fanout->active) {
+        int running;
+        if (curl_multi_perform(fanout->multi, &running)) {
+            fanout->last_error = 8;
+            return 2;
+        }
+
+        CURLMsg *msg;
+        int left;
+        while ((msg = curl_multi_info_read(fanout->multi, &left))) {
+            if (msg->msg == CURLMSG_DONE) {
+                fanout_receiver *receiver;
+                CURLcode code = msg->data.result;
+                curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**) &receiver);
+                receiver_done(fanout, receiver, code);
+            }
+        }
+
+        if (fanout->active) {
+            curl_multi_poll(fanout->multi, NULL, 0, 1000, NULL);
+        }
+    }
+
+    for (size_t i = 0; i < fanout->receivers_len; i++) {
+        if (fanout->receivers[i].result != OPENDROP_FANOUT_SENT) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+opendrop_fanout_result opendrop_fanout_get_result(const opendrop_fanout *fanout, size_t index) {
+    return index < fanout->receivers_len ? fanout->receivers[index].result : OPENDROP_FANOUT_PENDING;
+}
+
+void opendrop_fanout_set_done_callback(opendrop_fanout *fanout, opendrop_fanout_done_cb callback, void *userdata) {
+    fanout->done = callback;
+    fanout->done_userdata = userdata;
+}
+
+void opendrop_fanout_set_share(opendrop_fanout *fanout, opendrop_client_share *share) {
+    fanout->share = share;
+}
+
+void opendrop_fanout_set_memory_limit(opendrop_fanout *fanout, size_t bytes) {
+    fanout->memory_limit = bytes;
+}
+
+int opendrop_fanout_init_errno() {
+    return last_fanout_init_error;
+}
+
+int opendrop_fanout_errno(const opendrop_fanout *fanout) {
+    return fanout->last_error;
+}
+
+const char *opendrop_fanout_strerror(int code) {
+    switch (code) {
+        case 1: return "Failed to allocate memory.";
+        case 2: return "Failed to initialize cURL.";
+        case 3: return "Failed to create cURL multi handle.";
+        case 4: return "Failed to build Ask body.";
+        case 5: return "Failed to archive or compress files.";
+        case 6: return "Failed to spill chunks to a temporary file.";
+        case 7: return "Fanout was already sent.";
+        case 8: return "Failed to drive transfers.";
+    }
+
+    return "Unknown error.";
+}
@@ -0,0 +1,112 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "limiter.h"
+
+// Burst used when none is given, in fractions of a second
+#define LIMITER_DEFAULT_BURST_DIVISOR 10
+
+static void limiter_configure(opendrop_client_limiter *limiter, uint64_t rate, uint64_t burst) {
+    limiter->rate = rate;
+    limiter->burst = burst ? burst : rate / LIMITER_DEFAULT_BURST_DIVISOR;
+    if (!limiter->burst) {
+        limiter->burst = 1;
+    }
+}
+
+void opendrop_client_limiter_init(opendrop_client_limiter *limiter, uint64_t rate, uint64_t burst) {
+    memset(limiter, 0, sizeof(opendrop_client_limiter));
+    pthread_mutex_init(&limiter->lock, NULL);
+    limiter_configure(limiter, rate, burst);
+    limiter->tokens = limiter->burst;
+}
+
+void opendrop_client_limiter_destroy(opendrop_client_limiter *limiter) {
+    pthread_mutex_destroy(&limiter->lock);
+}
+
+int opendrop_client_limiter_new(opendrop_client_limiter **limiter, uint64_t bytes_per_second, uint64_t burst) {
+    if (!(*limiter = (opendrop_client_limiter*) malloc(sizeof(opendrop_client_limiter)))) {
+        return 1;
+    }
+
+    opendrop_client_limiter_init(*limiter, bytes_per_second, burst);
+    return 0;
+}
+
+void opendrop_client_limiter_free(opendrop_client_limiter *limiter) {
+    if (limiter) {
+        opendrop_client_limiter_destroy(limiter);
+        free(limiter);
+    }
+}
+
+void opendrop_client_limiter_set_rate(opendrop_client_limiter *limiter, uint64_t bytes_per_second, uint64_t burst) {
+    pthread_mutex_lock(&limiter->lock);
+    limiter_configure(limiter, bytes_per_second, burst);
+    if (limiter->tokens > limiter->burst) {
+        limiter->tokens = limiter->burst;
+    }
+    pthread_mutex_unlock(&limiter->lock);
+}
+
+// Adds the tokens earned since the last refill, caller holds the lock
+static void refill(opendrop_client_limiter *limiter, long long now_ns) {
+    if (limiter->refilled_ns && now_ns > limiter->refilled_ns) {
+        limiter->tokens += (double) (now_ns - limiter->refilled_ns) * limiter->rate / 1e9;
+        if (limiter->tokens > limiter->burst) {
+            limiter->tokens = limiter->burst;
+        }
+    }
+
+    if (now_ns > limiter->refilled_ns) {
+        limiter->refilled_ns = now_ns;
+    }
+}
+
+size_t opendrop_client_limiter_take(opendrop_client_limiter **limiters, size_t limiters_len, size_t want, long long now_ns,
+    long long *wait_ns) {
+    size_t take = want;
+    long long wait = 0;
+
+    // Buckets are looked at one at a time, so a client's own bucket and a shared one never wait on each other
+    for (size_t i = 0; i < limiters_len; i++) {
+        opendrop_client_limiter *limiter = limiters[i];
+        if (!limiter) {
+            continue;
+        }
+
+        pthread_mutex_lock(&limiter->lock);
+        if (limiter->rate) {
+            refill(limiter, now_ns);
+
+            // Waiting for a whole read, or a full bucket when reads are larger, avoids trickling tiny writes
+            double need = want < limiter->burst ? want : limiter->burst;
+            if (limiter->tokens < need) {
+                long long bucket_wait = (long long) ((need - limiter->tokens) * 1e9 / limiter->rate) + 1;
+                wait = bucket_wait > wait ? bucket_wait : wait;
+            } else if (limiter->tokens < take) {
+                take = (size_t) limiter->tokens;
+            }
+        }
+        pthread_mutex_unlock(&limiter->lock);
+    }
+
+    if (wait) {
+        *wait_ns = wait;
+        return 0;
+    }
+
+    for (size_t i = 0; i < limiters_len; i++) {
+        opendrop_client_limiter *limiter = limiters[i];
+        if (limiter) {
+            pthread_mutex_lock(&limiter->lock);
+            if (limiter->rate) {
+                limiter->tokens -= take;
+            }
+            pthread_mutex_unlock(&limiter->lock);
+        }
+    }
+
+    return take;
+}
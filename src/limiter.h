@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "../include/client.h"
+
+// Token bucket, the balance may go negative when clients sharing it race, later takers then wait the debt off
+struct opendrop_client_limiter_s {
+    pthread_mutex_t lock;
+    // Bytes per second, 0 for no limit
+    uint64_t rate;
+    // Most tokens the bucket holds, what may be sent at once after idling
+    uint64_t burst;
+    double tokens;
+    long long refilled_ns;
+};
+
+// Sets up a bucket in place, full so the first burst goes out immediately
+// Args:
+// - limiter: Bucket
+// - rate: Bytes per second, 0 for no limit
+// - burst: Bucket size in bytes, 0 for a tenth of a second's worth
+void opendrop_client_limiter_init(opendrop_client_limiter *limiter, uint64_t rate, uint64_t burst);
+
+// Tears down a bucket set up in place
+// Args:
+// - limiter: Bucket
+void opendrop_client_limiter_destroy(opendrop_client_limiter *limiter);
+
+// Takes up to want bytes from every bucket given, all of them must allow a read before any is charged
+// Args:
+// - limiters: Buckets, NULL entries and unlimited buckets are skipped
+// - limiters_len: Number of buckets
+// - want: Bytes wanted
+// - now_ns: Monotonic time
+// - wait_ns: Time until the read is allowed, set when nothing was taken
+// Returns bytes taken, 0 if the caller should wait
+size_t opendrop_client_limiter_take(opendrop_client_limiter **limiters, size_t limiters_len, size_t want, long long now_ns,
+    long long *wait_ns);
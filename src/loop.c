@@ -0,0 +1,270 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/epoll.h>
+#include <avahi-common/watch.h>
+
+#include "loop_private.h"
+
+// Events read per epoll_wait call in dispatch
+#define LOOP_EVENTS 32
+
+struct AvahiWatch {
+    struct AvahiWatch *next;
+    opendrop_loop *loop;
+    int fd;
+    AvahiWatchEvent events;
+    // Set only while the callback runs
+    AvahiWatchEvent revents;
+    AvahiWatchCallback callback;
+    void *userdata;
+    // Freed watches are unlinked after dispatch, they may still have events in the current batch
+    bool dead;
+};
+
+struct AvahiTimeout {
+    struct AvahiTimeout *next;
+    opendrop_loop *loop;
+    bool enabled;
+    struct timespec expiry;
+    AvahiTimeoutCallback callback;
+    void *userdata;
+    bool dead;
+};
+
+struct opendrop_loop_s {
+    AvahiPoll api;
+    int epoll_fd;
+
+    AvahiWatch *watches;
+    AvahiTimeout *timeouts;
+    bool dead_entries;
+};
+
+static uint32_t to_epoll(AvahiWatchEvent events) {
+    return (events & AVAHI_WATCH_IN ? EPOLLIN : 0) | (events & AVAHI_WATCH_OUT ? EPOLLOUT : 0);
+}
+
+static AvahiWatchEvent from_epoll(uint32_t events) {
+    return (events & EPOLLIN ? AVAHI_WATCH_IN : 0) | (events & EPOLLOUT ? AVAHI_WATCH_OUT : 0) |
+        (events & EPOLLERR ? AVAHI_WATCH_ERR : 0) | (events & EPOLLHUP ? AVAHI_WATCH_HUP : 0);
+}
+
+static AvahiWatch *watch_new(const AvahiPoll *api, int fd, AvahiWatchEvent events, AvahiWatchCallback callback, void *userdata) {
+    opendrop_loop *loop = (opendrop_loop*) api->userdata;
+
+    AvahiWatch *watch = (AvahiWatch*) malloc(sizeof(AvahiWatch));
+    if (!watch) {
+        return NULL;
+    }
+
+    memset(watch, 0, sizeof(AvahiWatch));
+    watch->loop = loop;
+    watch->fd = fd;
+    watch->events = events;
+    watch->callback = callback;
+    watch->userdata = userdata;
+
+    struct epoll_event event = { .events = to_epoll(events), .data.ptr = watch };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
+        free(watch);
+        return NULL;
+    }
+
+    watch->next = loop->watches;
+    loop->watches = watch;
+    return watch;
+}
+
+static void watch_update(AvahiWatch *watch, AvahiWatchEvent events) {
+    watch->events = events;
+    struct epoll_event event = { .events = to_epoll(events), .data.ptr = watch };
+    epoll_ctl(watch->loop->epoll_fd, EPOLL_CTL_MOD, watch->fd, &event);
+}
+
+static AvahiWatchEvent watch_get_events(AvahiWatch *watch) {
+    return watch->revents;
+}
+
+static void watch_free(AvahiWatch *watch) {
+    epoll_ctl(watch->loop->epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+    watch->dead = true;
+    watch->loop->dead_entries = true;
+}
+
+static void set_expiry(AvahiTimeout *timeout, const struct timeval *tv) {
+    if (!(timeout->enabled = tv != NULL)) {
+        return;
+    }
+
+    // Avahi passes absolute wall clock times, they are kept as monotonic deadlines so clock jumps don't matter
+    struct timeval wall;
+    gettimeofday(&wall, NULL);
+    long long usec = (tv->tv_sec - wall.tv_sec) * 1000000LL + (tv->tv_usec - wall.tv_usec);
+
+    clock_gettime(CLOCK_MONOTONIC, &timeout->expiry);
+    if (usec > 0) {
+        usec += timeout->expiry.tv_nsec / 1000;
+        timeout->expiry.tv_sec += usec / 1000000;
+        timeout->expiry.tv_nsec = usec % 1000000 * 1000;
+    }
+}
+
+static AvahiTimeout *timeout_new(const AvahiPoll *api, const struct timeval *tv, AvahiTimeoutCallback callback, void *userdata) {
+    opendrop_loop *loop = (opendrop_loop*) api->userdata;
+
+    AvahiTimeout *timeout = (AvahiTimeout*) malloc(sizeof(AvahiTimeout));
+    if (!timeout) {
+        return NULL;
+    }
+
+    memset(timeout, 0, sizeof(AvahiTimeout));
+    timeout->loop = loop;
+    timeout->callback = callback;
+    timeout->userdata = userdata;
+    set_expiry(timeout, tv);
+
+    timeout->next = loop->timeouts;
+    loop->timeouts = timeout;
+    return timeout;
+}
+
+static void timeout_update(AvahiTimeout *timeout, const struct timeval *tv) {
+    set_expiry(timeout, tv);
+}
+
+static void timeout_free(AvahiTimeout *timeout) {
+    timeout->enabled = false;
+    timeout->dead = true;
+    timeout->loop->dead_entries = true;
+}
+
+int opendrop_loop_new(opendrop_loop **loop) {
+    if (!(*loop = (opendrop_loop*) malloc(sizeof(opendrop_loop)))) {
+        return 1;
+    }
+
+    memset(*loop, 0, sizeof(opendrop_loop));
+
+    if (((*loop)->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        free(*loop);
+        return 1;
+    }
+
+    (*loop)->api.userdata = *loop;
+    (*loop)->api.watch_new = watch_new;
+    (*loop)->api.watch_update = watch_update;
+    (*loop)->api.watch_get_events = watch_get_events;
+    (*loop)->api.watch_free = watch_free;
+    (*loop)->api.timeout_new = timeout_new;
+    (*loop)->api.timeout_update = timeout_update;
+    (*loop)->api.timeout_free = timeout_free;
+
+    return 0;
+}
+
+// Unlinks and frees watches and timeouts freed by Avahi
+static void collect(opendrop_loop *loop, bool all) {
+    for (AvahiWatch **link = &loop->watches; *link;) {
+        if (all || (*link)->dead) {
+            AvahiWatch *watch = *link;
+            *link = watch->next;
+            free(watch);
+        } else {
+            link = &(*link)->next;
+        }
+    }
+
+    for (AvahiTimeout **link = &loop->timeouts; *link;) {
+        if (all || (*link)->dead) {
+            AvahiTimeout *timeout = *link;
+            *link = timeout->next;
+            free(timeout);
+        } else {
+            link = &(*link)->next;
+        }
+    }
+
+    loop->dead_entries = false;
+}
+
+void opendrop_loop_free(opendrop_loop *loop) {
+    if (loop) {
+        collect(loop, true);
+        close(loop->epoll_fd);
+        free(loop);
+    }
+}
+
+const AvahiPoll *opendrop_loop_get_poll(opendrop_loop *loop) {
+    return &loop->api;
+}
+
+int opendrop_loop_fd(const opendrop_loop *loop) {
+    return loop->epoll_fd;
+}
+
+static long long until_ms(const struct timespec *expiry, const struct timespec *now) {
+    return (expiry->tv_sec - now->tv_sec) * 1000LL + (expiry->tv_nsec - now->tv_nsec + 999999) / 1000000;
+}
+
+int opendrop_loop_timeout(const opendrop_loop *loop) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    long long timeout = -1;
+    for (const AvahiTimeout *it = loop->timeouts; it; it = it->next) {
+        if (it->enabled) {
+            long long ms = until_ms(&it->expiry, &now);
+            if (ms <= 0) {
+                return 0;
+            }
+
+            if (timeout < 0 || ms < timeout) {
+                timeout = ms;
+            }
+        }
+    }
+
+    return (int) timeout;
+}
+
+int opendrop_loop_dispatch(opendrop_loop *loop) {
+    struct epoll_event events[LOOP_EVENTS];
+    int events_len = epoll_wait(loop->epoll_fd, events, LOOP_EVENTS, 0);
+    if (events_len < 0 && errno != EINTR) {
+        return 1;
+    }
+
+    for (int i = 0; i < events_len; i++) {
+        AvahiWatch *watch = (AvahiWatch*) events[i].data.ptr;
+        if (watch->dead) {
+            continue;
+        }
+
+        watch->revents = from_epoll(events[i].events);
+        watch->callback(watch, watch->fd, watch->revents, watch->userdata);
+        watch->revents = 0;
+    }
+
+    // Timeouts added by callbacks are put at the head and wait for the next dispatch
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (AvahiTimeout *it = loop->timeouts; it; it = it->next) {
+        if (it->enabled && until_ms(&it->expiry, &now) <= 0) {
+            // Disabled first, the callback usually rearms it
+            it->enabled = false;
+            it->callback(it, it->userdata);
+        }
+    }
+
+    if (loop->dead_entries) {
+        collect(loop, false);
+    }
+
+    return 0;
+}
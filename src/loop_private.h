@@ -0,0 +1,7 @@
+#pragma once
+
+#include <avahi-common/watch.h>
+#include "../include/loop.h"
+
+// Gets the Avahi poll API backed by the loop
+const AvahiPoll *opendrop_loop_get_poll(opendrop_loop *loop);
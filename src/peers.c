@@ -0,0 +1,432 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "peers.h"
+
+// Starting bucket count, doubled whenever the table is three quarters full
+#define PEERS_INITIAL_BUCKETS 64
+
+typedef struct peer_entry_s {
+    struct peer_entry_s *next;
+    uint32_t hash;
+    // Monotonic seconds of the last put
+    time_t seen;
+
+    // Strings point into data
+    opendrop_service service;
+    size_t data_len;
+    char data[];
+} peer_entry;
+
+struct opendrop_peers_s {
+    pthread_mutex_t lock;
+
+    peer_entry **buckets;
+    size_t buckets_len;
+    size_t len;
+
+    unsigned int ttl;
+};
+
+int opendrop_peers_new(opendrop_peers **peers) {
+    if (!(*peers = (opendrop_peers*) malloc(sizeof(opendrop_peers)))) {
+        return 1;
+    }
+
+    memset(*peers, 0, sizeof(opendrop_peers));
+
+    if (!((*peers)->buckets = (peer_entry**) calloc(PEERS_INITIAL_BUCKETS, sizeof(peer_entry*)))) {
+        free(*peers);
+        return 1;
+    }
+
+    (*peers)->buckets_len = PEERS_INITIAL_BUCKETS;
+    pthread_mutex_init(&(*peers)->lock, NULL);
+
+    return 0;
+}
+
+void opendrop_peers_free(opendrop_peers *peers) {
+    if (peers) {
+        for (size_t i = 0; i < peers->buckets_len; i++) {
+            peer_entry *entry = peers->buckets[i];
+            while (entry) {
+                peer_entry *next = entry->next;
+                free(entry);
+                entry = next;
+            }
+        }
+
+        pthread_mutex_destroy(&peers->lock);
+        free(peers->buckets);
+        free(peers);
+    }
+}
+
+void opendrop_peers_set_ttl(opendrop_peers *peers, unsigned int ttl) {
+    pthread_mutex_lock(&peers->lock);
+    peers->ttl = ttl;
+    pthread_mutex_unlock(&peers->lock);
+}
+
+static time_t now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+// FNV-1a over the key, fields separated so ("ab", "c") and ("a", "bc") differ
+static uint32_t key_hash(const char *name, const char *type, const char *domain) {
+    uint32_t hash = 2166136261u;
+    const char *fields[] = { name, type, domain };
+
+    for (int i = 0; i < 3; i++) {
+        for (const unsigned char *c = (const unsigned char*) fields[i]; *c; c++) {
+            hash = (hash ^ *c) * 16777619u;
+        }
+        hash = (hash ^ 0xff) * 16777619u;
+    }
+
+    return hash;
+}
+
+static bool key_equals(const peer_entry *entry, uint32_t hash, const char *name, const char *type, const char *domain) {
+    return entry->hash == hash && !strcmp(entry->service.name, name) && !strcmp(entry->service.type, type) &&
+        !strcmp(entry->service.domain, domain);
+}
+
+static bool expired(const opendrop_peers *peers, const peer_entry *entry, time_t time) {
+    return peers->ttl && time - entry->seen >= peers->ttl;
+}
+
+// Finds the link pointing at the entry with the key, or the empty link ending its bucket
+static peer_entry **find(opendrop_peers *peers, uint32_t hash, const char *name, const char *type, const char *domain) {
+    peer_entry **link = &peers->buckets[hash & (peers->buckets_len - 1)];
+    while (*link && !key_equals(*link, hash, name, type, domain)) {
+        link = &(*link)->next;
+    }
+
+    return link;
+}
+
+static void grow(opendrop_peers *peers) {
+    size_t buckets_len = peers->buckets_len * 2;
+    peer_entry **buckets = (peer_entry**) calloc(buckets_len, sizeof(peer_entry*));
+    // Running with a fuller table is fine if this fails
+    if (!buckets) {
+        return;
+    }
+
+    for (size_t i = 0; i < peers->buckets_len; i++) {
+        peer_entry *entry = peers->buckets[i];
+        while (entry) {
+            peer_entry *next = entry->next;
+            size_t bucket = entry->hash & (buckets_len - 1);
+            entry->next = buckets[bucket];
+            buckets[bucket] = entry;
+            entry = next;
+        }
+    }
+
+    free(peers->buckets);
+    peers->buckets = buckets;
+    peers->buckets_len = buckets_len;
+}
+
+static bool address_equals(const opendrop_address *a, const opendrop_address *b) {
+    return a->family == b->family && a->scope_id == b->scope_id && !memcmp(a->address, b->address, sizeof(a->address));
+}
+
+// Appends the addresses of old missing from service, new addresses come first
+static void merge_addresses(opendrop_service *service, const opendrop_service *old) {
+    static const unsigned char zero[16] = { 0 };
+    if (!memcmp(service->address, zero, sizeof(zero))) {
+        memcpy(service->address, old->address, sizeof(service->address));
+    }
+
+    for (size_t i = 0; i < old->addresses_len && service->addresses_len < OPENDROP_SERVICE_MAX_ADDRESSES; i++) {
+        bool known = false;
+        for (size_t j = 0; j < service->addresses_len && !known; j++) {
+            known = address_equals(&old->addresses[i], &service->addresses[j]);
+        }
+
+        if (!known) {
+            service->addresses[service->addresses_len++] = old->addresses[i];
+        }
+    }
+}
+
+// Whether two copies of a service differ in anything a caller connects with, address order aside
+static bool service_differs(const opendrop_service *a, const opendrop_service *b) {
+    if (a->port != b->port || strcmp(a->host_name, b->host_name) || memcmp(a->address, b->address, sizeof(a->address)) ||
+        a->addresses_len != b->addresses_len) {
+        return true;
+    }
+
+    for (size_t i = 0; i < a->addresses_len; i++) {
+        bool known = false;
+        for (size_t j = 0; j < b->addresses_len && !known; j++) {
+            known = address_equals(&a->addresses[i], &b->addresses[j]);
+        }
+
+        if (!known) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+int opendrop_peers_put(opendrop_peers *peers, const opendrop_service *service, bool *changed) {
+    const char *host_name = service->host_name ? service->host_name : "";
+    size_t name_len = strlen(service->name) + 1, type_len = strlen(service->type) + 1;
+    size_t domain_len = strlen(service->domain) + 1, host_name_len = strlen(host_name) + 1;
+    size_t data_len = name_len + type_len + domain_len + host_name_len;
+
+    peer_entry *entry = (peer_entry*) malloc(sizeof(peer_entry) + data_len);
+    if (!entry) {
+        return 1;
+    }
+
+    entry->service = *service;
+    if (entry->service.addresses_len > OPENDROP_SERVICE_MAX_ADDRESSES) {
+        entry->service.addresses_len = OPENDROP_SERVICE_MAX_ADDRESSES;
+    }
+    entry->data_len = data_len;
+    entry->service.name = memcpy(entry->data, service->name, name_len);
+    entry->service.type = memcpy(entry->data + name_len, service->type, type_len);
+    entry->service.domain = memcpy(entry->data + name_len + type_len, service->domain, domain_len);
+    entry->service.host_name = memcpy(entry->data + name_len + type_len + domain_len, host_name, host_name_len);
+    entry->hash = key_hash(service->name, service->type, service->domain);
+    entry->seen = now();
+
+    pthread_mutex_lock(&peers->lock);
+
+    peer_entry **link = find(peers, entry->hash, service->name, service->type, service->domain);
+    if (*link) {
+        // Replace in place keeping addresses only the old copy knew, unless it expired, the old copy is freed
+        peer_entry *old = *link;
+        if (!expired(peers, old, entry->seen)) {
+            merge_addresses(&entry->service, &old->service);
+        }
+        if (changed) {
+            *changed = service_differs(&entry->service, &old->service);
+        }
+        entry->next = old->next;
+        *link = entry;
+        free(old);
+    } else {
+        entry->next = NULL;
+        *link = entry;
+        if (changed) {
+            *changed = true;
+        }
+        if (++peers->len > peers->buckets_len / 4 * 3) {
+            grow(peers);
+        }
+    }
+
+    pthread_mutex_unlock(&peers->lock);
+
+    return 0;
+}
+
+void opendrop_peers_remove(opendrop_peers *peers, const char *name, const char *type, const char *domain) {
+    uint32_t hash = key_hash(name, type, domain);
+
+    pthread_mutex_lock(&peers->lock);
+
+    peer_entry **link = find(peers, hash, name, type, domain);
+    if (*link) {
+        peer_entry *old = *link;
+        *link = old->next;
+        peers->len--;
+        free(old);
+    }
+
+    pthread_mutex_unlock(&peers->lock);
+}
+
+int opendrop_peers_remove_family(opendrop_peers *peers, const char *name, const char *type, const char *domain, int family) {
+    uint32_t hash = key_hash(name, type, domain);
+    int ret = 2;
+
+    pthread_mutex_lock(&peers->lock);
+
+    peer_entry **link = find(peers, hash, name, type, domain);
+    if (*link) {
+        opendrop_service *service = &(*link)->service;
+        size_t kept = 0;
+        for (size_t i = 0; i < service->addresses_len; i++) {
+            if (service->addresses[i].family != family) {
+                service->addresses[kept++] = service->addresses[i];
+            }
+        }
+        service->addresses_len = kept;
+        if (family == AF_INET6) {
+            memset(service->address, 0, sizeof(service->address));
+        }
+
+        ret = 0;
+        if (!kept) {
+            peer_entry *old = *link;
+            *link = old->next;
+            peers->len--;
+            free(old);
+            ret = 1;
+        }
+    }
+
+    pthread_mutex_unlock(&peers->lock);
+
+    return ret;
+}
+
+// Copies entries into one allocation, the services array followed by their strings
+static opendrop_service *copy_out(peer_entry **entries, size_t entries_len) {
+    size_t size = sizeof(opendrop_service) * entries_len;
+    for (size_t i = 0; i < entries_len; i++) {
+        size += entries[i]->data_len;
+    }
+
+    opendrop_service *services = (opendrop_service*) malloc(size);
+    if (!services) {
+        return NULL;
+    }
+
+    char *data = (char*) (services + entries_len);
+    for (size_t i = 0; i < entries_len; i++) {
+        const peer_entry *entry = entries[i];
+
+        memcpy(data, entry->data, entry->data_len);
+        services[i] = entry->service;
+        services[i].name = data + (entry->service.name - entry->data);
+        services[i].type = data + (entry->service.type - entry->data);
+        services[i].domain = data + (entry->service.domain - entry->data);
+        services[i].host_name = data + (entry->service.host_name - entry->data);
+        data += entry->data_len;
+    }
+
+    return services;
+}
+
+int opendrop_peers_get(opendrop_peers *peers, const char *name, const char *type, const char *domain, opendrop_service **service) {
+    uint32_t hash = key_hash(name, type, domain);
+    int ret = 0;
+    *service = NULL;
+
+    pthread_mutex_lock(&peers->lock);
+
+    peer_entry **link = find(peers, hash, name, type, domain);
+    if (!*link || expired(peers, *link, now())) {
+        ret = 1;
+    } else if (!(*service = copy_out(link, 1))) {
+        ret = 2;
+    }
+
+    pthread_mutex_unlock(&peers->lock);
+
+    return ret;
+}
+
+int opendrop_peers_snapshot(opendrop_peers *peers, opendrop_service **services, size_t *services_len) {
+    *services = NULL;
+    *services_len = 0;
+
+    pthread_mutex_lock(&peers->lock);
+
+    // Expired entries are skipped, they are left for opendrop_peers_expire to report
+    time_t time = now();
+    peer_entry **entries = peers->len ? (peer_entry**) malloc(sizeof(peer_entry*) * peers->len) : NULL;
+    if (peers->len && !entries) {
+        pthread_mutex_unlock(&peers->lock);
+        return 1;
+    }
+
+    size_t entries_len = 0;
+    for (size_t i = 0; i < peers->buckets_len; i++) {
+        for (peer_entry *entry = peers->buckets[i]; entry; entry = entry->next) {
+            if (!expired(peers, entry, time)) {
+                entries[entries_len++] = entry;
+            }
+        }
+    }
+
+    int ret = 0;
+    if (entries_len && !(*services = copy_out(entries, entries_len))) {
+        ret = 1;
+    } else {
+        *services_len = entries_len;
+    }
+
+    pthread_mutex_unlock(&peers->lock);
+    free(entries);
+
+    return ret;
+}
+
+int opendrop_peers_expire(opendrop_peers *peers, opendrop_service **services, size_t *services_len) {
+    *services = NULL;
+    *services_len = 0;
+
+    pthread_mutex_lock(&peers->lock);
+
+    time_t time = now();
+    size_t entries_len = 0;
+    for (size_t i = 0; i < peers->buckets_len; i++) {
+        for (peer_entry *entry = peers->buckets[i]; entry; entry = entry->next) {
+            entries_len += expired(peers, entry, time);
+        }
+    }
+
+    if (!entries_len) {
+        pthread_mutex_unlock(&peers->lock);
+        return 0;
+    }
+
+    // Copied before anything is unlinked, so a failed allocation leaves the table as it was
+    peer_entry **entries = (peer_entry**) malloc(sizeof(peer_entry*) * entries_len);
+    if (!entries) {
+        pthread_mutex_unlock(&peers->lock);
+        return 1;
+    }
+
+    entries_len = 0;
+    for (size_t i = 0; i < peers->buckets_len; i++) {
+        for (peer_entry *entry = peers->buckets[i]; entry; entry = entry->next) {
+            if (expired(peers, entry, time)) {
+                entries[entries_len++] = entry;
+            }
+        }
+    }
+
+    int ret = 0;
+    if (!(*services = copy_out(entries, entries_len))) {
+        ret = 1;
+    } else {
+        *services_len = entries_len;
+        for (size_t i = 0; i < peers->buckets_len; i++) {
+            peer_entry **link = &peers->buckets[i];
+            while (*link) {
+                if (expired(peers, *link, time)) {
+                    peer_entry *old = *link;
+                    *link = old->next;
+                    peers->len--;
+                    free(old);
+                } else {
+                    link = &(*link)->next;
+                }
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&peers->lock);
+    free(entries);
+
+    return ret;
+}
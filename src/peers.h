@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "../include/browser.h"
+
+typedef struct opendrop_peers_s opendrop_peers;
+
+// Creates a thread-safe table of services keyed by name, type and domain
+// Args:
+// - peers: Peer table
+// Returns 0 on success, >0 on error
+int opendrop_peers_new(opendrop_peers **peers);
+
+// Frees peer table and every service in it
+// Args:
+// - peers: Peer table
+void opendrop_peers_free(opendrop_peers *peers);
+
+// Sets how long services are kept after they were last resolved
+// Expired services are hidden from get and snapshot, and stay in the table until expired or put again
+// Args:
+// - peers: Peer table
+// - ttl: Lifetime in seconds, 0 keeps services until they are removed
+void opendrop_peers_set_ttl(opendrop_peers *peers, unsigned int ttl);
+
+// Inserts a service or replaces the one with the same key, refreshing its lifetime
+// Addresses of the replaced service are kept after the new ones, up to OPENDROP_SERVICE_MAX_ADDRESSES
+// Args:
+// - peers: Peer table
+// - service: Service, strings are copied
+// - changed: Set if the service is new or its host name, port or addresses differ from the stored one, may be NULL
+// Returns 0 on success, >0 if malloc failed
+int opendrop_peers_put(opendrop_peers *peers, const opendrop_service *service, bool *changed);
+
+// Removes a service if present
+// Args:
+// - peers: Peer table
+// - name, type, domain: Service key
+void opendrop_peers_remove(opendrop_peers *peers, const char *name, const char *type, const char *domain);
+
+// Removes the addresses of one family from a service, and the service itself once it has none left
+// Args:
+// - peers: Peer table
+// - name, type, domain: Service key
+// - family: AF_INET or AF_INET6
+// Returns 0 if the service still has addresses, 1 if it was removed, 2 if not found
+int opendrop_peers_remove_family(opendrop_peers *peers, const char *name, const char *type, const char *domain, int family);
+
+// Removes every expired service, so its removal can be reported
+// Args:
+// - peers: Peer table
+// - services: Array of the removed services in one allocation, free with free(), NULL if none expired
+// - services_len: Number of services
+// Returns 0 on success, >0 if malloc failed, nothing is removed then
+int opendrop_peers_expire(opendrop_peers *peers, opendrop_service **services, size_t *services_len);
+
+// Copies a service out of the table
+// Args:
+// - peers: Peer table
+// - name, type, domain: Service key
+// - service: Copy in one allocation, free with free()
+// Returns 0 on success, 1 if not found or expired, 2 if malloc failed
+int opendrop_peers_get(opendrop_peers *peers, const char *name, const char *type, const char *domain, opendrop_service **service);
+
+// Copies every live service out of the table
+// Args:
+// - peers: Peer table
+// - services: Array of copies in one allocation, free with free(), NULL if empty
+// - services_len: Number of services
+// Returns 0 on success, >0 if malloc failed
+int opendrop_peers_snapshot(opendrop_peers *peers, opendrop_service **services, size_t *services_len);
@@ -1 +1,809 @@
-#include "../include/server.h"
\ No newline at end of file
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <plist/plist.h>
+
+#include "../include/server.h"
+#include "config_private.h"
+#include "extract.h"
+
+// Largest request head accepted, also the per-connection read buffer
+#define SERVER_HEAD_MAX (16 * 1024)
+#define SERVER_MAX_CONNECTIONS 256
+#define SERVER_IDLE_TIMEOUT 60
+#define SERVER_MAX_EVENTS 64
+// Guards the chunk size parser against overflow
+#define SERVER_MAX_CHUNK (1ULL << 40)
+
+enum conn_state {
+    CONN_HANDSHAKE,
+    CONN_READ_HEAD,
+    CONN_READ_BODY,
+    CONN_WRITE,
+    CONN_CLOSE
+};
+
+enum conn_endpoint {
+    ENDPOINT_NONE,
+    ENDPOINT_DISCOVER,
+    ENDPOINT_ASK,
+    ENDPOINT_UPLOAD
+};
+
+enum chunk_state {
+    CHUNK_SIZE,
+    CHUNK_EXT,
+    CHUNK_DATA,
+    CHUNK_DATA_END,
+    CHUNK_TRAILER
+};
+
+typedef struct server_conn_s {
+    int fd;
+    SSL *ssl;
+    enum conn_state state;
+    time_t last_active;
+
+    unsigned char in[SERVER_HEAD_MAX];
+    size_t in_len;
+
+    // Current request
+    enum conn_endpoint endpoint;
+    bool keep_alive;
+    bool chunked;
+    enum chunk_state chunk_state;
+    size_t chunk_line_len;
+    unsigned long long body_left;
+
+    // Upload being written to disk, NULL when uploads aren't stored
+    opendrop_extract *extract;
+
+    // Response, points at a buffer owned by the server
+    const char *out;
+    size_t out_len;
+    size_t out_pos;
+
+    struct server_conn_s *prev;
+    struct server_conn_s *next;
+} server_conn;
+
+struct opendrop_server_s {
+    const opendrop_config *config;
+    SSL_CTX *ssl_ctx;
+
+    int listen_fd;
+    int epoll_fd;
+    int wake_fd;
+
+    pthread_t thread;
+    bool thread_started;
+    bool running;
+
+    server_conn *conns;
+    size_t conns_len;
+
+    char *output_directory;
+
+    // Complete HTTP responses, built once at start since they only depend on the config
+    char *discover_response;
+    size_t discover_response_len;
+    char *ask_response;
+    size_t ask_response_len;
+
+    int last_error;
+};
+
+static const char response_ok[] = "HTTP/1.1 200 OK\r\nContent-Length: 0\r\nConnection: keep-alive\r\n\r\n";
+static const char response_bad_request[] = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+static const char response_server_error[] = "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+static const char response_not_found[] = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+static const char response_too_large[] = "HTTP/1.1 431 Request Header Fields Too Large\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+// Distinguish the listening and wakeup descriptors from connections in epoll data
+static char listen_tag;
+static char wake_tag;
+
+int last_server_init_error = 0;
+
+int opendrop_server_new(opendrop_server **server, const opendrop_config *config) {
+    if (!(*server = (opendrop_server*) malloc(sizeof(opendrop_server)))) {
+        last_server_init_error = 1;
+        return 1;
+    }
+
+    memset(*server, 0, sizeof(opendrop_server));
+    (*server)->config = config;
+    (*server)->listen_fd = -1;
+    (*server)->epoll_fd = -1;
+    (*server)->wake_fd = -1;
+
+    if (!((*server)->ssl_ctx = SSL_CTX_new(TLS_server_method()))) {
+        opendrop_server_free(*server);
+        last_server_init_error = 2;
+        return 1;
+    }
+
+    SSL_CTX_set_min_proto_version((*server)->ssl_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_mode((*server)->ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    // Load the identity from the config blobs
+    BIO *cert_bio = BIO_new_mem_buf(config->cert_data->data, config->cert_data->len);
+    BIO *key_bio = BIO_new_mem_buf(config->key_data->data, config->key_data->len);
+    X509 *cert = cert_bio ? PEM_read_bio_X509(cert_bio, NULL, NULL, NULL) : NULL;
+    EVP_PKEY *key = key_bio ? PEM_read_bio_PrivateKey(key_bio, NULL, NULL, OPENDROP_KEY_PASSPHRASE) : NULL;
+
+    int err = 0;
+    if (!(cert && key && SSL_CTX_use_certificate((*server)->ssl_ctx, cert) == 1 &&
+        SSL_CTX_use_PrivateKey((*server)->ssl_ctx, key) == 1 && SSL_CTX_check_private_key((*server)->ssl_ctx) == 1)) {
+        err = 3;
+    }
+
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    BIO_free(cert_bio);
+    BIO_free(key_bio);
+
+    if (err) {
+        opendrop_server_free(*server);
+        last_server_init_error = err;
+        return 1;
+    }
+
+    return 0;
+}
+
+void opendrop_server_free(opendrop_server *server) {
+    if (server) {
+        opendrop_server_stop(server);
+
+        if (server->ssl_ctx) {
+            SSL_CTX_free(server->ssl_ctx);
+        }
+
+        free(server->output_directory);
+        free(server);
+    }
+}
+
+// Serializes a plist and wraps it in a complete HTTP response
+static int build_response(plist_t root, char **response, size_t *response_len) {
+    char *body;
+    uint32_t body_len;
+    if (plist_to_bin(root, &body, &body_len)) {
+        return 1;
+    }
+
+    char head[128];
+    int head_len = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: %u\r\nConnection: keep-alive\r\n\r\n", body_len);
+
+    if (!(*response = (char*) malloc(head_len + body_len))) {
+        plist_mem_free(body);
+        return 1;
+    }
+
+    memcpy(*response, head, head_len);
+    memcpy(*response + head_len, body, body_len);
+    *response_len = head_len + body_len;
+
+    plist_mem_free(body);
+    return 0;
+}
+
+static int build_responses(opendrop_server *server) {
+    const opendrop_config *config = server->config;
+
+    plist_t discover = plist_new_dict();
+    plist_dict_set_item(discover, "ReceiverComputerName", plist_new_string(config->computer_name));
+    plist_dict_set_item(discover, "ReceiverModelName", plist_new_string(config->computer_model));
+    static const char capabilities[] = "{\"Version\":1}";
+    plist_dict_set_item(discover, "ReceiverMediaCapabilities", plist_new_data(capabilities, sizeof(capabilities) - 1));
+    if (config->record_data) {
+        plist_dict_set_item(discover, "ReceiverRecordData", plist_new_data(config->record_data, strlen(config->record_data)));
+    }
+
+    plist_t ask = plist_new_dict();
+    plist_dict_set_item(ask, "ReceiverComputerName", plist_new_string(config->computer_name));
+    plist_dict_set_item(ask, "ReceiverModelName", plist_new_string(config->computer_model));
+
+    int ret = build_response(discover, &server->discover_response, &server->discover_response_len) ||
+        build_response(ask, &server->ask_response, &server->ask_response_len);
+
+    plist_free(discover);
+    plist_free(ask);
+    return ret;
+}
+
+static void conn_close(opendrop_server *server, server_conn *conn) {
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+
+    if (conn->ssl) {
+        SSL_free(conn->ssl);
+    }
+    close(conn->fd);
+
+    opendrop_extract_free(conn->extract);
+
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        server->conns = conn->next;
+    }
+    if (conn->next) {
+        conn->next->prev = conn->prev;
+    }
+
+    server->conns_len--;
+    free(conn);
+}
+
+// Discards a SIGPIPE raised by writing to a connection the peer reset, the loop thread keeps it blocked
+static void drain_sigpipe() {
+    sigset_t pipe_set;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+
+    struct timespec zero = { 0, 0 };
+    while (sigtimedwait(&pipe_set, NULL, &zero) > 0);
+}
+
+static void conn_watch(opendrop_server *server, server_conn *conn, uint32_t events) {
+    struct epoll_event ev = { .events = events, .data.ptr = conn };
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+static void conn_respond(server_conn *conn, const char *response, size_t response_len) {
+    conn->out = response;
+    conn->out_len = response_len;
+    conn->out_pos = 0;
+    conn->state = CONN_WRITE;
+}
+
+static void accept_conns(opendrop_server *server) {
+    while (true) {
+        int fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+
+        server_conn *conn = NULL;
+        if (server->conns_len >= SERVER_MAX_CONNECTIONS || !(conn = (server_conn*) malloc(sizeof(server_conn)))) {
+            close(fd);
+            continue;
+        }
+
+        memset(conn, 0, sizeof(server_conn));
+        conn->fd = fd;
+        conn->state = CONN_HANDSHAKE;
+        conn->last_active = time(NULL);
+
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = conn };
+        if (!(conn->ssl = SSL_new(server->ssl_ctx)) || !SSL_set_fd(conn->ssl, fd) || epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+            if (conn->ssl) {
+                SSL_free(conn->ssl);
+            }
+            close(fd);
+            free(conn);
+            continue;
+        }
+        SSL_set_accept_state(conn->ssl);
+
+        conn->next = server->conns;
+        if (server->conns) {
+            server->conns->prev = conn;
+        }
+        server->conns = conn;
+        server->conns_len++;
+    }
+}
+
+// Parses the request head in conn->in, returns its length or 0 if incomplete
+static size_t parse_head(opendrop_server *server, server_conn *conn) {
+    unsigned char *end = NULL;
+    for (size_t i = 3; i < conn->in_len; i++) {
+        if (!memcmp(conn->in + i - 3, "\r\n\r\n", 4)) {
+            end = conn->in + i + 1;
+            break;
+        }
+    }
+
+    if (!end) {
+        if (conn->in_len == SERVER_HEAD_MAX) {
+            conn_respond(conn, response_too_large, sizeof(response_too_large) - 1);
+            conn->keep_alive = false;
+        }
+        return 0;
+    }
+
+    // Headers are NUL-terminated line by line below, a NUL inside would cut a line short of its CRLF
+    if (memchr(conn->in, 0, end - conn->in)) {
+        conn_respond(conn, response_bad_request, sizeof(response_bad_request) - 1);
+        conn->keep_alive = false;
+        return end - conn->in;
+    }
+
+    end[-1] = 0;
+    char *line = (char*) conn->in;
+    char *next = strstr(line, "\r\n");
+    *next = 0;
+
+    char method[8], path[32], version[16];
+    if (sscanf(line, "%7s %31s %15s", method, path, version) != 3 || strcmp(method, "POST")) {
+        conn_respond(conn, response_bad_request, sizeof(response_bad_request) - 1);
+        conn->keep_alive = false;
+        return end - conn->in;
+    }
+
+    conn->keep_alive = strcmp(version, "HTTP/1.0") != 0;
+    conn->chunked = false;
+    conn->body_left = 0;
+    bool has_length = false;
+
+    while ((line = next + 2) < (char*) end - 1) {
+        if (!(next = strstr(line, "\r\n"))) {
+            next = line + strlen(line);
+        }
+        *next = 0;
+
+        if (!strncasecmp(line, "Content-Length:", 15)) {
+            conn->body_left = strtoull(line + 15, NULL, 10);
+            has_length = true;
+        } else if (!strncasecmp(line, "Transfer-Encoding:", 18) && strcasestr(line + 18, "chunked")) {
+            conn->chunked = true;
+            conn->chunk_state = CHUNK_SIZE;
+        } else if (!strncasecmp(line, "Connection:", 11)) {
+            if (strcasestr(line + 11, "close")) {
+                conn->keep_alive = false;
+            } else if (strcasestr(line + 11, "keep-alive")) {
+                conn->keep_alive = true;
+            }
+        }
+    }
+
+    // Framed both ways the body length is ambiguous, which could smuggle a second request past the first
+    if (has_length && conn->chunked) {
+        conn_respond(conn, response_bad_request, sizeof(response_bad_request) - 1);
+        conn->keep_alive = false;
+        return end - conn->in;
+    }
+
+    if (!strcmp(path, "/Discover")) {
+        conn->endpoint = ENDPOINT_DISCOVER;
+    } else if (!strcmp(path, "/Ask")) {
+        conn->endpoint = ENDPOINT_ASK;
+    } else if (!strcmp(path, "/Upload")) {
+        conn->endpoint = ENDPOINT_UPLOAD;
+
+        if (server->output_directory && opendrop_extract_new(&conn->extract, server->output_directory)) {
+            conn_respond(conn, response_server_error, sizeof(response_server_error) - 1);
+            conn->keep_alive = false;
+            return end - conn->in;
+        }
+    } else {
+        conn->endpoint = ENDPOINT_NONE;
+    }
+
+    conn->state = CONN_READ_BODY;
+    return end - conn->in;
+}
+
+// Passes request body bytes to the endpoint
+static int deliver_body(opendrop_server *server, server_conn *conn, const unsigned char *data, size_t len) {
+    // Discover and Ask bodies only carry sender details the receiver doesn't act on, so they are discarded
+    // without buffering. Uploads are extracted as they arrive.
+    if (conn->extract) {
+        return opendrop_extract_write(conn->extract, data, len);
+    }
+
+    return 0;
+}
+
+// Finishes the current request once its body has been consumed
+static void finish_request(opendrop_server *server, server_conn *conn) {
+    switch (conn->endpoint) {
+    case ENDPOINT_DISCOVER:
+        conn_respond(conn, server->discover_response, server->discover_response_len);
+        break;
+    case ENDPOINT_ASK:
+        conn_respond(conn, server->ask_response, server->ask_response_len);
+        break;
+    case ENDPOINT_UPLOAD:
+        if (conn->extract && opendrop_extract_finish(conn->extract)) {
+            conn_respond(conn, response_bad_request, sizeof(response_bad_request) - 1);
+            conn->keep_alive = false;
+        } else {
+            conn_respond(conn, response_ok, sizeof(response_ok) - 1);
+        }
+
+        opendrop_extract_free(conn->extract);
+        conn->extract = NULL;
+        break;
+    default:
+        conn_respond(conn, response_not_found, sizeof(response_not_found) - 1);
+        conn->keep_alive = false;
+    }
+}
+
+// Consumes body bytes, decoding chunked transfer encoding, returns bytes used or -1 on error
+static ssize_t consume_body(opendrop_server *server, server_conn *conn, const unsigned char *data, size_t len) {
+    size_t pos = 0;
+
+    if (!conn->chunked) {
+        size_t n = conn->body_left < len ? conn->body_left : len;
+        if (n && deliver_body(server, conn, data, n)) {
+            return -1;
+        }
+
+        conn->body_left -= n;
+        if (!conn->body_left) {
+            finish_request(server, conn);
+        }
+        return n;
+    }
+
+    while (pos < len && conn->state == CONN_READ_BODY) {
+        unsigned char c = data[pos];
+
+        switch (conn->chunk_state) {
+        case CHUNK_SIZE:
+            pos++;
+            if (c >= '0' && c <= '9') {
+                conn->body_left = conn->body_left * 16 + (c - '0');
+            } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+                conn->body_left = conn->body_left * 16 + ((c | 0x20) - 'a' + 10);
+            } else if (c == ';' || c == '\r') {
+                conn->chunk_state = CHUNK_EXT;
+            } else if (c == '\n') {
+                conn->chunk_state = conn->body_left ? CHUNK_DATA : CHUNK_TRAILER;
+                conn->chunk_line_len = 0;
+            } else {
+                return -1;
+            }
+
+            if (conn->body_left > SERVER_MAX_CHUNK) {
+                return -1;
+            }
+            break;
+
+        case CHUNK_EXT:
+            pos++;
+            if (c == '\n') {
+                conn->chunk_state = conn->body_left ? CHUNK_DATA : CHUNK_TRAILER;
+                conn->chunk_line_len = 0;
+            }
+            break;
+
+        case CHUNK_DATA: ;
+            size_t n = len - pos < conn->body_left ? len - pos : conn->body_left;
+            if (deliver_body(server, conn, data + pos, n)) {
+                return -1;
+            }
+
+            pos += n;
+            conn->body_left -= n;
+            if (!conn->body_left) {
+                conn->chunk_state = CHUNK_DATA_END;
+            }
+            break;
+
+        case CHUNK_DATA_END:
+            pos++;
+            if (c == '\n') {
+                conn->chunk_state = CHUNK_SIZE;
+            }
+            break;
+
+        case CHUNK_TRAILER:
+            pos++;
+            if (c == '\n') {
+                if (!conn->chunk_line_len) {
+                    finish_request(server, conn);
+                }
+                conn->chunk_line_len = 0;
+            } else if (c != '\r') {
+                conn->chunk_line_len++;
+            }
+            break;
+        }
+    }
+
+    return pos;
+}
+
+// Processes buffered input, returns nonzero if the connection must be closed
+static int process_input(opendrop_server *server, server_conn *conn) {
+    size_t pos = 0;
+
+    while (pos < conn->in_len && (conn->state == CONN_READ_HEAD || conn->state == CONN_READ_BODY)) {
+        if (conn->state == CONN_READ_HEAD) {
+            // parse_head expects the head at the start of the buffer
+            if (pos) {
+                memmove(conn->in, conn->in + pos, conn->in_len - pos);
+                conn->in_len -= pos;
+                pos = 0;
+            }
+
+            size_t head_len = parse_head(server, conn);
+            if (!head_len) {
+                break;
+            }
+            pos = head_len;
+
+            if (conn->state == CONN_READ_BODY && !conn->chunked && !conn->body_left) {
+                finish_request(server, conn);
+            }
+        } else {
+            ssize_t used = consume_body(server, conn, conn->in + pos, conn->in_len - pos);
+            if (used < 0) {
+                // Reject the rest of the request and close once the response is out
+                opendrop_extract_free(conn->extract);
+                conn->extract = NULL;
+                conn_respond(conn, response_bad_request, sizeof(response_bad_request) - 1);
+                conn->keep_alive = false;
+                conn->in_len = 0;
+                return 0;
+            }
+            pos += used;
+        }
+    }
+
+    // Keep unprocessed bytes, such as a pipelined request
+    memmove(conn->in, conn->in + pos, conn->in_len - pos);
+    conn->in_len -= pos;
+    return 0;
+}
+
+// Advances a connection as far as it can go without blocking
+static void conn_handle(opendrop_server *server, server_conn *conn) {
+    conn->last_active = time(NULL);
+
+    while (true) {
+        int ret, err;
+        ERR_clear_error();
+
+        switch (conn->state) {
+        case CONN_HANDSHAKE:
+            if ((ret = SSL_do_handshake(conn->ssl)) == 1) {
+                conn->state = CONN_READ_HEAD;
+                continue;
+            }
+            break;
+
+        case CONN_READ_HEAD:
+        case CONN_READ_BODY:
+            if (conn->in_len == SERVER_HEAD_MAX) {
+                // Only reachable with a full unparseable head, which parse_head already answered
+                conn->state = CONN_CLOSE;
+                continue;
+            }
+
+            if ((ret = SSL_read(conn->ssl, conn->in + conn->in_len, SERVER_HEAD_MAX - conn->in_len)) > 0) {
+                conn->in_len += ret;
+                if (process_input(server, conn)) {
+                    conn->state = CONN_CLOSE;
+                }
+                continue;
+            }
+            break;
+
+        case CONN_WRITE:
+            if ((ret = SSL_write(conn->ssl, conn->out + conn->out_pos, conn->out_len - conn->out_pos)) > 0) {
+                conn->out_pos += ret;
+                if (conn->out_pos == conn->out_len) {
+                    conn->state = conn->keep_alive ? CONN_READ_HEAD : CONN_CLOSE;
+                    if (conn->state == CONN_READ_HEAD && process_input(server, conn)) {
+                        conn->state = CONN_CLOSE;
+                    }
+                }
+                continue;
+            }
+            break;
+
+        case CONN_CLOSE:
+            conn_close(server, conn);
+            return;
+        }
+
+        err = SSL_get_error(conn->ssl, ret);
+        if (err == SSL_ERROR_WANT_READ) {
+            conn_watch(server, conn, EPOLLIN);
+        } else if (err == SSL_ERROR_WANT_WRITE) {
+            conn_watch(server, conn, EPOLLOUT);
+        } else {
+            drain_sigpipe();
+            conn_close(server, conn);
+        }
+        return;
+    }
+}
+
+static void sweep_idle(opendrop_server *server) {
+    time_t now = time(NULL);
+    server_conn *conn = server->conns;
+    while (conn) {
+        server_conn *next = conn->next;
+        if (now - conn->last_active > SERVER_IDLE_TIMEOUT) {
+            conn_close(server, conn);
+        }
+        conn = next;
+    }
+}
+
+static void *server_loop(void *userdata) {
+    opendrop_server *server = (opendrop_server*) userdata;
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    time_t last_sweep = time(NULL);
+
+    // OpenSSL writes to the socket with write(), so a peer resetting mid-response would kill the process
+    sigset_t pipe_set;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, NULL);
+
+    while (true) {
+        int n = epoll_wait(server->epoll_fd, events, SERVER_MAX_EVENTS, 1000);
+        if (n < 0 && errno != EINTR) {
+            server->last_error = 9;
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &wake_tag) {
+                return NULL;
+            } else if (ptr == &listen_tag) {
+                accept_conns(server);
+            } else {
+                conn_handle(server, (server_conn*) ptr);
+            }
+        }
+
+        if (time(NULL) - last_sweep >= 1) {
+            sweep_idle(server);
+            last_sweep = time(NULL);
+        }
+    }
+
+    return NULL;
+}
+
+int opendrop_server_start(opendrop_server *server) {
+    if (server->running) {
+        return 0;
+    }
+
+    if (!server->discover_response && build_responses(server)) {
+        server->last_error = 4;
+        return 1;
+    }
+
+    // Dual-stack socket restricted to the configured interface
+    int off = 0, on = 1;
+    struct sockaddr_in6 addr = {0};
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(server->config->server_port);
+
+    if ((server->listen_fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        server->last_error = 5;
+        goto FAIL;
+    }
+
+    setsockopt(server->listen_fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+    setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    if (setsockopt(server->listen_fd, SOL_SOCKET, SO_BINDTODEVICE, server->config->interface, strlen(server->config->interface))) {
+        server->last_error = 6;
+        goto FAIL;
+    }
+
+    if (bind(server->listen_fd, (struct sockaddr*) &addr, sizeof(addr)) || listen(server->listen_fd, SOMAXCONN)) {
+        server->last_error = 7;
+        goto FAIL;
+    }
+
+    struct epoll_event listen_ev = { .events = EPOLLIN, .data.ptr = &listen_tag };
+    struct epoll_event wake_ev = { .events = EPOLLIN, .data.ptr = &wake_tag };
+    if ((server->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0 || (server->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->listen_fd, &listen_ev) ||
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->wake_fd, &wake_ev)) {
+        server->last_error = 8;
+        goto FAIL;
+    }
+
+    if (pthread_create(&server->thread, NULL, server_loop, server)) {
+        server->last_error = 8;
+        goto FAIL;
+    }
+    server->thread_started = true;
+
+    server->running = true;
+    return 0;
+
+FAIL:
+    server->running = true;
+    opendrop_server_stop(server);
+    return 1;
+}
+
+void opendrop_server_stop(opendrop_server *server) {
+    if (!server->running) {
+        return;
+    }
+
+    if (server->thread_started) {
+        uint64_t one = 1;
+        write(server->wake_fd, &one, sizeof(one));
+        pthread_join(server->thread, NULL);
+        server->thread_started = false;
+    }
+
+    while (server->conns) {
+        conn_close(server, server->conns);
+    }
+
+    if (server->wake_fd >= 0) {
+        close(server->wake_fd);
+    }
+    if (server->epoll_fd >= 0) {
+        close(server->epoll_fd);
+    }
+    if (server->listen_fd >= 0) {
+        close(server->listen_fd);
+    }
+
+    server->wake_fd = server->epoll_fd = server->listen_fd = -1;
+    server->running = false;
+
+    free(server->discover_response);
+    free(server->ask_response);
+    server->discover_response = server->ask_response = NULL;
+}
+
+int opendrop_server_set_output_directory(opendrop_server *server, const char *directory) {
+    if (!(server->output_directory = (char*) realloc(server->output_directory, strlen(directory) + 1))) {
+        return 1;
+    }
+
+    strcpy(server->output_directory, directory);
+    return 0;
+}
+
+int opendrop_server_init_errno() {
+    return last_server_init_error;
+}
+
+int opendrop_server_errno(const opendrop_server *server) {
+    return server->last_error;
+}
+
+const char *opendrop_server_strerror(int code) {
+    switch (code) {
+    case 1: return "Failed to allocate server.";
+    case 2: return "Failed to create TLS context.";
+    case 3: return "Failed to load certificate or key from config.";
+    case 4: return "Failed to build responses.";
+    case 5: return "Failed to create socket.";
+    case 6: return "Failed to bind to network interface.";
+    case 7: return "Failed to listen on server port.";
+    case 8: return "Failed to start event loop.";
+    case 9: return "Event loop failed.";
+    }
+
+    return "Unknown error.";
+}
@@ -0,0 +1,429 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <curl/curl.h>
+
+#include "../include/sweep.h"
+#include "client_private.h"
+#include "config_private.h"
+#include "bplist.h"
+
+// Receivers that don't answer within this are skipped
+#define SWEEP_TIMEOUT_MS 10000L
+// Connect timeout while the service has further addresses to fall back to
+#define SWEEP_FALLBACK_CONNECT_MS 2000L
+// Discover responses are small, anything larger is treated as a failure
+#define SWEEP_MAX_RESPONSE (64 * 1024)
+
+typedef struct sweep_transfer_s {
+    struct sweep_transfer_s *next;
+    CURL *curl;
+
+    char *name;
+    // Tried in order until one answers
+    opendrop_address addresses[OPENDROP_SERVICE_MAX_ADDRESSES];
+    size_t addresses_len;
+    size_t address_idx;
+    uint16_t port;
+    char url[sizeof("https://:65535/Discover") + OPENDROP_CLIENT_HOST_MAX];
+
+    unsigned char *response;
+    size_t response_len;
+    size_t response_cap;
+} sweep_transfer;
+
+struct opendrop_sweep_s {
+    const opendrop_config *config;
+    opendrop_client_share *share;
+    unsigned int interface_idx;
+
+    CURLM *multi;
+    struct curl_slist *headers;
+    opendrop_bplist_template *template;
+    const unsigned char *body;
+    size_t body_len;
+
+    // Services waiting for a free slot, guarded by lock
+    pthread_mutex_t lock;
+    sweep_transfer *pending;
+    sweep_transfer *pending_tail;
+    bool running;
+
+    // Only touched by the sweep thread
+    sweep_transfer *active;
+    size_t active_len;
+    size_t max_transfers;
+
+    pthread_t thread;
+    bool thread_started;
+
+    opendrop_sweep_found_cb found;
+    void *found_userdata;
+
+    int last_error;
+};
+
+int last_sweep_init_error = 0;
+
+int opendrop_sweep_new(opendrop_sweep **sweep, const opendrop_config *config, size_t max_transfers) {
+    if (opendrop_client_global_init()) {
+        last_sweep_init_error = 2;
+        return 1;
+    }
+
+    if (!(*sweep = (opendrop_sweep*) malloc(sizeof(opendrop_sweep)))) {
+        opendrop_client_global_cleanup();
+        last_sweep_init_error = 1;
+        return 1;
+    }
+
+    memset(*sweep, 0, sizeof(opendrop_sweep));
+    (*sweep)->config = config;
+    (*sweep)->max_transfers = max_transfers ? max_transfers : 1;
+    (*sweep)->interface_idx = if_nametoindex(config->interface);
+    pthread_mutex_init(&(*sweep)->lock, NULL);
+
+    if (!((*sweep)->multi = curl_multi_init())) {
+        opendrop_sweep_free(*sweep);
+        last_sweep_init_error = 3;
+        return 1;
+    }
+
+    // Every receiver gets the same Discover body
+    if (opendrop_bplist_template_new(&(*sweep)->template, config)) {
+        opendrop_sweep_free(*sweep);
+        last_sweep_init_error = 4;
+        return 1;
+    }
+    (*sweep)->body = opendrop_bplist_template_discover((*sweep)->template, &(*sweep)->body_len);
+
+    if (!((*sweep)->headers = append_or_free(generate_default_headers_list(), "Content-Type: application/octet-stream"))) {
+        opendrop_sweep_free(*sweep);
+        last_sweep_init_error = 1;
+        return 1;
+    }
+
+    return 0;
+}
+
+static void transfer_free(sweep_transfer *transfer) {
+    if (transfer->curl) {
+        curl_easy_cleanup(transfer->curl);
+    }
+
+    free(transfer->name);
+    free(transfer->response);
+    free(transfer);
+}
+
+void opendrop_sweep_free(opendrop_sweep *sweep) {
+    if (sweep) {
+        opendrop_sweep_stop(sweep);
+
+        while (sweep->pending) {
+            sweep_transfer *next = sweep->pending->next;
+            transfer_free(sweep->pending);
+            sweep->pending = next;
+        }
+
+        if (sweep->multi) {
+            curl_multi_cleanup(sweep->multi);
+        }
+
+        curl_slist_free_all(sweep->headers);
+        opendrop_bplist_template_free(sweep->template);
+        pthread_mutex_destroy(&sweep->lock);
+        free(sweep);
+
+        opendrop_client_global_cleanup();
+    }
+}
+
+static size_t transfer_write(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    sweep_transfer *transfer = (sweep_transfer*) userdata;
+
+    size_t new_len = transfer->response_len + size * nmemb;
+    if (new_len > SWEEP_MAX_RESPONSE) {
+        return 0;
+    }
+
+    if (new_len > transfer->response_cap) {
+        size_t cap = transfer->response_cap ? transfer->response_cap : 1024;
+        while (cap < new_len) {
+            cap *= 2;
+        }
+
+        unsigned char *response = (unsigned char*) realloc(transfer->response, cap);
+        if (!response) {
+            return 0;
+        }
+
+        transfer->response = response;
+        transfer->response_cap = cap;
+    }
+
+    memcpy(transfer->response + transfer->response_len, ptr, size * nmemb);
+    transfer->response_len = new_len;
+    return size * nmemb;
+}
+
+// Creates the easy handle for a transfer and adds it to the multi handle
+static int transfer_begin(opendrop_sweep *sweep, sweep_transfer *transfer) {
+    const opendrop_address *address = &transfer->addresses[transfer->address_idx];
+    bool last = transfer->address_idx + 1 == transfer->addresses_len;
+    char host[OPENDROP_CLIENT_HOST_MAX];
+    opendrop_client_format_host(address, host);
+    snprintf(transfer->url, sizeof(transfer->url), "https://%s:%u/Discover", host, transfer->port);
+
+    if (!(transfer->curl = curl_easy_init())) {
+        return 1;
+    }
+
+    if (opendrop_client_configure(transfer->curl, sweep->config) ||
+        curl_easy_setopt(transfer->curl, CURLOPT_URL, transfer->url) ||
+        (address->scope_id && curl_easy_setopt(transfer->curl, CURLOPT_ADDRESS_SCOPE, (long) address->scope_id)) ||
+        curl_easy_setopt(transfer->curl, CURLOPT_HTTPHEADER, sweep->headers) ||
+        curl_easy_setopt(transfer->curl, CURLOPT_POSTFIELDSIZE, (long) sweep->body_len) ||
+        curl_easy_setopt(transfer->curl, CURLOPT_POSTFIELDS, sweep->body) ||
+        curl_easy_setopt(transfer->curl, CURLOPT_WRITEFUNCTION, transfer_write) ||
+        curl_easy_setopt(transfer->curl, CURLOPT_WRITEDATA, transfer) ||
+        curl_easy_setopt(transfer->curl, CURLOPT_PRIVATE, transfer) ||
+        curl_easy_setopt(transfer->curl, CURLOPT_TIMEOUT_MS, SWEEP_TIMEOUT_MS) ||
+        (!last && curl_easy_setopt(transfer->curl, CURLOPT_CONNECTTIMEOUT_MS, SWEEP_FALLBACK_CONNECT_MS)) ||
+        (sweep->share && curl_easy_setopt(transfer->curl, CURLOPT_SHARE, sweep->share->share)) ||
+        curl_multi_add_handle(sweep->multi, transfer->curl)) {
+        return 1;
+    }
+
+    return 0;
+}
+
+// Restarts a transfer that got no response with the service's next address, returns 0 if it was restarted
+static int transfer_retry(opendrop_sweep *sweep, sweep_transfer *transfer, CURLcode result) {
+    long status = 0;
+    curl_easy_getinfo(transfer->curl, CURLINFO_RESPONSE_CODE, &status);
+    if (result == CURLE_OK || status || transfer->address_idx + 1 >= transfer->addresses_len) {
+        return 1;
+    }
+
+    curl_multi_remove_handle(sweep->multi, transfer->curl);
+    curl_easy_cleanup(transfer->curl);
+    transfer->curl = NULL;
+    transfer->response_len = 0;
+    transfer->address_idx++;
+
+    // Each address that can't be set up counts as another failure
+    while (transfer_begin(sweep, transfer)) {
+        if (transfer->curl) {
+            curl_easy_cleanup(transfer->curl);
+            transfer->curl = NULL;
+        }
+        if (++transfer->address_idx == transfer->addresses_len) {
+            return 2;
+        }
+    }
+
+    return 0;
+}
+
+// Reports the receiver name if the transfer succeeded, then frees it
+static void transfer_finish(opendrop_sweep *sweep, sweep_transfer *transfer, CURLcode result) {
+    long status = 0;
+    curl_easy_getinfo(transfer->curl, CURLINFO_RESPONSE_CODE, &status);
+    curl_multi_remove_handle(sweep->multi, transfer->curl);
+
+    opendrop_bplist_value value;
+    size_t name_len;
+    if (result == CURLE_OK && status == 200 && sweep->found &&
+        !opendrop_bplist_dict_get(transfer->response, transfer->response_len, "ReceiverComputerName", &value) &&
+        !opendrop_bplist_get_string(&value, NULL, 0, &name_len)) {
+        char *receiver_name = (char*) malloc(name_len + 1);
+        if (receiver_name) {
+            opendrop_bplist_get_string(&value, receiver_name, name_len + 1, &name_len);
+            (*sweep->found)(sweep, transfer->name, receiver_name, sweep->found_userdata);
+        }
+        free(receiver_name);
+    }
+
+    transfer_free(transfer);
+}
+
+static void *sweep_run(void *userdata) {
+    opendrop_sweep *sweep = (opendrop_sweep*) userdata;
+
+    pthread_mutex_lock(&sweep->lock);
+    while (sweep->running) {
+        // Fill free slots from the queue
+        while (sweep->pending && sweep->active_len < sweep->max_transfers) {
+            sweep_transfer *transfer = sweep->pending;
+            if (!(sweep->pending = transfer->next)) {
+                sweep->pending_tail = NULL;
+            }
+
+            if (transfer_begin(sweep, transfer)) {
+                transfer_free(transfer);
+                continue;
+            }
+
+            transfer->next = sweep->active;
+            sweep->active = transfer;
+            sweep->active_len++;
+        }
+        pthread_mutex_unlock(&sweep->lock);
+
+        int running;
+        curl_multi_perform(sweep->multi, &running);
+
+        CURLMsg *msg;
+        int left;
+        while ((msg = curl_multi_info_read(sweep->multi, &left))) {
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+
+            sweep_transfer *transfer;
+            CURLcode result = msg->data.result;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**) &transfer);
+
+            int retry = transfer_retry(sweep, transfer, result);
+            if (!retry) {
+                continue;
+            }
+
+            for (sweep_transfer **it = &sweep->active; *it; it = &(*it)->next) {
+                if (*it == transfer) {
+                    *it = transfer->next;
+                    break;
+                }
+            }
+            sweep->active_len--;
+
+            if (retry == 2) {
+                transfer_free(transfer);
+            } else {
+                transfer_finish(sweep, transfer, result);
+            }
+        }
+
+        // Woken early by new services or stop
+        curl_multi_poll(sweep->multi, NULL, 0, 1000, NULL);
+        pthread_mutex_lock(&sweep->lock);
+    }
+    pthread_mutex_unlock(&sweep->lock);
+
+    // Requests in flight are abandoned
+    while (sweep->active) {
+        sweep_transfer *next = sweep->active->next;
+        curl_multi_remove_handle(sweep->multi, sweep->active->curl);
+        transfer_free(sweep->active);
+        sweep->active = next;
+    }
+    sweep->active_len = 0;
+
+    return NULL;
+}
+
+int opendrop_sweep_start(opendrop_sweep *sweep) {
+    if (sweep->thread_started) {
+        return 0;
+    }
+
+    sweep->running = true;
+    if (pthread_create(&sweep->thread, NULL, sweep_run, sweep)) {
+        sweep->running = false;
+        sweep->last_error = 5;
+        return 1;
+    }
+
+    sweep->thread_started = true;
+    return 0;
+}
+
+void opendrop_sweep_stop(opendrop_sweep *sweep) {
+    if (!sweep->thread_started) {
+        return;
+    }
+
+    pthread_mutex_lock(&sweep->lock);
+    sweep->running = false;
+    pthread_mutex_unlock(&sweep->lock);
+    curl_multi_wakeup(sweep->multi);
+
+    pthread_join(sweep->thread, NULL);
+    sweep->thread_started = false;
+}
+
+int opendrop_sweep_add(opendrop_sweep *sweep, const opendrop_service *service) {
+    sweep_transfer *transfer = (sweep_transfer*) malloc(sizeof(sweep_transfer));
+    if (!transfer) {
+        sweep->last_error = 1;
+        return 1;
+    }
+
+    memset(transfer, 0, sizeof(sweep_transfer));
+    if (!(transfer->name = strdup(service->name))) {
+        free(transfer);
+        sweep->last_error = 1;
+        return 1;
+    }
+
+    // Services filled in by hand may only carry the IPv6 address
+    if (service->addresses_len) {
+        transfer->addresses_len = service->addresses_len < OPENDROP_SERVICE_MAX_ADDRESSES ? service->addresses_len : OPENDROP_SERVICE_MAX_ADDRESSES;
+        memcpy(transfer->addresses, service->addresses, sizeof(opendrop_address) * transfer->addresses_len);
+    } else {
+        transfer->addresses_len = 1;
+        transfer->addresses[0].family = AF_INET6;
+        memcpy(transfer->addresses[0].address, service->address, sizeof(service->address));
+        // Link-local receivers are only reachable through the browsed interface
+        if (service->address[0] == 0xfe && (service->address[1] & 0xc0) == 0x80) {
+            transfer->addresses[0].scope_id = sweep->interface_idx;
+        }
+    }
+    transfer->port = service->port;
+
+    pthread_mutex_lock(&sweep->lock);
+    if (sweep->pending_tail) {
+        sweep->pending_tail->next = transfer;
+    } else {
+        sweep->pending = transfer;
+    }
+    sweep->pending_tail = transfer;
+    pthread_mutex_unlock(&sweep->lock);
+
+    curl_multi_wakeup(sweep->multi);
+    return 0;
+}
+
+void opendrop_sweep_set_found_callback(opendrop_sweep *sweep, opendrop_sweep_found_cb callback, void *userdata) {
+    sweep->found = callback;
+    sweep->found_userdata = userdata;
+}
+
+void opendrop_sweep_set_share(opendrop_sweep *sweep, opendrop_client_share *share) {
+    sweep->share = share;
+}
+
+int opendrop_sweep_init_errno() {
+    return last_sweep_init_error;
+}
+
+int opendrop_sweep_errno(const opendrop_sweep *sweep) {
+    return sweep->last_error;
+}
+
+const char *opendrop_sweep_strerror(int code) {
+    switch (code) {
+        case 1: return "Failed to allocate memory.";
+        case 2: return "Failed to initialize cURL.";
+        case 3: return "Failed to create cURL multi handle.";
+        case 4: return "Failed to build Discover body.";
+        case 5: return "Failed to start sweep thread.";
+    }
+
+    return "Unknown error.";
+}
@@ -0,0 +1,492 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "../include/walker.h"
+
+// Directories with more files than this have them stated by several jobs
+#define WALKER_STAT_BATCH 256
+
+typedef enum walker_kind_e {
+    WALKER_FILE,
+    WALKER_DIR,
+    // Not stated yet, d_type wasn't filled in
+    WALKER_UNKNOWN,
+    // Vanished, or turned out to be neither a file nor a directory
+    WALKER_SKIP
+} walker_kind;
+
+typedef struct walker_node_s {
+    // Path to open and path inside the archive, stored after the node
+    char *path;
+    char *bom_path;
+    // Last component of bom_path
+    char *name;
+    walker_kind kind;
+    uint64_t size;
+
+    // Contents of a directory, sorted by name once listed
+    struct walker_node_s **children;
+    size_t children_len;
+} walker_node;
+
+// Lists a directory when to is 0, otherwise stats its children in [from, to)
+typedef struct walker_job_s {
+    struct walker_job_s *next;
+    walker_node *dir;
+    size_t from;
+    size_t to;
+} walker_job;
+
+struct opendrop_walker_s {
+    walker_node **roots;
+    size_t roots_len;
+
+    // Jobs waiting for a thread, guarded by lock
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    walker_job *jobs;
+    // Jobs waiting or running, the walk is over when it reaches 0
+    size_t pending;
+    int error;
+
+    // Entries in archive order, the top-level ones come first within it
+    opendrop_client_file_data *entries;
+    const opendrop_client_file_data **files;
+    size_t files_len;
+    const opendrop_client_file_data **ask_files;
+    uint64_t bytes;
+};
+
+int last_walker_init_error = 0;
+
+// Creates a node below parent, or a top-level node when parent is NULL
+// Returns 0 on success, 1 if malloc failed, 3 if the path is too long
+static int node_new(walker_node **node, const walker_node *parent, const char *path, const char *name, walker_kind kind) {
+    size_t path_len = parent ? strlen(parent->path) + 1 + strlen(name) : strlen(path);
+    size_t bom_len = (parent ? strlen(parent->bom_path) : 1) + 1 + strlen(name);
+    if (bom_len >= PATH_MAX) {
+        return 3;
+    }
+
+    if (!(*node = (walker_node*) malloc(sizeof(walker_node) + path_len + 1 + bom_len + 1))) {
+        return 1;
+    }
+
+    memset(*node, 0, sizeof(walker_node));
+    (*node)->kind = kind;
+    (*node)->path = (char*) (*node + 1);
+    (*node)->bom_path = (*node)->path + path_len + 1;
+    (*node)->name = (*node)->bom_path + bom_len - strlen(name);
+
+    if (parent) {
+        sprintf((*node)->path, "%s/%s", parent->path, name);
+        sprintf((*node)->bom_path, "%s/%s", parent->bom_path, name);
+    } else {
+        strcpy((*node)->path, path);
+        sprintf((*node)->bom_path, "./%s", name);
+    }
+    return 0;
+}
+
+static void node_free(walker_node *node) {
+    if (node) {
+        for (size_t i = 0; i < node->children_len; i++) {
+            node_free(node->children[i]);
+        }
+
+        free(node->children);
+        free(node);
+    }
+}
+
+static int compare_nodes(const void *a, const void *b) {
+    return strcmp((*(walker_node* const*) a)->name, (*(walker_node* const*) b)->name);
+}
+
+// Queues a job onto a local list, it is handed to the walker once the running job is done
+static int push_job(walker_job **jobs, walker_node *dir, size_t from, size_t to) {
+    walker_job *job = (walker_job*) malloc(sizeof(walker_job));
+    if (!job) {
+        return 1;
+    }
+
+    job->dir = dir;
+    job->from = from;
+    job->to = to;
+    job->next = *jobs;
+    *jobs = job;
+    return 0;
+}
+
+// Reads a directory, queuing jobs for the stats d_type couldn't answer and for its subdirectories
+static int list_dir(walker_node *dir, walker_job **jobs) {
+    DIR *listing = opendir(dir->path);
+    if (!listing) {
+        return 2;
+    }
+
+    int ret = 0;
+    size_t cap = 0;
+    struct dirent *ent;
+    while (!ret && (ent = readdir(listing))) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+            continue;
+        }
+
+        walker_kind kind;
+        if (ent->d_type == DT_REG) {
+            // Still needs its size
+            kind = WALKER_UNKNOWN;
+        } else if (ent->d_type == DT_DIR) {
+            kind = WALKER_DIR;
+        } else if (ent->d_type == DT_UNKNOWN) {
+            kind = WALKER_UNKNOWN;
+        } else {
+            continue;
+        }
+
+        if (dir->children_len == cap) {
+            size_t new_cap = cap ? cap * 2 : 16;
+            walker_node **children = (walker_node**) realloc(dir->children, new_cap * sizeof(walker_node*));
+            if (!children) {
+                ret = 1;
+                break;
+            }
+
+            dir->children = children;
+            cap = new_cap;
+        }
+
+        if (!(ret = node_new(&dir->children[dir->children_len], dir, NULL, ent->d_name, kind))) {
+            dir->children_len++;
+        }
+    }
+    closedir(listing);
+
+    if (ret) {
+        return ret;
+    }
+
+    if (dir->children_len) {
+        qsort(dir->children, dir->children_len, sizeof(walker_node*), compare_nodes);
+    }
+
+    // Subdirectories are listed by any thread, and files are stated in batches so large flat directories spread out too
+    for (size_t i = 0; i < dir->children_len && !ret; i++) {
+        if (dir->children[i]->kind == WALKER_DIR) {
+            ret = push_job(jobs, dir->children[i], 0, 0);
+        }
+    }
+
+    for (size_t i = 0; i < dir->children_len && !ret; i += WALKER_STAT_BATCH) {
+        size_t to = i + WALKER_STAT_BATCH < dir->children_len ? i + WALKER_STAT_BATCH : dir->children_len;
+        for (size_t j = i; j < to; j++) {
+            if (dir->children[j]->kind == WALKER_UNKNOWN) {
+                ret = push_job(jobs, dir, i, to);
+                break;
+            }
+        }
+    }
+
+    return ret;
+}
+
+// Stats a batch of a directory's children, directories found this way are queued for listing
+static int stat_children(walker_node *dir, size_t from, size_t to, walker_job **jobs) {
+    int dir_fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) {
+        return 2;
+    }
+
+    int ret = 0;
+    for (size_t i = from; i < to && !ret; i++) {
+        walker_node *child = dir->children[i];
+        if (child->kind != WALKER_UNKNOWN) {
+            continue;
+        }
+
+        struct stat st;
+        if (fstatat(dir_fd, child->name, &st, AT_SYMLINK_NOFOLLOW)) {
+            child->kind = WALKER_SKIP;
+        } else if (S_ISREG(st.st_mode)) {
+            child->kind = WALKER_FILE;
+            child->size = st.st_size;
+        } else if (S_ISDIR(st.st_mode)) {
+            child->kind = WALKER_DIR;
+            ret = push_job(jobs, child, 0, 0);
+        } else {
+            child->kind = WALKER_SKIP;
+        }
+    }
+
+    close(dir_fd);
+    return ret;
+}
+
+static void *walker_run(void *userdata) {
+    opendrop_walker *walker = (opendrop_walker*) userdata;
+
+    pthread_mutex_lock(&walker->lock);
+    while (true) {
+        while (!walker->jobs && walker->pending && !walker->error) {
+            pthread_cond_wait(&walker->cond, &walker->lock);
+        }
+
+        if (!walker->jobs || walker->error) {
+            break;
+        }
+
+        walker_job *job = walker->jobs;
+        walker->jobs = job->next;
+        pthread_mutex_unlock(&walker->lock);
+
+        walker_job *found = NULL;
+        int err = job->to ? stat_children(job->dir, job->from, job->to, &found) : list_dir(job->dir, &found);
+        free(job);
+
+        pthread_mutex_lock(&walker->lock);
+        while (found) {
+            walker_job *next = found->next;
+            found->next = walker->jobs;
+            walker->jobs = found;
+            walker->pending++;
+            found = next;
+        }
+
+        if (err && !walker->error) {
+            walker->error = err;
+        }
+        walker->pending--;
+        pthread_cond_broadcast(&walker->cond);
+    }
+    pthread_mutex_unlock(&walker->lock);
+
+    return NULL;
+}
+
+// Guesses the uniform type of a file from its extension
+static const char *file_type(const walker_node *node) {
+    static const char *types[][2] = {
+        { "jpg", "public.jpeg" },
+        { "jpeg", "public.jpeg" },
+        { "heic", "public.heic" },
+        { "png", "public.png" },
+        { "gif", "com.compuserve.gif" },
+        { "mov", "com.apple.quicktime-movie" },
+        { "mp4", "public.mpeg-4" },
+        { "txt", "public.plain-text" },
+        { "pdf", "com.adobe.pdf" }
+    };
+
+    if (node->kind == WALKER_DIR) {
+        return "public.folder";
+    }
+
+    const char *extension = strrchr(node->name, '.');
+    for (size_t i = 0; extension && i < sizeof(types) / sizeof(types[0]); i++) {
+        if (!strcasecmp(extension + 1, types[i][0])) {
+            return types[i][1];
+        }
+    }
+    return "public.data";
+}
+
+static size_t count_entries(const walker_node *node) {
+    if (node->kind != WALKER_FILE && node->kind != WALKER_DIR) {
+        return 0;
+    }
+
+    size_t len = 1;
+    for (size_t i = 0; i < node->children_len; i++) {
+        len += count_entries(node->children[i]);
+    }
+    return len;
+}
+
+// Lays a tree out with each directory before its contents
+static void add_entries(opendrop_walker *walker, const walker_node *node) {
+    if (node->kind != WALKER_FILE && node->kind != WALKER_DIR) {
+        return;
+    }
+
+    opendrop_client_file_data *entry = &walker->entries[walker->files_len];
+    walker->files[walker->files_len++] = entry;
+    entry->name = node->name;
+    entry->type = (char*) file_type(node);
+    entry->bom_path = node->bom_path;
+    entry->is_dir = node->kind == WALKER_DIR;
+    entry->source = entry->is_dir ? OPENDROP_CLIENT_SOURCE_MEMORY : OPENDROP_CLIENT_SOURCE_PATH;
+    entry->path = node->path;
+    entry->fd = -1;
+    walker->bytes += node->size;
+
+    for (size_t i = 0; i < node->children_len; i++) {
+        add_entries(walker, node->children[i]);
+    }
+}
+
+// Adds the picked paths, queuing listing jobs for directories
+static int add_roots(opendrop_walker *walker, const char **paths, size_t paths_len) {
+    for (size_t i = 0; i < paths_len; i++) {
+        struct stat st;
+        if (stat(paths[i], &st) || (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))) {
+            return 2;
+        }
+
+        // Trailing slashes don't count towards the last component
+        char name[NAME_MAX + 1];
+        size_t end = strlen(paths[i]);
+        while (end > 1 && paths[i][end - 1] == '/') {
+            end--;
+        }
+        size_t start = end;
+        while (start && paths[i][start - 1] != '/') {
+            start--;
+        }
+        if (end - start > NAME_MAX || end == start || paths[i][start] == '/') {
+            return 2;
+        }
+        memcpy(name, paths[i] + start, end - start);
+        name[end - start] = '\0';
+        if (!strcmp(name, ".") || !strcmp(name, "..")) {
+            return 2;
+        }
+
+        int err;
+        if ((err = node_new(&walker->roots[i], NULL, paths[i], name, S_ISDIR(st.st_mode) ? WALKER_DIR : WALKER_FILE))) {
+            return err;
+        }
+        walker->roots_len++;
+        walker->roots[i]->size = S_ISREG(st.st_mode) ? st.st_size : 0;
+
+        if (S_ISDIR(st.st_mode)) {
+            if (push_job(&walker->jobs, walker->roots[i], 0, 0)) {
+                return 1;
+            }
+            walker->pending++;
+        }
+    }
+
+    return 0;
+}
+
+int opendrop_walker_new(opendrop_walker **walker, const char **paths, size_t paths_len, unsigned int threads) {
+    if (!(*walker = (opendrop_walker*) malloc(sizeof(opendrop_walker)))) {
+        last_walker_init_error = 1;
+        return 1;
+    }
+
+    memset(*walker, 0, sizeof(opendrop_walker));
+    pthread_mutex_init(&(*walker)->lock, NULL);
+    pthread_cond_init(&(*walker)->cond, NULL);
+
+    if (paths_len && !((*walker)->roots = (walker_node**) calloc(paths_len, sizeof(walker_node*)))) {
+        opendrop_walker_free(*walker);
+        last_walker_init_error = 1;
+        return 1;
+    }
+
+    if ((last_walker_init_error = add_roots(*walker, paths, paths_len))) {
+        opendrop_walker_free(*walker);
+        return 1;
+    }
+
+    // The calling thread takes part, threads that fail to start just leave more jobs to the others
+    pthread_t *workers = NULL;
+    size_t workers_len = 0;
+    if (threads > 1 && (workers = (pthread_t*) malloc((threads - 1) * sizeof(pthread_t)))) {
+        while (workers_len < threads - 1 && !pthread_create(&workers[workers_len], NULL, walker_run, *walker)) {
+            workers_len++;
+        }
+    }
+
+    walker_run(*walker);
+    for (size_t i = 0; i < workers_len; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+
+    if ((last_walker_init_error = (*walker)->error)) {
+        opendrop_walker_free(*walker);
+        return 1;
+    }
+
+    size_t len = 0;
+    for (size_t i = 0; i < paths_len; i++) {
+        len += count_entries((*walker)->roots[i]);
+    }
+
+    if (len && (!((*walker)->entries = (opendrop_client_file_data*) calloc(len, sizeof(opendrop_client_file_data))) ||
+        !((*walker)->files = (const opendrop_client_file_data**) malloc(len * sizeof(opendrop_client_file_data*))) ||
+        !((*walker)->ask_files = (const opendrop_client_file_data**) malloc(paths_len * sizeof(opendrop_client_file_data*))))) {
+        opendrop_walker_free(*walker);
+        last_walker_init_error = 1;
+        return 1;
+    }
+
+    for (size_t i = 0; i < paths_len; i++) {
+        (*walker)->ask_files[i] = &(*walker)->entries[(*walker)->files_len];
+        add_entries(*walker, (*walker)->roots[i]);
+    }
+
+    return 0;
+}
+
+void opendrop_walker_free(opendrop_walker *walker) {
+    if (walker) {
+        // Jobs are only left over when the walk failed
+        while (walker->jobs) {
+            walker_job *next = walker->jobs->next;
+            free(walker->jobs);
+            walker->jobs = next;
+        }
+
+        for (size_t i = 0; i < walker->roots_len; i++) {
+            node_free(walker->roots[i]);
+        }
+
+        free(walker->roots);
+        free(walker->entries);
+        free(walker->files);
+        free(walker->ask_files);
+        pthread_cond_destroy(&walker->cond);
+        pthread_mutex_destroy(&walker->lock);
+        free(walker);
+    }
+}
+
+const opendrop_client_file_data **opendrop_walker_get_ask_files(const opendrop_walker *walker, size_t *len) {
+    *len = walker->roots_len;
+    return walker->ask_files;
+}
+
+const opendrop_client_file_data **opendrop_walker_get_files(const opendrop_walker *walker, size_t *len) {
+    *len = walker->files_len;
+    return walker->files;
+}
+
+uint64_t opendrop_walker_get_bytes(const opendrop_walker *walker) {
+    return walker->bytes;
+}
+
+int opendrop_walker_init_errno() {
+    return last_walker_init_error;
+}
+
+const char *opendrop_walker_strerror(int code) {
+    switch (code) {
+        case 1: return "Failed to allocate memory.";
+        case 2: return "Failed to read a file or directory.";
+        case 3: return "Path too long for the archive.";
+    }
+
+    return "Unknown error.";
+}
@@ -1,12 +1,52 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <dirent.h>
+#include <zlib.h>
+#include <curl/curl.h>
+#include <openssl/ssl.h>
+#include <openssl/pem.h>
+#include <openssl/crypto.h>
+#include <plist/plist.h>
 
 #include "../include/browser.h"
 #include "../include/config.h"
+#include "../include/server.h"
+#include "../include/client.h"
+#include "../include/sweep.h"
+#include "../include/fanout.h"
+#include "../include/walker.h"
+#include "../src/config_private.h"
+#include "../src/archive.h"
+#include "../src/deflate.h"
+#include "../src/peers.h"
+#include "../src/loop_private.h"
+#include "../src/event_ring.h"
+#include "../src/bplist.h"
+#include "../src/limiter.h"
 
 int test_browser();
 int test_server();
 int test_config();
+int test_archive();
+int test_client();
+int test_sweep();
+int test_peers();
+int test_loop();
+int test_events();
+int test_bplist();
+int test_allocations();
+int test_limiter();
+int test_fanout();
+int test_cache();
+int test_walker();
 
 int main(int argc, char **argv) {
     if (argc == 1) {
@@ -20,6 +60,30 @@ int main(int argc, char **argv) {
         return test_server();
     } else if (!strcmp(argv[1], "config")) {
         return test_config();
+    } else if (!strcmp(argv[1], "archive")) {
+        return test_archive();
+    } else if (!strcmp(argv[1], "client")) {
+        return test_client();
+    } else if (!strcmp(argv[1], "sweep")) {
+        return test_sweep();
+    } else if (!strcmp(argv[1], "peers")) {
+        return test_peers();
+    } else if (!strcmp(argv[1], "loop")) {
+        return test_loop();
+    } else if (!strcmp(argv[1], "events")) {
+        return test_events();
+    } else if (!strcmp(argv[1], "bplist")) {
+        return test_bplist();
+    } else if (!strcmp(argv[1], "allocations")) {
+        return test_allocations();
+    } else if (!strcmp(argv[1], "limiter")) {
+        return test_limiter();
+    } else if (!strcmp(argv[1], "fanout")) {
+        return test_fanout();
+    } else if (!strcmp(argv[1], "cache")) {
+        return test_cache();
+    } else if (!strcmp(argv[1], "walker")) {
+        return test_walker();
     }
 
     return 2;
@@ -69,10 +133,867 @@ int test_browser() {
 SERVER TESTING
 */
 
+size_t server_test_write(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    size_t *received = (size_t*) userdata;
+    if (!*received && (size * nmemb < 8 || memcmp(ptr, "bplist00", 8))) {
+        return 0;
+    }
+
+    *received += size * nmemb;
+    return size * nmemb;
+}
+
+// Posts a body to the local server, returns the HTTP status
+long server_test_post(CURL *curl, const char *url, const char *body, size_t body_len, bool chunked, size_t *received) {
+    struct curl_slist *headers = NULL;
+    if (chunked) {
+        headers = curl_slist_append(headers, "Transfer-Encoding: chunked");
+    }
+
+    long status = 0;
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long) body_len);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, server_test_write);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, received);
+    if (curl_easy_perform(curl) == CURLE_OK) {
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    }
+
+    curl_slist_free_all(headers);
+    return status;
+}
+
+// Sends a raw request head over TLS to the local server
+// Returns whether the reply starts with the status line, or resets the connection without reading when status is NULL
+bool server_test_raw(int port, const char *head, size_t head_len, const char *status) {
+    struct sockaddr_in6 addr = { 0 };
+    addr.sin6_family = AF_INET6;
+    addr.sin6_port = htons(port);
+    addr.sin6_addr = in6addr_loopback;
+
+    int fd = socket(AF_INET6, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    SSL *ssl = SSL_new(ctx);
+    SSL_set_fd(ssl, fd);
+
+    char reply[128] = { 0 };
+    bool matched = SSL_connect(ssl) == 1 && SSL_write(ssl, head, head_len) == (int) head_len;
+    if (status) {
+        matched = matched && SSL_read(ssl, reply, sizeof(reply) - 1) > 0 && !strncmp(reply, status, strlen(status));
+    } else {
+        struct linger linger = { 1, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    }
+
+    SSL_free(ssl);
+    SSL_CTX_free(ctx);
+    close(fd);
+    return matched;
+}
+
 int test_server() {
+    opendrop_config *config;
+    unsigned char array[13] = {0x48, 0x65, 0x6C, 0x6C, 0x6F, 0x2C, 0x20, 0x57, 0x6F, 0x72, 0x6C, 0x64, 0x21};
+    if (opendrop_config_new(&config, array, 13)) {
+        printf("CONFIG ERROR %i: %s", opendrop_config_init_errno(), opendrop_config_strerror(opendrop_config_init_errno()));
+        return 1;
+    }
+
+    opendrop_config_set_interface(config, "lo");
+    opendrop_config_set_server_port(config, 18771);
+
+    opendrop_server *server;
+    if (opendrop_server_new(&server, config)) {
+        printf("CREATE ERROR %i: %s", opendrop_server_init_errno(), opendrop_server_strerror(opendrop_server_init_errno()));
+        return 1;
+    }
+
+    char output[] = "/tmp/opendrop-test-XXXXXX";
+    if (!mkdtemp(output) || opendrop_server_set_output_directory(server, output)) {
+        printf("OUTPUT DIRECTORY ERROR");
+        return 1;
+    }
+
+    // Compressed archive of a nested file, plus an entry trying to escape the output directory
+    unsigned char hello[] = "Hello, World!";
+    opendrop_client_file_data file = { "hello.txt", "public.plain-text", "./dir/hello.txt", false, hello, sizeof(hello) - 1 };
+    opendrop_client_file_data escape = { "escape.txt", "public.plain-text", "../escape.txt", false, hello, sizeof(hello) - 1 };
+    const opendrop_client_file_data *files[] = { &file, &escape };
+    char upload[1024], bad_upload[1024];
+    size_t upload_len, bad_upload_len;
+    opendrop_archive *archive;
+    opendrop_deflate *stream;
+    opendrop_archive_new(&archive, files, 1);
+    opendrop_deflate_new(&stream, archive, 1);
+    opendrop_deflate_read(stream, (unsigned char*) upload, sizeof(upload), &upload_len);
+    opendrop_deflate_free(stream);
+    opendrop_archive_free(archive);
+    opendrop_archive_new(&archive, files, 2);
+    opendrop_deflate_new(&stream, archive, 1);
+    opendrop_deflate_read(stream, (unsigned char*) bad_upload, sizeof(bad_upload), &bad_upload_len);
+    opendrop_deflate_free(stream);
+    opendrop_archive_free(archive);
+
+    if (opendrop_server_start(server)) {
+        printf("START ERROR %i: %s", opendrop_server_errno(server), opendrop_server_strerror(opendrop_server_errno(server)));
+        return 1;
+    }
+
+    // One keep-alive connection serves all requests
+    CURL *curl = curl_easy_init();
+    size_t discover_len = 0, ask_len = 0, ignored = 0;
+    int ret = server_test_post(curl, "https://[::1]:18771/Discover", "", 0, false, &discover_len) != 200 || !discover_len ||
+        server_test_post(curl, "https://[::1]:18771/Ask", "ask body", 8, false, &ask_len) != 200 || !ask_len ||
+        server_test_post(curl, "https://[::1]:18771/Upload", upload, upload_len, true, &ignored) != 200 ||
+        server_test_post(curl, "https://[::1]:18771/Upload", "not gzip", 8, true, &ignored) == 200 ||
+        server_test_post(curl, "https://[::1]:18771/Upload", bad_upload, bad_upload_len, false, &ignored) == 200 ||
+        server_test_post(curl, "https://[::1]:18771/Nothing", "", 0, false, &ignored) != 404;
+
+    // A NUL byte in the head is refused rather than cutting its lines short
+    const char nul_line[] = "\0\r\n\r\n", nul_header[] = "POST /Ask HTTP/1.1\r\nHost: a\0b\r\nContent-Length: 0\r\n\r\n";
+    ret |= !server_test_raw(18771, nul_line, sizeof(nul_line) - 1, "HTTP/1.1 400");
+    ret |= !server_test_raw(18771, nul_header, sizeof(nul_header) - 1, "HTTP/1.1 400");
+
+    // Peers resetting while pipelined responses are written must not take the process down with SIGPIPE
+    char pipelined[15000];
+    const char discover[] = "POST /Discover HTTP/1.1\r\nContent-Length: 0\r\n\r\n";
+    size_t pipelined_len = 0;
+    while (pipelined_len + sizeof(discover) - 1 <= sizeof(pipelined)) {
+        memcpy(pipelined + pipelined_len, discover, sizeof(discover) - 1);
+        pipelined_len += sizeof(discover) - 1;
+    }
+    for (int i = 0; i < 10; i++) {
+        server_test_raw(18771, pipelined, pipelined_len, NULL);
+        usleep(50000);
+    }
+
+    // Content-Length together with chunked encoding is refused rather than guessing which one frames the body
+    struct curl_slist *framing = curl_slist_append(curl_slist_append(NULL, "Transfer-Encoding: chunked"), "Content-Length: 3");
+    long status = 0;
+    curl_easy_setopt(curl, CURLOPT_URL, "https://[::1]:18771/Ask");
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, framing);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, "ask body");
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, 8L);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 5L);
+    if (curl_easy_perform(curl) == CURLE_OK) {
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    }
+    ret |= status != 400;
+    curl_slist_free_all(framing);
+    curl_easy_cleanup(curl);
+
+    // The upload must have been written under the output directory, and nothing outside it
+    char path[128], contents[32] = {0};
+    snprintf(path, sizeof(path), "%s/dir/hello.txt", output);
+    FILE *received = fopen(path, "r");
+    if (!received || fread(contents, 1, sizeof(contents), received) != sizeof(hello) - 1 || strcmp(contents, (char*) hello)) {
+        ret = 1;
+    }
+    if (received) {
+        fclose(received);
+        remove(path);
+    }
+
+    snprintf(path, sizeof(path), "%s/../escape.txt", output);
+    if (!access(path, F_OK)) {
+        ret = 1;
+    }
+
+    snprintf(path, sizeof(path), "%s/dir", output);
+    rmdir(path);
+    rmdir(output);
+
+    opendrop_server_free(server);
+    opendrop_config_free(config);
+
+    return ret;
+}
+
+/*
+CLIENT TESTING
+*/
+
+// HTTPS stand-in that answers every request on a fresh connection and counts full handshakes
+typedef struct client_test_receiver_s {
+    SSL_CTX *ctx;
+    int fd;
+    int connections;
+    int full_handshakes;
+} client_test_receiver;
+
+void *client_test_receive(void *userdata) {
+    client_test_receiver *receiver = (client_test_receiver*) userdata;
+
+    for (int i = 0; i < receiver->connections; i++) {
+        int fd = accept(receiver->fd, NULL, NULL);
+        if (fd < 0) {
+            break;
+        }
+
+        SSL *ssl = SSL_new(receiver->ctx);
+        SSL_set_fd(ssl, fd);
+        if (SSL_accept(ssl) == 1) {
+            receiver->full_handshakes += !SSL_session_reused(ssl);
+
+            // Read the head and Content-Length body before answering
+            char buf[4096];
+            size_t len = 0;
+            char *end = NULL;
+            int r;
+            while (!end && len < sizeof(buf) - 1 && (r = SSL_read(ssl, buf + len, sizeof(buf) - 1 - len)) > 0) {
+                len += r;
+                buf[len] = 0;
+                end = strstr(buf, "\r\n\r\n");
+            }
+
+            char *length = strstr(buf, "Content-Length:");
+            long body_left = end && length ? atol(length + 15) - (long) (buf + len - end - 4) : 0;
+            while (body_left > 0 && (r = SSL_read(ssl, buf, sizeof(buf))) > 0) {
+                body_left -= r;
+            }
+
+            const char *response = "HTTP/1.1 200 OK\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            SSL_write(ssl, response, strlen(response));
+            SSL_shutdown(ssl);
+        }
+
+        SSL_free(ssl);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+// Starts the stand-in on 127.0.0.1:18772 with the config's identity, serving the given number of connections
+int client_test_receiver_start(client_test_receiver *receiver, pthread_t *thread, const opendrop_config *config, int connections) {
+    receiver->connections = connections;
+    receiver->full_handshakes = 0;
+    receiver->ctx = SSL_CTX_new(TLS_server_method());
+    // AirDrop receivers speak TLS 1.2
+    SSL_CTX_set_max_proto_version(receiver->ctx, TLS1_2_VERSION);
+
+    BIO *cert_bio = BIO_new_mem_buf(config->cert_data->data, config->cert_data->len);
+    BIO *key_bio = BIO_new_mem_buf(config->key_data->data, config->key_data->len);
+    X509 *cert = PEM_read_bio_X509(cert_bio, NULL, NULL, NULL);
+    EVP_PKEY *key = PEM_read_bio_PrivateKey(key_bio, NULL, NULL, OPENDROP_KEY_PASSPHRASE);
+    SSL_CTX_use_certificate(receiver->ctx, cert);
+    SSL_CTX_use_PrivateKey(receiver->ctx, key);
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    BIO_free(cert_bio);
+    BIO_free(key_bio);
+
+    struct sockaddr_in addr = { 0 };
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(18772);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int one = 1;
+    // Don't hang the test if the client never connects
+    struct timeval timeout = { 10, 0 };
+    receiver->fd = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(receiver->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(receiver->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (bind(receiver->fd, (struct sockaddr*) &addr, sizeof(addr)) || listen(receiver->fd, 8)) {
+        close(receiver->fd);
+        SSL_CTX_free(receiver->ctx);
+        return 1;
+    }
+
+    pthread_create(thread, NULL, client_test_receive, receiver);
     return 0;
 }
 
+// Waits for the stand-in to serve its connections and returns the number of full handshakes
+int client_test_receiver_finish(client_test_receiver *receiver, pthread_t thread) {
+    pthread_join(thread, NULL);
+    close(receiver->fd);
+    SSL_CTX_free(receiver->ctx);
+
+    return receiver->full_handshakes;
+}
+
+// Sends one Ask per new client and returns the number of full handshakes the receiver saw
+// The clients' own stats must agree with the receiver on which handshakes were resumed
+int client_test_count_handshakes(const opendrop_config *config, opendrop_client_share *share, int requests) {
+    client_test_receiver receiver;
+    pthread_t thread;
+    if (client_test_receiver_start(&receiver, &thread, config, requests)) {
+        return -1;
+    }
+
+    opendrop_client_file_data file = { "hello.txt", "public.plain-text", "./hello.txt", false, NULL, 0 };
+    const opendrop_client_file_data *files[] = { &file };
+    int failed = 0, resumed = 0;
+    for (int i = 0; i < requests; i++) {
+        opendrop_client *client;
+        if (opendrop_client_new(&client, "https://127.0.0.1", 18772, config)) {
+            failed = 1;
+            continue;
+        }
+
+        failed |= (share && opendrop_client_set_share(client, share)) || opendrop_client_ask(client, files, 1, false, NULL);
+
+        opendrop_client_stats stats;
+        opendrop_client_get_stats(client, &stats);
+        resumed += stats.last.tls_sessions_resumed;
+        failed |= stats.total.requests != 1 || stats.last.connections_reused || !stats.last.bytes_up ||
+            stats.last.tls_us < stats.last.connect_us || stats.last.total_us < stats.last.tls_us;
+        opendrop_client_free(client);
+    }
+
+    int full_handshakes = client_test_receiver_finish(&receiver, thread);
+    return failed || full_handshakes + resumed != requests ? -1 : full_handshakes;
+}
+
+// Races an unreachable address against the stand-in, then asks over the winner
+// Returns the number of full handshakes, the race and the Ask should need only one
+int client_test_race(const opendrop_config *config) {
+    client_test_receiver receiver;
+    pthread_t thread;
+    if (client_test_receiver_start(&receiver, &thread, config, 2)) {
+        return -1;
+    }
+
+    // TEST-NET-1 never answers
+    opendrop_address addresses[] = { { AF_INET, { 192, 0, 2, 1 } }, { AF_INET, { 127, 0, 0, 1 } } };
+    opendrop_client_file_data file = { "hello.txt", "public.plain-text", "./hello.txt", false, NULL, 0 };
+    const opendrop_client_file_data *files[] = { &file };
+    opendrop_client *client;
+    int failed = 1;
+    if (!opendrop_client_new(&client, "https://receiver.local", 18772, config)) {
+        failed = opendrop_client_connect(client, addresses, 2) || opendrop_client_ask(client, files, 1, false, NULL);
+        opendrop_client_free(client);
+    }
+
+    // Unblock the stand-in if the client never got through
+    if (failed) {
+        shutdown(receiver.fd, SHUT_RDWR);
+    }
+
+    int full_handshakes = client_test_receiver_finish(&receiver, thread);
+    return failed ? -1 : full_handshakes;
+}
+
+int test_client() {
+    opendrop_config *config;
+    unsigned char array[13] = {0x48, 0x65, 0x6C, 0x6C, 0x6F, 0x2C, 0x20, 0x57, 0x6F, 0x72, 0x6C, 0x64, 0x21};
+    if (opendrop_config_new(&config, array, 13)) {
+        printf("CONFIG ERROR %i: %s", opendrop_config_init_errno(), opendrop_config_strerror(opendrop_config_init_errno()));
+        return 1;
+    }
+
+    opendrop_config_set_interface(config, "lo");
+    opendrop_config_set_verify_peer(config, false);
+
+    opendrop_client_share *share;
+    if (opendrop_client_share_new(&share, false)) {
+        printf("SHARE ERROR");
+        return 1;
+    }
+
+    // Without a share every client pays a full handshake, with one only the first does
+    int isolated = client_test_count_handshakes(config, NULL, 3);
+    int shared = client_test_count_handshakes(config, share, 3);
+    int raced = client_test_race(config);
+    printf("full handshakes: isolated=%i shared=%i raced=%i\n", isolated, shared, raced);
+
+    opendrop_client_share_free(share);
+    opendrop_config_free(config);
+
+    return isolated != 3 || shared != 1 || raced != 1;
+}
+
+// Allocations made by the test thread while counting, cURL and OpenSSL allocate around the counter
+static __thread bool alloc_counting = false;
+static size_t alloc_count = 0;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+void *malloc(size_t size) {
+    alloc_count += alloc_counting;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    alloc_count += alloc_counting;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    alloc_count += alloc_counting;
+    return __libc_realloc(ptr, size);
+}
+
+char *alloc_test_strdup(const char *str) {
+    char *copy = (char*) __libc_malloc(strlen(str) + 1);
+    return copy ? strcpy(copy, str) : NULL;
+}
+
+void *alloc_test_crypto_malloc(size_t size, const char *file, int line) {
+    return __libc_malloc(size);
+}
+
+void *alloc_test_crypto_realloc(void *ptr, size_t size, const char *file, int line) {
+    return __libc_realloc(ptr, size);
+}
+
+void alloc_test_crypto_free(void *ptr, const char *file, int line) {
+    __libc_free(ptr);
+}
+
+// Runs Discover, Ask and Upload over one client and counts what repeated rounds allocate
+int test_allocations() {
+    // Must happen before either library allocates anything
+    if (!CRYPTO_set_mem_functions(alloc_test_crypto_malloc, alloc_test_crypto_realloc, alloc_test_crypto_free) ||
+        curl_global_init_mem(CURL_GLOBAL_ALL, __libc_malloc, __libc_free, __libc_realloc, alloc_test_strdup, __libc_calloc)) {
+        printf("ALLOCATOR ERROR");
+        return 1;
+    }
+
+    opendrop_config *config;
+    unsigned char array[13] = {0x48, 0x65, 0x6C, 0x6C, 0x6F, 0x2C, 0x20, 0x57, 0x6F, 0x72, 0x6C, 0x64, 0x21};
+    if (opendrop_config_new(&config, array, 13)) {
+        printf("CONFIG ERROR %i: %s", opendrop_config_init_errno(), opendrop_config_strerror(opendrop_config_init_errno()));
+        return 1;
+    }
+
+    opendrop_config_set_interface(config, "lo");
+    opendrop_config_set_server_port(config, 18774);
+    opendrop_config_set_verify_peer(config, false);
+
+    opendrop_server *server;
+    opendrop_client *client;
+    if (opendrop_server_new(&server, config) || opendrop_server_start(server) ||
+        opendrop_client_new(&client, "https://[::1]", 18774, config)) {
+        printf("SETUP ERROR");
+        return 1;
+    }
+
+    unsigned char hello[] = "Hello, World!";
+    opendrop_client_file_data file = { "hello.txt", "public.plain-text", "./hello.txt", false, hello, sizeof(hello) - 1 };
+    const opendrop_client_file_data *files[] = { &file };
+    char *receiver_name = NULL;
+
+    // The first round builds the template, header lists, buffers and upload pipeline
+    int failed = 0;
+    size_t counted = 0;
+    for (int round = 0; round < 4 && !failed; round++) {
+        alloc_count = 0;
+        alloc_counting = round > 0;
+        failed = opendrop_client_discover(client, &receiver_name) || opendrop_client_ask(client, files, 1, false, NULL) ||
+            opendrop_client_send(client, files, 1);
+        alloc_counting = false;
+        counted += alloc_count;
+    }
+
+    printf("allocations after the first round: %zu\n", counted);
+    failed |= !receiver_name || strcmp(receiver_name, config->computer_name);
+
+    // Later requests reuse the connection and the text compresses, so the archive headers dominate
+    opendrop_client_stats stats;
+    opendrop_client_get_stats(client, &stats);
+    printf("requests: %llu, reused: %llu, last compression ratio: %.2f\n", (unsigned long long) stats.total.requests,
+        (unsigned long long) stats.total.connections_reused, stats.last.compression_ratio);
+    failed |= stats.total.requests != 12 || stats.total.connections_reused != 11 || !stats.last.uncompressed_bytes ||
+        stats.last.compression_ratio <= 0 || stats.last.compression_ratio >= 1 || !stats.total.bytes_down;
+
+    free(receiver_name);
+    opendrop_client_free(client);
+    opendrop_server_free(server);
+    opendrop_config_free(config);
+
+    return failed || counted;
+}
+
+/*
+PEER TABLE TESTING
+*/
+
+// Same FNV-1a as the table, to pick keys landing in one bucket
+uint32_t peers_test_hash(const char *name, const char *type, const char *domain) {
+    uint32_t hash = 2166136261u;
+    const char *fields[] = { name, type, domain };
+    for (int i = 0; i < 3; i++) {
+        for (const unsigned char *c = (const unsigned char*) fields[i]; *c; c++) {
+            hash = (hash ^ *c) * 16777619u;
+        }
+        hash = (hash ^ 0xff) * 16777619u;
+    }
+
+    return hash;
+}
+
+int test_peers() {
+    opendrop_peers *peers;
+    if (opendrop_peers_new(&peers)) {
+        return 1;
+    }
+
+    // Enough services to grow the table a few times
+    char name[32];
+    opendrop_service service = { name, "_airdrop._tcp", "local", "host.local", 8770, { 0 } };
+    for (int i = 0; i < 500; i++) {
+        snprintf(name, sizeof(name), "peer%i", i);
+        service.port = 8770 + i;
+        if (opendrop_peers_put(peers, &service, NULL)) {
+            return 1;
+        }
+    }
+
+    // Replacing keeps one entry per key, removing drops it
+    snprintf(name, sizeof(name), "peer7");
+    service.host_name = "moved.local";
+    service.port = 8777;
+    opendrop_peers_put(peers, &service, NULL);
+    opendrop_peers_remove(peers, "peer8", "_airdrop._tcp", "local");
+
+    int ret = 0;
+    opendrop_service *found;
+    if (opendrop_peers_get(peers, "peer7", "_airdrop._tcp", "local", &found) || strcmp(found->host_name, "moved.local") ||
+        strcmp(found->name, "peer7") || found->port != 8777) {
+        ret = 1;
+    }
+    free(found);
+
+    ret |= opendrop_peers_get(peers, "peer8", "_airdrop._tcp", "local", &found) != 1;
+    ret |= opendrop_peers_get(peers, "peer9", "_other._tcp", "local", &found) != 1;
+
+    opendrop_service *services;
+    size_t services_len;
+    if (opendrop_peers_snapshot(peers, &services, &services_len) || services_len != 499) {
+        ret = 1;
+    } else {
+        // Copies must stay intact once the table changes
+        opendrop_peers_remove(peers, services[0].name, services[0].type, services[0].domain);
+        ret |= strncmp(services[0].name, "peer", 4) || strcmp(services[services_len - 1].domain, "local");
+    }
+    free(services);
+
+    // Addresses resolved over each protocol are merged, newest first
+    opendrop_service dual = { "dual", "_airdrop._tcp", "local", "dual.local", 8770 };
+    dual.addresses_len = 1;
+    dual.addresses[0].family = AF_INET;
+    dual.addresses[0].address[0] = 10;
+    bool changed = false;
+    opendrop_peers_put(peers, &dual, &changed);
+    ret |= !changed;
+    dual.addresses[0].family = AF_INET6;
+    dual.addresses[0].address[0] = dual.address[0] = 0xfe;
+    opendrop_peers_put(peers, &dual, &changed);
+    ret |= !changed;
+
+    // Resolving either protocol again without news is only a refresh, a new port is a change
+    opendrop_peers_put(peers, &dual, &changed);
+    ret |= changed;
+    dual.port = 8771;
+    opendrop_peers_put(peers, &dual, &changed);
+    ret |= !changed;
+    if (opendrop_peers_get(peers, "dual", "_airdrop._tcp", "local", &found) || found->addresses_len != 2 ||
+        found->addresses[0].family != AF_INET6 || found->addresses[1].family != AF_INET || found->address[0] != 0xfe) {
+        ret = 1;
+    }
+    free(found);
+
+    // Losing one protocol keeps the service with the other's addresses, losing both removes it
+    ret |= opendrop_peers_remove_family(peers, "dual", "_airdrop._tcp", "local", AF_INET6) != 0;
+    if (opendrop_peers_get(peers, "dual", "_airdrop._tcp", "local", &found) || found->addresses_len != 1 ||
+        found->addresses[0].family != AF_INET || found->address[0]) {
+        ret = 1;
+    }
+    free(found);
+    ret |= opendrop_peers_remove_family(peers, "dual", "_airdrop._tcp", "local", AF_INET) != 1;
+    ret |= opendrop_peers_remove_family(peers, "dual", "_airdrop._tcp", "local", AF_INET) != 2;
+    ret |= opendrop_peers_get(peers, "dual", "_airdrop._tcp", "local", &found) != 1;
+
+    // An expired entry sharing its bucket with a live one, looked up without a snapshot purging it first
+    opendrop_peers *shared;
+    char live[32];
+    if (opendrop_peers_new(&shared)) {
+        return 1;
+    }
+    opendrop_service stale = { "stale", "_airdrop._tcp", "local", "stale.local", 8770 };
+    opendrop_peers_put(shared, &stale, NULL);
+    opendrop_peers_set_ttl(shared, 1);
+    for (int i = 0; ; i++) {
+        snprintf(live, sizeof(live), "live%i", i);
+        if (!((peers_test_hash(live, "_airdrop._tcp", "local") ^ peers_test_hash("stale", "_airdrop._tcp", "local")) & 63)) {
+            break;
+        }
+    }
+
+    // Everything expires once it hasn't been refreshed within the TTL
+    opendrop_peers_set_ttl(peers, 1);
+    sleep(1);
+
+    opendrop_service fresh = { live, "_airdrop._tcp", "local", "live.local", 8771 };
+    opendrop_peers_put(shared, &fresh, NULL);
+    ret |= opendrop_peers_get(shared, "stale", "_airdrop._tcp", "local", &found) != 1 || found;
+    free(found);
+    if (opendrop_peers_get(shared, live, "_airdrop._tcp", "local", &found) || strcmp(found->name, live)) {
+        ret = 1;
+    }
+    free(found);
+
+    // Expiring hands back only the stale entry, for its removal to be reported
+    if (opendrop_peers_expire(shared, &services, &services_len) || services_len != 1 || strcmp(services[0].name, "stale")) {
+        ret = 1;
+    }
+    free(services);
+    opendrop_peers_free(shared);
+
+    ret |= opendrop_peers_snapshot(peers, &services, &services_len) || services_len != 0;
+    ret |= opendrop_peers_get(peers, "peer7", "_airdrop._tcp", "local", &found) != 1;
+    ret |= opendrop_peers_expire(peers, &services, &services_len) || services_len != 498;
+    free(services);
+    ret |= opendrop_peers_expire(peers, &services, &services_len) || services_len != 0 || services;
+
+    opendrop_peers_free(peers);
+
+    return ret;
+}
+
+/*
+LOOP TESTING
+*/
+
+typedef struct loop_test_state_s {
+    const AvahiPoll *poll;
+    AvahiWatch *watch;
+    int reads;
+    int timeouts;
+} loop_test_state;
+
+void loop_test_watch(AvahiWatch *watch, int fd, AvahiWatchEvent event, void *userdata) {
+    loop_test_state *state = (loop_test_state*) userdata;
+    char c;
+    if (event & AVAHI_WATCH_IN && read(fd, &c, 1) == 1 && state->poll->watch_get_events(watch) & AVAHI_WATCH_IN) {
+        state->reads++;
+    }
+
+    // Avahi frees watches from inside their callbacks
+    if (state->reads == 2) {
+        state->poll->watch_free(watch);
+        state->watch = NULL;
+    }
+}
+
+void loop_test_timeout(AvahiTimeout *timeout, void *userdata) {
+    loop_test_state *state = (loop_test_state*) userdata;
+    state->timeouts++;
+}
+
+int test_loop() {
+    opendrop_loop *loop;
+    if (opendrop_loop_new(&loop)) {
+        return 1;
+    }
+
+    int fds[2];
+    if (pipe(fds)) {
+        return 1;
+    }
+
+    loop_test_state state = { opendrop_loop_get_poll(loop), NULL, 0, 0 };
+    state.watch = state.poll->watch_new(state.poll, fds[0], AVAHI_WATCH_IN, loop_test_watch, &state);
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    tv.tv_usec += 20000;
+    AvahiTimeout *timeout = state.poll->timeout_new(state.poll, &tv, loop_test_timeout, &state);
+    AvahiTimeout *disabled = state.poll->timeout_new(state.poll, NULL, loop_test_timeout, &state);
+
+    int ret = !state.watch || !timeout || !disabled;
+    ret |= opendrop_loop_timeout(loop) <= 0 || opendrop_loop_timeout(loop) > 20;
+
+    // Readiness shows up on the loop fd and is dispatched to the watch
+    struct pollfd pfd = { opendrop_loop_fd(loop), POLLIN };
+    ret |= write(fds[1], "ab", 2) != 2;
+    ret |= poll(&pfd, 1, 1000) != 1 || opendrop_loop_dispatch(loop) || state.reads != 1;
+    ret |= opendrop_loop_dispatch(loop) || state.reads != 2 || state.watch;
+
+    // The timeout fires once, then the loop has nothing left to wait for
+    poll(NULL, 0, opendrop_loop_timeout(loop));
+    ret |= opendrop_loop_dispatch(loop) || state.timeouts != 1 || opendrop_loop_timeout(loop) != -1;
+    ret |= opendrop_loop_dispatch(loop) || state.timeouts != 1;
+
+    state.poll->timeout_free(timeout);
+    state.poll->timeout_free(disabled);
+    opendrop_loop_free(loop);
+    close(fds[0]);
+    close(fds[1]);
+
+    return ret;
+}
+
+/*
+EVENT QUEUE TESTING
+*/
+
+#define EVENTS_TEST_COUNT 200000
+
+void *events_test_produce(void *userdata) {
+    opendrop_event_ring *ring = (opendrop_event_ring*) userdata;
+
+    // Sequence numbers ride in addresses_len
+    for (size_t i = 0; i < EVENTS_TEST_COUNT; i++) {
+        opendrop_service *service = (opendrop_service*) calloc(1, sizeof(opendrop_service));
+        service->addresses_len = i;
+        opendrop_browser_event event = { OPENDROP_BROWSER_EVENT_ADD, 0, service };
+        opendrop_event_ring_push(ring, &event);
+    }
+
+    // The final marker must get through
+    opendrop_browser_event done = { OPENDROP_BROWSER_EVENT_STATUS, OPENDROP_BROWSER_DONE, NULL };
+    while (opendrop_event_ring_push(ring, &done)) {
+        usleep(100);
+    }
+
+    return NULL;
+}
+
+int test_events() {
+    opendrop_event_ring *ring;
+    if (opendrop_event_ring_new(&ring, 1000)) {
+        return 1;
+    }
+
+    pthread_t producer;
+    pthread_create(&producer, NULL, events_test_produce, ring);
+
+    // Drains in batches, events must arrive in order and gaps must be reported as overflows
+    opendrop_browser_event events[64];
+    struct pollfd pfd = { opendrop_event_ring_fd(ring), POLLIN };
+    size_t received = 0, next = 0, overflows = 0;
+    bool done = false, gap = false, ordered = true;
+    while (!done && poll(&pfd, 1, 5000) == 1) {
+        size_t events_len;
+        do {
+            events_len = opendrop_event_ring_poll(ring, events, 64);
+            for (size_t i = 0; i < events_len; i++) {
+                if (events[i].type == OPENDROP_BROWSER_EVENT_ADD) {
+                    ordered &= events[i].service->addresses_len >= next;
+                    gap |= events[i].service->addresses_len != next;
+                    next = events[i].service->addresses_len + 1;
+                    received++;
+                } else if (events[i].type == OPENDROP_BROWSER_EVENT_OVERFLOW) {
+                    overflows++;
+                } else {
+                    done = true;
+                }
+            }
+            opendrop_browser_events_free(events, events_len);
+        } while (events_len == 64);
+    }
+
+    pthread_join(producer, NULL);
+    opendrop_event_ring_free(ring);
+
+    printf("events received=%zu overflows=%zu\n", received, overflows);
+    return !done || !ordered || !received || (gap && !overflows) || (received < EVENTS_TEST_COUNT && !overflows);
+}
+
+/*
+SWEEP TESTING
+*/
+
+typedef struct sweep_test_found_s {
+    pthread_mutex_t lock;
+    int found;
+    bool wrong_name;
+    const char *expected_name;
+} sweep_test_found;
+
+void sweep_test_found_cb(opendrop_sweep *sweep, const char *service_name, const char *receiver_name, void *userdata) {
+    sweep_test_found *found = (sweep_test_found*) userdata;
+    pthread_mutex_lock(&found->lock);
+    found->found++;
+    found->wrong_name |= strcmp(receiver_name, found->expected_name) != 0 || strncmp(service_name, "peer", 4) != 0;
+    pthread_mutex_unlock(&found->lock);
+}
+
+int test_sweep() {
+    opendrop_config *config;
+    unsigned char array[13] = {0x48, 0x65, 0x6C, 0x6C, 0x6F, 0x2C, 0x20, 0x57, 0x6F, 0x72, 0x6C, 0x64, 0x21};
+    if (opendrop_config_new(&config, array, 13)) {
+        printf("CONFIG ERROR %i: %s", opendrop_config_init_errno(), opendrop_config_strerror(opendrop_config_init_errno()));
+        return 1;
+    }
+
+    opendrop_config_set_interface(config, "lo");
+    opendrop_config_set_server_port(config, 18773);
+    opendrop_config_set_verify_peer(config, false);
+
+    opendrop_server *server;
+    if (opendrop_server_new(&server, config) || opendrop_server_start(server)) {
+        printf("SERVER ERROR");
+        return 1;
+    }
+
+    sweep_test_found found = { PTHREAD_MUTEX_INITIALIZER, 0, false, config->computer_name };
+    opendrop_sweep *sweep;
+    if (opendrop_sweep_new(&sweep, config, 2)) {
+        printf("CREATE ERROR %i: %s", opendrop_sweep_init_errno(), opendrop_sweep_strerror(opendrop_sweep_init_errno()));
+        return 1;
+    }
+
+    opendrop_sweep_set_found_callback(sweep, sweep_test_found_cb, &found);
+    if (opendrop_sweep_start(sweep)) {
+        printf("START ERROR %i: %s", opendrop_sweep_errno(sweep), opendrop_sweep_strerror(opendrop_sweep_errno(sweep)));
+        return 1;
+    }
+
+    // More receivers than slots, plus one that refuses connections
+    opendrop_service service = { "peer", "_airdrop._tcp", "local", "localhost", 18773, { 0 } };
+    service.address[15] = 1;
+    char names[3][8];
+    for (int i = 0; i < 3; i++) {
+        snprintf(names[i], sizeof(names[i]), "peer%i", i);
+        service.name = names[i];
+        opendrop_sweep_add(sweep, &service);
+    }
+    // A stale first address falls through to the next one
+    opendrop_service stale = service;
+    stale.name = "peer3";
+    stale.addresses_len = 2;
+    stale.addresses[0].family = AF_INET;
+    memcpy(stale.addresses[0].address, (unsigned char[]) { 192, 0, 2, 1 }, 4);
+    stale.addresses[1].family = AF_INET6;
+    stale.addresses[1].address[15] = 1;
+    opendrop_sweep_add(sweep, &stale);
+
+    service.name = "dead";
+    service.port = 18779;
+    opendrop_sweep_add(sweep, &service);
+
+    int ret = 1;
+    for (int i = 0; i < 100 && ret; i++) {
+        usleep(100 * 1000);
+        pthread_mutex_lock(&found.lock);
+        ret = found.found != 4;
+        pthread_mutex_unlock(&found.lock);
+    }
+
+    opendrop_sweep_free(sweep);
+    opendrop_server_free(server);
+    opendrop_config_free(config);
+
+    return ret || found.wrong_name;
+}
+
 /*
 CONFIG TESTING
 */
@@ -85,7 +1006,931 @@ int test_config() {
         return 1;
     }
 
+    // Identity round trip through a file
+    char path[] = "/tmp/opendrop-identity-XXXXXX";
+    int fd = mkstemp(path);
+    close(fd);
+
+    opendrop_config *loaded;
+    int err;
+    if ((err = opendrop_config_save_identity(config, path)) || opendrop_config_new_from_identity(&loaded, array, 13, path)) {
+        printf("IDENTITY ERROR %i: %s", err ? err : opendrop_config_init_errno(), opendrop_config_strerror(err ? err : opendrop_config_init_errno()));
+        return 1;
+    }
+
+    int ret = strcmp(config->service_id, loaded->service_id) ||
+        config->cert_data->len != loaded->cert_data->len || memcmp(config->cert_data->data, loaded->cert_data->data, config->cert_data->len) ||
+        config->key_data->len != loaded->key_data->len || memcmp(config->key_data->data, loaded->key_data->data, config->key_data->len);
+
+    // A missing identity file is created on first use
+    remove(path);
+    opendrop_config *created;
+    if (opendrop_config_new_from_identity(&created, array, 13, path) || access(path, R_OK)) {
+        printf("IDENTITY CREATE ERROR");
+        return 1;
+    }
+
+    // A certificate that doesn't belong to the stored key is replaced, keeping the service ID
+    FILE *mismatched = fopen(path, "w");
+    fprintf(mismatched, "%s\n", config->service_id);
+    fwrite(config->cert_data->data, 1, config->cert_data->len, mismatched);
+    fwrite(created->key_data->data, 1, created->key_data->len, mismatched);
+    fclose(mismatched);
+
+    opendrop_config *renewed, *reloaded;
+    if (opendrop_config_new_from_identity(&renewed, array, 13, path)) {
+        ret = 1;
+    } else {
+        ret |= strcmp(renewed->service_id, config->service_id) ||
+            (renewed->cert_data->len == config->cert_data->len && !memcmp(renewed->cert_data->data, config->cert_data->data, config->cert_data->len));
+
+        // The replacement was saved, loading again gives it back
+        if (opendrop_config_new_from_identity(&reloaded, array, 13, path)) {
+            ret = 1;
+        } else {
+            ret |= reloaded->cert_data->len != renewed->cert_data->len ||
+                memcmp(reloaded->cert_data->data, renewed->cert_data->data, renewed->cert_data->len);
+            opendrop_config_free(reloaded);
+        }
+        opendrop_config_free(renewed);
+    }
+
+    remove(path);
+    opendrop_config_free(created);
+    opendrop_config_free(loaded);
+
+    // Configs from a pool each get their own identity
+    opendrop_config_pool *pool;
+    if (opendrop_config_pool_new(&pool, 2, 2)) {
+        ret = 1;
+    } else {
+        opendrop_config *first, *second;
+        if (opendrop_config_new_from_pool(&first, array, 13, pool)) {
+            ret = 1;
+        } else {
+            if (opendrop_config_new_from_pool(&second, array, 13, pool)) {
+                ret = 1;
+            } else {
+                ret |= first->key_data->len == second->key_data->len && !memcmp(first->key_data->data, second->key_data->data, first->key_data->len);
+                opendrop_config_free(second);
+            }
+            opendrop_config_free(first);
+        }
+        opendrop_config_pool_free(pool);
+    }
+
     opendrop_config_free(config);
 
-    return 0;
-}
\ No newline at end of file
+    return ret;
+}
+
+/*
+ARCHIVE TESTING
+*/
+
+// Compresses a small tree and checks the inflated cpio entries
+int check_archive(unsigned int threads) {
+    unsigned char hello[] = "Hello, World!";
+    // Large enough to span several staging buffers
+    size_t big_len = 300 * 1024;
+    unsigned char *big = (unsigned char*) malloc(big_len);
+    for (size_t i = 0; i < big_len; i++) {
+        big[i] = (unsigned char) (i * 31 + i / 1024);
+    }
+
+    opendrop_client_file_data dir = { "dir", "public.folder", "./dir", true, NULL, 0 };
+    opendrop_client_file_data small = { "hello.txt", "public.plain-text", "./dir/hello.txt", false, hello, sizeof(hello) - 1 };
+    // Served from a file descriptor rather than memory
+    FILE *big_file = tmpfile();
+    fwrite(big, 1, big_len, big_file);
+    fflush(big_file);
+    opendrop_client_file_data large = { "big.bin", "public.data", "./big.bin", false, NULL, 0, OPENDROP_CLIENT_SOURCE_FD, NULL, fileno(big_file) };
+    const opendrop_client_file_data *files[] = { &dir, &small, &large };
+
+    opendrop_archive *archive;
+    opendrop_deflate *stream;
+    if (opendrop_archive_new(&archive, files, 3) || opendrop_deflate_new(&stream, archive, threads)) {
+        printf("CREATE ERROR");
+        return 1;
+    }
+
+    // Inflate the stream as it is produced, using small reads to exercise resumption
+    size_t out_cap = big_len + 4096, out_len = 0;
+    unsigned char *out = (unsigned char*) malloc(out_cap);
+    z_stream zs = {0};
+    inflateInit2(&zs, 15 + 16);
+
+    unsigned char chunk[1000];
+    size_t read;
+    int ret = Z_OK;
+    do {
+        if (opendrop_deflate_read(stream, chunk, sizeof(chunk), &read)) {
+            printf("READ ERROR");
+            return 1;
+        }
+
+        zs.next_in = chunk;
+        zs.avail_in = read;
+        zs.next_out = out + out_len;
+        zs.avail_out = out_cap - out_len;
+        ret = inflate(&zs, Z_NO_FLUSH);
+        out_len = out_cap - zs.avail_out;
+    } while (read && ret == Z_OK);
+
+    inflateEnd(&zs);
+    opendrop_deflate_free(stream);
+    opendrop_archive_free(archive);
+
+    if (ret != Z_STREAM_END) {
+        printf("INFLATE ERROR %i", ret);
+        return 1;
+    }
+
+    // Walk the odc entries
+    const char *expected[] = { "./dir", "./dir/hello.txt", "./big.bin", "TRAILER!!!" };
+    const unsigned char *expected_data[] = { NULL, hello, big, NULL };
+    size_t pos = 0;
+    for (int i = 0; i < 4; i++) {
+        char field[12];
+        if (pos + 76 > out_len || memcmp(out + pos, "070707", 6)) {
+            printf("BAD HEADER %i", i);
+            return 1;
+        }
+
+        memcpy(field, out + pos + 59, 6);
+        field[6] = 0;
+        size_t name_len = strtoul(field, NULL, 8);
+        memcpy(field, out + pos + 65, 11);
+        field[11] = 0;
+        size_t data_len = strtoul(field, NULL, 8);
+        pos += 76;
+
+        if (strcmp((const char*) out + pos, expected[i])) {
+            printf("BAD NAME %i", i);
+            return 1;
+        }
+        pos += name_len;
+
+        if (expected_data[i] && memcmp(out + pos, expected_data[i], data_len)) {
+            printf("BAD DATA %i", i);
+            return 1;
+        }
+        pos += data_len;
+    }
+
+    free(out);
+    free(big);
+    fclose(big_file);
+
+    return pos == out_len ? 0 : 1;
+}
+
+// Compresses media, dense, text and small files adaptively and checks the levels picked and the inflated archive
+int check_adaptive(unsigned int threads) {
+    size_t len = 200 * 1024;
+    unsigned char *jpeg = (unsigned char*) malloc(len), *text = (unsigned char*) malloc(len);
+    unsigned char *dense = (unsigned char*) malloc(len), *noise = (unsigned char*) malloc(len);
+    srand(1);
+    for (size_t i = 0; i < len; i++) {
+        jpeg[i] = rand();
+        noise[i] = rand();
+        dense[i] = rand() & 0x7f;
+        text[i] = "the quick brown fox jumps over the lazy dog "[i % 44];
+    }
+    memcpy(jpeg, "\xff\xd8\xff\xe0", 4);
+
+    opendrop_client_file_data dir = { "media", "public.folder", "./media", true, NULL, 0 };
+    opendrop_client_file_data photo = { "a.jpg", "public.jpeg", "./media/a.jpg", false, jpeg, len };
+    opendrop_client_file_data tiny = { "b.txt", "public.plain-text", "./media/b.txt", false, text, 100 };
+    opendrop_client_file_data words = { "c.txt", "public.plain-text", "./media/c.txt", false, text, len };
+    opendrop_client_file_data packed = { "d.bin", "public.data", "./media/d.bin", false, dense, len };
+    opendrop_client_file_data random = { "e.bin", "public.data", "./media/e.bin", false, noise, len };
+    const opendrop_client_file_data *files[] = { &dir, &photo, &tiny, &words, &packed, &random };
+
+    // The plain archive to compare against
+    size_t expected_cap = 6 * len, expected_len = 0, read;
+    unsigned char *expected = (unsigned char*) malloc(expected_cap);
+    opendrop_archive *archive;
+    opendrop_deflate *stream;
+    if (opendrop_archive_new(&archive, files, 6)) {
+        printf("CREATE ERROR");
+        return 1;
+    }
+    do {
+        opendrop_archive_read(archive, expected + expected_len, expected_cap - expected_len, &read);
+        expected_len += read;
+    } while (read);
+
+    opendrop_archive_reset(archive, files, 6);
+    opendrop_archive_set_adaptive(archive, true);
+    if (opendrop_deflate_new(&stream, archive, threads)) {
+        printf("CREATE ERROR");
+        return 1;
+    }
+
+    size_t out_len = 0;
+    unsigned char *out = (unsigned char*) malloc(expected_cap);
+    unsigned char chunk[16 * 1024];
+    uint64_t compressed = 0;
+    z_stream zs = {0};
+    inflateInit2(&zs, 15 + 16);
+    int ret = Z_OK;
+    do {
+        if (opendrop_deflate_read(stream, chunk, sizeof(chunk), &read)) {
+            printf("READ ERROR");
+            return 1;
+        }
+
+        compressed += read;
+        zs.next_in = chunk;
+        zs.avail_in = read;
+        zs.next_out = out + out_len;
+        zs.avail_out = expected_cap - out_len;
+        ret = inflate(&zs, Z_NO_FLUSH);
+        out_len = expected_cap - zs.avail_out;
+    } while (read && ret == Z_OK);
+    inflateEnd(&zs);
+
+    // Media and noise are stored, the small file rides along with them, only the text shrinks
+    uint64_t levels[OPENDROP_ARCHIVE_LEVELS], in, sent;
+    opendrop_deflate_level_counts(stream, levels);
+    opendrop_deflate_counts(stream, &in, &sent);
+    printf("adaptive %u: stored %llu, low %llu, high %llu, %llu -> %llu\n", threads, (unsigned long long) levels[0],
+        (unsigned long long) levels[1], (unsigned long long) levels[2], (unsigned long long) in, (unsigned long long) compressed);
+
+    ret = ret != Z_STREAM_END || out_len != expected_len || memcmp(out, expected, expected_len) ||
+        levels[OPENDROP_ARCHIVE_LEVEL_STORED] < 2 * len + 100 || levels[OPENDROP_ARCHIVE_LEVEL_STORED] > 2 * len + 1024 ||
+        levels[OPENDROP_ARCHIVE_LEVEL_LOW] < len || levels[OPENDROP_ARCHIVE_LEVEL_LOW] > len + 1024 ||
+        levels[OPENDROP_ARCHIVE_LEVEL_HIGH] < len || levels[0] + levels[1] + levels[2] != in || in != expected_len ||
+        compressed < 2 * len || compressed > 3 * len;
+
+    opendrop_deflate_free(stream);
+    opendrop_archive_free(archive);
+    free(jpeg);
+    free(text);
+    free(dense);
+    free(noise);
+    free(expected);
+    free(out);
+
+    return ret;
+}
+
+int test_archive() {
+    // Serial and parallel compression must both produce a single valid gzip member, adaptive or not
+    return check_archive(1) || check_archive(4) || check_adaptive(1) || check_adaptive(4);
+}
+/*
+BPLIST TESTING
+*/
+
+// Checks that a dict holds the expected string
+int bplist_check_string(plist_t dict, const char *key, const char *expected) {
+    char *value = NULL;
+    plist_t node = plist_dict_get_item(dict, key);
+    if (node) {
+        plist_get_string_val(node, &value);
+    }
+
+    int ret = !value || strcmp(value, expected);
+    plist_mem_free(value);
+    return ret;
+}
+
+int bplist_check_bool(plist_t dict, const char *key, bool expected) {
+    uint8_t value;
+    plist_t node = plist_dict_get_item(dict, key);
+    if (!node) {
+        return 1;
+    }
+
+    plist_get_bool_val(node, &value);
+    return !value != !expected;
+}
+
+int test_bplist() {
+    // Only the values serialized into bodies are needed
+    opendrop_config config = { 0 };
+    config.computer_name = "Zoë's 💻";
+    config.computer_model = "OpenDrop";
+    strcpy(config.service_id, "a1b2c3");
+    config.record_data = "record";
+
+    opendrop_bplist_template *template;
+    if (opendrop_bplist_template_new(&template, &config)) {
+        return 1;
+    }
+
+    int ret = 0;
+    plist_t root = NULL;
+
+    size_t discover_len;
+    const unsigned char *discover = opendrop_bplist_template_discover(template, &discover_len);
+    plist_from_bin((const char*) discover, discover_len, &root);
+    if (!root || plist_dict_get_size(root) != 1 || bplist_check_string(root, "SenderRecordData", "record")) {
+        printf("BAD DISCOVER");
+        ret = 1;
+    }
+    plist_free(root);
+
+    // Enough files to need two byte object references, with names too long to fit in a marker
+    char names[300][40];
+    opendrop_client_file_data files[300];
+    const opendrop_client_file_data *file_ptrs[300];
+    for (int i = 0; i < 300; i++) {
+        snprintf(names[i], sizeof(names[i]), i % 2 ? "file %i.txt" : "Ünïcode file 🎉 %i.txt", i);
+        files[i] = (opendrop_client_file_data) { names[i], "public.plain-text", names[i], i % 3 == 0 };
+        file_ptrs[i] = &files[i];
+    }
+
+    unsigned char icon_data[1000];
+    memset(icon_data, 0x5A, sizeof(icon_data));
+    opendrop_client_data icon = { icon_data, sizeof(icon_data) };
+
+    // The buffer is reused, the second body must not keep anything from the first
+    opendrop_bplist_buf buf = { 0 };
+    for (int pass = 0; pass < 2 && !ret; pass++) {
+        size_t files_len = pass ? 3 : 300;
+        if (opendrop_bplist_encode_ask(template, &buf, file_ptrs, files_len, false, pass ? NULL : &icon)) {
+            ret = 1;
+            break;
+        }
+
+        plist_from_bin((const char*) buf.data, buf.len, &root);
+        plist_t files_node = root ? plist_dict_get_item(root, "Files") : NULL;
+        if (!files_node || plist_array_get_size(files_node) != files_len || plist_dict_get_size(root) != (pass ? 7 : 8) ||
+            bplist_check_string(root, "SenderComputerName", config.computer_name) ||
+            bplist_check_string(root, "BundleID", "com.apple.finder") ||
+            bplist_check_string(root, "SenderModelName", "OpenDrop") ||
+            bplist_check_string(root, "SenderID", "a1b2c3") ||
+            bplist_check_string(root, "SenderRecordData", "record") ||
+            bplist_check_bool(root, "ConvertMediaFormats", false)) {
+            printf("BAD ASK %i", pass);
+            ret = 1;
+        }
+
+        for (size_t i = 0; !ret && i < files_len; i++) {
+            plist_t file = plist_array_get_item(files_node, i);
+            if (bplist_check_string(file, "FileName", names[i]) || bplist_check_string(file, "FileType", "public.plain-text") ||
+                bplist_check_string(file, "FileBomPath", names[i]) || bplist_check_bool(file, "FileIsDirectory", i % 3 == 0) ||
+                bplist_check_bool(file, "ConvertMediaFormats", false)) {
+                printf("BAD FILE %zu", i);
+                ret = 1;
+            }
+        }
+
+        if (!ret && !pass) {
+            char *data = NULL;
+            uint64_t data_len = 0;
+            plist_t icon_node = plist_dict_get_item(root, "FileIcon");
+            if (icon_node) {
+                plist_get_data_val(icon_node, &data, &data_len);
+            }
+
+            ret = !data || data_len != sizeof(icon_data) || memcmp(data, icon_data, data_len);
+            plist_mem_free(data);
+        }
+
+        plist_free(root);
+    }
+
+    // A URL is sent as the only entry of Files
+    const char *url = "https://example.com/a";
+    opendrop_client_file_data link = { "", "", "", false, (unsigned char*) url, strlen(url) };
+    const opendrop_client_file_data *link_ptr = &link;
+    if (!ret && !opendrop_bplist_encode_ask(template, &buf, &link_ptr, 1, true, NULL)) {
+        plist_from_bin((const char*) buf.data, buf.len, &root);
+        plist_t files_node = root ? plist_dict_get_item(root, "Files") : NULL;
+        char *value = NULL;
+        if (files_node && plist_array_get_size(files_node) == 1) {
+            plist_get_string_val(plist_array_get_item(files_node, 0), &value);
+        }
+
+        ret = !value || strcmp(value, url);
+        plist_mem_free(value);
+        plist_free(root);
+    } else {
+        ret = 1;
+    }
+
+    // Fields are read in place from the encoded body
+    opendrop_bplist_value value;
+    char name[64];
+    size_t name_len;
+    if (!ret && (opendrop_bplist_encode_ask(template, &buf, file_ptrs, 1, false, NULL) ||
+        opendrop_bplist_dict_get(buf.data, buf.len, "SenderComputerName", &value) ||
+        opendrop_bplist_get_string(&value, name, sizeof(name), &name_len) ||
+        strcmp(name, config.computer_name) || name_len != strlen(config.computer_name))) {
+        printf("BAD READ");
+        ret = 1;
+    }
+
+    // Truncation keeps whole code points, the emoji takes four bytes
+    if (!ret && (opendrop_bplist_get_string(&value, name, 9, &name_len) || strcmp(name, "Zoë's ") ||
+        name_len != strlen(config.computer_name))) {
+        printf("BAD TRUNCATE");
+        ret = 1;
+    }
+
+    ret |= opendrop_bplist_dict_get(buf.data, buf.len, "Missing", &value) != 1;
+
+    // Corrupt trailers and offsets are rejected instead of read
+    for (size_t cut = 0; !ret && cut < buf.len; cut += 7) {
+        ret |= opendrop_bplist_dict_get(buf.data, cut, "SenderID", &value) != 2;
+    }
+    buf.data[buf.len - 9] = 0xFF;
+    ret |= opendrop_bplist_dict_get(buf.data, buf.len, "SenderID", &value) != 2;
+
+    // Responses written by libplist with a large record blob
+    plist_t response = plist_new_dict();
+    unsigned char *record = (unsigned char*) malloc(40000);
+    memset(record, 0xA5, 40000);
+    plist_dict_set_item(response, "ReceiverComputerName", plist_new_string("Receiver"));
+    plist_dict_set_item(response, "ReceiverRecordData", plist_new_data((const char*) record, 40000));
+
+    char *response_bin = NULL;
+    uint32_t response_len;
+    if (!ret && (plist_to_bin(response, &response_bin, &response_len) ||
+        opendrop_bplist_dict_get((unsigned char*) response_bin, response_len, "ReceiverRecordData", &value) ||
+        value.len != 40000 || memcmp(value.data, record, 40000) ||
+        opendrop_bplist_dict_get((unsigned char*) response_bin, response_len, "ReceiverComputerName", &value) ||
+        opendrop_bplist_get_string(&value, name, sizeof(name), &name_len) || strcmp(name, "Receiver"))) {
+        printf("BAD RESPONSE");
+        ret = 1;
+    }
+
+    plist_mem_free(response_bin);
+    plist_free(response);
+    free(record);
+
+    opendrop_bplist_buf_free(&buf);
+    opendrop_bplist_template_free(template);
+    return ret;
+}
+
+/*
+LIMITER TESTING
+*/
+
+typedef struct limiter_test_state_s {
+    int events;
+    bool done;
+    // Cancel the client from its first progress event
+    bool cancel;
+    // Set if the last event's compressed size doesn't fit the upload
+    bool mismatch;
+} limiter_test_state;
+
+void limiter_test_progress(opendrop_client *client, const opendrop_client_progress *progress, void *userdata) {
+    limiter_test_state *state = (limiter_test_state*) userdata;
+    state->events++;
+    state->done |= progress->done;
+    if (progress->done) {
+        // The upload is the compressed body plus HTTP chunk framing
+        state->mismatch = !progress->compressed_bytes || progress->compressed_bytes > progress->bytes_sent;
+    }
+    if (state->cancel) {
+        opendrop_client_set_cancelled(client, true);
+    }
+}
+
+double limiter_test_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int test_limiter() {
+    // Bucket math on a fake clock, a full burst goes out at once and the rest follows at the rate
+    opendrop_client_limiter bucket, group;
+    opendrop_client_limiter_init(&bucket, 1000, 500);
+    opendrop_client_limiter_init(&group, 2000, 100);
+    opendrop_client_limiter *limiters[] = { &bucket, NULL };
+    long long wait_ns = 0;
+
+    int ret = opendrop_client_limiter_take(limiters, 2, 800, 1, &wait_ns) != 500;
+    ret |= opendrop_client_limiter_take(limiters, 2, 800, 1, &wait_ns) != 0 || wait_ns < 500000000 || wait_ns > 500000001;
+    ret |= opendrop_client_limiter_take(limiters, 2, 800, 1 + wait_ns, &wait_ns) != 500;
+
+    // A shared bucket caps the read further, both are charged
+    limiters[1] = &group;
+    ret |= opendrop_client_limiter_take(limiters, 2, 800, 2000000000, &wait_ns) != 100;
+    ret |= group.tokens != 0 || bucket.tokens != 400;
+    opendrop_client_limiter_destroy(&bucket);
+    opendrop_client_limiter_destroy(&group);
+    if (ret) {
+        printf("BUCKET ERROR");
+        return 1;
+    }
+
+    opendrop_config *config;
+    unsigned char array[13] = {0x48, 0x65, 0x6C, 0x6C, 0x6F, 0x2C, 0x20, 0x57, 0x6F, 0x72, 0x6C, 0x64, 0x21};
+    if (opendrop_config_new(&config, array, 13)) {
+        printf("CONFIG ERROR %i: %s", opendrop_config_init_errno(), opendrop_config_strerror(opendrop_config_init_errno()));
+        return 1;
+    }
+
+    opendrop_config_set_interface(config, "lo");
+    opendrop_config_set_server_port(config, 18776);
+    opendrop_config_set_verify_peer(config, false);
+
+    opendrop_server *server;
+    opendrop_client *client;
+    if (opendrop_server_new(&server, config) || opendrop_server_start(server) ||
+        opendrop_client_new(&client, "https://[::1]", 18776, config)) {
+        printf("SETUP ERROR");
+        return 1;
+    }
+
+    // Random data doesn't compress, so the upload is about as large as the file
+    size_t data_len = 192 * 1024;
+    unsigned char *data = (unsigned char*) malloc(data_len);
+    srand(1);
+    for (size_t i = 0; i < data_len; i++) {
+        data[i] = rand();
+    }
+
+    opendrop_client_file_data file = { "random.bin", "public.data", "./random.bin", false, data, data_len };
+    const opendrop_client_file_data *files[] = { &file };
+    limiter_test_state state = { 0 };
+    opendrop_client_set_progress_callback(client, limiter_test_progress, 50, &state);
+
+    // After the 16 KiB burst the rest goes at 256 KiB/s, about 0.7 seconds
+    opendrop_client_set_rate_limit(client, 256 * 1024, 16 * 1024);
+    double start = limiter_test_seconds();
+    ret = opendrop_client_send(client, files, 1);
+    double limited = limiter_test_seconds() - start;
+    printf("limited send: %.2f s, %i progress events\n", limited, state.events);
+    ret |= limited < (data_len - 16 * 1024) / (256.0 * 1024) * 0.9 || limited > 5 || state.events < 3 || !state.done || state.mismatch;
+
+    // At 16 KiB/s the send would take 12 seconds, cancelling from the first event stops it while it waits
+    opendrop_client_set_rate_limit(client, 16 * 1024, 16 * 1024);
+    state = (limiter_test_state) { 0, false, true };
+    start = limiter_test_seconds();
+    int cancelled = opendrop_client_send(client, files, 1);
+    double stopped = limiter_test_seconds() - start;
+    printf("cancelled send: %.2f s\n", stopped);
+    ret |= !cancelled || state.done || stopped > 1;
+
+    // Cancelled clients refuse requests until cleared
+    char *receiver_name = NULL;
+    ret |= !opendrop_client_discover(client, &receiver_name);
+    opendrop_client_set_cancelled(client, false);
+    ret |= opendrop_client_discover(client, &receiver_name) || !receiver_name;
+
+    free(receiver_name);
+    free(data);
+    opendrop_client_free(client);
+    opendrop_server_free(server);
+    opendrop_config_free(config);
+
+    return ret;
+}
+
+/*
+FANOUT TESTING
+*/
+
+void fanout_test_done(opendrop_fanout *fanout, size_t index, opendrop_fanout_result result, void *userdata) {
+    (*(int*) userdata)++;
+}
+
+// Starts a receiver on its own port writing to a new temporary directory
+int fanout_test_receiver(opendrop_config **config, opendrop_server **server, uint16_t port, char *output) {
+    unsigned char array[13] = {0x48, 0x65, 0x6C, 0x6C, 0x6F, 0x2C, 0x20, 0x57, 0x6F, 0x72, 0x6C, 0x64, 0x21};
+    if (opendrop_config_new(config, array, 13)) {
+        return 1;
+    }
+
+    opendrop_config_set_interface(*config, "lo");
+    opendrop_config_set_server_port(*config, port);
+    opendrop_config_set_verify_peer(*config, false);
+
+    return !mkdtemp(output) || opendrop_server_new(server, *config) ||
+        opendrop_server_set_output_directory(*server, output) || opendrop_server_start(*server);
+}
+
+// Checks a receiver got the payload and removes its directory
+int fanout_test_received(const char *output, const unsigned char *data, size_t data_len) {
+    char path[128];
+    snprintf(path, sizeof(path), "%s/payload.bin", output);
+
+    int ret = 1;
+    FILE *received = fopen(path, "rb");
+    unsigned char *contents = (unsigned char*) malloc(data_len + 1);
+    if (received && contents) {
+        ret = fread(contents, 1, data_len + 1, received) != data_len || memcmp(contents, data, data_len);
+    }
+
+    if (received) {
+        fclose(received);
+    }
+    free(contents);
+    remove(path);
+    rmdir(output);
+    return ret;
+}
+
+int test_fanout() {
+    opendrop_config *config_a, *config_b;
+    opendrop_server *server_a, *server_b;
+    char output_a[] = "/tmp/opendrop-test-XXXXXX", output_b[] = "/tmp/opendrop-test-XXXXXX";
+    if (fanout_test_receiver(&config_a, &server_a, 18777, output_a) ||
+        fanout_test_receiver(&config_b, &server_b, 18778, output_b)) {
+        printf("SETUP ERROR");
+        return 1;
+    }
+
+    // Half compressible, so the body takes several chunks
+    size_t data_len = 3 * 512 * 1024;
+    unsigned char *data = (unsigned char*) malloc(data_len);
+    srand(1);
+    for (size_t i = 0; i < data_len; i++) {
+        data[i] = i % 2 ? rand() : 'a';
+    }
+
+    opendrop_client_file_data file = { "payload.bin", "public.data", "./payload.bin", false, data, data_len };
+    const opendrop_client_file_data *files[] = { &file };
+
+    // Nothing listens on the third port, its Ask fails while the others upload
+    opendrop_fanout *fanout;
+    int done = 0;
+    if (opendrop_fanout_new(&fanout, config_a, files, 1, NULL) ||
+        opendrop_fanout_add(fanout, "https://[::1]", 18777) || opendrop_fanout_add(fanout, "https://[::1]", 18778) ||
+        opendrop_fanout_add(fanout, "https://[::1]", 18779)) {
+        printf("FANOUT ERROR %i: %s", opendrop_fanout_init_errno(), opendrop_fanout_strerror(opendrop_fanout_init_errno()));
+        return 1;
+    }
+
+    // Only the first chunk stays in memory, the rest goes through the spill file
+    opendrop_fanout_set_memory_limit(fanout, 256 * 1024);
+    opendrop_fanout_set_done_callback(fanout, fanout_test_done, &done);
+
+    int sent = opendrop_fanout_send(fanout);
+    printf("fanout: %i, results %i %i %i, errno %i\n", sent, opendrop_fanout_get_result(fanout, 0),
+        opendrop_fanout_get_result(fanout, 1), opendrop_fanout_get_result(fanout, 2), opendrop_fanout_errno(fanout));
+
+    int ret = sent != 1 || done != 3 || opendrop_fanout_get_result(fanout, 0) != OPENDROP_FANOUT_SENT ||
+        opendrop_fanout_get_result(fanout, 1) != OPENDROP_FANOUT_SENT ||
+        opendrop_fanout_get_result(fanout, 2) != OPENDROP_FANOUT_DECLINED;
+
+    // A fanout is only sent once
+    ret |= opendrop_fanout_send(fanout) != 2 || opendrop_fanout_errno(fanout) != 7;
+
+    ret |= fanout_test_received(output_a, data, data_len);
+    ret |= fanout_test_received(output_b, data, data_len);
+
+    free(data);
+    opendrop_fanout_free(fanout);
+    opendrop_server_free(server_a);
+    opendrop_server_free(server_b);
+    opendrop_config_free(config_a);
+    opendrop_config_free(config_b);
+
+    return ret;
+}
+
+/*
+CACHE TESTING
+*/
+
+// Counts the bodies in a cache directory, deleting them when asked
+int cache_test_bodies(const char *directory, bool delete) {
+    DIR *dir = opendir(directory);
+    if (!dir) {
+        return -1;
+    }
+
+    int bodies = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        size_t len = strlen(ent->d_name);
+        if (len > 3 && !strcmp(ent->d_name + len - 3, ".gz")) {
+            bodies++;
+            if (delete) {
+                char path[256];
+                snprintf(path, sizeof(path), "%s/%s", directory, ent->d_name);
+                remove(path);
+            }
+        }
+    }
+
+    closedir(dir);
+    return bodies;
+}
+
+// Sends the file with its first byte set to a version, returns whether the body came from the cache or -1 on error
+int cache_test_send(opendrop_client *client, const opendrop_client_file_data **files, unsigned char version) {
+    files[0]->data[0] = version;
+
+    opendrop_client_stats stats;
+    if (opendrop_client_send(client, files, 1)) {
+        return -1;
+    }
+
+    opendrop_client_get_stats(client, &stats);
+    return stats.last.cache_hits ? 1 : (stats.last.uncompressed_bytes ? 0 : -1);
+}
+
+int test_cache() {
+    opendrop_config *config;
+    opendrop_server *server;
+    opendrop_client *client;
+    char output[] = "/tmp/opendrop-test-XXXXXX", directory[] = "/tmp/opendrop-test-XXXXXX";
+    if (fanout_test_receiver(&config, &server, 18780, output) || !mkdtemp(directory) ||
+        opendrop_client_new(&client, "https://[::1]", 18780, config)) {
+        printf("SETUP ERROR");
+        return 1;
+    }
+
+    // Random data doesn't compress, so two bodies fit the cache but three don't
+    size_t data_len = 64 * 1024;
+    unsigned char *data = (unsigned char*) malloc(data_len);
+    srand(1);
+    for (size_t i = 0; i < data_len; i++) {
+        data[i] = rand();
+    }
+
+    opendrop_client_file_data file = { "payload.bin", "public.data", "./payload.bin", false, data, data_len };
+    const opendrop_client_file_data *files[] = { &file };
+
+    opendrop_client_cache *cache;
+    if (opendrop_client_cache_new(&cache, directory, 160 * 1024)) {
+        printf("CACHE ERROR");
+        return 1;
+    }
+    opendrop_client_set_cache(client, cache);
+
+    // Changed contents miss, and using a body again keeps it over one that was added after it
+    int ret = cache_test_send(client, files, 'a') != 0;
+    ret |= cache_test_send(client, files, 'a') != 1;
+    ret |= cache_test_send(client, files, 'b') != 0;
+    ret |= cache_test_send(client, files, 'a') != 1;
+    ret |= cache_test_send(client, files, 'c') != 0;
+    ret |= cache_test_bodies(directory, false) != 2;
+
+    opendrop_client_stats stats;
+    opendrop_client_get_stats(client, &stats);
+    printf("cache: %i hits, %i bodies\n", (int) stats.total.cache_hits, cache_test_bodies(directory, false));
+    ret |= stats.total.cache_hits != 2;
+
+    // A new cache picks the bodies up in the order they were used, so b is gone and adding it again evicts a
+    opendrop_client_cache_free(cache);
+    if (opendrop_client_cache_new(&cache, directory, 160 * 1024)) {
+        printf("CACHE ERROR");
+        return 1;
+    }
+    opendrop_client_set_cache(client, cache);
+
+    ret |= cache_test_send(client, files, 'b') != 0;
+    ret |= cache_test_send(client, files, 'c') != 1;
+    ret |= cache_test_send(client, files, 'a') != 0;
+
+    // Without a cache the body is compressed again, and the receiver got what the cached body held
+    opendrop_client_set_cache(client, NULL);
+    ret |= cache_test_send(client, files, 'c') != 0;
+    opendrop_client_set_cache(client, cache);
+    ret |= cache_test_send(client, files, 'c') != 1;
+    ret |= fanout_test_received(output, data, data_len);
+
+    // Missing directories are reported
+    opendrop_client_cache *missing;
+    ret |= opendrop_client_cache_new(&missing, "/tmp/opendrop-test-missing/cache", 1024) != 2;
+
+    cache_test_bodies(directory, true);
+    rmdir(directory);
+    free(data);
+    opendrop_client_cache_free(cache);
+    opendrop_client_free(client);
+    opendrop_server_free(server);
+    opendrop_config_free(config);
+
+    return ret;
+}
+
+/*
+WALKER TESTING
+*/
+
+// Writes a file below a directory, filled with a byte so the received copy can be checked
+int walker_test_write(const char *directory, const char *name, unsigned char fill, size_t len) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", directory, name);
+
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        return 1;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        fputc(fill, file);
+    }
+    return fclose(file);
+}
+
+// Checks a received file holds len copies of a byte
+int walker_test_check(const char *directory, const char *name, unsigned char fill, size_t len) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", directory, name);
+
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return 1;
+    }
+
+    size_t read = 0;
+    int c, ret = 0;
+    while ((c = fgetc(file)) != EOF) {
+        ret |= c != fill;
+        read++;
+    }
+    fclose(file);
+    return ret || read != len;
+}
+
+int test_walker() {
+    // A tree with nested and empty directories, a flat directory large enough to be stated in batches, and a link
+    char tree[] = "/tmp/opendrop-test-XXXXXX", root[64], path[128];
+    if (!mkdtemp(tree)) {
+        printf("SETUP ERROR");
+        return 1;
+    }
+
+    snprintf(root, sizeof(root), "%s/photos", tree);
+    const char *dirs[] = { "photos", "photos/b", "photos/b/deep", "photos/empty", "photos/flat" };
+    for (size_t i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++) {
+        snprintf(path, sizeof(path), "%s/%s", tree, dirs[i]);
+        mkdir(path, 0755);
+    }
+
+    int ret = walker_test_write(root, "a.JPG", 'a', 3000);
+    ret |= walker_test_write(root, "b/deep/c.txt", 'c', 100);
+    ret |= walker_test_write(root, "b/d.bin", 'd', 5 * 1024 * 1024);
+    for (int i = 0; i < 600; i++) {
+        snprintf(path, sizeof(path), "flat/%03i.heic", i);
+        ret |= walker_test_write(root, path, i, 1 + i);
+    }
+    ret |= walker_test_write(tree, "single.txt", 's', 10);
+    snprintf(path, sizeof(path), "%s/link", root);
+    ret |= symlink("a.JPG", path);
+
+    snprintf(path, sizeof(path), "%s/single.txt", tree);
+    const char *paths[] = { root, path };
+    opendrop_walker *walker;
+    if (ret || opendrop_walker_new(&walker, paths, 2, 4)) {
+        printf("WALKER ERROR %i: %s", opendrop_walker_init_errno(), opendrop_walker_strerror(opendrop_walker_init_errno()));
+        return 1;
+    }
+
+    size_t files_len, ask_len;
+    const opendrop_client_file_data **files = opendrop_walker_get_files(walker, &files_len);
+    const opendrop_client_file_data **ask_files = opendrop_walker_get_ask_files(walker, &ask_len);
+
+    // Directories come before their contents, siblings by name, the link is left out
+    const char *order[] = { "./photos", "./photos/a.JPG", "./photos/b", "./photos/b/d.bin", "./photos/b/deep",
+        "./photos/b/deep/c.txt", "./photos/empty", "./photos/flat", "./photos/flat/000.heic" };
+    ret = files_len != 9 + 599 + 1 || ask_len != 2 || ask_files[0] != files[0] || ask_files[1] != files[files_len - 1];
+    for (size_t i = 0; !ret && i < sizeof(order) / sizeof(order[0]); i++) {
+        ret |= strcmp(files[i]->bom_path, order[i]);
+    }
+    ret |= ret || strcmp(files[files_len - 1]->bom_path, "./single.txt") || !files[0]->is_dir || files[1]->is_dir ||
+        strcmp(files[1]->type, "public.jpeg") || strcmp(files[0]->type, "public.folder") || strcmp(files[1]->name, "a.JPG");
+
+    uint64_t bytes = 3000 + 100 + 5 * 1024 * 1024 + 600 * 601 / 2 + 10;
+    printf("walker: %zu entries, %llu bytes\n", files_len, (unsigned long long) opendrop_walker_get_bytes(walker));
+    ret |= opendrop_walker_get_bytes(walker) != bytes;
+
+    // Missing paths fail the walk
+    opendrop_walker *missing;
+    const char *missing_paths[] = { "/tmp/opendrop-test-missing" };
+    ret |= !opendrop_walker_new(&missing, missing_paths, 1, 2) || opendrop_walker_init_errno() != 2;
+
+    // The receiver asks about the top-level entries and recreates the whole tree
+    opendrop_config *config;
+    opendrop_server *server;
+    opendrop_client *client;
+    char output[] = "/tmp/opendrop-test-XXXXXX";
+    if (fanout_test_receiver(&config, &server, 18781, output) || opendrop_client_new(&client, "https://[::1]", 18781, config)) {
+        printf("SETUP ERROR");
+        return 1;
+    }
+
+    ret |= opendrop_client_ask(client, ask_files, ask_len, false, NULL);
+    ret |= opendrop_client_send(client, files, files_len);
+    ret |= walker_test_check(output, "photos/a.JPG", 'a', 3000);
+    ret |= walker_test_check(output, "photos/b/deep/c.txt", 'c', 100);
+    ret |= walker_test_check(output, "photos/b/d.bin", 'd', 5 * 1024 * 1024);
+    ret |= walker_test_check(output, "photos/flat/599.heic", 599 & 0xff, 600);
+    ret |= walker_test_check(output, "single.txt", 's', 10);
+
+    char command[128];
+    snprintf(command, sizeof(command), "rm -rf %s %s", tree, output);
+    ret |= system(command);
+
+    opendrop_client_free(client);
+    opendrop_server_free(server);
+    opendrop_config_free(config);
+    opendrop_walker_free(walker);
+
+    return ret;
+}